@@ -0,0 +1,263 @@
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "../src/tools/diskman.h"
+
+namespace diskman {
+
+typedef std::vector<unsigned char> bytes;
+
+const unsigned char *sector(const struct d81 *d, int track, int sector)
+{
+  return &d->data[(track - 1) * 256 * D81_SECTORS + sector * 256];
+}
+
+const unsigned char *bam_entry(const struct d81 *d, int track)
+{
+  return sector(d, 40, track <= 40 ? 1 : 2) + 0x10 + ((track - 1) % 40) * 6;
+}
+
+int bam_bit_count(const unsigned char *bam)
+{
+  int n = 0;
+  for (int i = 1; i < 6; i++)
+    n += __builtin_popcount(bam[i]);
+  return n;
+}
+
+bool bam_is_free(const struct d81 *d, int track, int s)
+{
+  return bam_entry(d, track)[1 + s / 8] & (1 << (s % 8));
+}
+
+const unsigned char *dir_entry(const struct d81 *d, int entry)
+{
+  return sector(d, 40, 3 + entry / 8) + (entry % 8) * 32;
+}
+
+bytes random_bytes(int len)
+{
+  bytes data(len);
+  for (int i = 0; i < len; i++)
+    data[i] = rand();
+  return data;
+}
+
+// Read a file back by following its sector chain, independently of diskman.c
+bytes read_file(const struct d81 *d, int entry, int *blocks)
+{
+  const unsigned char *dirent = dir_entry(d, entry);
+  bytes data;
+  int t = dirent[3], s = dirent[4];
+  *blocks = 0;
+  while (t) {
+    EXPECT_FALSE(bam_is_free(d, t, s)) << "sector " << t << "/" << s << " is not allocated";
+    const unsigned char *sec = sector(d, t, s);
+    int n = sec[0] ? 254 : sec[1] - 1;
+    data.insert(data.end(), sec + 2, sec + 2 + n);
+    t = sec[0];
+    s = sec[1];
+    (*blocks)++;
+  }
+  return data;
+}
+
+class DiskmanTestFixture : public ::testing::Test {
+  protected:
+  struct d81 *disk, *loaded;
+
+  void SetUp() override
+  {
+    srand(65);
+    disk = (struct d81 *)malloc(sizeof(struct d81));
+    loaded = (struct d81 *)malloc(sizeof(struct d81));
+    d81_format(disk, "TEST DISK", "TD");
+  }
+
+  void TearDown() override
+  {
+    free(disk);
+    free(loaded);
+    remove("diskman.d81");
+  }
+
+  // Add a file, and check that it reads back as it was given
+  int add_file(const char *name, const bytes &data)
+  {
+    int entry = d81_add_file(disk, name, FTYPE_PRG | FTYPE_CLOSEDFLAG, data.size() ? &data[0] : NULL, data.size());
+    EXPECT_LE(0, entry);
+    if (entry < 0)
+      return entry;
+    int blocks;
+    EXPECT_EQ(data, read_file(disk, entry, &blocks));
+    EXPECT_EQ(d81_blocks_needed(data.size()), blocks);
+    const unsigned char *dirent = dir_entry(disk, entry);
+    EXPECT_EQ(FTYPE_PRG | FTYPE_CLOSEDFLAG, dirent[2]);
+    EXPECT_EQ(blocks, dirent[0x1e] | (dirent[0x1f] << 8));
+    return entry;
+  }
+
+  // The BAM counts agree with its bitmaps, and with the free blocks of the disk
+  void expect_bam_consistent(const struct d81 *d)
+  {
+    int free_blocks = 0;
+    for (int t = 1; t <= D81_TRACKS; t++) {
+      const unsigned char *bam = bam_entry(d, t);
+      EXPECT_EQ(bam_bit_count(bam), bam[0]) << "track " << t;
+      if (t != D81_DIR_TRACK)
+        free_blocks += bam[0];
+    }
+    EXPECT_EQ(free_blocks, d->blocks_free);
+  }
+
+  void save_and_load(void)
+  {
+    ASSERT_EQ(0, d81_save(disk, "diskman.d81"));
+    ASSERT_EQ(0, d81_load(loaded, "diskman.d81"));
+    EXPECT_EQ(0, memcmp(disk->data, loaded->data, D81_SIZE));
+    EXPECT_EQ(disk->files, loaded->files);
+    EXPECT_EQ(disk->blocks_free, loaded->blocks_free);
+  }
+};
+
+TEST_F(DiskmanTestFixture, ShouldFormatEmptyDisk)
+{
+  EXPECT_EQ(0, disk->files);
+  EXPECT_EQ(D81_BLOCKS, disk->blocks_free);
+  expect_bam_consistent(disk);
+  // Header, both BAM sectors and the first directory sector
+  EXPECT_EQ(D81_SECTORS - 4, bam_entry(disk, D81_DIR_TRACK)[0]);
+  const unsigned char *header = sector(disk, 40, 0);
+  EXPECT_EQ(0, memcmp(&header[4], "TEST DISK\xa0\xa0\xa0\xa0\xa0\xa0\xa0", 16));
+  EXPECT_EQ(0, memcmp(&header[0x16], "TD", 2));
+  const unsigned char *dir = sector(disk, 40, 3);
+  EXPECT_EQ(0x00, dir[0]);
+  EXPECT_EQ(0xff, dir[1]);
+}
+
+TEST_F(DiskmanTestFixture, ShouldRoundTripFiles)
+{
+  bytes empty, small = random_bytes(100), exact = random_bytes(254), large = random_bytes(100000);
+  EXPECT_EQ(0, add_file("EMPTY", empty));
+  EXPECT_EQ(1, add_file("SMALL", small));
+  EXPECT_EQ(2, add_file("EXACT", exact));
+  EXPECT_EQ(3, add_file("LARGE", large));
+  EXPECT_EQ(D81_BLOCKS - 1 - 1 - 1 - d81_blocks_needed(large.size()), disk->blocks_free);
+  expect_bam_consistent(disk);
+
+  save_and_load();
+  expect_bam_consistent(loaded);
+  int blocks;
+  EXPECT_EQ(3, d81_find(loaded, "LARGE"));
+  EXPECT_EQ(large, read_file(loaded, 3, &blocks));
+  EXPECT_EQ(-1, d81_find(loaded, "MISSING"));
+}
+
+TEST_F(DiskmanTestFixture, ShouldChainDirectoryPastEightEntries)
+{
+  for (int i = 0; i < 20; i++)
+    ASSERT_EQ(i, add_file(("FILE" + std::to_string(i)).c_str(), random_bytes(rand() % 2000)));
+  // 40/3 -> 40/4 -> 40/5
+  EXPECT_EQ(40, sector(disk, 40, 3)[0]);
+  EXPECT_EQ(4, sector(disk, 40, 3)[1]);
+  EXPECT_EQ(40, sector(disk, 40, 4)[0]);
+  EXPECT_EQ(5, sector(disk, 40, 4)[1]);
+  EXPECT_EQ(0, sector(disk, 40, 5)[0]);
+  EXPECT_EQ(0xff, sector(disk, 40, 5)[1]);
+  EXPECT_EQ(D81_SECTORS - 6, bam_entry(disk, D81_DIR_TRACK)[0]);
+  EXPECT_FALSE(bam_is_free(disk, 40, 5));
+  EXPECT_TRUE(bam_is_free(disk, 40, 6));
+  expect_bam_consistent(disk);
+
+  save_and_load();
+  EXPECT_EQ(20, loaded->files);
+  for (int i = 0; i < 20; i++)
+    EXPECT_EQ(i, d81_find(loaded, ("FILE" + std::to_string(i)).c_str()));
+  // More files can be added after loading
+  bytes data = random_bytes(3000);
+  int entry = d81_add_file(loaded, "FILE20", FTYPE_PRG | FTYPE_CLOSEDFLAG, &data[0], data.size());
+  EXPECT_EQ(20, entry);
+  int blocks;
+  EXPECT_EQ(data, read_file(loaded, entry, &blocks));
+  expect_bam_consistent(loaded);
+}
+
+TEST_F(DiskmanTestFixture, ShouldRejectDuplicateNames)
+{
+  bytes data = random_bytes(10);
+  add_file("SAME", data);
+  int blocks_free = disk->blocks_free;
+  EXPECT_EQ(D81_ERR_EXISTS, d81_add_file(disk, "SAME", FTYPE_PRG, &data[0], data.size()));
+  // Only the first 16 characters are compared
+  add_file("ABCDEFGHIJKLMNOP", data);
+  EXPECT_EQ(D81_ERR_EXISTS, d81_add_file(disk, "ABCDEFGHIJKLMNOPQ", FTYPE_PRG, &data[0], data.size()));
+  EXPECT_EQ(2, disk->files);
+  EXPECT_EQ(blocks_free - 1, disk->blocks_free);
+}
+
+TEST_F(DiskmanTestFixture, ShouldFillDirectory)
+{
+  bytes data = random_bytes(10);
+  for (int i = 0; i < D81_MAX_FILES; i++)
+    ASSERT_EQ(i, d81_add_file(disk, ("F" + std::to_string(i)).c_str(), FTYPE_PRG, &data[0], data.size()));
+  EXPECT_FALSE(d81_fits(disk, data.size()));
+  EXPECT_EQ(D81_ERR_DIR_FULL, d81_add_file(disk, "ONE MORE", FTYPE_PRG, &data[0], data.size()));
+  EXPECT_EQ(0, bam_entry(disk, D81_DIR_TRACK)[0]);
+  expect_bam_consistent(disk);
+
+  save_and_load();
+  EXPECT_EQ(D81_MAX_FILES, loaded->files);
+  EXPECT_EQ(D81_MAX_FILES - 1, d81_find(loaded, ("F" + std::to_string(D81_MAX_FILES - 1)).c_str()));
+}
+
+TEST_F(DiskmanTestFixture, ShouldFillDisk)
+{
+  bytes data = random_bytes((D81_BLOCKS - 1) * 254);
+  add_file("BIG", data);
+  EXPECT_EQ(1, disk->blocks_free);
+  EXPECT_TRUE(d81_fits(disk, 254));
+  EXPECT_FALSE(d81_fits(disk, 255));
+  EXPECT_EQ(D81_ERR_DISK_FULL, d81_add_file(disk, "TOO BIG", FTYPE_PRG, &data[0], 255));
+  EXPECT_EQ(1, disk->files);
+  add_file("LAST", random_bytes(254));
+  EXPECT_EQ(0, disk->blocks_free);
+  expect_bam_consistent(disk);
+}
+
+TEST_F(DiskmanTestFixture, ShouldFillGapsInFragmentedDisk)
+{
+  // Most of every other track in use, so that no run of free sectors is
+  // long enough for a large file
+  for (int t = 1; t <= D81_TRACKS; t++) {
+    if (t == D81_DIR_TRACK)
+      continue;
+    int track, s;
+    for (int i = 0; i < ((t & 1) ? D81_SECTORS - 1 : 1); i++)
+      ASSERT_EQ(0, d81_alloc_sector(disk, &track, &s));
+  }
+  expect_bam_consistent(disk);
+  add_file("SPLIT", random_bytes(100000));
+  expect_bam_consistent(disk);
+  save_and_load();
+  expect_bam_consistent(loaded);
+}
+
+TEST_F(DiskmanTestFixture, ShouldNotLoadBrokenDirectoryChain)
+{
+  for (int i = 0; i < 10; i++)
+    add_file(("FILE" + std::to_string(i)).c_str(), random_bytes(10));
+  ASSERT_EQ(0, d81_save(disk, "diskman.d81"));
+  ASSERT_EQ(0, d81_load(loaded, "diskman.d81"));
+
+  // The 1581 always puts the second directory sector at 40/4
+  disk->data[(40 - 1) * 256 * D81_SECTORS + 3 * 256 + 1] = 10;
+  ASSERT_EQ(0, d81_save(disk, "diskman.d81"));
+  EXPECT_EQ(-1, d81_load(loaded, "diskman.d81"));
+  EXPECT_EQ(-1, d81_load(loaded, "diskman.missing"));
+}
+
+}
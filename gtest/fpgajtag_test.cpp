@@ -0,0 +1,145 @@
+#include "gtest/gtest.h"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// fpgajtag is compiled as C, so it is linked in as such
+extern "C" {
+#include "util.h"
+#include "fpga.h"
+
+void write_tms_transition(char *tail);
+void ENTER_TMS_STATE(char required);
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size);
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size);
+
+// Normally provided by the tool that fpgajtag is built into
+FILE *logfile;
+}
+
+typedef std::vector<uint8_t> bytes;
+
+bytes written;
+int read_requested;
+
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+{
+  written.insert(written.end(), buf, buf + size);
+  return size;
+}
+
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
+{
+  read_requested += size;
+  memset(buf, 0, size);
+  return size;
+}
+
+namespace fpgajtag {
+
+/*
+ * How much each command in a buffer reads, as worked out by parsing the
+ * whole buffer after it is complete, which is what read_data() relies on.
+ */
+std::vector<int> reference_read_sizes(const bytes &buf)
+{
+  std::vector<int> sizes;
+  size_t i = 0;
+  while (i < buf.size()) {
+    uint8_t ch = buf[i];
+    int plen = ch == 0x2e ? 2 : (ch == 0x85 || ch == 0x87 || ch == 0x8a || ch == 0xaa || ch == 0xab) ? 1 : 3;
+    unsigned tlen = plen == 3 ? (buf[i + 2] << 8 | buf[i + 1]) + 1 : 0;
+    if (ch & MPSSE_DO_READ) {
+      if (ch & MPSSE_BITMODE)
+        sizes.push_back((ch & MPSSE_WRITE_TMS) ? -1 : -(buf[i + 1] + 1));
+      else if (ch == 0x2c || ch == 0x3d)
+        sizes.push_back(tlen);
+      else
+        sizes.push_back(buf[i + 1]);
+    }
+    i += plen;
+    if (ch == 0x19 || ch == 0x3d)
+      i += tlen;
+  }
+  return sizes;
+}
+
+// Bytes the FTDI sends back for those reads: one for each bit command
+int reference_read_length(const std::vector<int> &sizes)
+{
+  int len = 0;
+  for (int size : sizes)
+    len += size > 0 ? size : 1;
+  return len;
+}
+
+// Bytes of data once the bits read by runs of bit commands are put together
+int reference_data_length(const std::vector<int> &sizes)
+{
+  int len = 0;
+  for (size_t i = 0; i < sizes.size(); i++)
+    if (sizes[i] > 0)
+      len += sizes[i];
+    else if (!i || sizes[i - 1] > 0)
+      len++;
+  return len;
+}
+
+class FpgajtagTestFixture : public ::testing::Test {
+  protected:
+  void SetUp() override
+  {
+    // Start from Run-Test/Idle, as after init_ftdi()
+    write_tms_transition("XR11111");
+    ENTER_TMS_STATE('I');
+    flush_write(NULL);
+    written.clear();
+    read_requested = 0;
+  }
+
+  // Read back what has been queued, and check it was read as the buffer describes
+  void expect_reads_match_buffer(void)
+  {
+    read_data();
+    std::vector<int> sizes = reference_read_sizes(written);
+    EXPECT_EQ(reference_read_length(sizes), read_requested);
+    EXPECT_EQ(reference_data_length(sizes), last_read_data_length);
+  }
+};
+
+TEST_F(FpgajtagTestFixture, ShouldReadLastBitOfShiftIntoIdle)
+{
+  uint8_t data[] = { 0x12, 0x34, 0x56, 0x78 };
+  write_bytes(DREAD, 'I', data, sizeof(data), SEND_SINGLE_FRAME, 1, 0, 0);
+  flush_write(NULL);
+  // The last bit is shifted by the TMS command that leaves Shift-DR, which
+  // has to read too
+  std::vector<int> sizes = reference_read_sizes(written);
+  ASSERT_EQ(std::vector<int>({ 3, -7, -1 }), sizes);
+  written.clear();
+
+  write_bytes(DREAD, 'I', data, sizeof(data), SEND_SINGLE_FRAME, 1, 0, 0);
+  expect_reads_match_buffer();
+}
+
+TEST_F(FpgajtagTestFixture, ShouldReadSeveralShiftsInOneBuffer)
+{
+  uint8_t data[] = { 0xff, 0x00, 0xa5 };
+  write_bytes(DREAD, 'I', data, sizeof(data), SEND_SINGLE_FRAME, 1, 0, 0);
+  write_bytes(0, 'I', data, sizeof(data), SEND_SINGLE_FRAME, 1, 0, 0);
+  write_bytes(DREAD, 'I', data, 1, SEND_SINGLE_FRAME, 1, 0, 0);
+  expect_reads_match_buffer();
+}
+
+TEST_F(FpgajtagTestFixture, ShouldKeepLaterReadsInStep)
+{
+  uint8_t data[] = { 0x01, 0x02 };
+  for (int k = 0; k < 3; k++) {
+    write_bytes(DREAD, 'I', data, sizeof(data), SEND_SINGLE_FRAME, 1, 0, 0);
+    expect_reads_match_buffer();
+    written.clear();
+    read_requested = 0;
+  }
+}
+
+}
@@ -0,0 +1,181 @@
+#include "gtest/gtest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+extern int real_main(int argc, char **argv);
+extern int *cost;
+
+namespace rlepack {
+
+typedef std::vector<unsigned char> bytes;
+
+void write_file(const char *name, const bytes &data)
+{
+  FILE *f = fopen(name, "wb");
+  if (data.size())
+    fwrite(&data[0], data.size(), 1, f);
+  fclose(f);
+}
+
+bytes read_file(const char *name)
+{
+  bytes data;
+  FILE *f = fopen(name, "rb");
+  int c;
+  while ((c = fgetc(f)) != EOF)
+    data.push_back(c);
+  fclose(f);
+  return data;
+}
+
+int call_rlepack(const bytes &input)
+{
+  char *argv[] = { "rlepack", "rlepack.in", "rlepack.out", NULL };
+  write_file("rlepack.in", input);
+  return real_main(3, argv);
+}
+
+// Unpack independently of rlepack's own verification
+bytes unpack(const bytes &packed)
+{
+  bytes out;
+  size_t i = 0;
+  while (i < packed.size() && packed[i]) {
+    if (packed[i] == 0x80) {
+      for (int n = 0; n < packed[i + 1]; n++) {
+        out.push_back(packed[i + 2]);
+        out.push_back(packed[i + 3]);
+      }
+      i += 4;
+    }
+    else if (packed[i] & 0x80) {
+      for (int n = 0; n < (packed[i] & 0x7f); n++)
+        out.push_back(packed[i + 1]);
+      i += 2;
+    }
+    else {
+      out.insert(out.end(), packed.begin() + i + 1, packed.begin() + i + 1 + packed[i]);
+      i += 1 + packed[i];
+    }
+  }
+  // Only the end marker may follow
+  EXPECT_EQ(i + 1, packed.size());
+  return out;
+}
+
+// The straightforward quadratic form of the DP that rlepack does in linear time
+int optimal_size(const bytes &raw)
+{
+  int n = raw.size();
+  std::vector<int> best(n + 1, 0);
+  for (int i = n - 1; i >= 0; i--) {
+    best[i] = 1 << 30;
+    for (int len = 1; len <= 127 && i + len <= n; len++)
+      best[i] = std::min(best[i], 1 + len + best[i + len]);
+    for (int len = 1; len <= 127 && i + len <= n && raw[i + len - 1] == raw[i]; len++)
+      best[i] = std::min(best[i], 2 + best[i + len]);
+    for (int len = 2; len <= 510 && i + len <= n; len += 2) {
+      if (raw[i + len - 2] != raw[i] || raw[i + len - 1] != raw[i + 1])
+        break;
+      best[i] = std::min(best[i], 4 + best[i + len]);
+    }
+  }
+  return best[0];
+}
+
+class RlepackTestFixture : public ::testing::Test {
+  protected:
+  void SetUp() override
+  {
+    // suppress the chatty output
+    ::testing::internal::CaptureStderr();
+    ::testing::internal::CaptureStdout();
+  }
+
+  void TearDown() override
+  {
+    testing::internal::GetCapturedStderr();
+    testing::internal::GetCapturedStdout();
+
+    remove("rlepack.in");
+    remove("rlepack.out");
+  }
+
+  void expect_optimal_round_trip(const bytes &input)
+  {
+    ASSERT_EQ(0, call_rlepack(input));
+    bytes packed = read_file("rlepack.out");
+    EXPECT_EQ(input, unpack(packed));
+    // Tokens plus the end marker
+    EXPECT_EQ(optimal_size(input) + 1, (int)packed.size());
+    EXPECT_EQ(cost[0] + 1, (int)packed.size());
+  }
+};
+
+TEST_F(RlepackTestFixture, ShouldRejectEmptyInput)
+{
+  ASSERT_NE(0, call_rlepack(bytes()));
+}
+
+TEST_F(RlepackTestFixture, ShouldPackSingleByte)
+{
+  expect_optimal_round_trip(bytes(1, 0x42));
+}
+
+TEST_F(RlepackTestFixture, ShouldSplitRunsAtTheLengthLimit)
+{
+  for (int len : { 126, 127, 128, 254, 255, 256 })
+    expect_optimal_round_trip(bytes(len, 0xaa));
+}
+
+TEST_F(RlepackTestFixture, ShouldSplitPairRunsAtTheLengthLimit)
+{
+  for (int len : { 508, 509, 510, 511, 512, 1020, 1021 }) {
+    bytes input;
+    for (int i = 0; i < len; i++)
+      input.push_back(i & 1 ? 0xff : 0x00);
+    expect_optimal_round_trip(input);
+  }
+}
+
+TEST_F(RlepackTestFixture, ShouldSplitLiteralsAtTheLengthLimit)
+{
+  for (int len : { 127, 128, 255 }) {
+    bytes input;
+    for (int i = 0; i < len; i++)
+      input.push_back(i);
+    expect_optimal_round_trip(input);
+  }
+}
+
+TEST_F(RlepackTestFixture, ShouldFindOptimalEncodingOfMixedData)
+{
+  srand(65);
+  for (int k = 0; k < 50; k++) {
+    bytes input;
+    int len = 1 + rand() % 3000;
+    while ((int)input.size() < len) {
+      int n = 1 + rand() % 300;
+      switch (rand() % 3) {
+      case 0:
+        for (int i = 0; i < n; i++)
+          input.push_back(rand() % 4);
+        break;
+      case 1:
+        input.insert(input.end(), n, rand());
+        break;
+      default: {
+        unsigned char a = rand(), b = rand();
+        for (int i = 0; i < n; i++)
+          input.push_back(i & 1 ? b : a);
+      }
+      }
+    }
+    input.resize(len);
+    expect_optimal_round_trip(input);
+  }
+}
+
+}
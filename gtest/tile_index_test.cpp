@@ -0,0 +1,158 @@
+#include "gtest/gtest.h"
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#include "../src/tools/pngprepare/tile_index.h"
+
+namespace tileindex {
+
+struct tile random_tile(int colours)
+{
+  struct tile t;
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++)
+      t.bytes[x][y] = rand() % colours;
+  return t;
+}
+
+struct tile flipped(const struct tile &t, int flip)
+{
+  struct tile out;
+  for (int x = 0; x < 8; x++)
+    for (int y = 0; y < 8; y++)
+      out.bytes[x][y] = t.bytes[(flip & TILE_FLIP_X) ? 7 - x : x][(flip & TILE_FLIP_Y) ? 7 - y : y];
+  return out;
+}
+
+class TileIndexTestFixture : public ::testing::Test {
+  protected:
+  struct tile_index ti;
+  std::vector<struct tile> tiles;
+
+  void SetUp() override
+  {
+    srand(65);
+    tile_index_init(&ti, 4096);
+    tiles.resize(4096);
+  }
+
+  void TearDown() override
+  {
+    tile_index_free(&ti);
+  }
+
+  int add(const struct tile &t, int num)
+  {
+    tiles[num] = t;
+    tile_index_add(&ti, num, tile_hash(&tiles[num]));
+    return num;
+  }
+
+  int find(struct tile t, int flips)
+  {
+    return tile_index_find(&ti, &tiles[0], &t, tile_hash(&t), flips);
+  }
+};
+
+TEST_F(TileIndexTestFixture, ShouldNotFindAnythingInEmptyIndex)
+{
+  struct tile t = random_tile(256);
+  ASSERT_EQ(-1, find(t, TILE_FLIP_X | TILE_FLIP_Y));
+}
+
+TEST_F(TileIndexTestFixture, ShouldHashAllOrientationsTheSame)
+{
+  for (int k = 0; k < 100; k++) {
+    struct tile t = random_tile(256);
+    for (int flip : { TILE_FLIP_X, TILE_FLIP_Y, TILE_FLIP_X | TILE_FLIP_Y }) {
+      struct tile f = flipped(t, flip);
+      ASSERT_EQ(tile_hash(&t), tile_hash(&f));
+    }
+  }
+}
+
+TEST_F(TileIndexTestFixture, ShouldFindExactMatch)
+{
+  for (int i = 0; i < 100; i++)
+    add(random_tile(256), i);
+  for (int i = 0; i < 100; i++)
+    ASSERT_EQ(i, find(tiles[i], 0));
+}
+
+TEST_F(TileIndexTestFixture, ShouldOnlyFindFlippedTilesWhenAllowed)
+{
+  struct tile t = random_tile(256);
+  add(t, 0);
+  for (int flip : { TILE_FLIP_X, TILE_FLIP_Y, TILE_FLIP_X | TILE_FLIP_Y }) {
+    struct tile f = flipped(t, flip);
+    EXPECT_EQ(-1, find(f, 0));
+    EXPECT_EQ(0 | flip, find(f, TILE_FLIP_X | TILE_FLIP_Y));
+    // Showing the stored tile with the returned flip bits gives the tile looked up
+    struct tile shown = flipped(tiles[0], flip);
+    EXPECT_EQ(0, memcmp(&shown, &f, sizeof(struct tile)));
+  }
+  EXPECT_EQ(-1, find(flipped(t, TILE_FLIP_X), TILE_FLIP_Y));
+  EXPECT_EQ(TILE_FLIP_Y, find(flipped(t, TILE_FLIP_Y), TILE_FLIP_Y));
+}
+
+TEST_F(TileIndexTestFixture, ShouldPreferUnflippedMatchOfSymmetricTile)
+{
+  // A tile that looks the same flipped either way
+  struct tile t;
+  memset(&t, 7, sizeof(t));
+  add(t, 0);
+  ASSERT_EQ(0, find(t, TILE_FLIP_X | TILE_FLIP_Y));
+}
+
+TEST_F(TileIndexTestFixture, ShouldFindLowestNumberedDuplicate)
+{
+  struct tile t = random_tile(256);
+  add(random_tile(256), 0);
+  add(t, 1);
+  add(random_tile(256), 2);
+  add(t, 3);
+  ASSERT_EQ(1, find(t, 0));
+}
+
+TEST_F(TileIndexTestFixture, ShouldForgetTilesWhenCleared)
+{
+  struct tile t = random_tile(256);
+  add(t, 0);
+  tile_index_clear(&ti);
+  ASSERT_EQ(-1, find(t, TILE_FLIP_X | TILE_FLIP_Y));
+  add(t, 5);
+  ASSERT_EQ(5, find(t, 0));
+}
+
+TEST_F(TileIndexTestFixture, ShouldMatchLinearSearch)
+{
+  // Few colours, so that plenty of tiles match each other when flipped
+  int count = 0;
+  for (int k = 0; k < 20000 && count < 4096; k++) {
+    struct tile t;
+    memset(&t, 0, sizeof(t));
+    for (int n = rand() % 3; n; n--)
+      t.bytes[rand() % 8][rand() % 8] = 1;
+    int flips = (k & 1) ? TILE_FLIP_X | TILE_FLIP_Y : 0;
+
+    int expected = -1;
+    for (int i = 0; i < count && expected == -1; i++)
+      for (int flip : { 0, TILE_FLIP_X, TILE_FLIP_Y, TILE_FLIP_X | TILE_FLIP_Y }) {
+        if ((flip & flips) != flip)
+          continue;
+        struct tile f = flipped(t, flip);
+        if (!memcmp(&tiles[i], &f, sizeof(struct tile))) {
+          expected = i | flip;
+          break;
+        }
+      }
+
+    int found = find(t, flips);
+    ASSERT_EQ(expected, found);
+    if (found == -1)
+      add(t, count++);
+  }
+}
+
+}
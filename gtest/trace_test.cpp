@@ -0,0 +1,388 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include "trace.h"
+
+namespace trace {
+
+struct change {
+  int64_t time;
+  uint64_t value;
+  int unknown;
+
+  bool operator==(const change &o) const
+  {
+    return time == o.time && value == o.value && unknown == o.unknown;
+  }
+};
+
+typedef std::vector<change> changes;
+
+void write_text(const char *name, const char *text)
+{
+  FILE *f = fopen(name, "w");
+  fputs(text, f);
+  fclose(f);
+}
+
+std::string read_binary(const char *name)
+{
+  std::string data;
+  FILE *f = fopen(name, "rb");
+  int c;
+  while ((c = fgetc(f)) != EOF)
+    data += c;
+  fclose(f);
+  return data;
+}
+
+void write_binary(const char *name, const std::string &data)
+{
+  FILE *f = fopen(name, "wb");
+  fwrite(data.data(), data.size(), 1, f);
+  fclose(f);
+}
+
+std::string read_text(const char *name)
+{
+  std::string text;
+  FILE *f = fopen(name, "r");
+  int c;
+  while ((c = fgetc(f)) != EOF)
+    text += c;
+  fclose(f);
+  return text;
+}
+
+// Every change of a signal, in order
+changes read_changes(struct trace_reader *r, int signal)
+{
+  changes out;
+  struct trace_cursor c;
+  EXPECT_EQ(0, trace_cursor_init(&c, r, signal, r->first_time));
+  if (!c.unknown)
+    out.push_back({ r->first_time, c.value, c.unknown });
+  while (trace_cursor_next(&c))
+    out.push_back({ c.time, c.value, c.unknown });
+  trace_cursor_free(&c);
+  return out;
+}
+
+// The state of a signal at a given time, from a list of its changes
+change state_at(const changes &list, int64_t time)
+{
+  auto after = std::upper_bound(list.begin(), list.end(), time, [](int64_t t, const change &ch) { return t < ch.time; });
+  if (after == list.begin())
+    return { time, 0, 1 };
+  return { time, (after - 1)->value, (after - 1)->unknown };
+}
+
+class TraceTestFixture : public ::testing::Test {
+  protected:
+  void SetUp() override
+  {
+    ::testing::internal::CaptureStderr();
+  }
+
+  void TearDown() override
+  {
+    testing::internal::GetCapturedStderr();
+
+    remove("trace.vcd");
+    remove("trace.m65t");
+    remove("trace2.vcd");
+    remove("trace2.m65t");
+  }
+
+  // Import a VCD file, export it again, and import the export
+  void import_export(const char *vcd, int64_t start_time, int64_t end_time)
+  {
+    write_text("trace.vcd", vcd);
+    ASSERT_EQ(0, trace_import_vcd("trace.vcd", "trace.m65t"));
+    struct trace_reader *r = trace_open("trace.m65t");
+    ASSERT_NE(nullptr, r);
+    FILE *f = fopen("trace2.vcd", "w");
+    ASSERT_EQ(0, trace_export_vcd(r, f, NULL, 0, start_time, end_time));
+    fclose(f);
+    trace_free(r);
+    ASSERT_EQ(0, trace_import_vcd("trace2.vcd", "trace2.m65t"));
+  }
+};
+
+const char *example_vcd = "$date today $end\n"
+                          "$timescale 1ns $end\n"
+                          "$scope module top $end\n"
+                          "$var wire 1 ! clk $end\n"
+                          "$var wire 8 \" data [7:0] $end\n"
+                          "$var wire 64 # wide $end\n"
+                          "$var wire 1 ! clk_alias $end\n"
+                          "$upscope $end\n"
+                          "$enddefinitions $end\n"
+                          "#0\n"
+                          "$dumpvars\n"
+                          "0!\n"
+                          "bx \"\n"
+                          "b0 #\n"
+                          "$end\n"
+                          "#10\n"
+                          "1!\n"
+                          "b10100101 \"\n"
+                          "#20\n"
+                          "0!\n"
+                          "b1000000000000000000000000000000000000000000000000000000000000001 #\n"
+                          "$comment a comment with #99 in it $end\n"
+                          "#30\n"
+                          "x!\n"
+                          "b101z0101 \"\n"
+                          "#40\n"
+                          "1!\n"
+                          "b11 \"\n";
+
+TEST_F(TraceTestFixture, ShouldNotOpenOtherFiles)
+{
+  write_text("trace.m65t", "not a trace\n");
+  ASSERT_EQ(nullptr, trace_open("trace.m65t"));
+  ASSERT_EQ(nullptr, trace_open("trace.missing"));
+}
+
+TEST_F(TraceTestFixture, ShouldImportVcd)
+{
+  write_text("trace.vcd", example_vcd);
+  ASSERT_EQ(0, trace_import_vcd("trace.vcd", "trace.m65t"));
+  struct trace_reader *r = trace_open("trace.m65t");
+  ASSERT_NE(nullptr, r);
+
+  EXPECT_EQ(TRACE_FS_PER_NS, r->timescale_fs);
+  EXPECT_EQ(0, r->first_time);
+  EXPECT_EQ(40, r->last_time);
+  // The second name for clk is not kept
+  ASSERT_EQ(3, r->signal_count);
+  EXPECT_EQ(0, trace_find_signal(r, "clk"));
+  EXPECT_EQ(1, trace_find_signal(r, "DATA"));
+  EXPECT_EQ(2, trace_find_signal(r, "wide"));
+  EXPECT_EQ(-1, trace_find_signal(r, "clk_alias"));
+  EXPECT_EQ(8, r->signals[1].width);
+  EXPECT_EQ(64, r->signals[2].width);
+
+  EXPECT_EQ(changes({ { 0, 0, 0 }, { 10, 1, 0 }, { 20, 0, 0 }, { 30, 0, 1 }, { 40, 1, 0 } }), read_changes(r, 0));
+  EXPECT_EQ(changes({ { 10, 0xa5, 0 }, { 30, 0, 1 }, { 40, 3, 0 } }), read_changes(r, 1));
+  EXPECT_EQ(changes({ { 0, 0, 0 }, { 20, 0x8000000000000001ULL, 0 } }), read_changes(r, 2));
+  trace_free(r);
+}
+
+TEST_F(TraceTestFixture, ShouldExportVcd)
+{
+  write_text("trace.vcd", example_vcd);
+  ASSERT_EQ(0, trace_import_vcd("trace.vcd", "trace.m65t"));
+  struct trace_reader *r = trace_open("trace.m65t");
+  ASSERT_NE(nullptr, r);
+  FILE *f = fopen("trace2.vcd", "w");
+  char *names[] = { "data", "clk" };
+  ASSERT_EQ(0, trace_export_vcd(r, f, names, 2, 15, 30));
+  fclose(f);
+  trace_free(r);
+
+  ASSERT_EQ("$version\n"
+            "   MEGA65 m65trace.\n"
+            "$end\n"
+            "$timescale 1 ns $end\n"
+            "$scope module logic $end\n"
+            "$var wire 8 ! data $end\n"
+            "$var wire 1 \" clk $end\n"
+            "$upscope $end\n"
+            "$enddefinitions $end\n"
+            "#15\n"
+            "$dumpvars\n"
+            "b10100101 !\n"
+            "1\"\n"
+            "$end\n"
+            "#20\n"
+            "0\"\n"
+            "#30\n"
+            "bx !\n"
+            "x\"\n",
+      read_text("trace2.vcd"));
+}
+
+TEST_F(TraceTestFixture, ShouldNotExportMissingSignal)
+{
+  write_text("trace.vcd", example_vcd);
+  ASSERT_EQ(0, trace_import_vcd("trace.vcd", "trace.m65t"));
+  struct trace_reader *r = trace_open("trace.m65t");
+  ASSERT_NE(nullptr, r);
+  FILE *f = fopen("trace2.vcd", "w");
+  char *names[] = { "clk", "nosuchsignal" };
+  ASSERT_EQ(-1, trace_export_vcd(r, f, names, 2, 0, -1));
+  fclose(f);
+  trace_free(r);
+}
+
+TEST_F(TraceTestFixture, ShouldRoundTripVcd)
+{
+  import_export(example_vcd, 0, -1);
+  struct trace_reader *a = trace_open("trace.m65t");
+  struct trace_reader *b = trace_open("trace2.m65t");
+  ASSERT_NE(nullptr, a);
+  ASSERT_NE(nullptr, b);
+  EXPECT_EQ(a->timescale_fs, b->timescale_fs);
+  ASSERT_EQ(a->signal_count, b->signal_count);
+  for (int i = 0; i < a->signal_count; i++) {
+    EXPECT_STREQ(a->signals[i].name, b->signals[i].name);
+    EXPECT_EQ(a->signals[i].width, b->signals[i].width);
+    EXPECT_EQ(read_changes(a, i), read_changes(b, i));
+  }
+  trace_free(a);
+  trace_free(b);
+}
+
+TEST_F(TraceTestFixture, ShouldRoundTripTimescales)
+{
+  for (const char *scale : { "1 s", "10 ms", "100 us", "1 ns", "10 ps", "100 fs" }) {
+    std::string vcd = std::string("$timescale ") + scale + " $end\n"
+        + "$var wire 1 ! a $end\n"
+          "$enddefinitions $end\n"
+          "#5\n"
+          "1!\n";
+    import_export(vcd.c_str(), 0, -1);
+    ASSERT_NE(std::string::npos, read_text("trace2.vcd").find(std::string("$timescale ") + scale + " $end")) << scale;
+  }
+}
+
+TEST_F(TraceTestFixture, ShouldReadBackManyBlocks)
+{
+  struct trace_writer *w = trace_create("trace.m65t", 10 * TRACE_FS_PER_NS);
+  ASSERT_NE(nullptr, w);
+  const int widths[] = { 1, 8, 64 };
+  std::vector<changes> expected(3);
+  for (int i = 0; i < 3; i++)
+    ASSERT_EQ(i, trace_add_signal(w, std::to_string(i).c_str(), widths[i]));
+
+  // Enough changes for several blocks, with a mix of large and small deltas
+  srand(65);
+  int64_t time = 100;
+  for (int n = 0; n < 3 * TRACE_BLOCK_CHANGES; n++) {
+    trace_set_time(w, time);
+    int signal = rand() % 3;
+    uint64_t value = ((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ rand();
+    if (widths[signal] < 64)
+      value &= (1ULL << widths[signal]) - 1;
+    int unknown = !(rand() % 10);
+    if (unknown)
+      value = 0;
+    trace_change(w, signal, value, unknown);
+
+    // Only changes of state are kept, but all of those are, even when
+    // a signal changes more than once at the same time
+    changes &list = expected[signal];
+    change before = list.empty() ? change({ 0, 0, 1 }) : list.back();
+    if (before.value != value || before.unknown != unknown)
+      list.push_back({ time, value, unknown });
+    time += (rand() % 16) ? rand() % 4 : rand();
+  }
+  ASSERT_EQ(0, trace_close(w));
+
+  struct trace_reader *r = trace_open("trace.m65t");
+  ASSERT_NE(nullptr, r);
+  EXPECT_LT(2, r->block_count);
+  EXPECT_EQ(10 * TRACE_FS_PER_NS, r->timescale_fs);
+  EXPECT_EQ(100, r->first_time);
+  int64_t last_time = 0;
+  for (int i = 0; i < 3; i++)
+    last_time = std::max(last_time, expected[i].back().time);
+  EXPECT_EQ(last_time, r->last_time);
+  for (int i = 0; i < 3; i++)
+    ASSERT_EQ(expected[i], read_changes(r, i));
+
+  // Starting part way through, including at block boundaries
+  std::vector<int64_t> starts;
+  for (int b = 0; b < r->block_count; b++) {
+    starts.push_back(r->blocks[b].start_time - 1);
+    starts.push_back(r->blocks[b].start_time);
+    starts.push_back(r->blocks[b].end_time);
+  }
+  for (int k = 0; k < 100; k++)
+    starts.push_back(100 + ((int64_t)rand() * rand()) % (time - 100));
+  for (int64_t start : starts)
+    for (int i = 0; i < 3; i++) {
+      struct trace_cursor c;
+      ASSERT_EQ(0, trace_cursor_init(&c, r, i, start));
+      change state = state_at(expected[i], start);
+      ASSERT_EQ(state.unknown, c.unknown) << "signal " << i << " at " << start;
+      ASSERT_EQ(state.value, c.value) << "signal " << i << " at " << start;
+      // The next change is the first one after the start
+      auto after = std::upper_bound(expected[i].begin(), expected[i].end(), start, [](int64_t t, const change &ch) { return t < ch.time; });
+      ASSERT_EQ(after == expected[i].end() ? INT64_MAX : after->time, trace_cursor_peek(&c));
+      trace_cursor_free(&c);
+    }
+  trace_free(r);
+}
+
+TEST_F(TraceTestFixture, ShouldReadFlushedTraceBeforeClose)
+{
+  struct trace_writer *w = trace_create("trace.m65t", 1);
+  ASSERT_NE(nullptr, w);
+  trace_add_signal(w, "a", 1);
+  trace_set_time(w, 1);
+  trace_change(w, 0, 1, 0);
+  trace_set_time(w, 2);
+  trace_change(w, 0, 0, 0);
+  ASSERT_EQ(0, trace_flush(w));
+  // Not flushed yet
+  trace_set_time(w, 3);
+  trace_change(w, 0, 1, 0);
+
+  struct trace_reader *r = trace_open("trace.m65t");
+  ASSERT_NE(nullptr, r);
+  EXPECT_EQ(changes({ { 1, 1, 0 }, { 2, 0, 0 } }), read_changes(r, 0));
+  trace_free(r);
+
+  ASSERT_EQ(0, trace_close(w));
+  r = trace_open("trace.m65t");
+  ASSERT_NE(nullptr, r);
+  EXPECT_EQ(changes({ { 1, 1, 0 }, { 2, 0, 0 }, { 3, 1, 0 } }), read_changes(r, 0));
+  trace_free(r);
+}
+
+TEST_F(TraceTestFixture, ShouldReadTraceInterruptedWhileWritingBlock)
+{
+  struct trace_writer *w = trace_create("trace.m65t", 1);
+  ASSERT_NE(nullptr, w);
+  trace_add_signal(w, "a", 8);
+  changes expected;
+  for (int i = 1; i <= 2; i++) {
+    trace_set_time(w, i);
+    trace_change(w, 0, i, 0);
+    expected.push_back({ i, (uint64_t)i, 0 });
+    ASSERT_EQ(0, trace_flush(w));
+  }
+  std::string before = read_binary("trace.m65t");
+
+  for (int i = 3; i < 1000; i++) {
+    trace_set_time(w, i);
+    trace_change(w, 0, i & 0xff, 0);
+  }
+  ASSERT_EQ(0, trace_flush(w));
+  std::string after = read_binary("trace.m65t");
+  ASSERT_EQ(0, trace_close(w));
+  ASSERT_LT(before.size(), after.size());
+  // Nothing but the header has changed
+  EXPECT_EQ(before.substr(56), after.substr(56, before.size() - 56));
+
+  // Killed at any point after starting on the third block, but before
+  // the header was rewritten
+  for (size_t size = before.size(); size <= after.size(); size += 7) {
+    write_binary("trace2.m65t", before.substr(0, 56) + after.substr(56, size - 56));
+    struct trace_reader *r = trace_open("trace2.m65t");
+    ASSERT_NE(nullptr, r) << size;
+    EXPECT_EQ(2, r->block_count);
+    EXPECT_EQ(expected, read_changes(r, 0));
+    trace_free(r);
+  }
+}
+
+}
@@ -0,0 +1,97 @@
+#include "gtest/gtest.h"
+#include <algorithm>
+#include <stdio.h>
+#include <vector>
+
+extern int real_main(int argc, char **argv);
+
+namespace vcdgraph {
+
+// An 8-bit luma signal that is $80 until 5us, then $F0 until 20us
+void write_vcd(const char *name)
+{
+  FILE *f = fopen(name, "w");
+  fprintf(f, "$timescale 1ns $end\n"
+             "$var wire 8 ! luma $end\n"
+             "$enddefinitions $end\n"
+             "#0\n"
+             "b10000000 !\n"
+             "#5000\n"
+             "b11110000 !\n"
+             "#20000\n");
+  fclose(f);
+}
+
+std::vector<unsigned char> read_samples(void)
+{
+  std::vector<unsigned char> samples;
+  FILE *f = fopen("samples.raw", "rb");
+  if (!f)
+    return samples;
+  int c;
+  while ((c = fgetc(f)) != EOF)
+    samples.push_back(c);
+  fclose(f);
+  return samples;
+}
+
+// A flat signal has no sync pulses, so vcdgraph exits once samples.raw is written
+void run_vcdgraph(const char *start, const char *end)
+{
+  char *argv[] = { "vcdgraph", "-s", (char *)start, "-e", (char *)end, "vcdgraph.vcd", "vcdgraph.pdf", "luma", NULL };
+  remove("samples.raw");
+  EXPECT_EXIT(real_main(8, argv), ::testing::ExitedWithCode(255), "Could not find any sync pulses");
+}
+
+class VcdgraphTestFixture : public ::testing::Test {
+  protected:
+  void SetUp() override
+  {
+    write_vcd("vcdgraph.vcd");
+  }
+
+  void TearDown() override
+  {
+    remove("vcdgraph.vcd");
+    remove("vcdgraph.pdf");
+    remove("samples.raw");
+  }
+};
+
+TEST_F(VcdgraphTestFixture, ShouldSampleWindowHoldingOneValue)
+{
+  run_vcdgraph("1000", "4000");
+  std::vector<unsigned char> samples = read_samples();
+  // 27 samples per microsecond
+  ASSERT_NEAR(3 * 27, (int)samples.size(), 1);
+  for (unsigned char s : samples)
+    ASSERT_EQ(0x80, s);
+}
+
+TEST_F(VcdgraphTestFixture, ShouldSampleLastValueUntilEndOfWindow)
+{
+  run_vcdgraph("4000", "8000");
+  std::vector<unsigned char> samples = read_samples();
+  ASSERT_NEAR(4 * 27, (int)samples.size(), 1);
+  ASSERT_EQ(0x80, samples.front());
+  ASSERT_EQ(0xf0, samples.back());
+  // One change, at 5us
+  int changes = 0;
+  for (size_t i = 1; i < samples.size(); i++)
+    if (samples[i] != samples[i - 1])
+      changes++;
+  ASSERT_EQ(1, changes);
+  ASSERT_NEAR(27, std::find(samples.begin(), samples.end(), 0xf0) - samples.begin(), 1);
+}
+
+TEST_F(VcdgraphTestFixture, ShouldSampleLastValueUntilEndOfTrace)
+{
+  // The window reaches beyond the last timestamp of the trace
+  run_vcdgraph("15000", "30000");
+  std::vector<unsigned char> samples = read_samples();
+  ASSERT_NEAR(5 * 27, (int)samples.size(), 1);
+  for (unsigned char s : samples)
+    ASSERT_EQ(0xf0, s);
+}
+
+}
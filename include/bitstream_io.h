@@ -0,0 +1,60 @@
+#ifndef BITSTREAM_IO_H
+#define BITSTREAM_IO_H
+
+/*
+  File handling shared by the bitstream and core file tools (bit2core,
+  bit2mcs, bitinfo and mega65_ftp's core flashing).
+
+  Input files are mapped rather than copied into fixed size buffers, and
+  output files are written from a list of pieces in one go, so that a core
+  file never needs to be assembled in memory.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct bitio_map {
+  unsigned char *data;
+  size_t size;
+  // 0 if the file was read into allocated memory instead (e.g., on Windows)
+  int mapped;
+};
+
+/*
+  Map a file read-only.  Returns 0 on success, or -1 with errno set.
+*/
+int bitio_map_file(const char *filename, struct bitio_map *m);
+void bitio_unmap_file(struct bitio_map *m);
+
+/*
+  A piece of an output file.  If data is NULL, len zero bytes are written.
+*/
+struct bitio_segment {
+  const void *data;
+  size_t len;
+};
+
+/*
+  Write the segments, in order, to a new file.  Returns 0 on success, or -1
+  with errno set.
+*/
+int bitio_write_segments(const char *filename, const struct bitio_segment *segments, int count);
+
+/*
+  Byte swap 32-bit words, using SIMD instructions where the compiler has
+  them enabled.  dst and src may be the same.
+*/
+void bitio_swap32(uint32_t *dst, const uint32_t *src, size_t words);
+
+/*
+  Convert big-endian words (as in a Xilinx bitstream) to host order.
+*/
+void bitio_be32_to_host(uint32_t *dst, const uint32_t *src, size_t words);
+
+/*
+  Write data as an Intel HEX (.mcs) file for Vivado, starting at flash
+  address load_addr.  Returns 0 on success, or -1 with errno set.
+*/
+int bitio_write_mcs(const char *filename, const unsigned char *data, size_t len, uint32_t load_addr);
+
+#endif // BITSTREAM_IO_H
@@ -11,6 +11,10 @@ extern int fpgajtag_libusb_open_failed;
 // enable USBDK interface
 extern int fpgajtag_usbdk_enable;
 
+// check the FPGA's CRC status after loading a bitstream, and make
+// fpgajtag_main return -1 if it failed
+extern int fpgajtag_verify;
+
 /*
  * init_fpgajtag(serialno, serialport, fpga_id)
  *   returns usb device string
@@ -21,11 +25,56 @@ extern int fpgajtag_usbdk_enable;
  */
 char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t fpga_id);
 
+/*
+ * A board found by fpgajtag_enumerate
+ */
+struct fpgajtag_device {
+  int usb_index;
+  int jtag_index;
+  uint32_t idcode;
+  char serial[64];
+  char port[1024];
+};
+
+/*
+ * fpgajtag_enumerate(fpga_id, devices, max_devices)
+ *   returns the number of boards found
+ *
+ * probes all usb interfaces, like init_fpgajtag, but fills in devices
+ * with every board that has an FPGA matching fpga_id instead of
+ * selecting one of them.
+ */
+int fpgajtag_enumerate(const uint32_t fpga_id, struct fpgajtag_device *devices, int max_devices);
+
+/*
+ * A bitstream to load into the board with a given serial number.
+ * result and seconds are filled in by fpgajtag_program_boards.
+ */
+struct fpgajtag_job {
+  char serial[64];
+  char *bitstream;
+  uint32_t fpga_id;
+  int result;
+  double seconds;
+};
+
+/*
+ * fpgajtag_program_boards(jobs, count)
+ *   returns the number of boards that failed
+ *
+ * loads the bitstreams into all of the boards at the same time, each in a
+ * process of its own (one after the other on Windows). Log messages are
+ * prefixed with the serial number of the board they are about.
+ * This does not need init_fpgajtag to have been run.
+ */
+int fpgajtag_program_boards(struct fpgajtag_job *jobs, int count);
+
 /*
  * fpgajtag_main(bitstream)
  *
  * pushes bistream via JTAG to FPGA
  * JTAG must have been initialised using init_fpgajtag prior to this!
+ * returns 0, or -1 if fpgajtag_verify is set and the CRC check failed
  */
 int fpgajtag_main(char *bitstream);
 
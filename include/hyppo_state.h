@@ -0,0 +1,50 @@
+#ifndef HYPPO_STATE_H
+#define HYPPO_STATE_H
+
+/*
+ * Decoder for the hypervisor's DOS state (m65 -X).
+ *
+ * The disk table, the DOS work area and the process descriptor are read
+ * as one block, and decoded using a table of the fields in it, so that
+ * the same layout gives the text report, JSON, and the list of fields
+ * that changed between two reads.
+ */
+
+#include <stdio.h>
+
+// $BB00-$BBFF disk table and SYSPART, $BC00-$BCFF DOS work area,
+// $BD00-$BDFF process descriptor
+#define HYPPO_STATE_ADDR 0xFFFBB00
+#define HYPPO_STATE_SIZE 0x300
+
+struct hyppo_state {
+  unsigned char data[HYPPO_STATE_SIZE];
+  long long time_ms;
+};
+
+/*
+ * hyppo_state_fetch(state)
+ *
+ * read the hypervisor state from the MEGA65.  Returns 0 on success.
+ */
+int hyppo_state_fetch(struct hyppo_state *s);
+
+/*
+ * hyppo_state_print(f, state, prev, json)
+ *
+ * print all of the fields, or if prev is not NULL only those that differ
+ * from it.  JSON is always one line with the whole state, and is only
+ * printed if some of it differs.  Returns the number of fields that
+ * differ (or all of them without prev).
+ */
+int hyppo_state_print(FILE *f, const struct hyppo_state *s, const struct hyppo_state *prev, int json);
+
+/*
+ * hyppo_state_watch(interval_ms, json)
+ *
+ * print the state, then the changes to it every interval_ms until
+ * interrupted.  Only returns if the MEGA65 stops responding.
+ */
+int hyppo_state_watch(int interval_ms, int json);
+
+#endif // HYPPO_STATE_H
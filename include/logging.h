@@ -26,6 +26,14 @@ int log_parse_level(char *levelarg);
  */
 void log_setup(FILE *outfile, const int level);
 
+/*
+ * log_set_prefix(prefix)
+ *
+ * puts [prefix] in front of every message, e.g., to tell apart
+ * messages about different devices. NULL removes the prefix.
+ */
+void log_set_prefix(const char *prefix);
+
 /*
  * log_raiselevel(level)
  *
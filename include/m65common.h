@@ -68,9 +68,69 @@ int breakpoint_set(int pc);
 int breakpoint_wait(void);
 int push_ram(unsigned long address, unsigned int count, unsigned char *buffer);
 int fetch_ram(unsigned long address, unsigned int count, unsigned char *buffer);
+int fetch_ram_checked(unsigned long address, unsigned int count, unsigned char *buffer);
+
+/*
+  Memory to push with push_ram_pieces(), which sends a list of pieces back
+  to back, only waiting for the monitor to acknowledge each 4KB chunk once
+  the next one has been sent.
+*/
+struct ram_piece {
+  unsigned long address;
+  unsigned int count;
+  unsigned char *buffer;
+};
+int push_ram_pieces(const struct ram_piece *pieces, int count);
 int fetch_ram_invalidate(void);
 int fetch_ram_cacheable(unsigned long address, unsigned int count, unsigned char *buffer);
 int detect_mode(void);
+
+/*
+  Register scripts: a list of pokes, peeks, waits and delays that is sent to
+  the serial monitor as a few pipelined bursts of commands, rather than one
+  round trip per register access.  Peek results are written to the supplied
+  locations once regscript_run() returns.
+*/
+#define REGSCRIPT_POKE 1
+#define REGSCRIPT_PEEK 2
+#define REGSCRIPT_MODIFY 3
+#define REGSCRIPT_WAIT_CLEAR 4
+#define REGSCRIPT_WAIT_SET 5
+#define REGSCRIPT_DELAY 6
+
+// Timeout for waits that poll until the hardware is done, however long it takes
+#define REGSCRIPT_WAIT_FOREVER 0
+
+struct regscript_op {
+  int type;
+  unsigned int addr;
+  unsigned char value;   // value to poke, or bits to set for modify
+  unsigned char mask;    // bits to keep for modify, or bits to test for waits
+  unsigned int usec;     // length of a delay, or timeout for waits (0 for none)
+  unsigned char *result; // where a peek stores its value
+};
+
+struct regscript {
+  struct regscript_op *ops;
+  int count;
+  int max;
+};
+
+void regscript_init(struct regscript *rs);
+void regscript_reset(struct regscript *rs);
+void regscript_free(struct regscript *rs);
+void regscript_poke(struct regscript *rs, unsigned int addr, unsigned char value);
+void regscript_peek(struct regscript *rs, unsigned int addr, unsigned char *result);
+void regscript_modify(struct regscript *rs, unsigned int addr, unsigned char and_mask, unsigned char or_value);
+/*
+  Waits poll addr until the bits in mask are all clear or all set.  If that
+  takes longer than usec microseconds, regscript_run() gives up and fails.
+*/
+void regscript_wait_clear(struct regscript *rs, unsigned int addr, unsigned char mask, unsigned int usec);
+void regscript_wait_set(struct regscript *rs, unsigned int addr, unsigned char mask, unsigned int usec);
+void regscript_delay(struct regscript *rs, unsigned int usec);
+int regscript_run(struct regscript *rs);
+
 void print_error(const char *context);
 #ifdef WINDOWS
 HANDLE open_serial_port(const char *device, uint32_t baud_rate);
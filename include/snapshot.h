@@ -0,0 +1,88 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Machine state snapshots for m65 (--snapsave / --snaprestore).
+ *
+ * A snapshot holds chip RAM, colour RAM, a list of I/O registers and the
+ * CPU registers.  Restoring one only sends the pages that have changed
+ * since: a small routine on the MEGA65 checksums every page, and the host
+ * compares the checksums with those of the snapshot, so that resetting a
+ * test to a known state takes a fraction of a second rather than a full
+ * reset and load.
+ */
+
+#include <stdint.h>
+
+#define SNAPSHOT_MAGIC "M65SNAP1"
+
+#define SNAPSHOT_CHIPRAM_ADDR 0x0000000
+#define SNAPSHOT_CHIPRAM_SIZE 0x60000
+#define SNAPSHOT_COLOURRAM_ADDR 0xFF80000
+#define SNAPSHOT_COLOURRAM_SIZE 0x8000
+
+#define SNAPSHOT_PAGES ((SNAPSHOT_CHIPRAM_SIZE + SNAPSHOT_COLOURRAM_SIZE) / 256)
+
+struct snapshot_regs {
+  uint16_t pc, sp, maph, mapl;
+  uint8_t a, x, y, z, b, p;
+};
+
+struct snapshot_io {
+  uint32_t addr;
+  uint8_t value;
+};
+
+struct snapshot {
+  struct snapshot_regs regs;
+  int c64_mode, c65_mode;
+  unsigned char *chipram;
+  unsigned char *colourram;
+  struct snapshot_io *io;
+  int io_count;
+};
+
+/*
+ * snapshot_checksum(page, sum)
+ *
+ * the 4 byte checksum of a 256 byte page, as computed by the routine that
+ * runs on the MEGA65: the sum of the bytes, the 16-bit sum of the running
+ * sums (low byte first) and the XOR of the bytes.
+ */
+void snapshot_checksum(const unsigned char *page, unsigned char *sum);
+
+/*
+ * snapshot_diff(snap, sums, dirty)
+ *
+ * compare the checksums read back from the MEGA65 (4 bytes per page,
+ * chip RAM then colour RAM) with those of the snapshot, setting dirty[n]
+ * for each of the SNAPSHOT_PAGES pages that needs to be restored.
+ * Returns the number of dirty pages.
+ */
+int snapshot_diff(const struct snapshot *snap, const unsigned char *sums, unsigned char *dirty);
+
+/*
+ * snapshot_checksum_ranges(count, addr, pages, sums)
+ *
+ * checksum memory on the MEGA65 without taking a snapshot: pages[i] pages
+ * from addr[i] for each of the count ranges, storing 4 bytes per page in
+ * sums.  The memory and registers that the checksum routine uses are put
+ * back afterwards.  Returns 0 on success, or -1 if the ranges are too
+ * large or the routine could not be run (e.g., in the hypervisor).
+ */
+int snapshot_checksum_ranges(int count, const uint32_t *addr, const int *pages, unsigned char *sums);
+
+// Reading and writing snapshot files.  Both return 0 on success.
+int snapshot_write(const char *filename, const struct snapshot *snap);
+int snapshot_read(const char *filename, struct snapshot *snap);
+void snapshot_free(struct snapshot *snap);
+
+/*
+ * Taking and restoring a snapshot through the serial monitor.  The CPU
+ * keeps running after snapshot_save(), and resumes with the saved
+ * registers after snapshot_restore().
+ */
+int snapshot_save(const char *filename);
+int snapshot_restore(const char *filename);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,157 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+  Compact binary traces of digital signals, as an alternative to VCD files.
+
+  A trace is a series of compressed blocks, each covering a span of time.
+  Within a block, each signal has its own column: the value it had when the
+  block starts, followed by its changes as (time delta, value) pairs.  Each
+  block is followed by a record of where it is and the times it covers, so
+  that a time window can be found without reading what comes before it,
+  and a signal can be followed without decoding the other signals.
+
+  Times are whole numbers of ticks, with the length of a tick given in fs.
+  Values are up to 64 bits, with a flag for unknown (x/z) values.
+
+  Nothing already written is overwritten when a block is added, other than
+  the header, and that is only rewritten to point at the new block once the
+  block is complete.  So a trace that is still being captured (or whose
+  capture was interrupted, even part way through writing a block) can be
+  read up to the last block written.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define TRACE_MAGIC "M65TRACE"
+#define TRACE_VERSION 1
+
+#define TRACE_MAX_NAME 256
+
+// Changes in a block before it is written out
+#define TRACE_BLOCK_CHANGES 65536
+
+#define TRACE_FS_PER_NS 1000000ULL
+#define TRACE_FS_PER_US 1000000000ULL
+
+struct trace_signal {
+  char name[TRACE_MAX_NAME];
+  int width;
+};
+
+struct trace_block_info {
+  uint64_t offset;
+  uint32_t compressed_size;
+  uint32_t size;
+  int64_t start_time;
+  int64_t end_time;
+};
+
+struct trace_column;
+
+struct trace_writer {
+  FILE *f;
+  uint64_t timescale_fs;
+
+  int signal_count;
+  struct trace_signal *signals;
+  struct trace_column *columns;
+
+  int block_count;
+  // Where the next block goes, and the record of the last block
+  uint64_t end_offset;
+  uint64_t last_record;
+
+  int64_t time;
+  int64_t block_start;
+  int block_changes;
+  int64_t first_time, last_time;
+  int have_time;
+};
+
+struct trace_reader {
+  const unsigned char *map;
+  size_t size;
+
+  uint64_t timescale_fs;
+  int signal_count;
+  struct trace_signal *signals;
+  int block_count;
+  struct trace_block_info *blocks;
+  int64_t first_time, last_time;
+
+  // The most recently decompressed block
+  int cached_block;
+  unsigned char *block_data;
+  size_t block_data_size;
+};
+
+/*
+  Follows one signal through a trace, from a given time.
+  After trace_cursor_init(), time/value/unknown give the state of the
+  signal at the start time.  Each call to trace_cursor_next() then moves
+  to the next change, until it returns 0.
+*/
+struct trace_cursor {
+  struct trace_reader *r;
+  int signal;
+  int block;
+
+  // Copy of the signal's column in the current block
+  unsigned char *column;
+  size_t column_size, column_max;
+  size_t pos;
+  int remaining;
+  int64_t column_time;
+
+  int64_t time;
+  uint64_t value;
+  int unknown;
+
+  // The next change is always decoded ahead, so that cursors on several
+  // signals can be merged by comparing times
+  int have_next;
+  int64_t next_time;
+  uint64_t next_value;
+  int next_unknown;
+};
+
+/*
+  Writing traces.  Signal values are given as changes, after setting the
+  time at which they happen.  Times must not go backwards.
+*/
+struct trace_writer *trace_create(const char *filename, uint64_t timescale_fs);
+int trace_add_signal(struct trace_writer *w, const char *name, int width);
+void trace_set_time(struct trace_writer *w, int64_t time);
+void trace_change(struct trace_writer *w, int signal, uint64_t value, int unknown);
+
+/*
+  Write out the changes so far as a block, so that they can be read even if
+  the writer is never closed (e.g., when a capture is interrupted).
+*/
+int trace_flush(struct trace_writer *w);
+int trace_close(struct trace_writer *w);
+
+/*
+  Reading traces.  trace_open() returns NULL if the file is not a trace.
+*/
+struct trace_reader *trace_open(const char *filename);
+void trace_free(struct trace_reader *r);
+int trace_find_signal(struct trace_reader *r, const char *name);
+double trace_ticks_to_ns(struct trace_reader *r, int64_t ticks);
+int64_t trace_ns_to_ticks(struct trace_reader *r, double ns);
+
+int trace_cursor_init(struct trace_cursor *c, struct trace_reader *r, int signal, int64_t start_time);
+int trace_cursor_next(struct trace_cursor *c);
+// Time of the next change, or INT64_MAX if there are none
+int64_t trace_cursor_peek(struct trace_cursor *c);
+void trace_cursor_free(struct trace_cursor *c);
+
+/*
+  Conversion to and from VCD.  An empty list of names exports every signal.
+*/
+int trace_import_vcd(const char *vcd_file, const char *trace_file);
+int trace_export_vcd(struct trace_reader *r, FILE *out, char **names, int name_count, int64_t start_time, int64_t end_time);
+
+#endif // TRACE_H
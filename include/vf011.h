@@ -0,0 +1,78 @@
+#ifndef VF011_H
+#define VF011_H
+
+/*
+ * Disk images served to the MEGA65 by the virtual F011 (m65 -d).
+ *
+ * Any number of images can be loaded, and each of the two drives has
+ * one of them (or none) mounted.  Each image is cached in memory, and
+ * written sectors are only marked dirty and written back to the file
+ * later, so swapping the disk in a drive costs nothing.
+ */
+
+#include <stdio.h>
+
+#define VF011_DRIVES 2
+#define VF011_MAX_IMAGES 64
+#define VF011_D81_SIZE 819200
+
+// Dirty sectors are written back once nothing has been written for this long
+#define VF011_FLUSH_IDLE_MS 1000
+
+struct vf011_image {
+  char *filename;
+  FILE *f;
+  unsigned char *data;
+  long size;
+  // One flag per 512 byte physical sector
+  unsigned char *dirty;
+  int dirty_count;
+  long long last_write_time;
+};
+
+/*
+ * vf011_add_image(filename)
+ *
+ * add an image to the list, returning its number, or -1 if the list is
+ * full.  The file is not opened until a drive first accesses it.
+ */
+int vf011_add_image(const char *filename);
+int vf011_image_count(void);
+struct vf011_image *vf011_get_image(int n);
+
+/*
+ * vf011_mount(drive, n)
+ *
+ * put image n in the drive, or empty it if n is -1.
+ */
+int vf011_mount(int drive, int n);
+// Image in the drive, or NULL if it is empty
+struct vf011_image *vf011_drive_image(int drive);
+
+/*
+ * vf011_sector(image, track, sector, side, writep)
+ *
+ * returns the cached 512 byte physical sector, or NULL if it is outside
+ * the image.  When writing, the image is extended as needed.
+ */
+unsigned char *vf011_sector(struct vf011_image *img, int track, int sector, int side, int writep);
+void vf011_sector_written(struct vf011_image *img, unsigned char *sector);
+
+/*
+ * Writing back dirty sectors.  vf011_flush_if_idle() only writes back
+ * images that have not been written to for VF011_FLUSH_IDLE_MS.
+ */
+int vf011_flush(struct vf011_image *img);
+int vf011_dirty_images(void);
+void vf011_flush_if_idle(void);
+void vf011_close_all(void);
+
+/*
+ * vf011_command(line)
+ *
+ * run a control command (list, mount, eject, flush or quit).  Returns 1
+ * for quit, otherwise 0.
+ */
+int vf011_command(const char *line);
+
+#endif // VF011_H
@@ -21,6 +21,7 @@
 #include <stdint.h>
 #include "m65common.h"
 #include "dirtymock.h"
+#include "bitstream_io.h"
 
 extern const char *version_string;
 
@@ -38,8 +39,13 @@ extern const char *version_string;
 #define ARG_COREPATH argv[5]
 
 #define CORE_HEADER_SIZE 4096
+#define CORE_SLOT_SIZE (8192 * 1024)
+#define BANNER_SIZE (32 * 1024)
+#define EMBED_RECORD_SIZE (4 + 4 + 32)
+#define MAX_EMBED_FILES 255
 
-static unsigned char bitstream_data[MAX_MB * BYTES_IN_MEGABYTE];
+static struct bitio_map bitstream_map;
+static unsigned char *bitstream_data;
 
 typedef struct {
   char name[MAX_M65_TARGET_NAME_LEN];
@@ -348,14 +354,12 @@ int check_bitstream_header_has_suitable_fpga_part_for_m65target(m65target_info *
 
 int read_bitstream_file(const char *filename)
 {
-  FILE *bf = fopen(filename, "rb");
-  if (!bf) {
+  if (bitio_map_file(filename, &bitstream_map)) {
     fprintf(stderr, "ERROR: Could not read bitstream file '%s'\n", filename);
     exit(-3);
   }
-
-  int bit_size = fread(bitstream_data, 1, MAX_MB * BYTES_IN_MEGABYTE, bf);
-  fclose(bf);
+  bitstream_data = bitstream_map.data;
+  int bit_size = bitstream_map.size;
 
   printf("Bitstream file is %d bytes long.\n", bit_size);
 
@@ -385,50 +389,66 @@ int check_bitstream_file(m65target_info *m65target, int bit_size)
   return 0;
 }
 
-void write_core_file(int core_len, unsigned char *core_file, char *core_filename)
+/*
+  The core file is never assembled in memory.  Instead it is described as a
+  list of pieces: the header, the mapped bitstream, and for each embedded
+  file its record and mapped contents, which are written out in one go.
+*/
+static header_info core_header;
+static struct bitio_segment core_segments[4 + 2 * MAX_EMBED_FILES];
+static int core_segment_count = 0;
+static unsigned char embed_records[MAX_EMBED_FILES][EMBED_RECORD_SIZE];
+static struct bitio_map embed_maps[MAX_EMBED_FILES];
+
+static void add_core_segment(const void *data, size_t len)
+{
+  core_segments[core_segment_count].data = data;
+  core_segments[core_segment_count].len = len;
+  core_segment_count++;
+}
+
+void write_core_file(int core_len, char *core_filename)
 {
-  FILE *of = fopen(core_filename, "wb");
-  if (!of) {
-    fprintf(stderr, "ERROR: Could not create core file '%s'\n", core_filename);
+  // Pad (e.g., up to the banner) with zeroes
+  size_t written = 0;
+  for (int i = 0; i < core_segment_count; i++)
+    written += core_segments[i].len;
+  if (written < core_len)
+    add_core_segment(NULL, core_len - written);
+
+  if (bitio_write_segments(core_filename, core_segments, core_segment_count)) {
+    fprintf(stderr, "ERROR: Could not write core file '%s'\n", core_filename);
     exit(-3);
   }
-  if (fwrite(core_file, core_len, 1, of) != 1) {
-    fprintf(stderr, "ERROR: Could not write all data to '%s'\n", core_filename);
-    exit(-1);
-  }
-
-  fclose(of);
 
   fprintf(stderr, "Core file written: \"%s\"\n", core_filename);
   return;
 }
 
-void build_core_file(const int bit_size, int *core_len, unsigned char *core_file, const char *core_name,
-    const char *core_version, const char *m65target_name, const char *core_filename)
+void build_core_file(const int bit_size, int *core_len, const char *core_name, const char *core_version,
+    const char *m65target_name, const char *core_filename)
 {
 
   // Write core file name and version
-  header_info header_block;
-
-  memset(core_file, 0, 8192 * 1024);
+  header_info *header_block = &core_header;
 
-  memset(header_block.data, 0, CORE_HEADER_SIZE);
+  memset(header_block->data, 0, CORE_HEADER_SIZE);
 
   for (int i = 0; i < 16; i++)
-    header_block.magic[i] = MAGIC_STR[i];
+    header_block->magic[i] = MAGIC_STR[i];
 
-  strcpy(header_block.core_name, core_name);
-  strcpy(header_block.core_version, core_version);
-  strcpy(header_block.m65_target, m65target_name);
-  header_block.model_id = get_model_id(m65target_name);
+  strcpy(header_block->core_name, core_name);
+  strcpy(header_block->core_version, core_version);
+  strcpy(header_block->m65_target, m65target_name);
+  header_block->model_id = get_model_id(m65target_name);
 
-  bcopy(header_block.data, core_file, CORE_HEADER_SIZE);
+  add_core_segment(header_block->data, CORE_HEADER_SIZE);
   *core_len = CORE_HEADER_SIZE;
-  if (bit_size + (*core_len) >= 8192 * 1024) {
+  if (bit_size + (*core_len) >= CORE_SLOT_SIZE) {
     fprintf(stderr, "ERROR: Bitstream + header > 8MB\n");
     exit(-1);
   }
-  bcopy(bitstream_data, &core_file[*core_len], bit_size);
+  add_core_segment(bitstream_data, bit_size);
   *core_len += bit_size;
 }
 
@@ -439,6 +459,8 @@ unsigned long htoc64l(unsigned long v)
     unsigned long l;
   } conv;
 
+  // unsigned long may be wider than the 4 bytes set here
+  conv.l = 0;
   conv.c[0] = (v >> 0) & 0xff;
   conv.c[1] = (v >> 8) & 0xff;
   conv.c[2] = (v >> 16) & 0xff;
@@ -459,12 +481,12 @@ unsigned long c64tohl(unsigned long v)
   return (conv.c[0] << 0) + (conv.c[1] << 8) + (conv.c[2] << 16) + (conv.c[3] << 24);
 }
 
-unsigned char file_data[1024 * 1024];
 unsigned int last_file_offset = 0;
 int banner_present = 0;
-void embed_file(int *core_len, unsigned char *core_file, char *filename)
+static struct bitio_map *banner_map = NULL;
+void embed_file(int *core_len, char *filename)
 {
-  header_info *header_block = (header_info *)core_file;
+  header_info *header_block = &core_header;
   if (!header_block->embed_file_offset) {
     fprintf(stderr, "INFO: Embedding first file. Setting embed_file_offset to current COR file length.\n");
     header_block->embed_file_offset = htoc64l(*core_len);
@@ -487,6 +509,10 @@ void embed_file(int *core_len, unsigned char *core_file, char *filename)
     fprintf(stderr, "ERROR: Cannot embed directory '%s'.\n", filename);
     exit(-1);
   }
+  if (header_block->embed_file_count == MAX_EMBED_FILES) {
+    fprintf(stderr, "ERROR: Cannot embed more than %d files.\n", MAX_EMBED_FILES);
+    exit(-1);
+  }
 
   /* Each embedded file is represented by:
       4 bytes = address of next embedded file record (or 0 if last)
@@ -494,51 +520,58 @@ void embed_file(int *core_len, unsigned char *core_file, char *filename)
      32 bytes = filename
   */
 
-  FILE *f = fopen(filename, "rb");
-  if (!f) {
+  struct bitio_map *file_map = &embed_maps[header_block->embed_file_count];
+  if (bitio_map_file(filename, file_map)) {
     fprintf(stderr, "ERROR: Could not read file '%s'\n", filename);
     exit(-1);
   }
-  int file_len = fread(file_data, 1, 1024 * 1024, f);
-  fclose(f);
+  int file_len = file_map->size;
+  if (file_len > 1024 * 1024) {
+    // Embedded files have always been cut off at 1MB
+    fprintf(stderr, "WARNING: Only embedding the first 1MB of '%s'\n", filename);
+    file_len = 1024 * 1024;
+  }
 
   fprintf(stderr, "INFO: Writing file '%s' at offset $%06x, len=%d\n", basename, last_file_offset, file_len);
 
   // XXX - And banner file if present gets put in the last 32KB of the slot so that a future update to HYPPO can
   // read it there instantly on boot.
   if (!strcmp(basename, "BANNER.M65")) {
-    if (file_len > 32 * 1024) {
+    if (file_len > BANNER_SIZE) {
       fprintf(stderr, "ERROR: BANNER.M65 file must be <= 32KB\n");
       exit(-1);
     }
     fprintf(stderr, "INFO: Embedding banner file in last 32KB of slot.\n");
     header_block->banner_present = 1;
     banner_present = 1;
-    bcopy(file_data, &core_file[(8192 - 32) * 1024], file_len);
+    banner_map = file_map;
   }
 
   // Write embedded file
   unsigned int this_offset = last_file_offset;
-  unsigned int next_offset = this_offset + 4 + 4 + 32 + file_len;
+  unsigned int next_offset = this_offset + EMBED_RECORD_SIZE + file_len;
 
-  if (next_offset >= 8192 * 1024 - 4) {
+  if (next_offset >= CORE_SLOT_SIZE - 4) {
     fprintf(stderr, "ERROR: COR files must be less than 8MB\n");
     exit(-1);
   }
 
-  core_file[this_offset + 0] = next_offset >> 0;
-  core_file[this_offset + 1] = next_offset >> 8;
-  core_file[this_offset + 2] = next_offset >> 16;
-  core_file[this_offset + 3] = next_offset >> 24;
+  unsigned char *record = embed_records[header_block->embed_file_count];
+  memset(record, 0, EMBED_RECORD_SIZE);
+  record[0] = next_offset >> 0;
+  record[1] = next_offset >> 8;
+  record[2] = next_offset >> 16;
+  record[3] = next_offset >> 24;
 
-  core_file[this_offset + 4] = file_len >> 0;
-  core_file[this_offset + 5] = file_len >> 8;
-  core_file[this_offset + 6] = file_len >> 16;
-  core_file[this_offset + 7] = file_len >> 24;
+  record[4] = file_len >> 0;
+  record[5] = file_len >> 8;
+  record[6] = file_len >> 16;
+  record[7] = file_len >> 24;
 
-  bcopy(basename, &core_file[this_offset + 4 + 4], 32);
+  strncpy((char *)&record[4 + 4], basename, 32);
 
-  bcopy(file_data, &core_file[this_offset + 4 + 4 + 32], file_len);
+  add_core_segment(record, EMBED_RECORD_SIZE);
+  add_core_segment(file_map->data, file_len);
 
   header_block->embed_file_count++;
 
@@ -548,7 +581,7 @@ void embed_file(int *core_len, unsigned char *core_file, char *filename)
   return;
 }
 
-void embed_file_list(int *core_len, unsigned char *core_file, char *filename)
+void embed_file_list(int *core_len, char *filename)
 {
   char *filepath = NULL, *seek = NULL, *next = NULL;
   FILE *listfile = NULL;
@@ -587,7 +620,7 @@ void embed_file_list(int *core_len, unsigned char *core_file, char *filename)
       strncpy(embedfile, filepath, 768);
       strncat(embedfile, seek, 256);
       // fprintf(stderr, "DEBUG FILE-LIST: %s\n", embedfile);
-      embed_file(core_len, core_file, embedfile);
+      embed_file(core_len, embedfile);
     }
     seek = next + 1;
   } while (next != NULL && seek < file_data + file_len);
@@ -601,7 +634,6 @@ char *find_fpga_part_from_m65targetname(const char *m65targetname)
   return m65target->fpga_part;
 }
 
-unsigned char core_file[8192 * 1024];
 int core_len = 0;
 
 int DIRTYMOCK(main)(int argc, char **argv)
@@ -621,27 +653,37 @@ int DIRTYMOCK(main)(int argc, char **argv)
   if (err != 0)
     return err;
 
-  build_core_file(bit_size, &core_len, core_file, ARG_CORENAME, ARG_COREVERSION, ARG_M65TARGETNAME, ARG_BITSTREAMPATH);
+  core_segment_count = 0;
+  last_file_offset = 0;
+  banner_present = 0;
+  build_core_file(bit_size, &core_len, ARG_CORENAME, ARG_COREVERSION, ARG_M65TARGETNAME, ARG_BITSTREAMPATH);
   for (int i = 6; i < argc; i++) {
     //    fprintf(stderr,"Embedding file '%s'\n",argv[i]);
     if (argv[i][0] == '@')
-      embed_file_list(&core_len, core_file, argv[i] + 1);
+      embed_file_list(&core_len, argv[i] + 1);
     else
-      embed_file(&core_len, core_file, argv[i]);
+      embed_file(&core_len, argv[i]);
   }
 
   if (banner_present) {
-    if (core_len >= (8192 - 32) * 1024 - 4) {
+    if (core_len >= CORE_SLOT_SIZE - BANNER_SIZE - 4) {
       fprintf(stderr, "ERROR: Insufficient room to place BANNER.M65 at end of slot.\n");
       exit(-1);
     }
-    core_len = 8192 * 1024;
+    // Zeroes up to the banner, which fills the rest of the slot
+    add_core_segment(NULL, CORE_SLOT_SIZE - BANNER_SIZE - core_len);
+    add_core_segment(banner_map->data, banner_map->size);
+    core_len = CORE_SLOT_SIZE;
   }
   else
     // Leave 4 extra zero bytes at end for end of embedded file chain
     core_len += 4;
 
-  write_core_file(core_len, core_file, ARG_COREPATH);
+  write_core_file(core_len, ARG_COREPATH);
+
+  for (int i = 0; i < core_header.embed_file_count; i++)
+    bitio_unmap_file(&embed_maps[i]);
+  bitio_unmap_file(&bitstream_map);
 
   return 0;
 }
@@ -3,6 +3,8 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include "bitstream_io.h"
+
 void error(char *fmt, ...)
 {
   va_list ap;
@@ -22,12 +24,7 @@ int main(int argc, char *argv[])
 #endif
 {
   unsigned int loadAddr = 0;
-  FILE *infile;
-  FILE *outfile;
-  int numBytes, i;
-  int c;
-  unsigned char lineData[16];
-  unsigned int chksum;
+  struct bitio_map infile;
 
   if (argc < 3 || argc > 4) {
     printf("bit2mcs - Converts XILINX bitstream files to flashable files\n"
@@ -43,52 +40,17 @@ int main(int argc, char *argv[])
     sscanf(argv[3], "%X", &loadAddr);
   }
 
-  infile = fopen(argv[1], "rb");
-
-  if (infile == NULL) {
+  if (bitio_map_file(argv[1], &infile)) {
     error("cannot open input file %s", argv[1]);
   }
-  // if old-style bitstream, then seek 120-bytes into the file before reading
+  // if old-style bitstream, then skip the first 120 bytes
+  size_t skip = 0;
   if (argc == 3) {
-    fseek(infile, 120, SEEK_SET);
-  }
-  outfile = fopen(argv[2], "wt");
-  if (outfile == NULL) {
-    error("cannot open output file %s", argv[2]);
+    skip = infile.size < 120 ? infile.size : 120;
   }
-  while (1) {
-    if ((loadAddr & 0xFFFF) == 0) {
-      fprintf(outfile, ":02000004");
-      fprintf(outfile, "%04X", loadAddr >> 16);
-      chksum = 0x02 + 0x04 + ((loadAddr >> 24) & 0xFF) + ((loadAddr >> 16) & 0xFF);
-      fprintf(outfile, "%02X\n", (-chksum) & 0xFF);
-    }
-    chksum = 0;
-    for (numBytes = 0; numBytes < 16; numBytes++) {
-      c = fgetc(infile);
-      if (c == EOF) {
-        break;
-      }
-      lineData[numBytes] = c;
-      chksum += c;
-    }
-    if (numBytes == 0) {
-      break;
-    }
-    fprintf(outfile, ":%02X%04X00", numBytes, loadAddr & 0xFFFF);
-    for (i = 0; i < numBytes; i++) {
-      fprintf(outfile, "%02X", lineData[i]);
-    }
-    chksum += numBytes;
-    chksum += ((loadAddr >> 8) & 0xFF) + ((loadAddr >> 0) & 0xFF);
-    fprintf(outfile, "%02X\n", (-chksum) & 0xFF);
-    loadAddr += numBytes;
-    if (c == EOF) {
-      break;
-    }
+  if (bitio_write_mcs(argv[2], infile.data + skip, infile.size - skip, loadAddr)) {
+    error("cannot write output file %s", argv[2]);
   }
-  fprintf(outfile, ":00000001FF\n");
-  fclose(infile);
-  fclose(outfile);
+  bitio_unmap_file(&infile);
   return 0;
 }
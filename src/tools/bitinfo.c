@@ -1,16 +1,10 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 
-// 4M x 32 bit words = 16MB
-unsigned int data[4 * 1024 * 1024];
-
-unsigned int swap_bytes(unsigned int v, int swapP)
-{
-  if (!swapP)
-    return v;
-  return (v >> 24) | (((v >> 16) & 0xff) << 8) | (((v >> 8) & 0xff) << 16) | ((v & 0xff) << 24);
-}
+#include "bitstream_io.h"
 
 int main(int argc, char **argv)
 {
@@ -19,23 +13,37 @@ int main(int argc, char **argv)
     exit(-1);
   }
 
-  FILE *f = fopen(argv[1], "r");
-  if (!f) {
+  struct bitio_map f;
+  if (bitio_map_file(argv[1], &f)) {
     fprintf(stderr, "Could not read bitstream file '%s'\n", argv[1]);
-    perror("fopen");
+    perror("open");
     exit(-1);
   }
-  int size = fread(&data[1], 4, 4 * 1024 * 1024 * 4, f);
+  int size = f.size / 4;
 
   printf("Bitstream file is %d words long.\n", size);
 
+  // Word numbers count from 1, as the file was always read in after a
+  // leading zero word
+  // A type 1 record can run up to 0x7ff words past the end, which read as
+  // zeroes (or the last few bytes of a partial word)
+  int allocated = size + 2 + 0x800;
+  uint32_t *raw = calloc(allocated, sizeof(uint32_t));
+  uint32_t *data = calloc(allocated, sizeof(uint32_t));
+  if (!raw || !data) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  memcpy(&raw[1], f.data, f.size);
+  size++;
+
   int w = 0;
   int rev = 0;
 
   while (w < size) {
-    if (data[w] == 0xAA995566)
+    if (raw[w] == 0xAA995566)
       break;
-    if (data[w] == 0x665599AA) {
+    if (raw[w] == 0x665599AA) {
       rev = 1;
       break;
     }
@@ -48,23 +56,29 @@ int main(int argc, char **argv)
   if (rev)
     printf("CPU and bitstream have opposite endianness.\n");
 
+  // Put all the words in CPU order once, rather than on every access
+  if (rev)
+    bitio_swap32(data, raw, allocated);
+  else
+    memcpy(data, raw, allocated * sizeof(uint32_t));
+
   unsigned int count, reg, val;
 
   while (w < size) {
     // Skip Type 1 NOOPs
-    if (swap_bytes(data[w], rev) == 0x20000000) {
+    if (data[w] == 0x20000000) {
       w++;
       continue;
     }
 
-    printf("$%x:  word $%08x (was $%08x)\n", w, swap_bytes(data[w], rev), data[w]);
-    if ((swap_bytes(data[w], rev) & 0xf0000000) == 0x30000000) {
+    printf("$%x:  word $%08x (was $%08x)\n", w, data[w], raw[w]);
+    if ((data[w] & 0xf0000000) == 0x30000000) {
       // Type 1 record: write or reserved operation.
-      count = swap_bytes(data[w], rev) & 0x7ff;
-      reg = (swap_bytes(data[w], rev) >> 13) & 0x1f;
+      count = data[w] & 0x7ff;
+      reg = (data[w] >> 13) & 0x1f;
       w++;
       while (count--) {
-        val = swap_bytes(data[w++], rev);
+        val = data[w++];
         switch (reg) {
         case 0b00000:
           printf("Setting CRC value to $%08x\n", val);
@@ -188,5 +202,7 @@ int main(int argc, char **argv)
     }
   }
 
-  fclose(f);
+  free(raw);
+  free(data);
+  bitio_unmap_file(&f);
 }
@@ -0,0 +1,293 @@
+/*
+  File handling for bitstreams and core files.  See include/bitstream_io.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef WINDOWS
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "bitstream_io.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// Zero bytes written per iovec for zero-filled segments
+#define BITIO_ZERO_CHUNK 65536
+// Text buffered before each write by bitio_write_mcs()
+#define BITIO_MCS_BUFFER (1024 * 1024)
+
+static const unsigned char bitio_zeroes[BITIO_ZERO_CHUNK];
+
+int bitio_map_file(const char *filename, struct bitio_map *m)
+{
+  memset(m, 0, sizeof(struct bitio_map));
+
+  int fd = open(filename, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (fstat(fd, &st)) {
+    close(fd);
+    return -1;
+  }
+  m->size = st.st_size;
+
+#ifndef WINDOWS
+  if (m->size) {
+    void *p = mmap(NULL, m->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      close(fd);
+      m->data = p;
+      m->mapped = 1;
+      return 0;
+    }
+  }
+#endif
+
+  // No mmap (or an empty file), so read it instead
+  m->data = malloc(m->size + 1);
+  if (!m->data) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  size_t got = 0;
+  while (got < m->size) {
+    ssize_t r = read(fd, m->data + got, m->size - got);
+    if (r <= 0) {
+      int err = r ? errno : EIO;
+      close(fd);
+      free(m->data);
+      m->data = NULL;
+      errno = err;
+      return -1;
+    }
+    got += r;
+  }
+  close(fd);
+  return 0;
+}
+
+void bitio_unmap_file(struct bitio_map *m)
+{
+  if (!m->data)
+    return;
+#ifndef WINDOWS
+  if (m->mapped)
+    munmap(m->data, m->size);
+  else
+#endif
+    free(m->data);
+  m->data = NULL;
+  m->size = 0;
+}
+
+int bitio_write_segments(const char *filename, const struct bitio_segment *segments, int count)
+{
+#ifndef WINDOWS
+  int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    return -1;
+
+  // Gather as many pieces as writev() allows, splitting zero fills into
+  // chunks of the static zero buffer
+  struct iovec iov[64];
+  int n = 0;
+  for (int i = 0; i <= count; i++) {
+    const unsigned char *data = i < count ? segments[i].data : NULL;
+    size_t len = i < count ? segments[i].len : 0;
+    do {
+      size_t chunk = len;
+      if (!data && chunk > BITIO_ZERO_CHUNK)
+        chunk = BITIO_ZERO_CHUNK;
+      if (chunk) {
+        iov[n].iov_base = (void *)(data ? data : bitio_zeroes);
+        iov[n].iov_len = chunk;
+        n++;
+        if (data)
+          data += chunk;
+        len -= chunk;
+      }
+      if (n && (n == 64 || i == count)) {
+        int first = 0;
+        while (first < n) {
+          ssize_t w = writev(fd, &iov[first], n - first);
+          if (w < 0) {
+            if (errno == EINTR)
+              continue;
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+          }
+          // Skip what was written, which may end part way through an iovec
+          while (first < n && (size_t)w >= iov[first].iov_len)
+            w -= iov[first++].iov_len;
+          if (first < n) {
+            iov[first].iov_base = (char *)iov[first].iov_base + w;
+            iov[first].iov_len -= w;
+          }
+        }
+        n = 0;
+      }
+    } while (len);
+  }
+  if (close(fd))
+    return -1;
+  return 0;
+#else
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    return -1;
+  for (int i = 0; i < count; i++) {
+    size_t len = segments[i].len;
+    const unsigned char *data = segments[i].data;
+    while (len) {
+      size_t chunk = len;
+      if (!data && chunk > BITIO_ZERO_CHUNK)
+        chunk = BITIO_ZERO_CHUNK;
+      if (fwrite(data ? data : bitio_zeroes, chunk, 1, f) != 1) {
+        fclose(f);
+        return -1;
+      }
+      if (data)
+        data += chunk;
+      len -= chunk;
+    }
+  }
+  if (fclose(f))
+    return -1;
+  return 0;
+#endif
+}
+
+void bitio_swap32(uint32_t *dst, const uint32_t *src, size_t words)
+{
+  size_t i = 0;
+#if defined(__SSSE3__)
+  const __m128i reverse = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+  for (; i + 4 <= words; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, reverse));
+  }
+#elif defined(__SSE2__)
+  for (; i + 4 <= words; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    // Swap the bytes in each 16-bit half, then swap the halves
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#elif defined(__ARM_NEON)
+  for (; i + 4 <= words; i += 4)
+    vst1q_u8((uint8_t *)(dst + i), vrev32q_u8(vld1q_u8((const uint8_t *)(src + i))));
+#endif
+  for (; i < words; i++) {
+    uint32_t v = src[i];
+    dst[i] = (v >> 24) | ((v >> 8) & 0xff00) | ((v << 8) & 0xff0000) | (v << 24);
+  }
+}
+
+void bitio_be32_to_host(uint32_t *dst, const uint32_t *src, size_t words)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  if (dst != src)
+    memmove(dst, src, words * sizeof(uint32_t));
+#else
+  bitio_swap32(dst, src, words);
+#endif
+}
+
+static const char bitio_hex[] = "0123456789ABCDEF";
+
+static char *put_hex8(char *p, unsigned int v)
+{
+  *p++ = bitio_hex[(v >> 4) & 0xf];
+  *p++ = bitio_hex[v & 0xf];
+  return p;
+}
+
+int bitio_write_mcs(const char *filename, const unsigned char *data, size_t len, uint32_t load_addr)
+{
+  FILE *f = fopen(filename, "wt");
+  if (!f)
+    return -1;
+  char *buffer = malloc(BITIO_MCS_BUFFER);
+  if (!buffer) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+
+  // Each pass writes at most an address record and a data record, which
+  // take well under 64 characters
+  char *p = buffer;
+  size_t pos = 0;
+  while (1) {
+    unsigned int chksum;
+    if ((load_addr & 0xFFFF) == 0) {
+      // Extended linear address record for the next 64KB
+      memcpy(p, ":02000004", 9);
+      p += 9;
+      p = put_hex8(p, load_addr >> 24);
+      p = put_hex8(p, load_addr >> 16);
+      chksum = 0x02 + 0x04 + ((load_addr >> 24) & 0xFF) + ((load_addr >> 16) & 0xFF);
+      p = put_hex8(p, -chksum);
+      *p++ = '\n';
+    }
+    int count = len - pos > 16 ? 16 : len - pos;
+    if (!count)
+      break;
+    *p++ = ':';
+    p = put_hex8(p, count);
+    p = put_hex8(p, load_addr >> 8);
+    p = put_hex8(p, load_addr);
+    p = put_hex8(p, 0);
+    chksum = count + ((load_addr >> 8) & 0xFF) + (load_addr & 0xFF);
+    for (int i = 0; i < count; i++) {
+      p = put_hex8(p, data[pos + i]);
+      chksum += data[pos + i];
+    }
+    p = put_hex8(p, -chksum);
+    *p++ = '\n';
+    pos += count;
+    load_addr += count;
+    // A short record means that the data has run out
+    if (count < 16)
+      break;
+
+    if (p - buffer > BITIO_MCS_BUFFER - 64) {
+      if (fwrite(buffer, p - buffer, 1, f) != 1)
+        goto fail;
+      p = buffer;
+    }
+  }
+  memcpy(p, ":00000001FF\n", 12);
+  p += 12;
+  if (fwrite(buffer, p - buffer, 1, f) != 1)
+    goto fail;
+
+  free(buffer);
+  if (fclose(f))
+    return -1;
+  return 0;
+
+fail:
+  free(buffer);
+  fclose(f);
+  return -1;
+}
@@ -0,0 +1,166 @@
+/*
+  Pack PRG files onto as few D81 images as they fit on.
+
+  Each file goes onto the first disk that still has room for it (both
+  blocks and a directory entry), and a new disk is started when none has,
+  so hundreds of files are packed in one pass without ever reading back
+  an image.  Disks are written as <prefix>1.d81, <prefix>2.d81, ...
+
+  File names are unique across the whole set, so that a file can be found
+  by name without knowing which disk it went onto.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+
+#include "diskman.h"
+
+#define MAX_DISKS 256
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: d81pack [-n <disk name>] [-i <disk id>] [-o <prefix>] <file.prg> ...\n"
+                  "  -n  name of each disk, followed by its number (default: the prefix)\n"
+                  "  -i  disk ID (default: 00)\n"
+                  "  -o  prefix of the D81 files (default: disk)\n");
+  exit(-1);
+}
+
+// PETSCII name of a file: its base name, up to the first '.', in upper case
+static void d81pack_name(char *dest, const char *path)
+{
+  const char *base = path;
+  for (const char *p = path; *p; p++)
+    if (*p == '/' || *p == '\\')
+      base = p + 1;
+  int n = 0;
+  while (base[n] && base[n] != '.' && n < D81_NAME_LEN) {
+    dest[n] = toupper(base[n]);
+    n++;
+  }
+  dest[n] = 0;
+}
+
+static unsigned char *d81pack_read(const char *filename, int *len)
+{
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  rewind(f);
+  unsigned char *buf = malloc(*len + 1);
+  if (!buf) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  if (fread(buf, 1, *len, f) != (size_t)*len) {
+    free(buf);
+    buf = NULL;
+  }
+  fclose(f);
+  return buf;
+}
+
+int main(int argc, char **argv)
+{
+  char *disk_name = NULL, *disk_id = "00", *prefix = "disk";
+  int opt;
+  while ((opt = getopt(argc, argv, "n:i:o:")) != -1) {
+    switch (opt) {
+    case 'n':
+      disk_name = optarg;
+      break;
+    case 'i':
+      disk_id = optarg;
+      break;
+    case 'o':
+      prefix = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind >= argc)
+    usage();
+  if (!disk_name)
+    disk_name = prefix;
+
+  struct d81 *disks[MAX_DISKS];
+  int disk_count = 0, packed = 0, skipped = 0;
+  for (int i = optind; i < argc; i++) {
+    int len;
+    unsigned char *buf = d81pack_read(argv[i], &len);
+    if (!buf) {
+      fprintf(stderr, "ERROR: Cannot read file '%s'\n", argv[i]);
+      skipped++;
+      continue;
+    }
+    char name[D81_NAME_LEN + 1];
+    d81pack_name(name, argv[i]);
+    if (d81_blocks_needed(len) > D81_BLOCKS) {
+      fprintf(stderr, "ERROR: '%s' is too large for a D81\n", argv[i]);
+      free(buf);
+      skipped++;
+      continue;
+    }
+
+    int d;
+    for (d = 0; d < disk_count; d++)
+      if (d81_find(disks[d], name) >= 0)
+        break;
+    if (d < disk_count) {
+      fprintf(stderr, "WARNING: Skipping '%s', as disk %d already has a file called \"%s\"\n", argv[i], d + 1, name);
+      free(buf);
+      skipped++;
+      continue;
+    }
+
+    // First fit, starting a new disk if none has room
+    for (d = 0; d < disk_count; d++)
+      if (d81_fits(disks[d], len))
+        break;
+    if (d == disk_count) {
+      if (disk_count == MAX_DISKS) {
+        fprintf(stderr, "ERROR: More than %d disks needed\n", MAX_DISKS);
+        exit(-1);
+      }
+      disks[d] = malloc(sizeof(struct d81));
+      if (!disks[d]) {
+        perror("malloc() failed");
+        exit(-3);
+      }
+      char label[64];
+      snprintf(label, sizeof(label), "%.13s %d", disk_name, d + 1);
+      for (char *p = label; *p; p++)
+        *p = toupper(*p);
+      d81_format(disks[d], label, disk_id);
+      disk_count++;
+    }
+
+    d81_add_file(disks[d], name, FTYPE_PRG | FTYPE_CLOSEDFLAG, buf, len);
+    free(buf);
+    packed++;
+  }
+
+  int failed = 0;
+  for (int d = 0; d < disk_count; d++) {
+    char filename[1024];
+    snprintf(filename, sizeof(filename), "%s%d.d81", prefix, d + 1);
+    if (d81_save(disks[d], filename)) {
+      fprintf(stderr, "ERROR: Cannot write '%s'\n", filename);
+      failed = 1;
+    }
+    else
+      printf("%s: %d files, %d blocks free\n", filename, disks[d]->files, disks[d]->blocks_free);
+    free(disks[d]);
+  }
+  printf("Packed %d files onto %d disks", packed, disk_count);
+  if (skipped)
+    printf(", skipped %d", skipped);
+  printf("\n");
+  return failed || skipped ? 1 : 0;
+}
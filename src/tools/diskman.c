@@ -1,238 +1,397 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
-char data[819200];
+#include "diskman.h"
 
-void write_tso_byte(int track, int sector, int offset, int val)
+static unsigned char *d81_sector(const struct d81 *d, int track, int sector)
 {
-  data[(track - 1) * (256 * 40) + sector * 256 + offset] = val;
+  return (unsigned char *)&d->data[(track - 1) * (256 * D81_SECTORS) + sector * 256];
 }
 
-void write_tso_str(int track, int sector, int offset, char *str, int maxlen)
+// BAM entry of a track: the number of free sectors, then one bit per sector (set if free)
+static unsigned char *d81_bam_entry(const struct d81 *d, int track)
 {
-  char *pstr = str;
-  for (int k = 0; k < maxlen; k++) {
-    int val = 0xa0; // assume padding byte
-    if (*pstr != '\0') {
-      val = *pstr;
-      pstr++;
-    }
-    write_tso_byte(track, sector, offset + k, val);
-  }
-}
-
-void write_header(char *disk_name, char *disk_id)
-{
-  write_tso_byte(40, 0, 0x00, 40); // write T/S location of first directory sector
-  write_tso_byte(40, 0, 0x01, 3);
-  write_tso_byte(40, 0, 0x02, 0x44); // Disk DOS version type 'D' = 1581
-  write_tso_byte(40, 0, 0x03, 0);
-  write_tso_str(40, 0, 0x04, disk_name, 16);
-  write_tso_byte(40, 0, 0x14, 0xA0);
-  write_tso_byte(40, 0, 0x15, 0xA0);
-  write_tso_str(40, 0, 0x16, disk_id, 2);
-  write_tso_byte(40, 0, 0x18, 0xA0);
-  write_tso_byte(40, 0, 0x19, '3');
-  write_tso_byte(40, 0, 0x1A, 'D');
-  write_tso_byte(40, 0, 0x1B, 0xA0);
-  write_tso_byte(40, 0, 0x1C, 0xA0);
-
-  // some BAM initialisation too
-  write_tso_byte(40, 1, 0x00, 40); // next bam t/s
-  write_tso_byte(40, 1, 0x01, 2);
-  write_tso_byte(40, 1, 0x02, 'D');
-  write_tso_byte(40, 1, 0x03, 0xBB);
-  write_tso_str(40, 1, 0x04, disk_id, 2);
-  write_tso_byte(40, 1, 0x06, 0xC0); // verify on, check header crc
-  write_tso_byte(40, 1, 0x07, 0x00); // auto-bootloader flag?
-  // initialise bam entries for tracks (set all sectors as empty)
-  for (int k = 0; k < 40; k++)
-    write_tso_str(40, 1, 0x10 + k * 6, "\x28\xff\xff\xff\xff\xff", 6);
-
-  write_tso_byte(40, 2, 0x00, 0x00); // next bam t/s (0x00 0xff is last one)
-  write_tso_byte(40, 2, 0x01, 0xff);
-  write_tso_byte(40, 2, 0x02, 'D');
-  write_tso_byte(40, 2, 0x03, 0xBB);
-  write_tso_str(40, 2, 0x04, disk_id, 2);
-  write_tso_byte(40, 2, 0x06, 0xC0); // verify on, check header crc
-  write_tso_byte(40, 2, 0x07, 0x00); // auto-bootloader flag?
-  // initialise bam entries for tracks (set all sectors as empty)
-  for (int k = 0; k < 40; k++)
-    write_tso_str(40, 2, 0x10 + k * 6, "\x28\xff\xff\xff\xff\xff", 6);
-}
-
-#define FTYPE_DEL 0
-#define FTYPE_SEQ 1
-#define FTYPE_PRG 2
-#define FTYPE_USR 3
-#define FTYPE_REL 4
-#define FTYPE_CBM 5
-#define FTYPE_CLOSEDFLAG 0x80
-
-void write_direntry(char *prgname, int firsttrack, int firstsector, int sectorcnt)
-{
-  write_tso_byte(40, 3, 0x00, 0x00); // write T/S location of next dir-entry sector (0x00 and 0xff for last sector)
-  write_tso_byte(40, 3, 0x01, 0xff);
-  write_tso_byte(40, 3, 0x02, FTYPE_PRG | FTYPE_CLOSEDFLAG);
-  write_tso_byte(40, 3, 0x03, firsttrack);
-  write_tso_byte(40, 3, 0x04, firstsector);
-  write_tso_str(40, 3, 0x05, prgname, 16);
-  write_tso_byte(40, 3, 0x15, 0x00);
-  write_tso_byte(40, 3, 0x16, 0x00);
-  write_tso_byte(40, 3, 0x17, 0x00);
-  write_tso_byte(40, 3, 0x1E, sectorcnt & 0xff);
-  write_tso_byte(40, 3, 0x1F, sectorcnt >> 8);
-}
-
-void get_nice_prgname(char *dest, char *src)
-{
-  char *pdest = dest;
-  char *psrc = src;
-  while (*psrc != '.' && *psrc != '\0') {
-    *pdest = toupper(*psrc);
-    pdest++;
-    psrc++;
-  }
-  *pdest = '\0';
+  // first bam sector is at t/s = 40/1, 2nd bam is at t/s = 40/2
+  if (track <= 40)
+    return d81_sector(d, D81_DIR_TRACK, 1) + 0x10 + (track - 1) * 6;
+  return d81_sector(d, D81_DIR_TRACK, 2) + 0x10 + (track - 41) * 6;
 }
 
-void get_nice_d81name(char *dest, char *src)
+static uint64_t d81_bam_bits(const unsigned char *bam)
 {
-  get_nice_prgname(dest, src);
+  return bam[1] | (uint64_t)bam[2] << 8 | (uint64_t)bam[3] << 16 | (uint64_t)bam[4] << 24 | (uint64_t)bam[5] << 32;
+}
 
-  strcat(dest, ".D81");
+static void d81_set_track_free(struct d81 *d, int track, int has_free)
+{
+  uint64_t bit = 1ULL << ((track - 1) & 63);
+  if (has_free)
+    d->free_tracks[(track - 1) >> 6] |= bit;
+  else
+    d->free_tracks[(track - 1) >> 6] &= ~bit;
 }
 
-int calc_offset(int track, int sector, int offset)
+static void d81_mark_used(struct d81 *d, int track, int sector)
 {
-  return (track - 1) * (256 * 40) + sector * 256 + offset;
+  unsigned char *bam = d81_bam_entry(d, track);
+  int mask = 1 << (sector & 7);
+  if (!(bam[1 + sector / 8] & mask))
+    return;
+  bam[1 + sector / 8] &= ~mask;
+  bam[0]--;
+  if (track == D81_DIR_TRACK)
+    return;
+  d->blocks_free--;
+  if (!bam[0])
+    d81_set_track_free(d, track, 0);
 }
 
-void mark_sector_used(char *bamentry, int sector)
+// Copy a name, padded with shifted spaces
+static void d81_pad(unsigned char *dest, const char *src, int len)
 {
-  int offs = sector >> 3;
-  int bitloc = sector & 0x0f;
-  bamentry[1 + offs] &= ~bitloc;
+  for (int k = 0; k < len; k++)
+    dest[k] = *src ? *src++ : 0xa0;
 }
 
-int calc_sectors_free(char *bamentry)
+static unsigned char *d81_dir_entry(const struct d81 *d, int entry)
 {
-  int cnt = 0;
-  for (int k = 1; k < 6; k++) {
-    int byteval = bamentry[k];
-    for (int z = 0; z < 8; z++) {
-      if (byteval & (1 << z))
-        cnt++;
-    }
-  }
-  return cnt;
+  return d81_sector(d, D81_DIR_TRACK, 3 + entry / 8) + (entry % 8) * 32;
 }
 
-void update_bam(int track, int sector)
+static unsigned int d81_hash(const unsigned char *name)
 {
-  int offs;
-  if (track <= 40)
-    offs = calc_offset(40, 1, 0x10) + (track - 1) * 0x06; // 6 bytes per track BAM entry
-  else
-    offs = calc_offset(40, 2, 0x10) + (track - 41) * 0x06; // 6 bytes per track BAM entry
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < D81_NAME_LEN; i++)
+    h = (h ^ name[i]) * 16777619u;
+  return h & (D81_DIR_HASH - 1);
+}
 
-  // first bam sector is at t/s = 40/1, 2nd bam is at t/s = 40/2
-  char *bamentry = &data[offs];
+static int d81_find_padded(const struct d81 *d, const unsigned char *name)
+{
+  for (unsigned int h = d81_hash(name); d->dir_hash[h]; h = (h + 1) & (D81_DIR_HASH - 1)) {
+    int entry = d->dir_hash[h] - 1;
+    if (!memcmp(d81_dir_entry(d, entry) + 5, name, D81_NAME_LEN))
+      return entry;
+  }
+  return -1;
+}
 
-  mark_sector_used(bamentry, sector);
-  bamentry[0x00] = calc_sectors_free(bamentry); // number of free sectors on the track
+static void d81_hash_insert(struct d81 *d, const unsigned char *name, int entry)
+{
+  unsigned int h = d81_hash(name);
+  while (d->dir_hash[h])
+    h = (h + 1) & (D81_DIR_HASH - 1);
+  d->dir_hash[h] = entry + 1;
 }
 
-void update_tsptr(int track, int sector, int t, int s)
+void d81_format(struct d81 *d, const char *disk_name, const char *disk_id)
 {
-  char *dest = &data[(track - 1) * (256 * 40) + sector * 256];
-  dest[0] = t;
-  dest[1] = s;
+  memset(d, 0, sizeof(struct d81));
+
+  unsigned char *header = d81_sector(d, D81_DIR_TRACK, 0);
+  header[0x00] = 40; // write T/S location of first directory sector
+  header[0x01] = 3;
+  header[0x02] = 0x44; // Disk DOS version type 'D' = 1581
+  d81_pad(&header[0x04], disk_name, 16);
+  header[0x14] = 0xA0;
+  header[0x15] = 0xA0;
+  d81_pad(&header[0x16], disk_id, 2);
+  header[0x18] = 0xA0;
+  header[0x19] = '3';
+  header[0x1A] = 'D';
+  header[0x1B] = 0xA0;
+  header[0x1C] = 0xA0;
+
+  for (int i = 0; i < 2; i++) {
+    unsigned char *bam = d81_sector(d, D81_DIR_TRACK, 1 + i);
+    // next bam t/s (0x00 0xff is last one)
+    bam[0x00] = i ? 0x00 : 40;
+    bam[0x01] = i ? 0xff : 2;
+    bam[0x02] = 'D';
+    bam[0x03] = 0xBB;
+    d81_pad(&bam[0x04], disk_id, 2);
+    bam[0x06] = 0xC0; // verify on, check header crc
+    bam[0x07] = 0x00; // auto-bootloader flag?
+    // initialise bam entries for tracks (set all sectors as empty)
+    for (int k = 0; k < 40; k++)
+      memcpy(&bam[0x10 + k * 6], "\x28\xff\xff\xff\xff\xff", 6);
+  }
+  d->blocks_free = D81_BLOCKS;
+  for (int t = 1; t <= D81_TRACKS; t++)
+    d81_set_track_free(d, t, t != D81_DIR_TRACK);
+
+  // Header, BAM and the first directory sector
+  for (int s = 0; s < 4; s++)
+    d81_mark_used(d, D81_DIR_TRACK, s);
+  unsigned char *dir = d81_sector(d, D81_DIR_TRACK, 3);
+  dir[0x00] = 0x00; // no next directory sector
+  dir[0x01] = 0xff;
 }
 
-static void write_sector(int track, int sector, char *chunk)
+int d81_load(struct d81 *d, const char *filename)
 {
-  char *dest = &data[(track - 1) * (256 * 40) + sector * 256];
-  memcpy(dest, chunk, 256);
+  memset(d, 0, sizeof(struct d81));
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    return -1;
+  if (fread(d->data, D81_SIZE, 1, f) != 1) {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
 
-  // update bam?
-  update_bam(track, sector);
+  for (int t = 1; t <= D81_TRACKS; t++) {
+    unsigned char *bam = d81_bam_entry(d, t);
+    // Trust the bitmap over the count, as that is what allocation uses
+    bam[0] = __builtin_popcountll(d81_bam_bits(bam));
+    if (t == D81_DIR_TRACK)
+      continue;
+    d->blocks_free += bam[0];
+    d81_set_track_free(d, t, bam[0]);
+  }
+
+  unsigned char *header = d81_sector(d, D81_DIR_TRACK, 0);
+  if (header[0x00] != D81_DIR_TRACK || header[0x01] != 3)
+    return -1;
+  for (int n = 0;; n++) {
+    unsigned char *dir = d81_sector(d, D81_DIR_TRACK, 3 + n);
+    for (int i = 0; i < 8; i++) {
+      if (!dir[i * 32 + 2])
+        continue;
+      d->files = n * 8 + i + 1;
+      d81_hash_insert(d, &dir[i * 32 + 5], n * 8 + i);
+    }
+    if (!dir[0x00])
+      break;
+    if (dir[0x00] != D81_DIR_TRACK || dir[0x01] != 4 + n || 4 + n >= D81_SECTORS)
+      return -1;
+  }
+  return 0;
 }
 
-int check_file_access(char *file)
+int d81_save(const struct d81 *d, const char *filename)
 {
-  FILE *f = fopen(file, "rb");
+  FILE *f = fopen(filename, "wb");
   if (!f)
     return -1;
-  fclose(f);
+  if (fwrite(d->data, D81_SIZE, 1, f) != 1) {
+    fclose(f);
+    return -1;
+  }
+  return fclose(f) ? -1 : 0;
+}
 
+int d81_blocks_needed(int len)
+{
+  // 254 bytes per sector, and even an empty file takes one
+  return len ? (len + 253) / 254 : 1;
+}
+
+int d81_fits(const struct d81 *d, int len)
+{
+  return d->files < D81_MAX_FILES && d81_blocks_needed(len) <= d->blocks_free;
+}
+
+int d81_find(const struct d81 *d, const char *name)
+{
+  unsigned char padded[D81_NAME_LEN];
+  d81_pad(padded, name, D81_NAME_LEN);
+  return d81_find_padded(d, padded);
+}
+
+int d81_alloc_sector(struct d81 *d, int *track, int *sector)
+{
+  int t;
+  if (d->free_tracks[0])
+    t = __builtin_ctzll(d->free_tracks[0]) + 1;
+  else if (d->free_tracks[1])
+    t = __builtin_ctzll(d->free_tracks[1]) + 65;
+  else
+    return -1;
+  *track = t;
+  *sector = __builtin_ctzll(d81_bam_bits(d81_bam_entry(d, t)));
+  d81_mark_used(d, t, *sector);
   return 0;
 }
 
-void add_prg(char *fname)
+// First run of count free sectors, in track and sector order
+static int d81_find_run(const struct d81 *d, int count, int *track, int *sector)
 {
-  // load the prg
-  FILE *f = fopen(fname, "rb");
-  char prgname[256];
-  get_nice_prgname(prgname, fname);
-  char chunk[256] = { 0 };
-
-  int starttrack = 1;
-  int startsector = 0;
-  int curtrack = starttrack;
-  int cursector = startsector;
-  int prevtrack = 0;
-  int prevsector = 0;
-
-  int bytes;
-  int sectorcnt = 0;
-  while ((bytes = fread(chunk + 2, 1, 254, f)) != 0) {
-    if (sectorcnt != 0) {
-      update_tsptr(prevtrack, prevsector, curtrack, cursector);
+  int run = 0;
+  for (int t = 1; t <= D81_TRACKS; t++) {
+    if (t == D81_DIR_TRACK)
+      continue;
+    const unsigned char *bam = d81_bam_entry(d, t);
+    // Whole free tracks are common, so take them in one go
+    if (bam[0] == D81_SECTORS && run + D81_SECTORS < count) {
+      if (!run) {
+        *track = t;
+        *sector = 0;
+      }
+      run += D81_SECTORS;
+      continue;
     }
-    chunk[0] = 0x00; // assume this is the last chunk
-    chunk[1] = 0xff; // (can overwrite it later)
-    write_sector(curtrack, cursector, chunk);
-    prevtrack = curtrack;
-    prevsector = cursector;
-    sectorcnt++;
-    memset(chunk, 0, 256);
-    cursector++;
-    if (cursector >= 40) {
-      cursector = 0;
-      curtrack++;
+    uint64_t bits = d81_bam_bits(bam);
+    for (int s = 0; s < D81_SECTORS; s++) {
+      if (!((bits >> s) & 1)) {
+        run = 0;
+        continue;
+      }
+      if (!run++) {
+        *track = t;
+        *sector = s;
+      }
+      if (run == count)
+        return 0;
     }
   }
+  return -1;
+}
 
-  write_direntry(prgname, starttrack, startsector, sectorcnt);
+int d81_add_file(struct d81 *d, const char *name, int type, const unsigned char *buf, int len)
+{
+  unsigned char padded[D81_NAME_LEN];
+  d81_pad(padded, name, D81_NAME_LEN);
+  if (d81_find_padded(d, padded) >= 0)
+    return D81_ERR_EXISTS;
+  if (d->files >= D81_MAX_FILES)
+    return D81_ERR_DIR_FULL;
+  int blocks = d81_blocks_needed(len);
+  if (blocks > d->blocks_free)
+    return D81_ERR_DISK_FULL;
+
+  unsigned char *ts = malloc(blocks * 2);
+  if (!ts) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  int t, s;
+  if (!d81_find_run(d, blocks, &t, &s)) {
+    for (int i = 0; i < blocks; i++) {
+      ts[i * 2] = t;
+      ts[i * 2 + 1] = s;
+      d81_mark_used(d, t, s);
+      if (++s == D81_SECTORS) {
+        s = 0;
+        if (++t == D81_DIR_TRACK)
+          t++;
+      }
+    }
+  }
+  else {
+    // Too fragmented for one run, so take the first free sectors
+    for (int i = 0; i < blocks; i++) {
+      d81_alloc_sector(d, &t, &s);
+      ts[i * 2] = t;
+      ts[i * 2 + 1] = s;
+    }
+  }
 
-  fclose(f);
+  for (int i = 0; i < blocks; i++) {
+    unsigned char *sec = d81_sector(d, ts[i * 2], ts[i * 2 + 1]);
+    int n = len - i * 254 > 254 ? 254 : len - i * 254;
+    memset(sec, 0, 256);
+    if (i + 1 < blocks) {
+      sec[0] = ts[i * 2 + 2];
+      sec[1] = ts[i * 2 + 3];
+    }
+    else {
+      // The last sector holds the offset of its last byte
+      sec[0] = 0x00;
+      sec[1] = n + 1;
+    }
+    if (n > 0)
+      memcpy(&sec[2], &buf[i * 254], n);
+  }
+
+  int entry = d->files++;
+  if (entry && !(entry % 8)) {
+    // Chain on another directory sector
+    unsigned char *prev = d81_sector(d, D81_DIR_TRACK, 3 + entry / 8 - 1);
+    unsigned char *next = d81_sector(d, D81_DIR_TRACK, 3 + entry / 8);
+    prev[0x00] = D81_DIR_TRACK;
+    prev[0x01] = 3 + entry / 8;
+    memset(next, 0, 256);
+    next[0x01] = 0xff;
+    d81_mark_used(d, D81_DIR_TRACK, 3 + entry / 8);
+  }
+  unsigned char *dirent = d81_dir_entry(d, entry);
+  memset(&dirent[2], 0, 30);
+  dirent[0x02] = type;
+  dirent[0x03] = ts[0];
+  dirent[0x04] = ts[1];
+  memcpy(&dirent[0x05], padded, D81_NAME_LEN);
+  dirent[0x1E] = blocks & 0xff;
+  dirent[0x1F] = blocks >> 8;
+  d81_hash_insert(d, padded, entry);
+
+  free(ts);
+  return entry;
 }
 
-void save_d81(char *fname)
+static void get_nice_prgname(char *dest, char *src)
 {
-  FILE *f = fopen(fname, "wb");
-  fwrite(data, 1, 819200, f);
-  fclose(f);
+  char *pdest = dest;
+  char *psrc = src;
+  while (*psrc != '.' && *psrc != '\0') {
+    *pdest = toupper(*psrc);
+    pdest++;
+    psrc++;
+  }
+  *pdest = '\0';
+}
+
+static void get_nice_d81name(char *dest, char *src)
+{
+  get_nice_prgname(dest, src);
+
+  strcat(dest, ".D81");
 }
 
 char *create_d81_for_prg(char *prgfname)
 {
   static char d81name[256];
+  static struct d81 d;
 
-  if (check_file_access(prgfname)) {
+  FILE *f = fopen(prgfname, "rb");
+  if (!f) {
     printf("ERROR: Cannot open file '%s'\n", prgfname);
     return NULL;
   }
+  fseek(f, 0, SEEK_END);
+  int len = ftell(f);
+  rewind(f);
+  unsigned char *buf = malloc(len + 1);
+  if (!buf) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  if (fread(buf, 1, len, f) != (size_t)len) {
+    printf("ERROR: Cannot read file '%s'\n", prgfname);
+    fclose(f);
+    free(buf);
+    return NULL;
+  }
+  fclose(f);
 
-  memset(data, 0, 819200);
-  write_header("PRG WRAPPER", "GI");
-  add_prg(prgfname);
+  char prgname[256];
+  get_nice_prgname(prgname, prgfname);
+  d81_format(&d, "PRG WRAPPER", "GI");
+  int entry = d81_add_file(&d, prgname, FTYPE_PRG | FTYPE_CLOSEDFLAG, buf, len);
+  free(buf);
+  if (entry < 0) {
+    printf("ERROR: '%s' does not fit on a D81\n", prgfname);
+    return NULL;
+  }
 
   get_nice_d81name(d81name, prgfname);
   printf("Wrapping \"%s\" into \"%s\"...\n", prgfname, d81name);
-  save_d81(d81name);
+  if (d81_save(&d, d81name)) {
+    printf("ERROR: Cannot write '%s'\n", d81name);
+    return NULL;
+  }
   return d81name;
 }
 
@@ -1,6 +1,93 @@
 #ifndef DISKMAN_H
 #define DISKMAN_H
 
+/*
+  D81 disk images built in memory, for wrapping PRGs for mega65_ftp and
+  packing many of them onto disks with d81pack.
+
+  Free sectors are found straight from the BAM bitmaps, files are placed
+  in one contiguous run of sectors where there is room for it (so that
+  they load without seeking), and directory entries are hashed by name to
+  catch duplicates without scanning the directory.
+*/
+
+#include <stdint.h>
+
+#define D81_SIZE 819200
+#define D81_TRACKS 80
+#define D81_SECTORS 40
+#define D81_DIR_TRACK 40
+// Directory entries fill sectors 40/3 to 40/39, 8 to a sector
+#define D81_MAX_FILES ((D81_SECTORS - 3) * 8)
+#define D81_NAME_LEN 16
+// Every track but the directory track
+#define D81_BLOCKS ((D81_TRACKS - 1) * D81_SECTORS)
+#define D81_DIR_HASH 1024
+
+#define FTYPE_DEL 0
+#define FTYPE_SEQ 1
+#define FTYPE_PRG 2
+#define FTYPE_USR 3
+#define FTYPE_REL 4
+#define FTYPE_CBM 5
+#define FTYPE_CLOSEDFLAG 0x80
+
+// Errors from d81_add_file()
+#define D81_ERR_EXISTS -1
+#define D81_ERR_DISK_FULL -2
+#define D81_ERR_DIR_FULL -3
+
+struct d81 {
+  unsigned char data[D81_SIZE];
+  // One bit per track (track 1 is bit 0) that has free sectors
+  uint64_t free_tracks[2];
+  int blocks_free;
+  int files;
+  // Directory entry number + 1 for each name, by hash
+  int16_t dir_hash[D81_DIR_HASH];
+};
+
+/*
+  Initialise an empty disk.  The name and ID are padded or cut to 16 and
+  2 characters.
+*/
+void d81_format(struct d81 *d, const char *disk_name, const char *disk_id);
+
+/*
+  Load or save an image file.  Return 0 on success.  d81_load() only
+  accepts images whose directory runs through sectors 40/3, 40/4, ...,
+  as the 1581 writes them.
+*/
+int d81_load(struct d81 *d, const char *filename);
+int d81_save(const struct d81 *d, const char *filename);
+
+// Blocks taken by a file of len bytes
+int d81_blocks_needed(int len);
+// Whether a file of len bytes would fit
+int d81_fits(const struct d81 *d, int len);
+
+/*
+  Directory entry number of a file, or -1.  name is PETSCII, and is
+  compared with the first 16 characters.
+*/
+int d81_find(const struct d81 *d, const char *name);
+
+/*
+  Add a file, returning its directory entry number or one of the
+  D81_ERR_ values.  Nothing is changed if it does not fit.
+*/
+int d81_add_file(struct d81 *d, const char *name, int type, const unsigned char *buf, int len);
+
+/*
+  Allocate the first free sector, outside the directory track.  Returns 0,
+  or -1 if the disk is full.
+*/
+int d81_alloc_sector(struct d81 *d, int *track, int *sector);
+
+/*
+  Wrap a PRG into a D81 named after it (FOO.PRG goes into FOO.D81).
+  Returns the name of the D81, or NULL on error.
+*/
 char *create_d81_for_prg(char *prgfname);
 
 #endif // DISKMAN_H
@@ -0,0 +1,915 @@
+/*
+  Flux level decoding of MEGA65 floppy captures.
+
+  This software may be freely redistributed under the terms
+  of the X11 license.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "flux.h"
+
+float quantise_gap_mfm(float gap)
+{
+  if (gap > 0.7 && gap <= 1.25)
+    gap = 1.0;
+  if (gap > 1.25 && gap <= 1.75)
+    gap = 1.5;
+  if (gap > 1.75 && gap < 2.25)
+    gap = 2.0;
+
+  // Give invalid gaps pseudo sensible values
+  if (gap <= 0.7)
+    gap = 1.0;
+  if (gap >= 2.25)
+    gap = 2.0;
+
+  return gap;
+}
+
+float quantise_gap_rll27(float gap)
+{
+  if (gap < 3.5)
+    gap = 3;
+  else if (gap < 4.5)
+    gap = 4;
+  else if (gap < 5.5)
+    gap = 5;
+  else if (gap < 6.5)
+    gap = 6;
+  else if (gap < 7.5)
+    gap = 7;
+  else
+    gap = 8;
+
+  // RLL2,7 uses convention of counting the gap length, excluding the pulse
+  // which is assumed to take up one pulse
+  gap -= 1;
+
+  return gap;
+}
+
+float quantise_gap(float gap, int rll_encoding)
+{
+  if (rll_encoding)
+    return quantise_gap_rll27(gap);
+  else
+    return quantise_gap_mfm(gap);
+}
+
+// CRC16 algorithm from:
+// https://github.com/psbhlw/floppy-disk-ripper/blob/master/fdrc/mfm.cpp
+// GPL3+, Copyright (C) 2014, psb^hlw, ts-labs.
+// crc16 table
+static unsigned short crc_ccitt[256];
+
+// crc16 init table
+void crc16_init(void)
+{
+  for (int i = 0; i < 256; i++) {
+    unsigned short w = i << 8;
+    for (int a = 0; a < 8; a++)
+      w = (w << 1) ^ ((w & 0x8000) ? 0x1021 : 0);
+    crc_ccitt[i] = w;
+  }
+}
+
+// calc crc16 for 1 byte
+unsigned short crc16(unsigned short crc, unsigned short b)
+{
+  crc = (crc << 8) ^ crc_ccitt[((crc >> 8) & 0xff) ^ b];
+  return crc;
+}
+
+// CRC of a field, including the sync marks.  A good field (with its CRC on
+// the end) gives 0.
+static unsigned short field_crc(unsigned char *data, int length)
+{
+  unsigned short crc = 0xffff;
+  for (int i = 0; i < 3; i++)
+    crc = crc16(crc, 0xa1);
+  for (int i = 0; i < length; i++)
+    crc = crc16(crc, data[i]);
+  return crc;
+}
+
+/* ============================================================= */
+
+void flux_track_init(struct flux_track *t)
+{
+  bzero(t, sizeof(struct flux_track));
+}
+
+void flux_track_free(struct flux_track *t)
+{
+  for (int i = 0; i < 256; i++)
+    free(t->sectors[i]);
+  free(t->entries);
+  flux_track_init(t);
+}
+
+static void add_index_entry(struct flux_track *t, size_t offset, int type, int track, int side, int sector, int crc_ok)
+{
+  if (t->entry_count == t->entry_max) {
+    t->entry_max = t->entry_max ? t->entry_max * 2 : 64;
+    t->entries = realloc(t->entries, sizeof(struct flux_index_entry) * t->entry_max);
+    if (!t->entries) {
+      perror("realloc() failed");
+      exit(-3);
+    }
+  }
+  struct flux_index_entry *e = &t->entries[t->entry_count++];
+  e->offset = offset;
+  e->type = type;
+  e->track = track;
+  e->side = side;
+  e->sector = sector;
+  e->crc_ok = crc_ok;
+}
+
+static struct flux_sector *get_sector(struct flux_track *t, int sector)
+{
+  if (!t->sectors[sector]) {
+    t->sectors[sector] = calloc(1, sizeof(struct flux_sector));
+    if (!t->sectors[sector]) {
+      perror("calloc() failed");
+      exit(-3);
+    }
+    t->sectors[sector]->best = -1;
+  }
+  return t->sectors[sector];
+}
+
+static void add_sector_copy(struct flux_track *t, int sector, unsigned char *data, int good)
+{
+  struct flux_sector *s = get_sector(t, sector);
+  if (s->good)
+    return;
+  if (good) {
+    // No need to keep any other copies
+    memcpy(s->data[0], data, FLUX_DATA_FIELD_SIZE);
+    s->copies = 1;
+    s->good = 1;
+    s->best = 0;
+    return;
+  }
+  if (s->copies < FLUX_MAX_COPIES)
+    memcpy(s->data[s->copies++], data, FLUX_DATA_FIELD_SIZE);
+}
+
+void flux_track_merge(struct flux_track *t, struct flux_track *other)
+{
+  t->syncs += other->syncs;
+  t->headers += other->headers;
+  t->header_crc_errors += other->header_crc_errors;
+  t->data_fields += other->data_fields;
+  t->data_crc_errors += other->data_crc_errors;
+  t->gaps += other->gaps;
+  for (int i = 0; i < FLUX_JITTER_BUCKETS; i++)
+    t->jitter[i] += other->jitter[i];
+  for (int i = 0; i < 256; i++) {
+    struct flux_sector *s = other->sectors[i];
+    if (!s)
+      continue;
+    for (int c = 0; c < s->copies; c++)
+      add_sector_copy(t, i, s->data[c], s->good);
+  }
+}
+
+int flux_track_vote(struct flux_track *t)
+{
+  int recovered = 0;
+  for (int i = 0; i < 256; i++) {
+    struct flux_sector *s = t->sectors[i];
+    if (!s)
+      continue;
+    if (s->good) {
+      t->sector_status[i] = 2;
+      continue;
+    }
+    t->sector_status[i] = 1;
+    // It takes at least three copies to outvote a bad bit
+    if (s->copies < 3)
+      continue;
+    for (int b = 0; b < FLUX_DATA_FIELD_SIZE; b++) {
+      unsigned char v = 0;
+      for (int bit = 0x80; bit; bit >>= 1) {
+        int ones = 0;
+        for (int c = 0; c < s->copies; c++)
+          if (s->data[c][b] & bit)
+            ones++;
+        if (ones * 2 > s->copies)
+          v |= bit;
+      }
+      s->voted[b] = v;
+    }
+    if (!field_crc(s->voted, FLUX_DATA_FIELD_SIZE)) {
+      s->recovered = 1;
+      t->sector_status[i] = 3;
+      recovered++;
+    }
+  }
+  return recovered;
+}
+
+unsigned char *flux_sector_data(struct flux_track *t, int sector)
+{
+  struct flux_sector *s = t->sectors[sector];
+  if (!s)
+    return NULL;
+  if (s->good)
+    return &s->data[s->best][1];
+  if (s->recovered)
+    return &s->voted[1];
+  return NULL;
+}
+
+int flux_track_sectors_ok(struct flux_track *t)
+{
+  int sectors = 0;
+  for (int i = 0; i < 256; i++)
+    if (t->sector_status[i] >= 2)
+      sectors++;
+  return sectors;
+}
+
+void flux_track_report(FILE *out, struct flux_track *t, const char *name)
+{
+  fprintf(out, "\nSUMMARY for %s:\n", name);
+  if (t->headers - t->header_crc_errors)
+    fprintf(out, "  Track %d, Side %d\n", t->track, t->side);
+  if (t->tib_rate)
+    fprintf(out, "  Track info block: Divisor=%d, Encoding=$%02x\n", t->tib_rate, t->tib_encoding);
+  fprintf(out, "  %d sync marks, %d sector headers (%d CRC errors), %d data fields (%d CRC errors)\n", t->syncs, t->headers,
+      t->header_crc_errors, t->data_fields, t->data_crc_errors);
+  fprintf(out, "  %d sectors read ok:", flux_track_sectors_ok(t));
+  for (int i = 0; i < 256; i++)
+    if (t->sector_status[i] >= 2)
+      fprintf(out, " %d%s", i, t->sector_status[i] == 3 ? "(voted)" : "");
+  fprintf(out, "\n");
+  for (int i = 0; i < 256; i++)
+    if (t->sector_status[i] == 1)
+      fprintf(out, "  Sector %d could not be read\n", i);
+
+  // There is no jitter to show for gaps that came already quantised
+  unsigned int most = 0;
+  for (int i = 0; i < FLUX_JITTER_BUCKETS; i++)
+    if (t->jitter[i] > most)
+      most = t->jitter[i];
+  if (!most)
+    return;
+  fprintf(out, "  Jitter (gaps vs. quantised gap):\n");
+  for (int i = 0; i < FLUX_JITTER_BUCKETS; i++) {
+    fprintf(out, "    %+.2f : %7u", (i - FLUX_JITTER_BUCKET_CENTRE) * 0.05, t->jitter[i]);
+    int width = (t->jitter[i] * 50 + most - 1) / most;
+    if (width)
+      fputc(' ', out);
+    for (int j = 0; j < width; j++)
+      fputc('#', out);
+    fprintf(out, "\n");
+  }
+}
+
+/* ============================================================= */
+
+static int jitter_bucket(float error)
+{
+  int bucket = FLUX_JITTER_BUCKET_CENTRE + (int)(error * 20 + (error < 0 ? -0.5 : 0.5));
+  if (bucket < 0 || bucket >= FLUX_JITTER_BUCKETS)
+    return -1;
+  return bucket;
+}
+
+void flux_set_encoding(struct flux_decoder *d, float divisor, int rll_encoding)
+{
+  d->divisor = divisor;
+  d->rll_encoding = rll_encoding;
+  for (int t = 0; t < FLUX_QUANTISE_TABLE_SIZE; t++) {
+    float gap = t / divisor;
+    float q = quantise_gap(gap, rll_encoding);
+    d->quantised[t] = q * 2;
+    // RLL gaps are quantised without the pulse, so add it back
+    d->jitter_bucket[t] = jitter_bucket(gap - q - (rll_encoding ? 1 : 0));
+  }
+}
+
+void flux_decoder_init(struct flux_decoder *d, struct flux_track *t, float divisor)
+{
+  bzero(d, sizeof(struct flux_decoder));
+  d->track = t;
+  d->last_header_sector = -1;
+  crc16_init();
+  flux_set_encoding(d, divisor, FLUX_MFM);
+}
+
+void flux_enable_pll(struct flux_decoder *d)
+{
+  d->pll = 1;
+  d->pll_period = d->divisor;
+  d->pll_phase = 0;
+}
+
+/*
+  Finish the field that follows the last sync marks: check its CRC, add it
+  to the track, and tell the caller about it.
+*/
+static void complete_field(struct flux_decoder *d)
+{
+  struct flux_track *t = d->track;
+  unsigned char *data_field = d->data_field;
+  struct flux_field f;
+
+  if (!d->field_open)
+    return;
+  d->field_open = 0;
+
+  bzero(&f, sizeof(f));
+  f.type = data_field[0];
+  f.offset = d->field_offset;
+  f.length = d->field_ofs;
+  f.data = data_field;
+  f.sector = -1;
+
+  switch (f.type) {
+  case FLUX_FIELD_TIB:
+  case FLUX_FIELD_HEADER:
+    f.crc_calc = field_crc(data_field, 5);
+    f.crc_saw = (data_field[5] << 8) + data_field[6];
+    f.crc_ok = f.length >= 7 && !field_crc(data_field, 7);
+    if (f.type == FLUX_FIELD_TIB) {
+      // MEGA65 Track Information Block.
+      // The gaps are still measured against the rate we started with, but
+      // the rest of the track uses the new encoding.
+      flux_set_encoding(d, d->divisor, (data_field[3] & 0x0f) == 0x01);
+      t->tib_rate = data_field[2];
+      t->tib_encoding = data_field[3];
+      add_index_entry(t, f.offset, f.type, data_field[1], 0, 0, f.crc_ok);
+      break;
+    }
+    t->headers++;
+    if (f.crc_ok) {
+      t->track = data_field[1];
+      t->side = data_field[2];
+      d->last_header_sector = data_field[3];
+    }
+    else {
+      t->header_crc_errors++;
+      d->last_header_sector = -1;
+    }
+    add_index_entry(t, f.offset, f.type, data_field[1], data_field[2], data_field[3], f.crc_ok);
+    break;
+  case FLUX_FIELD_DATA:
+    f.crc_calc = field_crc(data_field, 1 + FLUX_SECTOR_SIZE);
+    f.crc_saw = (data_field[1 + FLUX_SECTOR_SIZE] << 8) + data_field[2 + FLUX_SECTOR_SIZE];
+    f.crc_ok = !field_crc(data_field, FLUX_DATA_FIELD_SIZE);
+    f.sector = d->last_header_sector;
+    t->data_fields++;
+    if (!f.crc_ok)
+      t->data_crc_errors++;
+    if (f.sector >= 0)
+      add_sector_copy(t, f.sector, data_field, f.crc_ok);
+    add_index_entry(t, f.offset, f.type, t->track, t->side, f.sector >= 0 ? f.sector : 0xff, f.crc_ok);
+    d->last_header_sector = -1;
+    break;
+  }
+
+  if (d->field_callback)
+    d->field_callback(d, &f, d->callback_ctx);
+
+  if (f.type == FLUX_FIELD_DATA) {
+    // Clear sector between operations
+    bzero(data_field, FLUX_SECTOR_SIZE);
+  }
+}
+
+static void emit_bit(struct flux_decoder *d, int b)
+{
+  FILE *log = (d->log_flags & FLUX_LOG_BYTES) ? d->log : NULL;
+
+  if (d->log_flags & FLUX_LOG_BITS)
+    fprintf(d->log, "  bit %d\n", b);
+  d->last_bit = b;
+  d->byte = (d->byte << 1) | b;
+  d->bits++;
+  if (d->bits == 8) {
+    if (d->byte_count < 16)
+      d->byte_count++;
+    else {
+      if (log)
+        fprintf(log, "\n");
+      d->byte_count = 0;
+    }
+    if (d->sync_count == 3) {
+      if (log)
+        fprintf(log, "Data field type $%02x\n", d->byte);
+      d->sync_count = 0;
+      d->field_ofs = 1;
+      d->field_open = 1;
+      d->field_offset = d->sample;
+      d->data_field[0] = d->byte;
+    }
+    else {
+      if (log)
+        fprintf(log, " $%02x", d->byte);
+      if (d->field_ofs < sizeof(d->data_field))
+        d->data_field[d->field_ofs++] = d->byte;
+      // The track info block changes how we decode the rest of the track
+      if (d->data_field[0] == FLUX_FIELD_TIB && d->field_ofs == 7)
+        complete_field(d);
+    }
+    d->bytes_emitted++;
+    d->byte = 0;
+    d->bits = 0;
+  }
+}
+
+static void buffer_bit(struct flux_decoder *d, int bit)
+{
+  d->buffered_bits[d->buffered_bit_count] = 0;
+  if (d->skip_bits) {
+    d->skip_bits--;
+    return;
+  }
+  if (d->buffered_bit_count < 16) {
+    d->buffered_bits[d->buffered_bit_count++] = bit;
+    d->buffered_bits[d->buffered_bit_count] = 0;
+  }
+}
+
+static void emit_bits(struct flux_decoder *d, const char *bits, int consumed)
+{
+  while (*bits)
+    emit_bit(d, *bits++ - '0');
+
+  for (int i = 0; i < (d->buffered_bit_count - consumed); i++)
+    d->buffered_bits[i] = d->buffered_bits[i + consumed];
+  d->buffered_bit_count -= consumed;
+  d->buffered_bits[d->buffered_bit_count] = 0;
+}
+
+static void rll27_decode_gap(struct flux_decoder *d, int gap)
+{
+  /*
+    Input    Encoded
+
+    11       1000
+    10       0100
+    000      100100
+    010      000100
+    011      001000
+    0011     00001000
+    0010     00100100
+  */
+
+  for (int i = 0; i < gap; i++)
+    buffer_bit(d, '0');
+  buffer_bit(d, '1');
+
+  char *buffered_bits = d->buffered_bits;
+  buffered_bits[d->buffered_bit_count] = 0;
+
+  if (d->buffered_bit_count >= 8) {
+    if (!strncmp("00001000", buffered_bits, 8))
+      emit_bits(d, "0011", 8);
+    else if (!strncmp("00100100", buffered_bits, 8))
+      emit_bits(d, "0010", 8);
+  }
+  if (d->buffered_bit_count >= 6) {
+    if (!strncmp("100100", buffered_bits, 6))
+      emit_bits(d, "000", 6);
+    else if (!strncmp("000100", buffered_bits, 6))
+      emit_bits(d, "010", 6);
+    else if (!strncmp("001000", buffered_bits, 6))
+      emit_bits(d, "011", 6);
+  }
+  if (d->buffered_bit_count >= 4) {
+    if (!strncmp("1000", buffered_bits, 4))
+      emit_bits(d, "11", 4);
+    else if (!strncmp("0100", buffered_bits, 4))
+      emit_bits(d, "10", 4);
+  }
+}
+
+// Sync marks, as twice the quantised gaps
+static const int sync_gaps_mfm[4] = { 4, 3, 4, 3 };
+static const int sync_gaps_rll27[2] = { 14, 4 };
+
+static int decode_gap(struct flux_decoder *d, int gap)
+{
+  FILE *log = (d->log_flags & FLUX_LOG_BYTES) ? d->log : NULL;
+
+  // Look at recent gaps to see if it is a sync mark
+  for (int i = 0; i < 3; i++)
+    d->recent_gaps[i] = d->recent_gaps[i + 1];
+  d->recent_gaps[3] = gap;
+
+  int i;
+  if (!d->rll_encoding) {
+    for (i = 0; i < 4; i++)
+      if (d->recent_gaps[i] != sync_gaps_mfm[i])
+        break;
+  }
+  else {
+    for (i = 2; i < 4; i++)
+      if (d->recent_gaps[i] != sync_gaps_rll27[i - 2])
+        break;
+  }
+  if (i == 4) {
+    if (d->bytes_emitted) {
+      complete_field(d);
+      if (log)
+        fprintf(log, "(%d bytes since last sync)\n", d->bytes_emitted);
+      d->sync_count = 0;
+    }
+    d->sync_count++;
+    if (d->sync_count == 3) {
+      if (log)
+        fprintf(log, "SYNC MARK (3x $A1)\n");
+      d->found_sync3++;
+      d->track->syncs++;
+    }
+    if (log)
+      fprintf(log, "Sync $A1 x #%d\n", d->sync_count);
+    d->bits = 0;
+    d->byte = 0;
+    d->byte_count = 0;
+    d->bytes_emitted = 0;
+    d->buffered_bits[0] = '1';
+    d->buffered_bits[1] = 0;
+    d->buffered_bit_count = 1;
+    d->reset_delta = 1;
+    if (d->rll_encoding)
+      d->skip_bits = 3;
+    return gap;
+  }
+
+  if (d->rll_encoding) {
+    rll27_decode_gap(d, gap / 2);
+  }
+  else {
+    // MFM
+    if (!d->last_gap) {
+      if (gap == 2) {
+        emit_bit(d, 1);
+        emit_bit(d, 1);
+      }
+      else if (gap == 3) {
+        emit_bit(d, 0);
+        emit_bit(d, 1);
+      }
+      else if (gap >= 4) {
+        emit_bit(d, 1);
+        emit_bit(d, 0);
+        emit_bit(d, 1);
+      }
+    }
+    else {
+      if (d->last_bit == 1) {
+        if (gap == 2)
+          emit_bit(d, 1);
+        else if (gap == 3) {
+          emit_bit(d, 0);
+          emit_bit(d, 0);
+        }
+        else if (gap >= 4) {
+          emit_bit(d, 0);
+          emit_bit(d, 1);
+        }
+      }
+      else {
+        // last bit was a 0
+        if (gap == 2)
+          emit_bit(d, 0);
+        else if (gap == 3) {
+          emit_bit(d, 1);
+        }
+        else if (gap == 4) {
+          emit_bit(d, 0);
+          emit_bit(d, 1);
+        }
+      }
+    }
+  }
+
+  d->last_gap = gap;
+  return gap;
+}
+
+// How quickly the PLL follows the data rate and the pulse timing
+#define PLL_PERIOD_GAIN 0.05
+#define PLL_PHASE_GAIN 0.5
+// How far the PLL may wander from the nominal rate
+#define PLL_RANGE 0.15
+
+/*
+  Quantise against the PLL's idea of the bit cell length, and then pull it
+  towards the gap we saw.  Part of the timing error is carried into the next
+  gap, as a late pulse makes the next gap look short.
+*/
+static int pll_quantise(struct flux_decoder *d, int ticks)
+{
+  float t = ticks + d->pll_phase;
+  float gap = t / d->pll_period;
+  float q = quantise_gap(gap, d->rll_encoding);
+  float cells = q + (d->rll_encoding ? 1 : 0);
+  float error = t - cells * d->pll_period;
+
+  int bucket = jitter_bucket(error / d->pll_period);
+  if (bucket >= 0)
+    d->track->jitter[bucket]++;
+
+  d->pll_period += PLL_PERIOD_GAIN * error / cells;
+  if (d->pll_period < d->divisor * (1 - PLL_RANGE))
+    d->pll_period = d->divisor * (1 - PLL_RANGE);
+  if (d->pll_period > d->divisor * (1 + PLL_RANGE))
+    d->pll_period = d->divisor * (1 + PLL_RANGE);
+  d->pll_phase = PLL_PHASE_GAIN * error;
+
+  return q * 2;
+}
+
+int flux_decode_ticks(struct flux_decoder *d, int ticks)
+{
+  FILE *log = (d->log_flags & FLUX_LOG_BYTES) ? d->log : NULL;
+  int ticks_in = ticks + d->previous_partial_gap;
+  float period = d->pll ? d->pll_period : d->divisor;
+
+  d->sample++;
+
+  if (ticks_in < 0.7 * period) {
+    d->previous_partial_gap = ticks;
+    if (log)
+      fprintf(log, "Accumulating short gap %.2f\n", ticks / period);
+    return 0;
+  }
+
+  if (d->previous_partial_gap && log)
+    fprintf(log, "Accumulated gap = %.2f + %.2f = %.2f\n", ticks / period, d->previous_partial_gap / period,
+        ticks_in / period);
+  d->previous_partial_gap = 0;
+
+  int gap;
+  if (d->pll)
+    gap = pll_quantise(d, ticks_in);
+  else if (ticks_in < FLUX_QUANTISE_TABLE_SIZE) {
+    gap = d->quantised[ticks_in];
+    if (d->jitter_bucket[ticks_in] >= 0)
+      d->track->jitter[(int)d->jitter_bucket[ticks_in]]++;
+  }
+  else
+    gap = quantise_gap(ticks_in / period, d->rll_encoding) * 2;
+  d->track->gaps++;
+
+  if (d->log_flags & FLUX_LOG_QUANTISED)
+    fprintf(d->log, "%.2f (%.2f)\n", gap / 2.0, ticks_in / period);
+
+  return decode_gap(d, gap);
+}
+
+int flux_decode_quantised(struct flux_decoder *d, int gap)
+{
+  d->sample++;
+  d->track->gaps++;
+  return decode_gap(d, gap);
+}
+
+void flux_decoder_finish(struct flux_decoder *d)
+{
+  if (d->bytes_emitted)
+    complete_field(d);
+}
+
+/* ============================================================= */
+
+float flux_detect_rate(const unsigned char *samples, size_t count)
+{
+  unsigned int histogram[256];
+  bzero(histogram, sizeof(histogram));
+  for (size_t i = 1; i < count; i++)
+    histogram[samples[i]]++;
+
+  // MFM gaps are 1, 1.5 or 2 bit cells, so find the cell length that puts
+  // the most gaps closest to one of those.
+  static const float steps[3] = { 1.0, 1.5, 2.0 };
+  float best_period = 0, best_score = 0;
+  for (float period = 16; period <= 160; period += 0.25) {
+    float score = 0;
+    for (int v = 1; v < 256; v++) {
+      if (!histogram[v])
+        continue;
+      float gap = v / period;
+      for (int s = 0; s < 3; s++) {
+        float error = gap - steps[s];
+        if (error < 0)
+          error = -error;
+        if (error < 0.2)
+          score += histogram[v] * (0.2 - error);
+      }
+    }
+    if (score > best_score) {
+      best_score = score;
+      best_period = period;
+    }
+  }
+  if (!best_period)
+    return 0;
+
+  // Then refine it with the average of the gaps that matched
+  double sum = 0, weight = 0;
+  for (int v = 1; v < 256; v++) {
+    float gap = v / best_period;
+    for (int s = 0; s < 3; s++) {
+      float error = gap - steps[s];
+      if (error > -0.2 && error < 0.2) {
+        sum += histogram[v] * (v / steps[s]);
+        weight += histogram[v];
+      }
+    }
+  }
+  // Too few gaps to trust
+  if (weight < 64)
+    return 0;
+  return sum / weight;
+}
+
+const unsigned char *flux_map_capture(const char *filename, size_t *count, time_t *mtime)
+{
+  static const unsigned char empty[1];
+
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open '%s'\n", filename);
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st)) {
+    perror("fstat() failed");
+    close(fd);
+    return NULL;
+  }
+  *count = st.st_size;
+  if (mtime)
+    *mtime = st.st_mtime;
+  if (!*count) {
+    close(fd);
+    return empty;
+  }
+  const unsigned char *samples = mmap(NULL, *count, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (samples == MAP_FAILED) {
+    perror("mmap() failed");
+    return NULL;
+  }
+  madvise((void *)samples, *count, MADV_SEQUENTIAL);
+  return samples;
+}
+
+void flux_unmap_capture(const unsigned char *samples, size_t count)
+{
+  if (count)
+    munmap((void *)samples, count);
+}
+
+/* ============================================================= */
+
+/*
+  Index file layout, all little-endian:
+    "M65FLUX1", capture size (64 bits), capture mtime (64 bits),
+    the counters of struct flux_track (32 bits each), the jitter histogram,
+    the status of each of the 256 sectors (8 bits each),
+    the number of entries, and then 8 bytes for each entry.
+*/
+#define FLUX_INDEX_MAGIC "M65FLUX1"
+#define FLUX_INDEX_COUNTERS 10
+
+static void index_name(const char *filename, char *name, int len)
+{
+  snprintf(name, len, "%s.idx", filename);
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+  p[2] = v >> 16;
+  p[3] = v >> 24;
+}
+
+static uint32_t get_u32(unsigned char *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+  put_u32(p, v);
+  put_u32(p + 4, v >> 32);
+}
+
+static uint64_t get_u64(unsigned char *p)
+{
+  return get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+static void track_counters(struct flux_track *t, int **counters)
+{
+  int *c[FLUX_INDEX_COUNTERS] = { &t->track, &t->side, &t->syncs, &t->headers, &t->header_crc_errors, &t->data_fields,
+    &t->data_crc_errors, &t->tib_rate, &t->tib_encoding, (int *)&t->gaps };
+  memcpy(counters, c, sizeof(c));
+}
+
+int flux_index_write(const char *filename, struct flux_track *t, size_t count, time_t mtime)
+{
+  char name[1024];
+  index_name(filename, name, sizeof(name));
+  FILE *f = fopen(name, "wb");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not create '%s'\n", name);
+    return -1;
+  }
+
+  unsigned char header[8 + 8 + 8 + 4 * FLUX_INDEX_COUNTERS + 4 * FLUX_JITTER_BUCKETS + 256 + 4];
+  unsigned char *p = header;
+  memcpy(p, FLUX_INDEX_MAGIC, 8);
+  p += 8;
+  put_u64(p, count);
+  p += 8;
+  put_u64(p, mtime);
+  p += 8;
+  int *counters[FLUX_INDEX_COUNTERS];
+  track_counters(t, counters);
+  for (int i = 0; i < FLUX_INDEX_COUNTERS; i++, p += 4)
+    put_u32(p, *counters[i]);
+  for (int i = 0; i < FLUX_JITTER_BUCKETS; i++, p += 4)
+    put_u32(p, t->jitter[i]);
+  memcpy(p, t->sector_status, 256);
+  p += 256;
+  put_u32(p, t->entry_count);
+  fwrite(header, sizeof(header), 1, f);
+
+  for (int i = 0; i < t->entry_count; i++) {
+    struct flux_index_entry *e = &t->entries[i];
+    unsigned char entry[8];
+    put_u32(entry, e->offset);
+    entry[4] = e->type;
+    entry[5] = e->track;
+    entry[6] = (e->side & 0x7f) | (e->crc_ok ? 0x80 : 0);
+    entry[7] = e->sector;
+    fwrite(entry, sizeof(entry), 1, f);
+  }
+
+  if (fclose(f)) {
+    fprintf(stderr, "ERROR: Could not write '%s'\n", name);
+    unlink(name);
+    return -1;
+  }
+  return 0;
+}
+
+int flux_index_read(const char *filename, struct flux_track *t, size_t count, time_t mtime)
+{
+  char name[1024];
+  index_name(filename, name, sizeof(name));
+  FILE *f = fopen(name, "rb");
+  if (!f)
+    return -1;
+
+  unsigned char header[8 + 8 + 8 + 4 * FLUX_INDEX_COUNTERS + 4 * FLUX_JITTER_BUCKETS + 256 + 4];
+  unsigned char *p = header;
+  if (fread(header, sizeof(header), 1, f) != 1 || memcmp(p, FLUX_INDEX_MAGIC, 8)
+      || get_u64(p + 8) != (uint64_t)count || get_u64(p + 16) != (uint64_t)mtime) {
+    fclose(f);
+    return -1;
+  }
+  p += 24;
+
+  flux_track_free(t);
+  int *counters[FLUX_INDEX_COUNTERS];
+  track_counters(t, counters);
+  for (int i = 0; i < FLUX_INDEX_COUNTERS; i++, p += 4)
+    *counters[i] = get_u32(p);
+  for (int i = 0; i < FLUX_JITTER_BUCKETS; i++, p += 4)
+    t->jitter[i] = get_u32(p);
+  memcpy(t->sector_status, p, 256);
+  p += 256;
+
+  int entries = get_u32(p);
+  for (int i = 0; i < entries; i++) {
+    unsigned char entry[8];
+    if (fread(entry, sizeof(entry), 1, f) != 1) {
+      fclose(f);
+      flux_track_free(t);
+      return -1;
+    }
+    add_index_entry(t, get_u32(entry), entry[4], entry[5], entry[6] & 0x7f, entry[7], entry[6] >> 7);
+  }
+  fclose(f);
+  return 0;
+}
@@ -0,0 +1,230 @@
+#ifndef FLUX_H
+#define FLUX_H
+
+/*
+  Flux level decoding of MEGA65 floppy captures, shared by mfm-decode and
+  mfm-gapcheck.
+
+  Gaps between flux transitions are turned into bits (MFM or RLL2,7), bits
+  into bytes, and bytes into the fields that follow each set of sync marks.
+  Everything that is found is collected in a struct flux_track, so that
+  several revolutions (or captures) of a track can be voted on, and so that
+  it can be saved as a compact index of the capture.
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Encodings
+#define FLUX_MFM 0
+#define FLUX_RLL27 1
+
+// Field types, from the byte that follows the sync marks
+#define FLUX_FIELD_TIB 0x65
+#define FLUX_FIELD_HEADER 0xfe
+#define FLUX_FIELD_DATA 0xfb
+
+// What the decoder logs as it goes
+#define FLUX_LOG_BYTES 0x01 // bytes, sync marks and field types
+#define FLUX_LOG_BITS 0x02
+#define FLUX_LOG_QUANTISED 0x04
+
+/*
+  Gaps are quantised by table lookup on the raw tick count.  Quantised gaps
+  are always given as twice the gap, so that the MFM half steps are whole
+  numbers.
+*/
+#define FLUX_QUANTISE_TABLE_SIZE 512
+
+// Jitter histogram buckets are 0.05 gaps wide, from -0.5 to +0.5
+#define FLUX_JITTER_BUCKETS 21
+#define FLUX_JITTER_BUCKET_CENTRE (FLUX_JITTER_BUCKETS / 2)
+
+#define FLUX_SECTOR_SIZE 512
+// Type byte, sector data and CRC
+#define FLUX_DATA_FIELD_SIZE (1 + FLUX_SECTOR_SIZE + 2)
+// Copies of each sector that are kept for voting
+#define FLUX_MAX_COPIES 8
+
+struct flux_field {
+  int type;
+  size_t offset; // sample at which the field starts
+  int length;
+  unsigned char *data; // starting with the type byte
+  int crc_ok;
+  unsigned short crc_saw, crc_calc;
+  // From the last good sector header, for data fields
+  int sector;
+};
+
+struct flux_sector {
+  int copies;
+  unsigned char data[FLUX_MAX_COPIES][FLUX_DATA_FIELD_SIZE];
+  int good;      // one of the copies had a good CRC
+  int recovered; // voting on the copies gave a good CRC
+  int best;      // the copy to use, or -1 if voted
+  unsigned char voted[FLUX_DATA_FIELD_SIZE];
+};
+
+// What the index records for each field
+struct flux_index_entry {
+  uint32_t offset;
+  uint8_t type;
+  uint8_t track, side, sector;
+  uint8_t crc_ok;
+};
+
+struct flux_track {
+  int track, side;
+  int syncs;
+  int headers, header_crc_errors;
+  int data_fields, data_crc_errors;
+  int tib_rate, tib_encoding;
+  unsigned int gaps;
+  unsigned int jitter[FLUX_JITTER_BUCKETS];
+  // Status of each sector, once voted: 0 = not seen, 1 = bad, 2 = good, 3 = recovered
+  unsigned char sector_status[256];
+  struct flux_sector *sectors[256];
+
+  struct flux_index_entry *entries;
+  int entry_count, entry_max;
+};
+
+struct flux_decoder;
+typedef void (*flux_field_callback)(struct flux_decoder *d, struct flux_field *f, void *ctx);
+
+struct flux_decoder {
+  FILE *log;
+  int log_flags;
+  struct flux_track *track;
+  flux_field_callback field_callback;
+  void *callback_ctx;
+
+  float divisor;
+  int rll_encoding;
+  unsigned char quantised[FLUX_QUANTISE_TABLE_SIZE];
+  signed char jitter_bucket[FLUX_QUANTISE_TABLE_SIZE];
+
+  // PLL data separator, if enabled
+  int pll;
+  float pll_period;
+  float pll_phase;
+
+  size_t sample;
+  int last_gap;
+  int last_bit;
+  unsigned char byte;
+  int bits;
+  int byte_count;
+  int bytes_emitted;
+  int sync_count;
+  int field_ofs;
+  int field_open;
+  size_t field_offset;
+  unsigned char data_field[1024];
+  int last_header_sector;
+
+  int skip_bits;
+  char buffered_bits[17];
+  int buffered_bit_count;
+
+  int recent_gaps[4];
+  int reset_delta;
+  int found_sync3;
+  int previous_partial_gap;
+};
+
+/*
+  Gap quantisation for a gap measured in bit cells.  RLL2,7 gaps are given
+  excluding the pulse.
+*/
+float quantise_gap_mfm(float gap);
+float quantise_gap_rll27(float gap);
+float quantise_gap(float gap, int rll_encoding);
+
+void crc16_init(void);
+unsigned short crc16(unsigned short crc, unsigned short b);
+
+/*
+  Set up a decoder that collects what it finds into the given track.
+  The divisor is the number of ticks in one MFM bit cell.
+*/
+void flux_decoder_init(struct flux_decoder *d, struct flux_track *t, float divisor);
+
+/*
+  Change the rate or encoding.  A track information block does this by
+  itself.
+*/
+void flux_set_encoding(struct flux_decoder *d, float divisor, int rll_encoding);
+
+/*
+  Use a PLL to follow slow changes in the data rate (e.g., from the drive
+  speed), rather than quantising against a fixed rate.
+*/
+void flux_enable_pll(struct flux_decoder *d);
+
+/*
+  Decode the next gap, given in ticks.  Returns twice the quantised gap, or
+  0 if the gap was too short, and will be added to the next one.
+*/
+int flux_decode_ticks(struct flux_decoder *d, int ticks);
+
+/*
+  Decode a gap that the FDC has already quantised, given as twice the gap.
+*/
+int flux_decode_quantised(struct flux_decoder *d, int gap);
+
+/*
+  Finish off the field after the last sync mark at the end of a capture.
+*/
+void flux_decoder_finish(struct flux_decoder *d);
+
+void flux_track_init(struct flux_track *t);
+void flux_track_free(struct flux_track *t);
+
+/*
+  Add the sector copies from another capture of the same track to this one.
+*/
+void flux_track_merge(struct flux_track *t, struct flux_track *other);
+
+/*
+  Settle the status of each sector.  Sectors without a good copy are voted
+  on bit by bit across all of the copies, which can recover a sector that
+  is weak in a different place on each revolution.
+  Returns the number of sectors recovered by voting.
+*/
+int flux_track_vote(struct flux_track *t);
+
+/*
+  Data for a sector (without the type byte), or NULL if it could not be
+  read.  Only valid after flux_track_vote().
+*/
+unsigned char *flux_sector_data(struct flux_track *t, int sector);
+
+int flux_track_sectors_ok(struct flux_track *t);
+void flux_track_report(FILE *out, struct flux_track *t, const char *name);
+
+/*
+  Work out the MFM bit cell length in ticks from the histogram of the gaps.
+  Returns 0 if there are not enough gaps to tell.
+*/
+float flux_detect_rate(const unsigned char *samples, size_t count);
+
+/*
+  Map a capture into memory.  Returns NULL on failure.
+*/
+const unsigned char *flux_map_capture(const char *filename, size_t *count, time_t *mtime);
+void flux_unmap_capture(const unsigned char *samples, size_t count);
+
+/*
+  The index of a capture is a small binary file next to it, with the
+  summary of the track and every sync mark and field found in it.  It is
+  only used if the capture has not changed since it was written.
+  flux_index_read() returns 0 if the index was valid.
+*/
+int flux_index_write(const char *filename, struct flux_track *t, size_t count, time_t mtime);
+int flux_index_read(const char *filename, struct flux_track *t, size_t count, time_t mtime);
+
+#endif // FLUX_H
@@ -20,6 +20,7 @@ char *strcasestr(const char *haystack, const char *needle);
 unsigned long long gettime_ms(void);
 
 #include "m65common.h"
+#include "trace.h"
 
 #define MAX_PINS 4096
 char *pin_names[MAX_PINS];
@@ -34,12 +35,25 @@ int boundary_bit_count = 0;
 char part_name[1024];
 
 FILE *vcd = NULL;
+// Binary trace instead of VCD, if the file name ends in .m65t
+struct trace_writer *trace_out = NULL;
 
 void set_vcd_file(char *name)
 {
+  int len = strlen(name);
+  if (len > 5 && !strcasecmp(&name[len - 5], ".m65t")) {
+    // Boundary scan times are in usec
+    trace_out = trace_create(name, TRACE_FS_PER_US);
+    if (!trace_out)
+      perror("Failed to open trace file for writing");
+    return;
+  }
   vcd = fopen(name, "w");
   if (!vcd)
     perror("Failed to open VCD file for writing");
+  else
+    // Samples arrive in batches, so write them out in large chunks
+    setvbuf(vcd, NULL, _IOFBF, 1024 * 1024);
 }
 
 int parse_xdc(char *xdc)
@@ -164,6 +178,139 @@ int parse_bsdl(char *bsdl)
 
 static uint8_t boundary_ppattern[] = DITEM(BOUNDARY_PPAT);
 
+// Bytes of samples read back per batch
+#define BOUNDARY_BATCH_BYTES 65536
+// Report the sample rate this often (usec)
+#define BOUNDARY_REPORT_INTERVAL 5000000
+
+static char *bbit_names[MAX_BOUNDARY_BITS];
+static int bbit_ignore[MAX_BOUNDARY_BITS];
+static int bbit_show[MAX_BOUNDARY_BITS];
+static char bbit_vcdchar[MAX_BOUNDARY_BITS];
+static int bbit_trace[MAX_BOUNDARY_BITS];
+
+static char last_rdata[1024];
+static int first_time = 1;
+
+/*
+  Take a single sample, going through Test-Logic-Reset and loading the
+  SAMPLE instruction each time.
+*/
+static uint8_t *boundary_read_single(void)
+{
+  write_tms_transition("IR1");
+
+  LOGNOTE("Checkpoint pre marker_for_reset()");
+
+  // Send 1 + 4 TMS reset bits?
+  marker_for_reset(4);
+
+  // PGS: Try to explicitly send the IDCODE command.
+  // Once we get this working, we know we can then adapt for BOUNDARY command.
+  // The following seems to work:
+  // 1. Switch to idle.
+  // 2. Switch to Select IR scan
+  // 3. Clock a null bit (maybe to switch to capture IR ?)
+  // 4. Send IDCODE command. Not sure why we need 5 instead of 6 for length/
+  // 5. Switch to IDLE after done
+  ENTER_TMS_STATE('I');
+  ENTER_TMS_STATE('S');
+  write_bit(0, 0, 0xff, 0);         // Select first device on bus
+  write_bit(0, 5, IRREG_SAMPLE, 0); // Send IDCODE command
+  ENTER_TMS_STATE('I');
+
+  LOGNOTE("Checkpoint pre write-pattern");
+
+  // This sends the transition to Shift-DR, but doesn't seem to actually send
+  // the IDCODE command.  Does the FPGA default to IDCODE?
+  // Yes: This seems to be the case, according to here:
+  // https://forums.xilinx.com/t5/Spartan-Family-FPGAs-Archived/Spartan-3AN-200-JTAG-Idcode-debugging-on-a-new-board/td-p/131792
+  uint8_t *rdata = write_pattern(0, boundary_ppattern, 'I');
+
+  LOGNOTE("Checkpoint post write-pattern");
+
+  ENTER_TMS_STATE('I');
+  return rdata;
+}
+
+/*
+  Build the MPSSE commands for a batch of samples.  Once the SAMPLE
+  instruction is loaded, each sample is just a pass through Capture-DR
+  and reading out the boundary register, so that many samples can be
+  queued and read back in one go.
+*/
+static int boundary_batch_commands(uint8_t *buf, int samples, int sample_bytes)
+{
+  int len = 0;
+  for (int i = 0; i < samples; i++) {
+    // Idle -> Select-DR -> Capture-DR -> Shift-DR
+    buf[len++] = TMSW;
+    buf[len++] = 2;
+    buf[len++] = 0x01;
+    buf[len++] = DREAD;
+    buf[len++] = M(sample_bytes - 1);
+    buf[len++] = M((sample_bytes - 1) >> 8);
+    // Shift-DR -> Exit1-DR -> Update-DR -> Idle
+    buf[len++] = TMSW;
+    buf[len++] = 2;
+    buf[len++] = 0x03;
+  }
+  buf[len++] = SEND_IMMEDIATE;
+  return len;
+}
+
+static void boundary_sample(uint8_t *rdata, int len, unsigned long long time_delta, char *bsdl, char *sensitivity)
+{
+  if (!bsdl) {
+    dump_bytes(0, "boundary data", rdata, 256);
+  }
+  else {
+    int count_shown = 0;
+    for (int i = 0; i < boundary_bit_count; i++) {
+      int value = (rdata[(i) >> 3] >> ((i)&7)) & 1;
+      int last_value = (last_rdata[(i) >> 3] >> ((i)&7)) & 1;
+
+      if (bbit_show[i] | bbit_vcdchar[i] | (bbit_trace[i] >= 0)) {
+        if (first_time || last_value != value) {
+
+          if ((first_time && ((!sensitivity) || vcd || trace_out)) || (!bbit_ignore[i])) {
+
+            if (!count_shown) {
+              if (vcd) {
+                fprintf(vcd, "#%lld\n", time_delta);
+              }
+              else if (trace_out)
+                trace_set_time(trace_out, time_delta);
+              else {
+                printf("T+%lldusec >>> Signal(s) changed.\n", time_delta);
+              }
+            }
+            count_shown++;
+
+            if (vcd) {
+              if (bbit_vcdchar[i])
+                fprintf(vcd, "%d%c\n", value, bbit_vcdchar[i]);
+            }
+            else if (trace_out) {
+              if (bbit_trace[i] >= 0)
+                trace_change(trace_out, bbit_trace[i], value, 0);
+            }
+            else
+              printf("bit#%d : %s (pin %s, signal %s) = %x\n", i, boundary_bit_fullname[i], boundary_bit_pin[i],
+                  bbit_names[i], value);
+          }
+        }
+      }
+    }
+  }
+
+  // Copy this data to old
+  if (len > sizeof(last_rdata))
+    len = sizeof(last_rdata);
+  bcopy(rdata, last_rdata, len);
+  first_time = 0;
+}
+
 int xilinx_boundaryscan(char *xdc, char *bsdl, char *sensitivity)
 {
   ENTER();
@@ -175,9 +322,7 @@ int xilinx_boundaryscan(char *xdc, char *bsdl, char *sensitivity)
   }
   get_deviceid(uinfo_selected, interface_id);
 
-  char last_rdata[1024];
   int loop = 1;
-  int first_time = 1;
 
   if (xdc)
     parse_xdc(xdc);
@@ -195,11 +340,6 @@ int xilinx_boundaryscan(char *xdc, char *bsdl, char *sensitivity)
     fprintf(stderr, "WARNING: No BSDL file, so cannot decode boundary scan information.\n");
   }
 
-  char *bbit_names[MAX_BOUNDARY_BITS];
-  int bbit_ignore[MAX_BOUNDARY_BITS];
-  int bbit_show[MAX_BOUNDARY_BITS];
-  char bbit_vcdchar[MAX_BOUNDARY_BITS];
-
   int next_vcdchar = 33;
 
   // Map JTAG bits to pins
@@ -225,6 +365,7 @@ int xilinx_boundaryscan(char *xdc, char *bsdl, char *sensitivity)
     else
       bbit_names[i] = "<unknown>";
     bbit_vcdchar[i] = 0;
+    bbit_trace[i] = -1;
     if (!strcmp("CLK_IN", s))
       bbit_ignore[i] = 1;
     else
@@ -247,6 +388,9 @@ int xilinx_boundaryscan(char *xdc, char *bsdl, char *sensitivity)
           if (vcd)
             fprintf(stderr, "WARNING: Too many signals on sensitivity list for VCD output.\n");
         }
+        // Traces have no such limit
+        if (trace_out)
+          bbit_trace[i] = trace_add_signal(trace_out, bbit_names[i], 1);
         printf("Adding '%s' to sensitivity list.\n", s);
       }
       else
@@ -290,92 +434,75 @@ int xilinx_boundaryscan(char *xdc, char *bsdl, char *sensitivity)
     }
     fprintf(vcd, "$end\n");
   }
+  if (trace_out)
+    trace_flush(trace_out);
 
   unsigned long long start_time = gettime_us();
+  unsigned long long last_trace_flush = start_time;
+  unsigned long long last_report = start_time;
+  unsigned long long samples = 0, last_report_samples = 0;
+
+  // The first sample also loads the SAMPLE instruction, which then stays
+  // in the instruction register for the batches
+  uint8_t *rdata = boundary_read_single();
+  boundary_sample(rdata, sizeof(last_rdata), gettime_us() - start_time, bsdl, sensitivity);
+  samples++;
+
+  int sample_bytes = bsdl ? (boundary_bit_count + 7) / 8 : 256;
+  if (sample_bytes < 1 || sample_bytes > sizeof(last_rdata))
+    sample_bytes = sizeof(last_rdata);
+  int batch = BOUNDARY_BATCH_BYTES / sample_bytes;
+  uint8_t *batch_commands = malloc(batch * 9 + 1);
+  uint8_t *batch_data = malloc(batch * sample_bytes);
+  if (!batch_commands || !batch_data) {
+    log_crit("could not allocate boundary scan buffers");
+    exit(-3);
+  }
+  int batch_command_len = boundary_batch_commands(batch_commands, batch, sample_bytes);
+  int batched = 1;
 
   do {
-
-    write_tms_transition("IR1");
-
-    LOGNOTE("Checkpoint pre marker_for_reset()");
-
-    // Send 1 + 4 TMS reset bits?
-    marker_for_reset(4);
-
-    // PGS: Try to explicitly send the IDCODE command.
-    // Once we get this working, we know we can then adapt for BOUNDARY command.
-    // The following seems to work:
-    // 1. Switch to idle.
-    // 2. Switch to Select IR scan
-    // 3. Clock a null bit (maybe to switch to capture IR ?)
-    // 4. Send IDCODE command. Not sure why we need 5 instead of 6 for length/
-    // 5. Switch to IDLE after done
-    ENTER_TMS_STATE('I');
-    ENTER_TMS_STATE('S');
-    write_bit(0, 0, 0xff, 0);         // Select first device on bus
-    write_bit(0, 5, IRREG_SAMPLE, 0); // Send IDCODE command
-    ENTER_TMS_STATE('I');
-
-    LOGNOTE("Checkpoint pre write-pattern");
-
-    // This sends the transition to Shift-DR, but doesn't seem to actually send
-    // the IDCODE command.  Does the FPGA default to IDCODE?
-    // Yes: This seems to be the case, according to here:
-    // https://forums.xilinx.com/t5/Spartan-Family-FPGAs-Archived/Spartan-3AN-200-JTAG-Idcode-debugging-on-a-new-board/td-p/131792
-    uint8_t *rdata = write_pattern(0, boundary_ppattern, 'I');
-
-    unsigned long long now = gettime_us();
-    unsigned long long time_delta = now - start_time;
-
-    if (!bsdl) {
-      dump_bytes(0, "boundary data", rdata, 256);
+    if (batched) {
+      unsigned long long before = gettime_us();
+      if (ftdi_stream(batch_commands, batch_command_len, batch_data, batch * sample_bytes) < 0) {
+        log_warn("batched boundary scan failed, falling back to one sample at a time");
+        batched = 0;
+        // Start again from a known state
+        rdata = boundary_read_single();
+        continue;
+      }
+      unsigned long long after = gettime_us();
+      // The samples are spread evenly over the time that the batch took
+      for (int i = 0; i < batch; i++)
+        boundary_sample(&batch_data[i * sample_bytes], sample_bytes,
+            before - start_time + (after - before) * (i + 1) / batch, bsdl, sensitivity);
+      samples += batch;
     }
     else {
-      int count_shown = 0;
-      for (int i = 0; i < boundary_bit_count; i++) {
-        int value = (rdata[(i) >> 3] >> ((i)&7)) & 1;
-        int last_value = (last_rdata[(i) >> 3] >> ((i)&7)) & 1;
-
-        if (bbit_show[i] | bbit_vcdchar[i]) {
-          if (first_time || last_value != value) {
-
-            if ((first_time && ((!sensitivity) || vcd)) || (!bbit_ignore[i])) {
-
-              if (!count_shown) {
-                if (vcd) {
-                  fprintf(vcd, "#%lld\n", time_delta);
-                }
-                else {
-                  printf("T+%lldusec >>> Signal(s) changed.\n", time_delta);
-                }
-              }
-              count_shown++;
-
-              if (vcd) {
-                if (bbit_vcdchar[i])
-                  fprintf(vcd, "%d%c\n", value, bbit_vcdchar[i]);
-              }
-              else
-                printf("bit#%d : %s (pin %s, signal %s) = %x\n", i, boundary_bit_fullname[i], boundary_bit_pin[i],
-                    bbit_names[i], value);
-            }
-          }
-        }
-      }
-      if (vcd)
-        fflush(vcd);
+      rdata = boundary_read_single();
+      boundary_sample(rdata, sizeof(last_rdata), gettime_us() - start_time, bsdl, sensitivity);
+      samples++;
     }
 
-    LOGNOTE("Checkpoint post write-pattern");
-
-    ENTER_TMS_STATE('I');
-
-    // Copy this data to old
-    bcopy(rdata, last_rdata, 1024);
-    first_time = 0;
-
+    unsigned long long now = gettime_us();
+    if (vcd)
+      fflush(vcd);
+    // Traces are written a block at a time, so that an interrupted
+    // capture loses at most the last second
+    if (trace_out && now - last_trace_flush >= 1000000) {
+      trace_flush(trace_out);
+      last_trace_flush = now;
+    }
+    if (now - last_report >= BOUNDARY_REPORT_INTERVAL) {
+      fprintf(stderr, "INFO: Boundary scan at %.1f samples/sec (%llu samples)\n",
+          (samples - last_report_samples) * 1000000.0 / (now - last_report), samples);
+      last_report = now;
+      last_report_samples = samples;
+    }
   } while (loop);
 
+  free(batch_commands);
+  free(batch_data);
   EXIT();
   return 0;
 }
@@ -40,8 +40,12 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <dirent.h>
+#ifndef WINDOWS
+#include <sys/wait.h>
+#endif
 
 #include "m65common.h"
+#include "fpgajtag.h"
 
 #ifdef WINDOWS
 #include <winsock.h>
@@ -533,6 +537,9 @@ static void send_data_file(
     write_req(0, zerod, idcode_count - 9 + tremain * (found_cortex != -1) - mid * (idcode_count - 1 - jtag_index));
   write_int32(post);
   int limit_len = MAX_SINGLE_USB_DATA - buffer_current_size();
+  // Nothing is read back while the data is sent, so don't wait for each
+  // buffer to go out before building the next
+  ftdi_upload_begin();
   while (psize) {
     int size = FILE_READSIZE;
     if (psize < size)
@@ -543,6 +550,7 @@ static void send_data_file(
     limit_len = MAX_SINGLE_USB_DATA;
     pdata += size;
   };
+  ftdi_upload_end();
   if (extra_shift)
     write_fill(0, 0, 'E');
   ENTER_TMS_STATE('I');
@@ -696,20 +704,11 @@ static void read_config_memory(int fd, uint32_t size)
 }
 
 /*
- * init_fpgajtag(serialno, serialport, fpga_id)
- *   returns usb device string
- *
- * this will probe the usb interfaces and decide which one to use,
- * depending on the serialno, serialport and fpga_id given.
- *
+ * Find the USB devices and serial ports that could be JTAG adapters
  */
-char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t fpga_id)
+static void probe_start(void)
 {
-  ENTER();
-  int i, j, ser, bus, pnum_len, last_index = -1, last_match = -1;
-  uint8_t pnum[8];
-  uint32_t last_idcode = 0xffffffff;
-  char last_path[1024] = "UNKNOWN";
+  int i;
 
   // get usbdev candidates
   usbdev_get_candidates();
@@ -720,88 +719,122 @@ char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t
   for (i = 0; i < sizeof(bitswap); i++)
     bitswap[i] = BSWAP(i);
   uinfo = fpgausb_init();
+}
 
-  for (i = 0; uinfo[i].dev; i++) {
-    // fetch bus information
-    bus = libusb_get_bus_number(uinfo[i].dev);
-    pnum_len = libusb_get_port_numbers(uinfo[i].dev, pnum, 8);
-    // log what we found
-    log_concat(NULL);
-    log_concat("found %s (serial %s) [%d, [", uinfo[i].iManufacturer, uinfo[i].iSerialNumber, bus);
-    for (j = 0; j < pnum_len; j++)
-      log_concat("%d%s", pnum[j], j + 1 == pnum_len ? "" : ",");
-    log_concat("]]");
-    log_info(NULL);
-
-    // if we got a serial_no, look if it matches, otherwise skip interface
-    if (serialno && strcmp(serialno, (char *)uinfo[i].iSerialNumber)) {
-      log_info("  serial %s does not match, skipping", serialno);
-    }
+/*
+ * probe_device(i, serialno, fpga_id, autodiscover, dev)
+ *   returns 1 if usb device i has an FPGA matching fpga_id
+ *
+ * reads the id codes of the JTAG chain on usb device i, and fills in dev
+ * with what was found.
+ */
+static int probe_device(int i, const char *serialno, const uint32_t fpga_id, int autodiscover, struct fpgajtag_device *dev)
+{
+  int j, ser, bus, pnum_len, matched = 0;
+  uint8_t pnum[8];
 
-    // now find the serial device in the list of candidates
-    for (ser = 0; ser < usbdev_info_count; ser++)
-      // match linux/macos by bus-port(.subport)
-      if (usbdev_info[ser].bus > -1 && usbdev_info[ser].bus == bus && usbdev_info[ser].pnum0 == pnum[0]
-          && (pnum_len == 1 || usbdev_info[ser].pnum1 == pnum[1]) && (pnum_len <= 2 || usbdev_info[ser].pnum2 == pnum[2])
-          && (pnum_len <= 3 || usbdev_info[ser].pnum3 == pnum[3]))
-        break;
-      // match by serial_no on windows
-      else if (usbdev_info[ser].serial_no
-               && !strncmp(
-                   usbdev_info[ser].serial_no, (char *)uinfo[i].iSerialNumber, strlen((char *)uinfo[i].iSerialNumber)))
-        break;
-    if (ser >= usbdev_info_count)
-      ser = -1;
-    else
-      log_info("  matched to serial device %s", usbdev_info[ser].device);
-
-    // generic initialization of FTDI chip
-    get_deviceid(i, interface_id);
-    fpgausb_close();
-    // log what we found
-    log_concat(NULL);
-    log_concat("  got %d id code%s: ", idcode_count, idcode_count > 1 ? "s" : "");
-    for (j = 0; j < idcode_count; j++) /*** look for device matching file idcode ***/
-      log_concat(j + 1 == idcode_count ? "%08x" : "%08x,", idcode_array[j]);
-    log_info(NULL);
-    // check if device is powered on
-    if (idcode_count == 16 && (idcode_array[0] < 0x00ffffff || idcode_array[0] >= 0x0fffffff)) {
-      log_info("  device seems to be disabled, please power on");
-      continue;
-    }
+  // fetch bus information
+  bus = libusb_get_bus_number(uinfo[i].dev);
+  pnum_len = libusb_get_port_numbers(uinfo[i].dev, pnum, 8);
+  // log what we found
+  log_concat(NULL);
+  log_concat("found %s (serial %s) [%d, [", uinfo[i].iManufacturer, uinfo[i].iSerialNumber, bus);
+  for (j = 0; j < pnum_len; j++)
+    log_concat("%d%s", pnum[j], j + 1 == pnum_len ? "" : ",");
+  log_concat("]]");
+  log_info(NULL);
+
+  // if we got a serial_no, look if it matches, otherwise skip interface
+  if (serialno && strcmp(serialno, (char *)uinfo[i].iSerialNumber)) {
+    log_info("  serial %s does not match, skipping", serialno);
+    return 0;
+  }
 
-    // look for device matching file idcode
-    for (j = 0; j < idcode_count; j++)
-      if (idcode_array[j] == fpga_id || fpga_id == 0xffffffff || match_any_idcode) {
-        log_info("  id code %08x matches %08x", idcode_array[j], match_any_idcode ? 0xffffffff : fpga_id);
-        last_index = j;
-        last_match = i;
-        last_idcode = idcode_array[j];
-        if (ser > -1) {
-          strncpy(last_path, usbdev_info[ser].device, 1023);
-          last_path[1023] = 0;
-        }
-        else
-          strcpy(last_path, "UNKNOWN");
-        break;
-      }
-    if (j == idcode_count)
-      log_info("  id codes do not match %08x", match_any_idcode ? 0xffffffff : fpga_id);
-
-    // autodiscover?
-    if (!serialno && !serialport && (fpga_id == 0xffffffff || match_any_idcode))
-      log_note("#%d: %s (%s; %04X:%04X; %s; %08x)", i, ser > -1 ? usbdev_info[ser].device : "UNKNOWN",
-          uinfo[i].iManufacturer, uinfo[i].idVendor, uinfo[i].idProduct, uinfo[i].iSerialNumber,
-          j < idcode_count ? idcode_array[j] : 0xffffffff);
+  // now find the serial device in the list of candidates
+  for (ser = 0; ser < usbdev_info_count; ser++)
+    // match linux/macos by bus-port(.subport)
+    if (usbdev_info[ser].bus > -1 && usbdev_info[ser].bus == bus && usbdev_info[ser].pnum0 == pnum[0]
+        && (pnum_len == 1 || usbdev_info[ser].pnum1 == pnum[1]) && (pnum_len <= 2 || usbdev_info[ser].pnum2 == pnum[2])
+        && (pnum_len <= 3 || usbdev_info[ser].pnum3 == pnum[3]))
+      break;
+    // match by serial_no on windows
+    else if (usbdev_info[ser].serial_no
+             && !strncmp(usbdev_info[ser].serial_no, (char *)uinfo[i].iSerialNumber, strlen((char *)uinfo[i].iSerialNumber)))
+      break;
+  if (ser >= usbdev_info_count)
+    ser = -1;
+  else
+    log_info("  matched to serial device %s", usbdev_info[ser].device);
+
+  // generic initialization of FTDI chip
+  get_deviceid(i, interface_id);
+  fpgausb_close();
+  // log what we found
+  log_concat(NULL);
+  log_concat("  got %d id code%s: ", idcode_count, idcode_count > 1 ? "s" : "");
+  for (j = 0; j < idcode_count; j++) /*** look for device matching file idcode ***/
+    log_concat(j + 1 == idcode_count ? "%08x" : "%08x,", idcode_array[j]);
+  log_info(NULL);
+  // check if device is powered on
+  if (idcode_count == 16 && (idcode_array[0] < 0x00ffffff || idcode_array[0] >= 0x0fffffff)) {
+    log_info("  device seems to be disabled, please power on");
+    return 0;
   }
 
-  if (last_match != -1) {
-    log_note("selecting device %s (%s; %04X:%04X; %s; %08x)", last_path, uinfo[last_match].iManufacturer,
-        uinfo[last_match].idVendor, uinfo[last_match].idProduct, uinfo[last_match].iSerialNumber, last_idcode);
-    jtag_index = last_index;
-    uinfo_selected = last_match;
+  // look for device matching file idcode
+  for (j = 0; j < idcode_count; j++)
+    if (idcode_array[j] == fpga_id || fpga_id == 0xffffffff || match_any_idcode) {
+      log_info("  id code %08x matches %08x", idcode_array[j], match_any_idcode ? 0xffffffff : fpga_id);
+      dev->usb_index = i;
+      dev->jtag_index = j;
+      dev->idcode = idcode_array[j];
+      snprintf(dev->serial, sizeof(dev->serial), "%s", (char *)uinfo[i].iSerialNumber);
+      snprintf(dev->port, sizeof(dev->port), "%s", ser > -1 ? usbdev_info[ser].device : "UNKNOWN");
+      matched = 1;
+      break;
+    }
+  if (j == idcode_count)
+    log_info("  id codes do not match %08x", match_any_idcode ? 0xffffffff : fpga_id);
+
+  // autodiscover?
+  if (autodiscover)
+    log_note("#%d: %s (%s; %04X:%04X; %s; %08x)", i, ser > -1 ? usbdev_info[ser].device : "UNKNOWN",
+        uinfo[i].iManufacturer, uinfo[i].idVendor, uinfo[i].idProduct, uinfo[i].iSerialNumber,
+        j < idcode_count ? idcode_array[j] : 0xffffffff);
 
-    return strdup(last_path);
+  return matched;
+}
+
+/*
+ * init_fpgajtag(serialno, serialport, fpga_id)
+ *   returns usb device string
+ *
+ * this will probe the usb interfaces and decide which one to use,
+ * depending on the serialno, serialport and fpga_id given.
+ *
+ */
+char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t fpga_id)
+{
+  ENTER();
+  struct fpgajtag_device dev, last;
+  int i, found = 0;
+  int autodiscover = !serialno && !serialport && (fpga_id == 0xffffffff || match_any_idcode);
+
+  probe_start();
+
+  for (i = 0; uinfo[i].dev; i++)
+    if (probe_device(i, serialno, fpga_id, autodiscover, &dev)) {
+      last = dev;
+      found = 1;
+    }
+
+  if (found) {
+    log_note("selecting device %s (%s; %04X:%04X; %s; %08x)", last.port, uinfo[last.usb_index].iManufacturer,
+        uinfo[last.usb_index].idVendor, uinfo[last.usb_index].idProduct, last.serial, last.idcode);
+    jtag_index = last.jtag_index;
+    uinfo_selected = last.usb_index;
+
+    return strdup(last.port);
   }
 
   uinfo_selected = -1;
@@ -811,6 +844,103 @@ char *init_fpgajtag(const char *serialno, const char *serialport, const uint32_t
   return NULL;
 }
 
+int fpgajtag_enumerate(const uint32_t fpga_id, struct fpgajtag_device *devices, int max_devices)
+{
+  int i, count = 0;
+
+  probe_start();
+
+  for (i = 0; uinfo[i].dev && count < max_devices; i++)
+    if (probe_device(i, NULL, fpga_id, 0, &devices[count]))
+      count++;
+
+  return count;
+}
+
+/*
+ * Program one board.  The JTAG code keeps the state of the selected board
+ * in globals, so this is run in a process of its own for each board when
+ * they are done in parallel.
+ */
+static int program_board(struct fpgajtag_job *job)
+{
+  log_note("loading bitstream %s", job->bitstream);
+  if (!init_fpgajtag(job->serial, NULL, job->fpga_id)) {
+    log_error("board not found");
+    return -1;
+  }
+  int ret = fpgajtag_main(job->bitstream);
+  log_note(ret ? "bitstream load failed" : "bitstream loaded");
+  return ret;
+}
+
+int fpgajtag_program_boards(struct fpgajtag_job *jobs, int count)
+{
+  int i, failed = 0;
+
+  // Each board opens libusb for itself
+  fpgausb_release();
+
+#ifdef WINDOWS
+  // No fork() here, so the boards are done one after another
+  for (i = 0; i < count; i++) {
+    unsigned long long start = gettime_us();
+    log_set_prefix(jobs[i].serial);
+    jobs[i].result = program_board(&jobs[i]);
+    log_set_prefix(NULL);
+    jobs[i].seconds = (gettime_us() - start) / 1000000.0;
+    if (jobs[i].result)
+      failed++;
+  }
+#else
+  pid_t pids[count];
+  unsigned long long start = gettime_us();
+  int running = 0;
+
+  fflush(NULL);
+  for (i = 0; i < count; i++) {
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      log_error("could not start programming board %s: %s", jobs[i].serial, strerror(errno));
+      jobs[i].result = -1;
+      failed++;
+      continue;
+    }
+    if (!pids[i]) {
+      log_set_prefix(jobs[i].serial);
+      int ret = program_board(&jobs[i]);
+      fflush(NULL);
+      _exit(ret ? 1 : 0);
+    }
+    running++;
+  }
+
+  while (running) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    for (i = 0; i < count; i++)
+      if (pids[i] == pid)
+        break;
+    if (i == count)
+      continue;
+    running--;
+    jobs[i].seconds = (gettime_us() - start) / 1000000.0;
+    jobs[i].result = (WIFEXITED(status) && !WEXITSTATUS(status)) ? 0 : -1;
+    if (jobs[i].result)
+      failed++;
+    log_note("board %s %s after %.1f seconds (%d still running)", jobs[i].serial, jobs[i].result ? "FAILED" : "done",
+        jobs[i].seconds, running);
+  }
+#endif
+
+  return failed;
+}
+
 #ifndef WINDOWS
 int min(int a, int b)
 {
@@ -825,6 +955,7 @@ int fpgajtag_main(char *bitstream)
 {
   ENTER();
   uint32_t ret;
+  int result = 0;
   int rflag = 0, mflag = 0, cflag = 0, xflag = 0; // rescan = 0;
 
   // reopen device found by init_fpgajtag
@@ -967,9 +1098,11 @@ int fpgajtag_main(char *bitstream)
    * Step 6: Load Configuration Data Frames
    */
   log_note("fpgajtag: Starting to send file");
+  unsigned long long send_start = gettime_us();
   send_data_file(
       DREAD, !dcount && jtag_index, input_fileptr, input_filesize, NULL, DITEM(INT32(0)), !(jtag_index && dcount), 1);
-  log_note("fpgajtag: Done sending file\n");
+  unsigned long long send_time = gettime_us() - send_start;
+  log_note("fpgajtag: Done sending file (%d bytes in %.2f seconds)\n", input_filesize, send_time / 1000000.0);
 
   /*
    * Step 8: Startup
@@ -1000,6 +1133,21 @@ int fpgajtag_main(char *bitstream)
     log_debug("[%s:%d] expect %x mismatch %x", __FUNCTION__, __LINE__, 0xf07910, ret);
   log_debug("STATUS %08x done %x release_done %x eos %x startup_state %x", status, status & 0x4000, status & 0x2000,
       status & 0x10, (status >> 18) & 7);
+  if (fpgajtag_verify) {
+    // STAT bit 0 is CRC_ERROR: the FPGA checks the CRC words in the
+    // bitstream against what it received, so there is no need to read
+    // the configuration back
+    if (status & 0x0001) {
+      log_error("fpgajtag: bitstream CRC check failed (STAT %06x)", status);
+      result = -1;
+    }
+    else if (!(status & 0x4000)) {
+      log_error("fpgajtag: FPGA did not assert DONE after configuration (STAT %06x)", status);
+      result = -1;
+    }
+    else
+      log_note("fpgajtag: bitstream CRC check passed");
+  }
   access_mdm(0, 0, 1);
   // rescan = 1;
 
@@ -1010,7 +1158,7 @@ exit_label:
   fpgausb_close();
   fpgausb_release();
   EXIT();
-  return 0;
+  return result;
 }
 
 #include "boundary_scan.c"
@@ -34,9 +34,11 @@
 #endif
 #include "util.h"
 #include "elfdef.h"
+#include "dirtymock.h"
 
 int fpgajtag_usbdk_enable = 0;
 int fpgajtag_libusb_open_failed = 0;
+int fpgajtag_verify = 0;
 
 // clang-format off
 static int usbValidDeviceList[][2] = {
@@ -146,11 +148,133 @@ void memdump(const uint8_t *p, int len, char *title)
     printf("\n");
 }
 
+/*
+ * Pipelined writes
+ *
+ * While a bitstream is being sent, nothing is read back, so there is no
+ * need to wait for each buffer to go out before building the next one.
+ * Between ftdi_upload_begin() and ftdi_upload_end(), buffers that do not
+ * read anything are gathered into a ring of large transfers, which are
+ * submitted without waiting.  Anything that does read waits for the ring
+ * to empty first, so that the order of commands is kept.
+ */
+#define UPLOAD_URBS 8
+#define UPLOAD_URB_SIZE 65536
+
+#if !defined(NO_LIBUSB) && !defined(USE_LIBFTDI)
+static struct {
+  int active;
+  struct libusb_transfer *transfers[UPLOAD_URBS];
+  int busy[UPLOAD_URBS];
+  int current, current_len;
+  int error;
+} upload;
+
+static void LIBUSB_CALL upload_done(struct libusb_transfer *t)
+{
+  int *busy = t->user_data;
+  if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length) {
+    log_error("fpgajtag: usb bulk write failed: status %d req size %d act %d", t->status, t->length, t->actual_length);
+    upload.error = 1;
+  }
+  *busy = 0;
+}
+
+static void upload_wait(int slot)
+{
+  while (upload.busy[slot])
+    if (libusb_handle_events(usb_context) < 0) {
+      log_crit("fpgajtag: libusb_handle_events failed");
+      exit(-1);
+    }
+}
+
+static void upload_submit(void)
+{
+  if (!upload.current_len)
+    return;
+  struct libusb_transfer *t = upload.transfers[upload.current];
+  // The device may have been reopened since the transfers were allocated
+  t->dev_handle = usbhandle;
+  t->endpoint = ENDPOINT_IN;
+  t->length = upload.current_len;
+  upload.busy[upload.current] = 1;
+  int ret = libusb_submit_transfer(t);
+  if (ret < 0) {
+    log_crit("fpgajtag: usb bulk write failed: ret %d req size %d", ret, upload.current_len);
+    exit(-1);
+  }
+  upload.current = (upload.current + 1) % UPLOAD_URBS;
+  upload.current_len = 0;
+  upload_wait(upload.current);
+}
+
+static void upload_queue(const uint8_t *buf, int size)
+{
+  if (logging)
+    formatwrite(1, buf, size, "WRITE");
+  if (upload.current_len + size > UPLOAD_URB_SIZE)
+    upload_submit();
+  memcpy(upload.transfers[upload.current]->buffer + upload.current_len, buf, size);
+  upload.current_len += size;
+}
+
+static void upload_drain(void)
+{
+  upload_submit();
+  for (int i = 0; i < UPLOAD_URBS; i++)
+    upload_wait(i);
+  if (upload.error) {
+    log_crit("fpgajtag: pipelined usb write failed");
+    exit(-1);
+  }
+}
+#endif
+
+void ftdi_upload_begin(void)
+{
+#if !defined(NO_LIBUSB) && !defined(USE_LIBFTDI)
+  flush_write(NULL);
+  if (!upload.transfers[0]) {
+    for (int i = 0; i < UPLOAD_URBS; i++) {
+      struct libusb_transfer *t = libusb_alloc_transfer(0);
+      uint8_t *buffer = malloc(UPLOAD_URB_SIZE);
+      if (!t || !buffer) {
+        log_crit("could not allocate USB transfer");
+        exit(-3);
+      }
+      libusb_fill_bulk_transfer(t, usbhandle, ENDPOINT_IN, buffer, 0, upload_done, &upload.busy[i], USB_TIMEOUT);
+      upload.transfers[i] = t;
+    }
+  }
+  upload.error = 0;
+  upload.active = 1;
+#endif
+}
+
+void ftdi_upload_end(void)
+{
+#if !defined(NO_LIBUSB) && !defined(USE_LIBFTDI)
+  if (!upload.active)
+    return;
+  flush_write(NULL);
+  upload_drain();
+  upload.active = 0;
+#endif
+}
+
 #ifndef USE_LIBFTDI
-static int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size)
+int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf, int size);
+int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size);
+
+int DIRTYMOCK(ftdi_write_data)(struct ftdi_context *ftdi, const unsigned char *buf, int size)
 {
   int actual_length = -1;
   int ret = -1;
+#ifndef NO_LIBUSB
+  if (upload.active)
+    upload_drain();
+#endif
   if (logging)
     formatwrite(1, buf, size, "WRITE");
 #ifndef NO_LIBUSB
@@ -171,10 +295,14 @@ static int ftdi_write_data(struct ftdi_context *ftdi, const unsigned char *buf,
 #endif
   return actual_length;
 }
-static int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int size)
+int DIRTYMOCK(ftdi_read_data)(struct ftdi_context *ftdi, unsigned char *buf, int size)
 {
   int actual_length = 1;
   int count = 0, ret = -1;
+#ifndef NO_LIBUSB
+  if (upload.active)
+    upload_drain();
+#endif
   do {
     count++;
 #ifndef NO_LIBUSB
@@ -214,47 +342,16 @@ static int ftdi_read_data(struct ftdi_context *ftdi, unsigned char *buf, int siz
 /*
  * Write utility functions
  */
-void write_data(uint8_t *buf, int size)
-{
-  ENTER();
-#ifdef USE_LOGGING
-  dump_bytes(log_depth + 2, "write_data()", buf, size);
-#endif
 
-  memcpy(usbreadbuffer_ptr, buf, size);
-  usbreadbuffer_ptr += size;
-
-  EXIT();
-}
-
-void write_item(uint8_t *buf)
-{
-  ENTER();
-  write_data(buf + 1, buf[0]);
-  EXIT();
-}
-
-int buffer_current_size(void)
-{
-  return usbreadbuffer_ptr - usbreadbuffer;
-}
-uint8_t *buffer_current_ptr(void)
-{
-  return usbreadbuffer_ptr;
-}
-
-void flush_write(uint8_t *req)
+/*
+ * Work out how much each command in a finished buffer will read, so that
+ * read_data() knows how to take apart what comes back.  This has to wait
+ * until the buffer is complete, as commands are changed after they have
+ * been added (e.g., write_bit() turns a TMS write into a TMS read).
+ */
+static void parse_reads(const uint8_t *p, int write_length)
 {
-  if (req)
-    write_item(req);
-  int write_length = buffer_current_size();
-  usbreadbuffer_ptr = usbreadbuffer;
-  if (!write_length)
-    return;
-  ftdi_write_data(global_ftdi, usbreadbuffer, write_length);
   read_size_ptr = 0;
-
-  const uint8_t *p = usbreadbuffer;
   while (write_length > 0) {
     int plen = 1;
     uint8_t ch = *p;
@@ -308,6 +405,53 @@ void flush_write(uint8_t *req)
   }
 }
 
+void write_data(uint8_t *buf, int size)
+{
+  ENTER();
+#ifdef USE_LOGGING
+  dump_bytes(log_depth + 2, "write_data()", buf, size);
+#endif
+
+  memcpy(usbreadbuffer_ptr, buf, size);
+  usbreadbuffer_ptr += size;
+
+  EXIT();
+}
+
+void write_item(uint8_t *buf)
+{
+  ENTER();
+  write_data(buf + 1, buf[0]);
+  EXIT();
+}
+
+int buffer_current_size(void)
+{
+  return usbreadbuffer_ptr - usbreadbuffer;
+}
+uint8_t *buffer_current_ptr(void)
+{
+  return usbreadbuffer_ptr;
+}
+
+void flush_write(uint8_t *req)
+{
+  if (req)
+    write_item(req);
+  int write_length = buffer_current_size();
+  usbreadbuffer_ptr = usbreadbuffer;
+  if (!write_length)
+    return;
+  parse_reads(usbreadbuffer, write_length);
+#if !defined(NO_LIBUSB) && !defined(USE_LIBFTDI)
+  if (upload.active && !read_size_ptr) {
+    upload_queue(usbreadbuffer, write_length);
+    return;
+  }
+#endif
+  ftdi_write_data(global_ftdi, usbreadbuffer, write_length);
+}
+
 /*
  * Read utility functions
  */
@@ -377,6 +521,147 @@ uint8_t *read_data(void)
   return last_read_data;
 }
 
+/*
+ * Streaming transfers
+ *
+ * Sends a whole buffer of MPSSE commands and collects the data that they
+ * read back, with several USB transfers in flight in each direction, so
+ * that the FTDI never waits for the host.  The FTDI puts two status bytes
+ * at the start of every packet that it returns, which are removed here.
+ */
+#define STREAM_URBS 8
+#define STREAM_URB_SIZE 16384
+
+#ifndef NO_LIBUSB
+struct stream_state {
+  int out_len, out_done;
+  uint8_t *in;
+  int in_len, in_received;
+  int packet_size;
+  struct libusb_transfer *reads[STREAM_URBS];
+  int writes_in_flight;
+  int error;
+};
+
+static void LIBUSB_CALL stream_out_done(struct libusb_transfer *t)
+{
+  struct stream_state *s = t->user_data;
+  if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length != t->length)
+    s->error = 1;
+  s->out_done += t->actual_length;
+  s->writes_in_flight--;
+  libusb_free_transfer(t);
+}
+
+static void LIBUSB_CALL stream_in_done(struct libusb_transfer *t)
+{
+  struct stream_state *s = t->user_data;
+  for (int ofs = 0; ofs < t->actual_length; ofs += s->packet_size) {
+    int len = t->actual_length - ofs;
+    if (len > s->packet_size)
+      len = s->packet_size;
+    len -= 2;
+    if (len > s->in_len - s->in_received)
+      len = s->in_len - s->in_received;
+    if (len <= 0)
+      continue;
+    memcpy(s->in + s->in_received, t->buffer + ofs + 2, len);
+    s->in_received += len;
+  }
+  if (t->status != LIBUSB_TRANSFER_COMPLETED && t->status != LIBUSB_TRANSFER_CANCELLED)
+    s->error = 1;
+  if (t->status == LIBUSB_TRANSFER_COMPLETED && s->in_received < s->in_len && !s->error && !libusb_submit_transfer(t))
+    return;
+  for (int i = 0; i < STREAM_URBS; i++)
+    if (s->reads[i] == t)
+      s->reads[i] = NULL;
+  free(t->buffer);
+  libusb_free_transfer(t);
+}
+
+static int stream_reads_in_flight(struct stream_state *s)
+{
+  int n = 0;
+  for (int i = 0; i < STREAM_URBS; i++)
+    if (s->reads[i])
+      n++;
+  return n;
+}
+#endif
+
+int ftdi_stream(const uint8_t *out, int out_len, uint8_t *in, int in_len)
+{
+#ifdef NO_LIBUSB
+  return -1;
+#else
+  struct stream_state s;
+  memset(&s, 0, sizeof(s));
+  s.out_len = out_len;
+  s.in = in;
+  s.in_len = in_len;
+  s.packet_size = libusb_get_max_packet_size(libusb_get_device(usbhandle), ENDPOINT_OUT);
+  if (s.packet_size <= 2)
+    s.packet_size = 512;
+
+  // Reads first, so that there is always somewhere for the data to go
+  for (int i = 0; i < STREAM_URBS; i++) {
+    struct libusb_transfer *t = libusb_alloc_transfer(0);
+    uint8_t *buffer = malloc(STREAM_URB_SIZE);
+    if (!t || !buffer) {
+      log_crit("could not allocate USB transfer");
+      exit(-3);
+    }
+    libusb_fill_bulk_transfer(t, usbhandle, ENDPOINT_OUT, buffer, STREAM_URB_SIZE, stream_in_done, &s, USB_TIMEOUT);
+    if (libusb_submit_transfer(t)) {
+      free(buffer);
+      libusb_free_transfer(t);
+      s.error = 1;
+      break;
+    }
+    s.reads[i] = t;
+  }
+
+  for (int sent = 0; !s.error && sent < out_len;) {
+    int len = out_len - sent;
+    if (len > STREAM_URB_SIZE)
+      len = STREAM_URB_SIZE;
+    struct libusb_transfer *t = libusb_alloc_transfer(0);
+    if (!t) {
+      log_crit("could not allocate USB transfer");
+      exit(-3);
+    }
+    libusb_fill_bulk_transfer(
+        t, usbhandle, ENDPOINT_IN, (unsigned char *)out + sent, len, stream_out_done, &s, USB_TIMEOUT);
+    if (libusb_submit_transfer(t)) {
+      libusb_free_transfer(t);
+      s.error = 1;
+      break;
+    }
+    s.writes_in_flight++;
+    sent += len;
+  }
+
+  while ((s.writes_in_flight || s.in_received < in_len) && !s.error) {
+    if (libusb_handle_events(usb_context) < 0)
+      s.error = 1;
+  }
+
+  // The reads that are still waiting for data will not get any more
+  for (int i = 0; i < STREAM_URBS; i++)
+    if (s.reads[i])
+      libusb_cancel_transfer(s.reads[i]);
+  while (s.writes_in_flight || stream_reads_in_flight(&s))
+    if (libusb_handle_events(usb_context) < 0)
+      break;
+
+  if (s.error || s.in_received < in_len) {
+    log_debug("%s: received %d of %d bytes", __FUNCTION__, s.in_received, in_len);
+    return -1;
+  }
+  return s.in_received;
+#endif
+}
+
 /*
  * USB interface
  * fills the usbinfo_array with information and returns it
@@ -388,6 +673,8 @@ USB_INFO *fpgausb_init(void)
   libusb_device *dev;
   struct libusb_device_descriptor desc;
 
+  usbinfo_array_index = 0;
+
 #define UDESC(A)                                                                                                            \
   libusb_get_string_descriptor_ascii(                                                                                       \
       usbhandle, desc.A, usbinfo_array[usbinfo_array_index].A, sizeof(usbinfo_array[usbinfo_array_index].A))
@@ -569,12 +856,21 @@ void fpgausb_close(void)
 }
 void fpgausb_release(void)
 {
-  fclose(logfile);
-  close(datafile_fd);
+  // fpgajtag_main() points this at stdout
+  if (logfile && logfile != stdout)
+    fclose(logfile);
+  logfile = NULL;
+  if (datafile_fd != -1)
+    close(datafile_fd);
+  datafile_fd = -1;
 #ifndef NO_LIBUSB
-  libusb_free_device_list(device_list, 1);
+  if (device_list)
+    libusb_free_device_list(device_list, 1);
+  device_list = NULL;
 #ifndef USE_LIBFTDI
-  libusb_exit(usb_context);
+  if (usb_context)
+    libusb_exit(usb_context);
+  usb_context = NULL;
 #endif
 #endif
 }
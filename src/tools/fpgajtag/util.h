@@ -120,8 +120,20 @@ void write_item(uint8_t *buf);
 void flush_write(uint8_t *req);
 int buffer_current_size(void);
 uint8_t *buffer_current_ptr(void);
+/*
+ * Between these, buffers that read nothing are sent without waiting for
+ * each one to complete.  ftdi_upload_end() waits for them all.
+ */
+void ftdi_upload_begin(void);
+void ftdi_upload_end(void);
 
 uint8_t *read_data(void);
+/*
+ * Send a buffer of MPSSE commands, and collect in_len bytes of what they
+ * read, with several USB transfers in flight at once.  Returns the number
+ * of bytes read, or -1 on failure.
+ */
+int ftdi_stream(const uint8_t *out, int out_len, uint8_t *in, int in_len);
 void tmsw_delay(int delay_time, int extra);
 void idle_to_shift_dr(int extra);
 uint32_t read_inputfile(const char *filename);
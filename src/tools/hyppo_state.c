@@ -0,0 +1,258 @@
+/*
+  Hypervisor DOS state decoder for m65 -X.  See include/hyppo_state.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "m65common.h"
+#include "logging.h"
+#include "hyppo_state.h"
+
+#define HF_BYTE 1
+#define HF_WORD 2
+#define HF_LONG 4
+#define HF_STRING 0
+
+struct hyppo_field {
+  const char *name;  // JSON key
+  const char *label; // text report
+  int offset;
+  int type;
+  int len; // for strings
+};
+
+/*
+  A group of fields.  Sections without a name are at the top level, and
+  those with a count of more than one are arrays of records.
+*/
+struct hyppo_section {
+  const char *name;
+  const char *label;
+  int offset;
+  int count;
+  int stride;
+  const struct hyppo_field *fields;
+};
+
+// Offsets are from HYPPO_STATE_ADDR
+static const struct hyppo_field hyppo_dos_fields[] = {
+  { "disk_count", "Disk count", 0x101, HF_BYTE },
+  { "default_disk", "Default Disk", 0x102, HF_BYTE },
+  { "current_disk", "Current Disk", 0x103, HF_BYTE },
+  { "disk_table_offset", "Disk Table offset", 0x104, HF_BYTE },
+  { "cwd_cluster", "Cluster of current directory", 0x105, HF_LONG },
+  { "opendir_cluster", "opendir_cluster", 0x109, HF_LONG },
+  { "opendir_sector", "opendir_sector", 0x10d, HF_BYTE },
+  { "opendir_entry", "opendir_entry", 0x10e, HF_BYTE },
+  { NULL },
+};
+
+static const struct hyppo_field hyppo_dirent_fields[] = {
+  { "filename", "Filename", 0x00, HF_STRING, 64 },
+  { "filename_len", "Filename len", 0x40, HF_BYTE },
+  { "short_name", "Short name", 0x41, HF_STRING, 13 },
+  { "start_cluster", "Start cluster", 0x4e, HF_LONG },
+  { "file_length", "File length", 0x52, HF_LONG },
+  { "attrib", "ATTRIB byte", 0x56, HF_BYTE },
+  { NULL },
+};
+
+static const struct hyppo_field hyppo_read_fields[] = {
+  { "requested_filename_len", "Requested filename len", 0x166, HF_BYTE },
+  { "requested_filename", "Requested filename", 0x167, HF_STRING, 66 },
+  { "sectors_read", "sectorsread", 0x1a9, HF_WORD },
+  { "bytes_remaining", "bytes_remaining", 0x1ab, HF_LONG },
+  { "current_sector", "current sector", 0x1af, HF_LONG },
+  { "current_cluster", "current cluster", 0x1b3, HF_LONG },
+  { "sector_in_cluster", "current sector in cluster", 0x1b7, HF_BYTE },
+  { NULL },
+};
+
+static const struct hyppo_field hyppo_fd_fields[] = {
+  { "disk_id", "disk ID", 0x00, HF_BYTE },
+  { "mode", "mode", 0x01, HF_BYTE },
+  { "start_cluster", "start cluster", 0x02, HF_LONG },
+  { "current_cluster", "current cluster", 0x06, HF_LONG },
+  { "sector_in_cluster", "sector in cluster", 0x0a, HF_BYTE },
+  { "offset_in_sector", "offset in sector", 0x0b, HF_WORD },
+  { NULL },
+};
+
+static const struct hyppo_field hyppo_error_fields[] = {
+  { "current_fd", "Current file descriptor #", 0x1f4, HF_BYTE },
+  { "current_fd_offset", "Current file descriptor offset", 0x1f5, HF_BYTE },
+  { "dos_error", "Dos error code", 0x1f6, HF_BYTE },
+  { "syspart_error", "SYSPART error code", 0x1f7, HF_BYTE },
+  { "syspart_present", "SYSPART present", 0x1f8, HF_BYTE },
+  { "syspart_start", "SYSPART start", 0x0c0, HF_LONG },
+  { NULL },
+};
+
+static const struct hyppo_field hyppo_disk_fields[] = {
+  { "start", "Start", 0x00, HF_LONG },
+  { "size", "Size", 0x04, HF_LONG },
+  { "fs", "FS", 0x08, HF_BYTE },
+  { "fat_length", "FAT_Len", 0x09, HF_LONG },
+  { "system_sectors", "SysLen", 0x0d, HF_WORD },
+  { "reserved", "Rsv", 0x0f, HF_BYTE },
+  { "root_dir", "RootDir", 0x10, HF_WORD },
+  { "clusters", "Clusters", 0x12, HF_LONG },
+  { "cluster_size", "CSz", 0x16, HF_BYTE },
+  { "fat_count", "#FATs", 0x17, HF_BYTE },
+  { "cluster0", "Cluster0", 0x18, HF_LONG },
+  { NULL },
+};
+
+static const struct hyppo_field hyppo_process_fields[] = {
+  { "id", "Process ID", 0x00, HF_BYTE },
+  { "name", "Process name", 0x01, HF_STRING, 16 },
+  { NULL },
+};
+
+static const struct hyppo_section hyppo_sections[] = {
+  { NULL, NULL, 0, 1, 0, hyppo_dos_fields },
+  { "dirent", "dirent structure", 0x10f, 1, 0, hyppo_dirent_fields },
+  { NULL, NULL, 0, 1, 0, hyppo_read_fields },
+  { "fd", "File descriptor", 0x1b8, 4, 0x10, hyppo_fd_fields },
+  { NULL, NULL, 0, 1, 0, hyppo_error_fields },
+  { "disk", "Disk", 0x000, 6, 0x20, hyppo_disk_fields },
+  { "process", "Process descriptor", 0x200, 1, 0, hyppo_process_fields },
+};
+
+#define HYPPO_SECTION_COUNT (int)(sizeof(hyppo_sections) / sizeof(hyppo_sections[0]))
+
+int hyppo_state_fetch(struct hyppo_state *s)
+{
+  s->time_ms = gettime_ms();
+  return fetch_ram_checked(HYPPO_STATE_ADDR, HYPPO_STATE_SIZE, s->data);
+}
+
+static int hyppo_field_len(const struct hyppo_field *field)
+{
+  return field->type == HF_STRING ? field->len : field->type;
+}
+
+static unsigned int hyppo_field_value(const unsigned char *p, const struct hyppo_field *field)
+{
+  unsigned int v = 0;
+  for (int i = field->type - 1; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static void hyppo_print_value(FILE *f, const unsigned char *p, const struct hyppo_field *field, int json)
+{
+  if (field->type != HF_STRING) {
+    if (json)
+      fprintf(f, "%u", hyppo_field_value(p, field));
+    else
+      fprintf(f, "$%0*x", field->type * 2, hyppo_field_value(p, field));
+    return;
+  }
+
+  fputc(json ? '"' : '\'', f);
+  for (int i = 0; i < field->len && p[i]; i++) {
+    if (!json)
+      fputc(p[i] >= 0x20 && p[i] < 0x7f ? p[i] : '.', f);
+    else if (p[i] == '"' || p[i] == '\\')
+      fprintf(f, "\\%c", p[i]);
+    else if (p[i] < 0x20 || p[i] >= 0x7f)
+      fprintf(f, "\\u%04x", p[i]);
+    else
+      fputc(p[i], f);
+  }
+  fputc(json ? '"' : '\'', f);
+}
+
+static void hyppo_print_json(FILE *f, const struct hyppo_state *s)
+{
+  fprintf(f, "{\"time_ms\":%lld", s->time_ms);
+  for (int i = 0; i < HYPPO_SECTION_COUNT; i++) {
+    const struct hyppo_section *sec = &hyppo_sections[i];
+    if (sec->name)
+      fprintf(f, ",\"%s\":%s", sec->name, sec->count > 1 ? "[" : "");
+    for (int r = 0; r < sec->count; r++) {
+      if (sec->name)
+        fprintf(f, "%s{", r ? "," : "");
+      for (const struct hyppo_field *field = sec->fields; field->name; field++) {
+        fprintf(f, "%s\"%s\":", sec->name && field == sec->fields ? "" : ",", field->name);
+        hyppo_print_value(f, &s->data[sec->offset + r * sec->stride + field->offset], field, 1);
+      }
+      if (sec->name)
+        fputc('}', f);
+    }
+    if (sec->name && sec->count > 1)
+      fputc(']', f);
+  }
+  fprintf(f, "}\n");
+}
+
+int hyppo_state_print(FILE *f, const struct hyppo_state *s, const struct hyppo_state *prev, int json)
+{
+  int printed = 0;
+  if (!prev && !json)
+    fprintf(f, "HYPPO status:\n");
+  for (int i = 0; i < HYPPO_SECTION_COUNT; i++) {
+    const struct hyppo_section *sec = &hyppo_sections[i];
+    for (int r = 0; r < sec->count; r++) {
+      if (!prev && !json && sec->name) {
+        if (sec->count > 1)
+          fprintf(f, "%s #%d:\n", sec->label, r);
+        else
+          fprintf(f, "%s:\n", sec->label);
+      }
+      for (const struct hyppo_field *field = sec->fields; field->name; field++) {
+        int offset = sec->offset + r * sec->stride + field->offset;
+        if (prev && !memcmp(&s->data[offset], &prev->data[offset], hyppo_field_len(field)))
+          continue;
+        printed++;
+        if (json)
+          continue;
+        if (prev) {
+          // One line per change, named as in the JSON
+          fprintf(f, "%lld ", s->time_ms);
+          if (sec->name && sec->count > 1)
+            fprintf(f, "%s[%d].", sec->name, r);
+          else if (sec->name)
+            fprintf(f, "%s.", sec->name);
+          fprintf(f, "%s = ", field->name);
+        }
+        else
+          fprintf(f, "%s%s = ", sec->name ? "  " : "", field->label);
+        hyppo_print_value(f, &s->data[offset], field, 0);
+        fputc('\n', f);
+      }
+    }
+  }
+  // JSON is always the whole state, but only when some of it has changed
+  if (json && printed)
+    hyppo_print_json(f, s);
+  return printed;
+}
+
+int hyppo_state_watch(int interval_ms, int json)
+{
+  struct hyppo_state s[2];
+  int cur = 0;
+  if (hyppo_state_fetch(&s[cur])) {
+    log_error("could not read the hypervisor state");
+    return -1;
+  }
+  hyppo_state_print(stdout, &s[cur], NULL, json);
+  fflush(stdout);
+
+  while (1) {
+    long long wait = s[cur].time_ms + interval_ms - (long long)gettime_ms();
+    if (wait > 0)
+      do_usleep(wait * 1000);
+    cur ^= 1;
+    if (hyppo_state_fetch(&s[cur])) {
+      log_error("could not read the hypervisor state");
+      return -1;
+    }
+    if (hyppo_state_print(stdout, &s[cur], &s[cur ^ 1], json))
+      fflush(stdout);
+  }
+}
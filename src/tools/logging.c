@@ -11,6 +11,7 @@ static FILE *log_file = NULL;
 static unsigned char log_level = LOG_NOTE, log_fallback = 1;
 #define LOG_TEMP_MESSAGE_MAX 1023
 static char log_temp_message[LOG_TEMP_MESSAGE_MAX + 1] = "";
+static char log_prefix[64] = "";
 
 static char *log_level_name[] = { "CRIT", "ERRO", "WARN", "NOTE", "INFO", "DEBG" };
 static char *log_level_name_low[] = { "crit", "erro", "warn", "note", "info", "debu" };
@@ -54,6 +55,16 @@ void log_setup(FILE *outfile, const int level)
   log_fallback = 0;
 }
 
+/*
+ * log_set_prefix(prefix)
+ *
+ * puts [prefix] in front of every message, or nothing if prefix is NULL
+ */
+void log_set_prefix(const char *prefix)
+{
+  snprintf(log_prefix, sizeof(log_prefix), "%s", prefix ? prefix : "");
+}
+
 /*
  * log_raiselevel(level)
  *
@@ -113,6 +124,8 @@ void log_format(const int level, const char *message, va_list args)
 #else
   int pos = snprintf(outstring, 1023, "%s.%03ldZ %s ", date, currentTime.tv_usec / 1000, log_level_name[level]);
 #endif
+  if (log_prefix[0])
+    pos += snprintf(outstring + pos, 1023 - pos, "[%s] ", log_prefix);
   int pos2 = vsnprintf(outstring + pos, 1023 - pos, message, args);
   if (outstring[strlen(outstring) - 1] != '\n') {
     outstring[pos + pos2] = '\n';
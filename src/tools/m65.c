@@ -46,18 +46,24 @@
 #include <inttypes.h>
 #include <pthread.h>
 #include <libusb.h>
+#include <zlib.h>
 
 #ifndef WINDOWS
 #include <glob.h>
 #include <sys/ioctl.h>
+#include <sys/wait.h>
 #else
 #include <windows.h>
+#include <process.h>
 #endif
 
 #include <m65common.h>
 #include <logging.h>
 #include <screen_shot.h>
 #include <fpgajtag.h>
+#include <vf011.h>
+#include <snapshot.h>
+#include <hyppo_state.h>
 
 #define UT_TIMEOUT 10
 #define UT_RES_TIMEOUT 127
@@ -105,10 +111,11 @@ char *load_binary = NULL;
 int viciv_mode_report(unsigned char *viciv_regs);
 
 void do_exit(int retval);
+int check_file_access(char *file, char *purpose);
 
 extern const char *version_string;
 
-#define MAX_CMD_OPTS 50
+#define MAX_CMD_OPTS 64
 int cmd_count = 0, cmd_log_start = -1, cmd_log_end = -1;
 char *cmd_desc[MAX_CMD_OPTS];
 char *cmd_arg[MAX_CMD_OPTS];
@@ -132,7 +139,8 @@ char boundary_bsdl[1024] = "";
 char jtag_sensitivity[1024] = "";
 
 int hyppo_report = 0;
-unsigned char hyppo_buffer[1024];
+int hyppo_json = 0;
+int hyppo_watch_ms = 0;
 
 int counter = 0;
 
@@ -146,16 +154,16 @@ int comma_eight_comma_one = 0;
 int ethernet_video = 0;
 int ethernet_cpulog = 0;
 int virtual_f011 = 0;
-char *d81file = NULL;
+int vf011_drive1 = 0;
 char *filename = NULL;
 char *romfile = NULL;
 char *logfile = NULL;
 char *unittest_logfile = NULL;
+char *unittest_targets = NULL;
 char *flashmenufile = NULL;
 char *charromfile = NULL;
 char *colourramfile = NULL;
 FILE *f = NULL;
-FILE *fd81 = NULL;
 char *search_path = ".";
 char *bitstream = NULL;
 char *vivado_bat = NULL;
@@ -171,6 +179,9 @@ int zap = 0;
 int wait_for_bitstream = 0;
 int memsave_start = -1, memsave_end = -1;
 char *memsave_filename = NULL;
+int memsave_resume = 0;
+char *snapsave_filename = NULL;
+char *snaprestore_filename = NULL;
 
 int hypervisor_paused = 0;
 
@@ -335,7 +346,9 @@ void init_cmd_options(void)
                   "Try to autodiscover device and exit. "
                   "NOTE: m65 always tries to autodiscover the device if needed. This option is just for debugging.");
   CMD_OPTION("device",    1, 0,         'l', "port",  "Name of serial <port> to use, e.g., "DEVICENAME".");
-  CMD_OPTION("jtagser",   1, 0,         'f', "serial","Select which FPGA to reconfigure by specifying JTAG <serial>.");
+  CMD_OPTION("jtagser",   1, 0,         'f', "serial","Select which FPGA to reconfigure by specifying JTAG <serial>. "
+                  "A comma separated list of serials, each optionally followed by =<bitstream>, or 'all', "
+                  "loads the bitstreams into all of those boards at the same time, and then quits.");
   CMD_OPTION("speed",     1, 0,         's', "230400|1000000|1500000|2000000|4000000",
                   "Speed of serial port in <bits per second> (defaults to 2000000). This needs to match the speed your bitstream uses!");
   CMD_OPTION("usedk",     0, 0,         'K', "",      "Use DK backend for libUSB, if available.");
@@ -344,6 +357,7 @@ void init_cmd_options(void)
   CMD_OPTION("bit",       1, 0,         'b', "file",  "name of a FPGA bitstream <file> to load.");
   CMD_OPTION("bitonly",   1, 0,         'q', "file",  "name of a FPGA bitstream <file> to load and then directly quit. Use this for cores other than MEGA65.");
   CMD_OPTION("vivadopath",1, 0,         'v', "",      "The location of the Vivado executable to use for -b on Windows.");
+  CMD_OPTION("bitverify", 0, &fpgajtag_verify, 1, "", "Check the FPGA's CRC status after loading a bitstream with -b.");
 
   CMD_OPTION("reset",     0, 0,         'F', "",      "Force reset on start.");
   CMD_OPTION("halt",      0, 0,         'H', "",      "Halt CPU after loading ROMs and program.");
@@ -353,6 +367,9 @@ void init_cmd_options(void)
   CMD_OPTION("break",     1, 0,         'B', "addr",  "set a breakpoint at <addr>ess (hex) on synchronising, and then immediately exit.");
 
   CMD_OPTION("hyppostatus", 0, 0,       'X', "",      "Show a report of current Hypervisor status.");
+  CMD_OPTION("json",      0, &hyppo_json, 1, "",      "with -X, show the Hypervisor status as JSON.");
+  CMD_OPTION("watch",     1, 0,         0x85, "ms",   "with -X, keep reading the Hypervisor status every <ms> "
+                  "milliseconds, and show what changes (or with --json, each new status) until interrupted.");
   CMD_OPTION("inject",    1, 0,         '@', "file@addr", "Load a binary <file> at <addr>ess (hex).");
   CMD_OPTION("c64mode",   0, 0,         '4', "",      "Switch to C64 mode.");
   CMD_OPTION("volume",    1, 0,         'A', "x[-y]=p", "Set audio coefficient(s) <x> (and optionally up to <y>) to <p> percent of maximum volume.");
@@ -360,10 +377,16 @@ void init_cmd_options(void)
   CMD_OPTION("pal",       0, 0,         'p', "",      "switch to PAL video mode.");
   CMD_OPTION("ntsc",      0, 0,         'n', "",      "switch to NTSC video mode.");
 
-  CMD_OPTION("virtuald81",1, 0,         'd', "d81",   "enable virtual D81 access on local <d81> image.");
+  CMD_OPTION("virtuald81",1, 0,         'd', "d81",   "enable virtual D81 access on local <d81> image. A comma separated list "
+                  "(or several -d) loads several images: the first goes in drive 0, the second in drive 1, and "
+                  "any of them can be swapped in while running.");
 
   CMD_OPTION("unittest",  2, 0,         'u', "timeout", "run program in unit test mode (<timeout> in seconds, defaults to 10).");
   CMD_OPTION("utlog",     1, 0,         'w', "file",  "append unit test results to <file>.");
+  CMD_OPTION("uttargets", 1, 0,         0x82, "ports", "run all of the programs given as unit tests, spread over the "
+                  "comma separated list of serial <ports> (or tcp# Xemu endpoints), with the results merged into the "
+                  "-w log. The speed, log level, ROM and mode options (-s, -k, -R, -C, -c, -U, -N, -p, -n, -4, -1) "
+                  "are passed on to each test.");
 
   CMD_OPTION("screenshot", 2, 0,        'S', "file",
                   "show text rendering of MEGA65 screen, optionally save PNG screenshot to <file>. "
@@ -376,7 +399,9 @@ void init_cmd_options(void)
   CMD_OPTION("flashmenu", 1, 0,         'U', "file",  "Flash menu <file> to preload at $50000-$57FFF.");
   CMD_OPTION("basicrom",  1, 0,         'R', "file",  "BASIC ROM <file> to preload at $20000-$3FFFF.");
   CMD_OPTION("charrom",   1, 0,         'C', "file",  "Character ROM <file> to preload at $FF7E000.");
-  CMD_OPTION("colourrom", 1, 0,         'c', "file",  "Colour RAM <file> to preload at $FF80000.");
+  CMD_OPTION("colourrom", 1, 0,         'c', "file",  "Colour RAM <file> to preload at $FF80000. Only the "
+                  "pages that differ are sent with -U, -R, -C and -c: to find them, the running program is stopped "
+                  "and a checksum routine is run at $0C00 (what it overwrites, and the CPU speed, are put back).");
 
   CMD_OPTION("vtype",     1, 0,         't', "-|text",
                   "Type <text> via keyboard virtualisation.\nThe following escape sequences are supported:\n"
@@ -394,6 +419,13 @@ void init_cmd_options(void)
   CMD_OPTION("memsave",   1, 0,         0x81, "[addr:addr;]filename", "saves memory range addr:addr (hex) to filename. "
                   "If addr range is omitted, save current basic memory. "
                   "Only BASIC save without addr range will add load addr in front of data!");
+  CMD_OPTION("resume",    0, &memsave_resume, 1, "",   "resume an interrupted --memsave of the same range, keeping the "
+                  "blocks already saved that still match their checksums.");
+  CMD_OPTION("snapsave",  1, 0,         0x83, "file", "save a snapshot of chip RAM, colour RAM, the main I/O registers "
+                  "and the CPU registers to <file>.");
+  CMD_OPTION("snaprestore", 1, 0,       0x84, "file", "restore a snapshot saved with --snapsave, only sending the memory "
+                  "pages that have changed since. Use instead of -F to reset the machine quickly between tests "
+                  "(including those run by --uttargets).");
 
   CMD_OPTION("boundaryscan", 1, 0,      'J', "xdc,bsdl[,sens[,log]]",
                   "Do JTAG boundary scan of attached FPGA, using the provided <xdc> and <bsdl> files. "
@@ -406,6 +438,18 @@ void init_cmd_options(void)
   // clang-format on
 }
 
+/*
+  Which drive a request is for.  The request itself only gives the track,
+  sector and side, so when drive 1 is virtualised too, the drive select
+  bits of the F011 control register are read (with the CPU stopped).
+*/
+int vf011_request_drive(void)
+{
+  if (!vf011_drive1)
+    return 0;
+  return mega65_peek(0xffd3080) & 0x07;
+}
+
 int virtual_f011_read(int device, int track, int sector, int side)
 {
 
@@ -416,62 +460,27 @@ int virtual_f011_read(int device, int track, int sector, int side)
   if (!vf011_first_read_time)
     vf011_first_read_time = start - 1;
 
-#if 0
-#ifdef WINDOWS
-  fprintf(stderr,"T+%I64d ms : Servicing hypervisor request for F011 FDC sector read.\n",
-	  gettime_ms()-start);
-#else
-  fprintf(stderr,"T+%lld ms : Servicing hypervisor request for F011 FDC sector read.\n",
-	  gettime_ms()-start);
-#endif
-#endif
-
-  if (fd81 == NULL) {
+  // The CPU is stopped once for the whole request, instead of once for
+  // pushing the sector and again for signalling that it is done
+  real_stop_cpu();
 
-    fd81 = fopen(d81file, "rb+");
-    if (!fd81) {
-      log_crit("could not open D81 file: '%s'", d81file);
-      exit(-1);
-    }
+  device = vf011_request_drive();
+  struct vf011_image *img = vf011_drive_image(device);
+  unsigned char *buf = img ? vf011_sector(img, track, sector, side, 0) : NULL;
+  if (!buf) {
+    log_warn("drive %d has no track %d sector %d side %d", device, track, sector, side);
   }
-
-  // Only actually load new sector contents if we don't think it is a duplicate request
-  if ( // ((gettime_ms()-last_virtual_time)>100)
-       // ||
-      (last_virtual_writep) || (last_virtual_track != track) || (last_virtual_sector != sector)
-      || (last_virtual_side != side)) {
+  else {
     last_virtual_time = gettime_ms();
     last_virtual_track = track;
     last_virtual_sector = sector;
     last_virtual_side = side;
 
-    /* read the block */
-    unsigned char buf[512];
-    int b = -1;
-    int physical_sector = (side == 0 ? sector - 1 : sector + 9);
-
-    int result = fseek(fd81, (track * 20 + physical_sector) * 512, SEEK_SET);
-
-    if (result) {
-      log_crit("error finding D81 sector %d @ 0x%x", result, (track * 20 + physical_sector) * 512);
-      exit(-2);
-    }
-    else {
-      b = fread(buf, 1, 512, fd81);
-      //	fprintf(stderr, " bytes read: %d @ 0x%x\n", b,(track*20+physical_sector)*512);
-
-      if (b == 512) {
-
-        //      dump_bytes(0,"The sector",buf,512);
-
-        /* send block to m65 memory */
-        push_ram(READ_SECTOR_BUFFER_ADDRESS, 0x200, buf);
-      }
-    }
+    /* send block to m65 memory */
+    push_ram(READ_SECTOR_BUFFER_ADDRESS, 0x200, buf);
   }
 
   /* signal done/result */
-  real_stop_cpu();
   mega65_poke(0xffd3086, side & 0x7f);
   start_cpu();
 
@@ -494,42 +503,25 @@ int virtual_f011_write(int device, int track, int sector, int side)
 
   log_debug("servicing hypervisor request for F011 FDC sector write.");
 
-  if (fd81 == NULL) {
-
-    fd81 = fopen(d81file, "wb+");
-    if (!fd81) {
-      log_crit("could not open D81 file: '%s'", d81file);
-      exit(-1);
-    }
-  }
-
   last_virtual_time = gettime_ms();
   last_virtual_track = track;
   last_virtual_sector = sector;
   last_virtual_side = side;
 
-  unsigned char buf[512];
-  fetch_ram(WRITE_SECTOR_BUFFER_ADDRESS, 512, buf);
-
-  int physical_sector = (side == 0 ? sector - 1 : sector + 9);
-
-  int result = fseek(fd81, (track * 20 + physical_sector) * 512, SEEK_SET);
+  real_stop_cpu();
 
-  if (result) {
-    log_crit("failed to find D81 sector %d @ 0x%x", result, (track * 20 + physical_sector) * 512);
-    exit(-2);
+  device = vf011_request_drive();
+  struct vf011_image *img = vf011_drive_image(device);
+  unsigned char *buf = img ? vf011_sector(img, track, sector, side, 1) : NULL;
+  if (!buf) {
+    log_warn("drive %d has no disk, so the write to track %d sector %d side %d is lost", device, track, sector, side);
   }
   else {
-    int b = fwrite(buf, 1, 512, fd81);
-    //	log_debeg("bytes read: %d @ 0x%x", b,(track*20+physical_sector)*512);
-
-    if (b != 512) {
-      log_warn("short write of %d bytes", b);
-    }
+    fetch_ram(WRITE_SECTOR_BUFFER_ADDRESS, 512, buf);
+    vf011_sector_written(img, buf);
   }
 
   /* signal done/result */
-  real_stop_cpu();
   mega65_poke(0xffd3086, side & 0x0f);
   start_cpu();
 
@@ -540,23 +532,122 @@ int virtual_f011_write(int device, int track, int sector, int side)
   return 0;
 }
 
-uint32_t uint32_from_buf(unsigned char *b, int ofs)
+#ifndef WINDOWS
+/*
+  Control commands for the virtualised F011, one per line on stdin, e.g.,
+  from a test harness.  stdin is read into our own buffer rather than with
+  stdio, as select() can't see lines that stdio has already buffered, and
+  several commands can arrive in a single write.  Returns 1 if the commands
+  asked to quit.
+*/
+char vf011_command_buf[1100];
+int vf011_command_len = 0;
+
+int vf011_stdin_commands(int *stdin_open)
 {
-  uint32_t v = 0;
-  v = b[ofs + 0];
-  v |= (b[ofs + 1] << 8);
-  v |= (b[ofs + 2] << 16);
-  v |= (b[ofs + 3] << 24);
-  return v;
+  int n = read(STDIN_FILENO, &vf011_command_buf[vf011_command_len], sizeof(vf011_command_buf) - 1 - vf011_command_len);
+  if (n < 1)
+    *stdin_open = 0;
+  else
+    vf011_command_len += n;
+  vf011_command_buf[vf011_command_len] = 0;
+
+  char *line = vf011_command_buf, *eol;
+  while ((eol = strchr(line, '\n'))) {
+    *eol = 0;
+    if (vf011_command(line))
+      return 1;
+    line = eol + 1;
+  }
+  vf011_command_len -= line - vf011_command_buf;
+  memmove(vf011_command_buf, line, vf011_command_len + 1);
+
+  // A line too long for the buffer, or the last one at the end of input,
+  // is taken as it is
+  if (vf011_command_len && (!*stdin_open || vf011_command_len == sizeof(vf011_command_buf) - 1)) {
+    vf011_command_len = 0;
+    return vf011_command(vf011_command_buf);
+  }
+  return 0;
+}
+#endif
+
+/*
+  Memory dumps are fetched in blocks, each of which is written to a
+  temporary file as soon as it arrives, along with its CRC32 in a sums file.
+  The dump is only renamed to the requested name once it is complete, so a
+  failed dump never leaves a truncated file behind under that name.  With
+  --resume, the blocks of an earlier failed dump whose data still matches its
+  CRC are kept, and only the rest are fetched.
+*/
+#define MEMSAVE_BLOCK 0x10000
+#define MEMSAVE_RETRIES 3
+#define MEMSAVE_MAGIC "M65MSAV1"
+
+struct memsave_header {
+  char magic[8];
+  uint32_t start, end, block_size;
+};
+
+struct memsave_sum {
+  uint32_t block;
+  uint32_t crc;
+};
+
+/*
+  Check which blocks of an earlier dump of the same range can be kept.
+  Returns the number of them, or -1 if there is nothing to resume.
+*/
+int memsave_load_sums(const char *part_name, const char *sums_name, struct memsave_header *header, int header_len,
+    unsigned char *done, int blocks)
+{
+  FILE *s = fopen(sums_name, "rb");
+  if (!s)
+    return -1;
+  struct memsave_header old;
+  if (fread(&old, sizeof(old), 1, s) != 1 || memcmp(&old, header, sizeof(old))) {
+    log_warn("'%s' is for a different memory range, starting again", sums_name);
+    fclose(s);
+    return -1;
+  }
+  FILE *p = fopen(part_name, "rb");
+  if (!p) {
+    fclose(s);
+    return -1;
+  }
+
+  unsigned char *data = malloc(MEMSAVE_BLOCK);
+  if (!data) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  int kept = 0;
+  struct memsave_sum sum;
+  while (fread(&sum, sizeof(sum), 1, s) == 1) {
+    if (sum.block >= blocks || done[sum.block])
+      continue;
+    uint32_t len = header->end - header->start - sum.block * MEMSAVE_BLOCK;
+    if (len > MEMSAVE_BLOCK)
+      len = MEMSAVE_BLOCK;
+    if (fseek(p, header_len + (long)sum.block * MEMSAVE_BLOCK, SEEK_SET) || fread(data, len, 1, p) != 1
+        || crc32(0, data, len) != sum.crc) {
+      log_debug("memory_save: block %d does not match its checksum", sum.block);
+      continue;
+    }
+    done[sum.block] = 1;
+    kept++;
+  }
+  free(data);
+  fclose(p);
+  fclose(s);
+  return kept;
 }
 
 int memory_save(const int start, const int end, const char *filename)
 {
   int memsave_start_addr = -1;
   int memsave_end_addr = -1;
-  int cur_addr, count;
-  unsigned char membuf[4096], is_basic = 0;
-  FILE *o;
+  unsigned char membuf[4], is_basic = 0;
 
   if (start == -1 && end == -1) {
     log_debug("memory_save: no memory range given, detecting BASIC program");
@@ -588,12 +679,53 @@ int memory_save(const int start, const int end, const char *filename)
     }
   }
 
-  o = fopen(filename, "w");
-  if (!o) {
-    log_error("could not open memory save file '%s'", filename);
+  uint32_t total = memsave_end_addr - memsave_start_addr;
+  int blocks = (total + MEMSAVE_BLOCK - 1) / MEMSAVE_BLOCK;
+  int header_len = is_basic ? 2 : 0;
+  unsigned char *done = calloc(blocks + 1, 1);
+  unsigned char *data = malloc(MEMSAVE_BLOCK);
+  if (!done || !data) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+
+  char part_name[1024], sums_name[1024];
+  snprintf(part_name, sizeof(part_name), "%s.part", filename);
+  snprintf(sums_name, sizeof(sums_name), "%s.part.sums", filename);
+
+  struct memsave_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MEMSAVE_MAGIC, 8);
+  header.start = memsave_start_addr;
+  header.end = memsave_end_addr;
+  header.block_size = MEMSAVE_BLOCK;
+
+  FILE *o = NULL, *sums = NULL;
+  int kept = memsave_resume ? memsave_load_sums(part_name, sums_name, &header, header_len, done, blocks) : -1;
+  if (kept >= 0) {
+    log_note("resuming memory dump, %d of %d blocks already saved", kept, blocks);
+    o = fopen(part_name, "rb+");
+    sums = fopen(sums_name, "ab");
+  }
+  else {
+    if (memsave_resume)
+      log_note("no earlier dump of this range to resume");
+    o = fopen(part_name, "wb");
+    sums = fopen(sums_name, "wb");
+    if (sums)
+      fwrite(&header, sizeof(header), 1, sums);
+  }
+  if (!o || !sums) {
+    log_error("could not open memory save file '%s'", o ? sums_name : part_name);
+    if (o)
+      fclose(o);
+    if (sums)
+      fclose(sums);
+    free(done);
+    free(data);
     return -1;
   }
-  log_debug("memory_save: opened '%s' for writing", filename);
+  log_debug("memory_save: opened '%s' for writing", part_name);
 
   if (is_basic) {
     membuf[0] = memsave_start_addr & 0xff;
@@ -602,18 +734,70 @@ int memory_save(const int start, const int end, const char *filename)
   }
 
   log_debug("memory_save: saving memory $%08x-%08x", memsave_start_addr, memsave_end_addr);
-  cur_addr = memsave_start_addr;
-  while (cur_addr < memsave_end_addr) {
-    count = memsave_end_addr - cur_addr;
-    if (count > 4096)
-      count = 4096;
-    log_debug("memory_save: fetching $%08x %d", cur_addr, count);
-    fetch_ram(cur_addr, count, membuf);
-    fwrite(membuf, count, 1, o);
-    cur_addr += count;
-  }
-
-  fclose(o);
+  long long start_time = gettime_ms(), last_report = start_time;
+  uint32_t fetched = 0;
+  int retval = 0;
+  for (int b = 0; b < blocks && !retval; b++) {
+    if (done[b])
+      continue;
+    uint32_t addr = memsave_start_addr + b * MEMSAVE_BLOCK;
+    uint32_t count = memsave_end_addr - addr;
+    if (count > MEMSAVE_BLOCK)
+      count = MEMSAVE_BLOCK;
+
+    log_debug("memory_save: fetching $%08x %d", addr, count);
+    int tries = 0;
+    while (fetch_ram_checked(addr, count, data)) {
+      if (++tries == MEMSAVE_RETRIES) {
+        retval = -1;
+        break;
+      }
+      log_warn("fetching $%08x failed, retrying", addr);
+      purge_input();
+    }
+    if (retval)
+      break;
+
+    struct memsave_sum sum = { b, crc32(0, data, count) };
+    if (fseek(o, header_len + (long)b * MEMSAVE_BLOCK, SEEK_SET) || fwrite(data, count, 1, o) != 1
+        || fwrite(&sum, sizeof(sum), 1, sums) != 1) {
+      log_error("could not write to '%s': %s", part_name, strerror(errno));
+      retval = -1;
+      break;
+    }
+    fflush(sums);
+    fetched += count;
+
+    if (gettime_ms() - last_report >= 1000) {
+      last_report = gettime_ms();
+      log_info("saved $%08x, %d%% @ %.1fKB/sec", addr + count, (int)((b + 1) * 100LL / blocks),
+          fetched * 1.0 / (last_report - start_time));
+    }
+  }
+  free(done);
+  free(data);
+
+  fclose(sums);
+  fflush(o);
+#ifndef WINDOWS
+  fsync(fileno(o));
+#endif
+  if (fclose(o))
+    retval = -1;
+  if (retval) {
+    log_error("memory dump failed, the blocks saved so far are in '%s' (use --resume to continue)", part_name);
+    return -1;
+  }
+
+#ifdef WINDOWS
+  // rename() does not replace an existing file on Windows
+  remove(filename);
+#endif
+  if (rename(part_name, filename)) {
+    log_error("could not rename '%s' to '%s': %s", part_name, filename, strerror(errno));
+    return -1;
+  }
+  remove(sums_name);
   log_debug("memory_save: closed output file");
 
   log_note("saved memory dump $%08x-$%08x to '%s'", memsave_start_addr, memsave_end_addr, filename);
@@ -621,96 +805,112 @@ int memory_save(const int start, const int end, const char *filename)
   return 0;
 }
 
-void show_hyppo_report(void)
+/*
+  Files preloaded with -R, -C, -c and -U.  The MEGA65 checksums the pages
+  they go to first, and only the pages that differ are sent.  This stops
+  the running program and runs the snapshot checksum helper at $0C00.
+*/
+struct preload {
+  char *filename;
+  uint32_t addr;
+  unsigned char *data;
+  int size;
+  unsigned char *dirty; // one flag per page
+};
+
+void preload_read(struct preload *p)
+{
+  FILE *f = fopen(p->filename, "rb");
+  if (!f) {
+    log_crit("could not open file '%s'", p->filename);
+    exit(-2);
+  }
+  fseek(f, 0, SEEK_END);
+  p->size = ftell(f);
+  rewind(f);
+  p->data = malloc(p->size + 1);
+  p->dirty = malloc(p->size / 256 + 1);
+  if (!p->data || !p->dirty) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  if (fread(p->data, 1, p->size, f) != (size_t)p->size) {
+    log_crit("could not read file '%s'", p->filename);
+    exit(-2);
+  }
+  fclose(f);
+  memset(p->dirty, 1, p->size / 256 + 1);
+}
+
+void preload_check(struct preload *preloads, int count)
+{
+  uint32_t addr[count];
+  int pages[count], total = 0;
+  for (int i = 0; i < count; i++) {
+    addr[i] = preloads[i].addr;
+    // A partial page at the end is always sent
+    pages[i] = preloads[i].filename ? preloads[i].size / 256 : 0;
+    total += pages[i];
+  }
+  if (!total)
+    return;
+
+  unsigned char *sums = malloc(total * 4);
+  if (!sums) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  long long start = gettime_ms();
+  if (snapshot_checksum_ranges(count, addr, pages, sums)) {
+    log_info("could not checksum memory on the MEGA65, loading all files");
+    free(sums);
+    return;
+  }
+  log_debug("checksummed %d pages in %lldms", total, gettime_ms() - start);
+
+  unsigned char *sum = sums;
+  for (int i = 0; i < count; i++) {
+    struct preload *p = &preloads[i];
+    int same = 0;
+    for (int n = 0; n < pages[i]; n++, sum += 4) {
+      unsigned char mine[4];
+      snapshot_checksum(&p->data[n * 256], mine);
+      p->dirty[n] = memcmp(mine, sum, 4) != 0;
+      same += !p->dirty[n];
+    }
+    if (pages[i])
+      log_info("'%s': %d of %d pages already loaded", p->filename, same, pages[i]);
+  }
+  free(sums);
+}
+
+// Send the pages that differ, back to back
+void preload_push(struct preload *p)
 {
-  // Buffer starats at $BC00 in HYPPO
-  // $BC00 - $BCFF = DOS work area
-  // $BD00 - $BDFF = Process Descriptor
-  // $BE00 - $BEFF = Stack
-  // $BF00 - $BFFF = ZP
-
-  unsigned char syspart_buffer[0x40];
-  unsigned char disktable_buffer[0x100];
-  unsigned char pd_buffer[0x0100];
-
-  fetch_ram(0xfffbb00, 0x100, disktable_buffer);
-  fetch_ram(0xfffbbc0, 0x40, syspart_buffer);
-  fetch_ram(0xfffbc00, 0x400, hyppo_buffer);
-  fetch_ram(0xfffbd00, 0x100, pd_buffer);
-  printf("HYPPO status:\n");
-
-  printf("Disk count = $%02x\n", hyppo_buffer[0x001]);
-  printf("Default Disk = $%02x\n", hyppo_buffer[0x002]);
-  printf("Current Disk = $%02x\n", hyppo_buffer[0x003]);
-  printf("Disk Table offset = $%02x\n", hyppo_buffer[0x004]);
-  printf("Cluster of current directory = $%02x%02x%02x%02x\n", hyppo_buffer[0x008], hyppo_buffer[0x007], hyppo_buffer[0x006],
-      hyppo_buffer[0x005]);
-  printf("opendir_cluster = $%02x%02x%02x%02x\n", hyppo_buffer[0x00c], hyppo_buffer[0x00b], hyppo_buffer[0x00a],
-      hyppo_buffer[0x009]);
-  printf("opendir_sector = $%02x\n", hyppo_buffer[0x00d]);
-  printf("opendir_entry = $%02x\n", hyppo_buffer[0x00e]);
-
-  // Dirent struct follows:
-  // 64 bytes for file name
-  printf("dirent structure:\n");
-  printf("  Filename = '%s'\n", &hyppo_buffer[0x00f]);
-  printf("  Filename len = $%02x\n", hyppo_buffer[0x04f]);
-  printf("  Short name = '%s'\n", &hyppo_buffer[0x050]);
-  printf("  Start cluster = $%02x%02x%02x%02x\n", hyppo_buffer[0x060], hyppo_buffer[0x05f], hyppo_buffer[0x05e],
-      hyppo_buffer[0x05d]);
-  printf("  File length = $%02x%02x%02x%02x\n", hyppo_buffer[0x064], hyppo_buffer[0x063], hyppo_buffer[0x062],
-      hyppo_buffer[0x061]);
-  printf("  ATTRIB byte = $%02x\n", hyppo_buffer[0x065]);
-  printf("Requested filename len = $%02x\n", hyppo_buffer[0x66]);
-  printf("Requested filename = '%s'\n", &hyppo_buffer[0x67]);
-  printf("sectorsread = $%02x%02x\n", hyppo_buffer[0xaa], hyppo_buffer[0xa9]);
-  printf("bytes_remaining = $%02x%02x%02x%02x\n", hyppo_buffer[0xae], hyppo_buffer[0x0ad], hyppo_buffer[0xac],
-      hyppo_buffer[0xab]);
-  printf("current sector = $%02x%02x%02x%02x, ", hyppo_buffer[0xb2], hyppo_buffer[0x0b1], hyppo_buffer[0xb0],
-      hyppo_buffer[0xaf]);
-  printf("current cluster = $%02x%02x%02x%02x\n", hyppo_buffer[0xb6], hyppo_buffer[0x0b5], hyppo_buffer[0xb4],
-      hyppo_buffer[0xb3]);
-  printf("current sector in cluster = $%02x\n", hyppo_buffer[0xb7]);
-
-  for (int fd = 0; fd < 4; fd++) {
-    int fd_o = 0xb8 + fd * 0x10;
-    printf("File descriptor #%d:\n", fd);
-    printf("  disk ID = $%02x, ", hyppo_buffer[fd_o + 0]);
-    printf("  mode = $%02x\n", hyppo_buffer[fd_o + 1]);
-    printf("  start cluster = $%02x%02x%02x%02x, ", hyppo_buffer[fd_o + 5], hyppo_buffer[fd_o + 4], hyppo_buffer[fd_o + 3],
-        hyppo_buffer[fd_o + 2]);
-    printf("  current cluster = $%02x%02x%02x%02x\n", hyppo_buffer[fd_o + 9], hyppo_buffer[fd_o + 8], hyppo_buffer[fd_o + 7],
-        hyppo_buffer[fd_o + 6]);
-    printf("  sector in cluster = $%02x, ", hyppo_buffer[fd_o + 10]);
-    printf("  offset in sector = $%02x%02x\n", hyppo_buffer[fd_o + 12], hyppo_buffer[fd_o + 11]);
-    //    printf("  file offset = $%02x%02x (x 256 bytes? not used?)\n",
-    //	   hyppo_buffer[fd_o+14],hyppo_buffer[fd_o+13]);
-  }
-
-  printf("Disk Table:\n");
-  printf("  Disk# Start     Size       FS FAT_Len   SysLen Rsv RootDir Clusters  CSz #FATs Cluster0\n");
-  for (int disk = 0; disk < 6; disk++) {
-    printf("   #%d   $%08x $%08x  %02x $%08x $%04x  %02x  $%04x   $%08x %02x  %02x    $%08x\n", disk,
-        uint32_from_buf(disktable_buffer, disk * 32 + 0), uint32_from_buf(disktable_buffer, disk * 32 + 4),
-        (int)disktable_buffer[disk * 32 + 8], uint32_from_buf(disktable_buffer, disk * 32 + 9),
-        uint32_from_buf(disktable_buffer, disk * 32 + 0x0d) & 0xffff, (int)disktable_buffer[disk * 32 + 0x0f],
-        uint32_from_buf(disktable_buffer, disk * 32 + 0x10) & 0xffff, uint32_from_buf(disktable_buffer, disk * 32 + 0x12),
-        (int)disktable_buffer[disk * 32 + 0x16], (int)disktable_buffer[disk * 32 + 0x17],
-        uint32_from_buf(disktable_buffer, disk * 32 + 0x18));
-  }
-  printf("Current file descriptor # = $%02x\n", hyppo_buffer[0xf4]);
-  printf("Current file descriptor offset = $%02x\n", hyppo_buffer[0xf5]);
-  printf("Dos error code = $%02x\n", hyppo_buffer[0xf6]);
-  printf("SYSPART error code = $%02x\n", hyppo_buffer[0xf7]);
-  printf("SYSPART present = $%02x\n", hyppo_buffer[0xf8]);
-  printf("SYSPART start = $%02x%02x%02x%02x\n", syspart_buffer[3], syspart_buffer[2], syspart_buffer[1], syspart_buffer[0]);
-
-  printf("\nProcess descriptor:\n");
-  printf("    Process ID: $%02x\n", pd_buffer[0x00]);
-  printf("  Process name: ");
-  for (int i = 0; i < 16; i++)
-    printf("%c", pd_buffer[0x01 + i]);
-  printf("\n");
+  int pages = (p->size + 255) / 256;
+  struct ram_piece *pieces = malloc(sizeof(struct ram_piece) * (pages + 1));
+  if (!pieces) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  int count = 0, bytes = 0;
+  for (int n = 0; n < pages; n++) {
+    if (!p->dirty[n])
+      continue;
+    int run = 1;
+    while (n + run < pages && p->dirty[n + run])
+      run++;
+    pieces[count].address = p->addr + n * 256;
+    pieces[count].buffer = &p->data[n * 256];
+    pieces[count].count = (n + run == pages ? p->size : (n + run) * 256) - n * 256;
+    bytes += pieces[count].count;
+    count++;
+    n += run - 1;
+  }
+  if (count)
+    push_ram_pieces(pieces, count);
+  log_info("file '%s' loaded (%d of %d bytes sent)", p->filename, bytes, p->size);
+  free(pieces);
 }
 
 int type_serial_mode = 0;
@@ -1003,6 +1203,160 @@ void do_type_key(unsigned char key)
   usleep(20000);
 }
 
+/*
+  Typing engine for -t/-T.  Keys that the ROM's keyboard buffer can express
+  are put into the buffer a chunk at a time, waiting each time for the ROM to
+  empty it.  Only keys it can't (e.g., RUN/STOP, which the ROM reads straight
+  from the matrix) are pressed on the virtual keyboard, which needs two
+  keyboard scans per key.
+
+  The buffer has room for 10 keys, but like stuff_keybuffer(), only 9 are
+  used at a time, as filling all 10 gives garbage characters.
+*/
+#define TYPE_CHUNK 9
+#define TYPE_BUFFER_TIMEOUT_MS 3000
+
+unsigned char type_chunk[TYPE_CHUNK];
+int type_chunk_len = 0;
+int type_buffer_addr = 0x277;
+int type_buffer_len_addr = 0xc6;
+// 0 if the keyboard buffer is not being read, so that only the matrix can be used
+int type_use_buffer = 0;
+long long type_start_time;
+int type_chars = 0, type_matrix_chars = 0;
+
+/*
+  PETSCII code that do_type_key(key) would make the ROM put in its keyboard
+  buffer, or 0 if the key has to be typed on the matrix.
+*/
+int type_buffer_code(unsigned char key)
+{
+  if (key >= 'a' && key <= 'z')
+    return key - 0x20;
+  if (key >= 'A' && key <= 'Z')
+    return key + 0x80;
+  if (key >= ' ' && key <= '@')
+    return key;
+  switch (key) {
+  case '[':
+  case ']':
+  case 0x0d: // RETURN
+  case 0x11: // Cursor down
+  case 0x91: // Cursor up
+  case 0x1d: // Cursor right
+  case 0x9d: // Cursor left
+  case 0x13: // HOME
+  case 0x14: // INST/DEL
+    return key;
+  case '}':
+    return 0x5c; // British pound symbol
+  case '_':
+    return 0x5f; // Left arrow
+  case 0xF1:
+    return 0x85;
+  case 0xF3:
+    return 0x86;
+  case 0xF5:
+    return 0x87;
+  case 0xF7:
+    return 0x88;
+  }
+  return 0;
+}
+
+void type_begin(void)
+{
+  type_chunk_len = 0;
+  type_chars = type_matrix_chars = 0;
+  type_start_time = gettime_ms();
+
+  if (!saw_c64_mode && !saw_c65_mode)
+    detect_mode();
+  type_use_buffer = saw_c64_mode || saw_c65_mode;
+  if (saw_c65_mode) {
+    type_buffer_addr = 0x2b0;
+    type_buffer_len_addr = 0xd0;
+  }
+  else {
+    type_buffer_addr = 0x277;
+    type_buffer_len_addr = 0xc6;
+  }
+  if (!type_use_buffer)
+    log_note("not at the BASIC prompt, so typing everything on the keyboard matrix");
+}
+
+/*
+  Wait for the ROM to take everything out of the keyboard buffer.  If it
+  doesn't, the program running is not reading the buffer, so the rest is
+  typed on the matrix.
+*/
+void type_wait_buffer_empty(void)
+{
+  if (!type_use_buffer)
+    return;
+  long long start = gettime_ms();
+  while (mega65_peek(type_buffer_len_addr)) {
+    if (gettime_ms() - start > TYPE_BUFFER_TIMEOUT_MS) {
+      log_warn("keyboard buffer is not being emptied, typing the rest on the keyboard matrix");
+      type_use_buffer = 0;
+      return;
+    }
+    usleep(1000);
+  }
+}
+
+void type_flush(void)
+{
+  char cmd[128];
+
+  if (!type_chunk_len)
+    return;
+  type_wait_buffer_empty();
+  if (!type_use_buffer) {
+    // The buffer stopped being read, so type what is left of the chunk
+    int len = type_chunk_len;
+    type_chunk_len = 0;
+    for (int i = 0; i < len; i++)
+      do_type_key(type_chunk[i]);
+    type_matrix_chars += len;
+    return;
+  }
+
+  // Fill the buffer and set its length in the same write, so the ROM never
+  // sees a partial chunk
+  int n = snprintf(cmd, sizeof(cmd), "s%04x", type_buffer_addr);
+  for (int i = 0; i < type_chunk_len; i++)
+    n += snprintf(cmd + n, sizeof(cmd) - n, " %02x", type_buffer_code(type_chunk[i]));
+  n += snprintf(cmd + n, sizeof(cmd) - n, "\rs%x %d\r", type_buffer_len_addr, type_chunk_len);
+  slow_write(fd, cmd, n);
+  type_chunk_len = 0;
+}
+
+void type_char(unsigned char key)
+{
+  type_chars++;
+  if (type_use_buffer && !type_serial_mode && key != '~' && type_buffer_code(key)) {
+    type_chunk[type_chunk_len++] = key;
+    if (type_chunk_len == TYPE_CHUNK)
+      type_flush();
+    return;
+  }
+  // Keys typed on the matrix have to come after everything in the buffer
+  type_flush();
+  type_wait_buffer_empty();
+  do_type_key(key);
+  type_matrix_chars++;
+}
+
+void type_end(void)
+{
+  type_flush();
+  type_wait_buffer_empty();
+  long long ms = gettime_ms() - type_start_time;
+  log_note("typed %d characters in %.2fs (%.1f chars/sec, %d on the keyboard matrix)", type_chars, ms / 1000.0,
+      ms ? type_chars * 1000.0 / ms : 0.0, type_matrix_chars);
+}
+
 void do_type_text(char *type_text)
 {
   log_note("typing text via virtual keyboard...");
@@ -1027,17 +1381,13 @@ void do_type_text(char *type_text)
         if (!strcmp(line, "."))
           break;
 
+        type_begin();
         for (int i = 0; line[i]; i++)
-          do_type_key(line[i]);
+          type_char(line[i]);
 
         // carriage return at end of line
-        slow_write(fd, "sffd3615 01 7f 7f \n", 19);
-        // Allow time for a keyboard scan interrupt
-        usleep(20000);
-        // release keys
-        slow_write(fd, "sffd3615 7f 7f 7f \n", 19);
-        // Allow time for a keyboard scan interrupt
-        usleep(20000);
+        type_char(0x0d);
+        type_end();
 
         // Display screen updates while typing if requested
         if (screen_shot) {
@@ -1181,11 +1531,13 @@ void do_type_text(char *type_text)
   else {
     int i;
     unsigned char c1;
+    type_begin();
     for (i = 0; type_text[i]; i++) {
       if (type_text[i] == '~') {
         // eos after tilde? break out of loop!
         if (type_text[i + 1] == 0)
           break;
+        c1 = 0;
         // control sequences (remember to UPDATE USAGE!)
         switch (type_text[i + 1]) {
         case 'C':
@@ -1225,24 +1577,25 @@ void do_type_text(char *type_text)
           c1 = 0xF7;
           break; // F7
         case 'Z':
-          sleep(1);
         case 'z':
-          sleep(1);
+          // Pauses start once everything before them has been typed
+          type_flush();
+          type_wait_buffer_empty();
+          sleep(type_text[i + 1] == 'Z' ? 2 : 1);
           break;
         }
-        do_type_key(c1);
+        if (c1)
+          type_char(c1);
         i++;
       }
       else
-        do_type_key(type_text[i]);
+        type_char(type_text[i]);
     }
 
     // RETURN at end if requested
-    if (type_text_cr) {
-      slow_write(fd, "sffd3615 01 7f 7f \n", 19);
-      // Allow time for a keyboard scan interrupt
-      usleep(20000);
-    }
+    if (type_text_cr)
+      type_char(0x0d);
+    type_end();
   }
   // Stop pressing keys
   slow_write(fd, "sffd3615 7f 7f 7f \n", 19);
@@ -1264,6 +1617,72 @@ int thread_count = 0;
 pthread_t threads[MAX_THREADS];
 #endif
 
+#define MAX_BOARDS 64
+
+/*
+  Load bitstreams into several boards at once, for --jtagser with a list
+  of serials, or 'all' for every board that matches the bitstream.
+*/
+void program_boards(void)
+{
+  struct fpgajtag_job jobs[MAX_BOARDS];
+  int count = 0;
+
+  if (!strcmp(jtag_serial, "all")) {
+    struct fpgajtag_device devices[MAX_BOARDS];
+    if (!bitstream) {
+      log_crit("--jtagser all needs a bitstream to load");
+      exit(-1);
+    }
+    unsigned int fpga_id = get_bitstream_fpgaid(bitstream);
+    int found = fpgajtag_enumerate(fpga_id, devices, MAX_BOARDS);
+    for (int i = 0; i < found; i++) {
+      memset(&jobs[count], 0, sizeof(struct fpgajtag_job));
+      snprintf(jobs[count].serial, sizeof(jobs[count].serial), "%s", devices[i].serial);
+      jobs[count].bitstream = bitstream;
+      jobs[count].fpga_id = fpga_id;
+      count++;
+    }
+  }
+  else {
+    char *list = strdup(jtag_serial), *saveptr = NULL;
+    for (char *serial = strtok_r(list, ",", &saveptr); serial; serial = strtok_r(NULL, ",", &saveptr)) {
+      char *file = strchr(serial, '=');
+      if (file)
+        *file++ = 0;
+      else
+        file = bitstream;
+      if (!file) {
+        log_crit("no bitstream given for board %s", serial);
+        exit(-1);
+      }
+      check_file_access(file, "bitstream");
+      if (count == MAX_BOARDS) {
+        log_crit("too many boards, at most %d can be loaded at once", MAX_BOARDS);
+        exit(-1);
+      }
+      memset(&jobs[count], 0, sizeof(struct fpgajtag_job));
+      snprintf(jobs[count].serial, sizeof(jobs[count].serial), "%s", serial);
+      jobs[count].bitstream = file;
+      jobs[count].fpga_id = get_bitstream_fpgaid(file);
+      count++;
+    }
+  }
+
+  if (!count) {
+    log_crit("no boards found to load");
+    exit(1);
+  }
+
+  log_note("loading bitstreams into %d board%s", count, count > 1 ? "s" : "");
+  int failed = fpgajtag_program_boards(jobs, count);
+
+  for (int i = 0; i < count; i++)
+    log_note("%-20s %-6s %6.1fs %s", jobs[i].serial, jobs[i].result ? "FAILED" : "ok", jobs[i].seconds, jobs[i].bitstream);
+  log_note("%d of %d boards loaded", count - failed, count);
+  do_exit(failed ? 1 : 0);
+}
+
 void download_bitstream(void)
 {
   int issue, tag;
@@ -1453,7 +1872,10 @@ void load_bitstream(char *bitstream)
   }
   else {
     // No Vivado.bat, so try to use internal fpgajtag implementation.
-    fpgajtag_main(bitstream);
+    if (fpgajtag_main(bitstream)) {
+      log_crit("bitstream failed verification");
+      exit(-1);
+    }
   }
   log_note("Bitstream loaded");
 }
@@ -1533,6 +1955,7 @@ void handle_vf011_requests()
     if (pending_vf011_write)
       virtual_f011_write(pending_vf011_device, pending_vf011_track, pending_vf011_sector, pending_vf011_side);
   }
+  vf011_flush_if_idle();
 }
 
 char *test_states[16] = { "START", " SKIP", " PASS", " FAIL", "ERROR", "C#$05", "C#$06", "C#$07", "C#$08", "C#$09", "C#$0A",
@@ -1737,6 +2160,337 @@ void enterTestMode()
   do_exit(UT_RES_TIMEOUT);
 }
 
+/*
+  Unit test runner: runs a list of test programs on several targets (serial
+  ports or Xemu tcp# endpoints) at once.  Each test is run by a separate m65
+  process on the next free target, which loads it, runs it and reports the
+  results as usual.  The runner forwards their output, prefixed with the
+  target, and appends their results to a single log as each test finishes,
+  followed by the target and how long the test took.
+*/
+struct ut_job {
+  char *test;
+  int target;
+  int result; // fail count, or UT_RES_TIMEOUT
+  double seconds;
+  char log[1024];
+};
+
+struct ut_target {
+  char *port;
+  int job; // running job, or -1
+#ifndef WINDOWS
+  pid_t pid;
+  int out;
+  char line[1024];
+  int line_len;
+  unsigned long long start;
+#endif
+};
+
+#define UT_MAX_ARGS 40
+#define UT_MAX_TARGETS 64
+
+// Arguments for the m65 that runs a test, passing on the options that apply to each test
+static int ut_job_args(char *argv0, struct ut_job *job, struct ut_target *target, char **args, char *timeout)
+{
+  // These only depend on the options, so are the same for every job
+  static char speed[16], level[16];
+  int n = 0;
+  snprintf(timeout, 16, "-u%d", unit_test_timeout);
+  snprintf(speed, sizeof(speed), "%d", serial_speed);
+  snprintf(level, sizeof(level), "%d", loglevel);
+  args[n++] = argv0;
+  args[n++] = "--log";
+  args[n++] = level;
+  args[n++] = "-l";
+  args[n++] = target->port;
+  args[n++] = "-s";
+  args[n++] = speed;
+  // The ROMs are put back each time the machine is reset
+  if (hyppo) {
+    args[n++] = "-k";
+    args[n++] = hyppo;
+  }
+  if (romfile) {
+    args[n++] = "-R";
+    args[n++] = romfile;
+  }
+  if (charromfile) {
+    args[n++] = "-C";
+    args[n++] = charromfile;
+  }
+  if (colourramfile) {
+    args[n++] = "-c";
+    args[n++] = colourramfile;
+  }
+  if (flashmenufile) {
+    args[n++] = "-U";
+    args[n++] = flashmenufile;
+  }
+  // A snapshot brings the machine back to a known state much faster than a reset
+  if (snaprestore_filename) {
+    args[n++] = "--snaprestore";
+    args[n++] = snaprestore_filename;
+  }
+  else
+    args[n++] = "-F";
+  if (no_cart)
+    args[n++] = "-N";
+  if (pal_mode)
+    args[n++] = "-p";
+  if (ntsc_mode)
+    args[n++] = "-n";
+  if (do_go64)
+    args[n++] = "-4";
+  if (comma_eight_comma_one)
+    args[n++] = "-1";
+  args[n++] = "-r";
+  args[n++] = timeout;
+  args[n++] = "-w";
+  args[n++] = job->log;
+  args[n++] = job->test;
+  args[n] = NULL;
+  return n;
+}
+
+/*
+  Options that act on a single machine once, rather than on each test, can't
+  be spread over several targets.
+*/
+static void ut_check_options(void)
+{
+  const struct {
+    int given;
+    const char *option;
+  } unsupported[] = { { virtual_f011, "-d" }, { type_text != NULL, "-t/-T" }, { screen_shot, "-S" },
+    { load_binary != NULL, "-@" }, { memsave_filename != NULL, "--memsave" }, { snapsave_filename != NULL, "--snapsave" },
+    { hyppo_report, "-X" }, { break_point != -1, "-B" }, { halt, "-H" }, { zap, "-Z" } };
+
+  if (bitstream) {
+    log_crit("-b/-q can't be used with --uttargets, load the bitstream onto each of the targets first");
+    exit(-3);
+  }
+  for (int i = 0; i < sizeof(unsupported) / sizeof(unsupported[0]); i++)
+    if (unsupported[i].given) {
+      log_crit("%s can't be used with --uttargets", unsupported[i].option);
+      exit(-3);
+    }
+}
+
+// Number of ports in a --uttargets list, skipping empty entries as strtok() does
+static int ut_count_targets(const char *target_list)
+{
+  int count = 0;
+  for (const char *p = target_list; *p; p++)
+    if (*p != ',' && (p == target_list || p[-1] == ','))
+      count++;
+  return count;
+}
+
+// Append the results of a test to the merged log
+static void ut_merge_log(FILE *merged, struct ut_job *job, struct ut_target *target)
+{
+  FILE *f = fopen(job->log, "r");
+  if (f) {
+    char line[1024];
+    while (fgets(line, sizeof(line), f))
+      fputs(line, merged);
+    fclose(f);
+    unlink(job->log);
+  }
+  else
+    fprintf(merged, ">>>>> TEST: %s\n!!!!! ERROR: no results (m65 exit code %d)\n<<<<< TEST COMPLETED\n", job->test,
+        job->result);
+  fprintf(merged, "===== TARGET: %s\n===== DURATION: %.2fs\n", target->port, job->seconds);
+  fflush(merged);
+}
+
+#ifndef WINDOWS
+static void ut_forward_output(struct ut_target *t)
+{
+  char buf[4096];
+  int r = read(t->out, buf, sizeof(buf));
+  if (r <= 0) {
+    close(t->out);
+    t->out = -1;
+    r = 0;
+  }
+  for (int i = 0; i < r || (t->out < 0 && t->line_len); i++) {
+    char c = i < r ? buf[i] : '\n';
+    if (c != '\n' && t->line_len < sizeof(t->line) - 1) {
+      t->line[t->line_len++] = c;
+      continue;
+    }
+    t->line[t->line_len] = 0;
+    fprintf(stderr, "[%s] %s\n", t->port, t->line);
+    t->line_len = 0;
+  }
+}
+
+static int ut_start_job(char *argv0, struct ut_job *job, struct ut_target *t)
+{
+  int fds[2];
+  char timeout[16];
+  char *args[UT_MAX_ARGS];
+  ut_job_args(argv0, job, t, args, timeout);
+
+  if (pipe(fds)) {
+    log_error("pipe() failed: %s", strerror(errno));
+    return -1;
+  }
+  fflush(NULL);
+  t->pid = fork();
+  if (t->pid < 0) {
+    log_error("could not start test %s on %s: %s", job->test, t->port, strerror(errno));
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (!t->pid) {
+    close(fds[0]);
+    dup2(fds[1], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close(fds[1]);
+    execvp(argv0, args);
+    fprintf(stderr, "could not run %s: %s\n", argv0, strerror(errno));
+    _exit(126);
+  }
+  close(fds[1]);
+  t->out = fds[0];
+  t->line_len = 0;
+  t->start = gettime_ms();
+  return 0;
+}
+#endif
+
+int run_unit_tests(char *argv0, char **tests, int test_count, char *target_list)
+{
+  struct ut_target targets[UT_MAX_TARGETS];
+  int target_count = 0;
+  char *list = strdup(target_list), *saveptr = NULL;
+  for (char *port = strtok_r(list, ",", &saveptr); port && target_count < UT_MAX_TARGETS; port = strtok_r(NULL, ",", &saveptr)) {
+    targets[target_count].port = port;
+    targets[target_count++].job = -1;
+  }
+
+  struct ut_job *jobs = calloc(test_count, sizeof(struct ut_job));
+  if (!jobs) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  for (int i = 0; i < test_count; i++) {
+    jobs[i].test = tests[i];
+    jobs[i].target = -1;
+    snprintf(jobs[i].log, sizeof(jobs[i].log), "%s/m65-ut-%d-%d.log", tmpdir, (int)getpid(), i);
+  }
+
+  FILE *merged = NULL;
+  if (unittest_logfile) {
+    merged = fopen(unittest_logfile, "a");
+    if (!merged) {
+      log_error("could not open logfile %s for appending. aborting", unittest_logfile);
+      exit(127);
+    }
+  }
+
+  log_note("running %d tests on %d targets", test_count, target_count);
+  unsigned long long start = gettime_ms();
+  int next = 0, done = 0, failed = 0;
+
+#ifdef WINDOWS
+  // No fork() here, so the tests are run one after another on the first target
+  for (next = 0; next < test_count; next++) {
+    char timeout[16];
+    char *args[UT_MAX_ARGS];
+    struct ut_job *job = &jobs[next];
+    ut_job_args(argv0, job, &targets[0], args, timeout);
+    unsigned long long job_start = gettime_ms();
+    job->target = 0;
+    job->result = _spawnvp(_P_WAIT, argv0, (const char *const *)args);
+    job->seconds = (gettime_ms() - job_start) / 1000.0;
+    if (job->result)
+      failed++;
+    if (merged)
+      ut_merge_log(merged, job, &targets[0]);
+    done++;
+  }
+#else
+  while (done < test_count) {
+    // Give every idle target the next test in the queue
+    for (int t = 0; t < target_count && next < test_count; t++) {
+      if (targets[t].job >= 0)
+        continue;
+      jobs[next].target = t;
+      if (ut_start_job(argv0, &jobs[next], &targets[t])) {
+        jobs[next].result = -1;
+        failed++;
+        done++;
+        next++;
+        continue;
+      }
+      log_note("%s: started %s", targets[t].port, jobs[next].test);
+      targets[t].job = next++;
+    }
+
+    // Forward output until one of the tests is finished
+    fd_set read_set;
+    FD_ZERO(&read_set);
+    int max_fd = -1;
+    for (int t = 0; t < target_count; t++)
+      if (targets[t].job >= 0 && targets[t].out >= 0) {
+        FD_SET(targets[t].out, &read_set);
+        if (targets[t].out > max_fd)
+          max_fd = targets[t].out;
+      }
+    struct timeval tv = { 0, 100000 };
+    if (select(max_fd + 1, &read_set, NULL, NULL, &tv) > 0)
+      for (int t = 0; t < target_count; t++)
+        if (targets[t].job >= 0 && targets[t].out >= 0 && FD_ISSET(targets[t].out, &read_set))
+          ut_forward_output(&targets[t]);
+
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      int t;
+      for (t = 0; t < target_count; t++)
+        if (targets[t].job >= 0 && targets[t].pid == pid)
+          break;
+      if (t == target_count)
+        continue;
+      while (targets[t].out >= 0)
+        ut_forward_output(&targets[t]);
+
+      struct ut_job *job = &jobs[targets[t].job];
+      job->seconds = (gettime_ms() - targets[t].start) / 1000.0;
+      job->result = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+      if (job->result)
+        failed++;
+      done++;
+      log_note("%s: %s %s in %.2fs (%d of %d done)", targets[t].port, job->test,
+          job->result == UT_RES_TIMEOUT ? "TIMED OUT" : (job->result ? "FAILED" : "passed"), job->seconds, done,
+          test_count);
+      if (merged)
+        ut_merge_log(merged, job, &targets[t]);
+      targets[t].job = -1;
+    }
+  }
+#endif
+
+  log_note("%d tests, %d failed, in %.2fs", test_count, failed, (gettime_ms() - start) / 1000.0);
+  for (int i = 0; i < test_count; i++)
+    if (jobs[i].result)
+      log_note("  FAILED: %s (%s)", jobs[i].test, jobs[i].target >= 0 ? targets[jobs[i].target].port : "not run");
+  if (merged) {
+    fprintf(merged, "===== TESTS: %d, FAILED: %d\n", test_count, failed);
+    fclose(merged);
+  }
+  free(jobs);
+  free(list);
+  return failed;
+}
+
 int main(int argc, char **argv)
 {
   int opt_index;
@@ -1874,10 +2628,15 @@ int main(int argc, char **argv)
     case 'o':
       osk_enable = 1;
       break;
-    case 'd':
+    case 'd': {
+      // Several images can be given, either as a list or with several -d
+      char *list = strdup(optarg), *saveptr = NULL;
+      for (char *name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr))
+        if (vf011_add_image(name) < 0)
+          exit(-1);
+      free(list);
       virtual_f011 = 1;
-      d81file = strdup(optarg);
-      break;
+    } break;
     case 's':
       serial_speed = atoi(optarg);
       switch (serial_speed) {
@@ -1949,6 +2708,20 @@ int main(int argc, char **argv)
       }
       wait_for_bitstream = 1;
       break;
+    case 0x82: // uttargets
+      unittest_targets = strdup(optarg);
+      break;
+    case 0x83: // snapsave
+      snapsave_filename = strdup(optarg);
+      break;
+    case 0x84: // snaprestore
+      snaprestore_filename = strdup(optarg);
+      break;
+    case 0x85: // watch
+      hyppo_watch_ms = atoi(optarg);
+      if (hyppo_watch_ms <= 0)
+        usage(-3, "failed to parse watch interval");
+      break;
     case 0x81: // memsave
     {
       char *next;
@@ -1973,6 +2746,20 @@ int main(int argc, char **argv)
     }
   }
 
+  if (unittest_targets) {
+    if (optind == argc)
+      usage(-3, "--uttargets needs a list of test programs");
+    int target_count = ut_count_targets(unittest_targets);
+    if (!target_count)
+      usage(-3, "--uttargets needs at least one serial port");
+    if (target_count > UT_MAX_TARGETS)
+      usage(-3, "--uttargets can not use more than 64 serial ports");
+    ut_check_options();
+    for (int i = optind; i < argc; i++)
+      check_file_access(argv[i], "programme");
+    exit(run_unit_tests(argv[0], &argv[optind], argc - optind, unittest_targets) ? 1 : 0);
+  }
+
   if (argv[optind]) {
     filename = strdup(argv[optind]);
     check_file_access(filename, "programme");
@@ -2005,6 +2792,9 @@ int main(int argc, char **argv)
    *
    * This is done by init_fpgajtag, which returns the device as a string.
    */
+  if (jtag_serial && (!strcmp(jtag_serial, "all") || strpbrk(jtag_serial, ",=")))
+    program_boards();
+
   if (bitstream || jtag_only || !serial_port) {
     unsigned int fpga_id = get_bitstream_fpgaid(bitstream);
 
@@ -2184,11 +2974,28 @@ int main(int argc, char **argv)
       do_exit(-1);
   }
 
-  if (virtual_f011)
-    log_note("vf011 - remote access to disk image '%s' requested", d81file);
+  if (snapsave_filename && snapshot_save(snapsave_filename))
+    do_exit(-1);
 
-  if (hyppo_report)
-    show_hyppo_report();
+  if (virtual_f011) {
+    // The first image goes in drive 0, and the second (if any) in drive 1.
+    // Any others can be swapped in later.
+    for (int i = 0; i < VF011_DRIVES && i < vf011_image_count(); i++)
+      if (vf011_mount(i, i))
+        do_exit(-1);
+    vf011_drive1 = vf011_image_count() > 1;
+    log_note("vf011 - remote access to %d disk image(s) requested", vf011_image_count());
+  }
+
+  if (hyppo_report) {
+    if (hyppo_watch_ms)
+      do_exit(hyppo_state_watch(hyppo_watch_ms, hyppo_json) ? -1 : 0);
+    struct hyppo_state state;
+    if (hyppo_state_fetch(&state))
+      log_error("could not read the hypervisor state");
+    else
+      hyppo_state_print(stdout, &state, NULL, hyppo_json);
+  }
 
   // If we have no HYPPO file provided, but need one, then
   // extract one out of the running bitstream.
@@ -2213,6 +3020,17 @@ int main(int argc, char **argv)
     }
   }
 
+  // Files to preload, skipping the pages that the MEGA65 already has
+  enum { PRELOAD_ROM, PRELOAD_CHARROM, PRELOAD_COLOURRAM, PRELOAD_FLASHMENU, PRELOAD_COUNT };
+  struct preload preloads[PRELOAD_COUNT] = { { romfile, 0x20000 }, { charromfile, 0xFF7E000 },
+    { colourramfile, 0xFF80000 }, { flashmenufile, 0x50000 } };
+  if (romfile || charromfile || colourramfile || flashmenufile) {
+    for (int i = 0; i < PRELOAD_COUNT; i++)
+      if (preloads[i].filename)
+        preload_read(&preloads[i]);
+    preload_check(preloads, PRELOAD_COUNT);
+  }
+
   if (!hyppo) {
 
     // XXX These two need the CPU to be in hypervisor mode
@@ -2223,24 +3041,24 @@ int main(int argc, char **argv)
         log_info("replacing rom");
         mega65_poke(0xffd367d, mega65_peek(0xffd367d) & (0xff - 4));
 
-        load_file(romfile, 0x20000, 0);
+        preload_push(&preloads[PRELOAD_ROM]);
         // reenable ROM write protect
         mega65_poke(0xffd367d, mega65_peek(0xffd367d) | 0x04);
       }
       if (charromfile) {
-        log_info("replacing colourr ram");
-        load_file(charromfile, 0xFF7E000, 0);
+        log_info("replacing character rom");
+        preload_push(&preloads[PRELOAD_CHARROM]);
       }
       return_from_hypervisor_mode();
     }
 
     if (colourramfile) {
       log_info("replacing colourram");
-      load_file(colourramfile, 0xFF80000, 0);
+      preload_push(&preloads[PRELOAD_COLOURRAM]);
     }
     if (flashmenufile) {
       log_info("replacing flashmenu");
-      load_file(flashmenufile, 0x50000, 0);
+      preload_push(&preloads[PRELOAD_FLASHMENU]);
     }
   }
   else {
@@ -2256,27 +3074,27 @@ int main(int argc, char **argv)
     }
     if (flashmenufile) {
       log_info("replacing flashmenu");
-      load_file(flashmenufile, 0x50000, 0);
+      preload_push(&preloads[PRELOAD_FLASHMENU]);
     }
     if (romfile) {
       log_info("replacing rom");
-      load_file(romfile, 0x20000, 0);
+      preload_push(&preloads[PRELOAD_ROM]);
     }
     if (charromfile) {
       log_info("replacing character rom");
-      load_file(charromfile, 0xFF7E000, 0);
+      preload_push(&preloads[PRELOAD_CHARROM]);
     }
     if (colourramfile) {
       log_info("replacing colourram");
-      load_file(colourramfile, 0xFF80000, 0);
+      preload_push(&preloads[PRELOAD_COLOURRAM]);
     }
     if (virtual_f011) {
       log_note("virtualising F011 FDC access");
 
       // Enable FDC virtualisation
-      mega65_poke(0xffd3659, 0x01);
-      // Enable disk 0 (including for write)
-      mega65_poke(0xffd368b, 0x03);
+      mega65_poke(0xffd3659, vf011_drive1 ? 0x03 : 0x01);
+      // Enable disk 0 (including for write), and disk 1 if it is virtualised too
+      mega65_poke(0xffd368b, vf011_drive1 ? 0x1b : 0x03);
     }
     if (!reset_first)
       start_cpu();
@@ -2291,6 +3109,10 @@ int main(int argc, char **argv)
     sleep(2);
   }
 
+  // Restoring a snapshot also restores the C64/C65 mode it was taken in
+  if (snaprestore_filename && snapshot_restore(snaprestore_filename))
+    do_exit(-1);
+
   if (no_cart) {
     char cmd[1024];
 
@@ -2328,35 +3150,41 @@ int main(int argc, char **argv)
     do_exit(0);
   }
 
-  if (pal_mode) {
-    log_info("switching to PAL mode");
-    mega65_poke(0xFFD306fL, 0x00);
-    mega65_poke(0xFFD3072L, 0x00);
-    mega65_poke(0xFFD3048L, 0x68);
-    mega65_poke(0xFFD3049L, 0x0 | (mega65_peek(0xFFD3049L) & 0xf0));
-    mega65_poke(0xFFD304AL, 0xF8);
-    mega65_poke(0xFFD304BL, 0x1 | (mega65_peek(0xFFD304BL) & 0xf0));
-    mega65_poke(0xFFD304EL, 0x68);
-    mega65_poke(0xFFD304FL, 0x0 | (mega65_peek(0xFFD304FL) & 0xf0));
-    mega65_poke(0xFFD3072L, 0);
-    // switch CIA TOD 50/60
-    mega65_poke(0xffd3c0el, mega65_peek(0xffd3c0el) | 0x80);
-    mega65_poke(0xffd3d0el, mega65_peek(0xffd3d0el) | 0x80);
-  }
-  else if (ntsc_mode) {
-    log_info("switching to NTSC mode");
-    mega65_poke(0xFFD306fL, 0x87);
-    mega65_poke(0xFFD3072L, 0x18);
-    mega65_poke(0xFFD3048L, 0x2A);
-    mega65_poke(0xFFD3049L, 0x0 | (mega65_peek(0xFFD3049L) & 0xf0));
-    mega65_poke(0xFFD304AL, 0xB9);
-    mega65_poke(0xFFD304BL, 0x1 | (mega65_peek(0xFFD304BL) & 0xf0));
-    mega65_poke(0xFFD304EL, 0x2A);
-    mega65_poke(0xFFD304FL, 0x0 | (mega65_peek(0xFFD304FL) & 0xf0));
-    mega65_poke(0xFFD3072L, 24);
-    // switch CIA TOD 50/60
-    mega65_poke(0xffd3c0el, mega65_peek(0xffd3c0el) & 0x7f);
-    mega65_poke(0xffd3d0el, mega65_peek(0xffd3d0el) & 0x7f);
+  if (pal_mode || ntsc_mode) {
+    struct regscript rs;
+    regscript_init(&rs);
+    if (pal_mode) {
+      log_info("switching to PAL mode");
+      regscript_poke(&rs, 0xFFD306fL, 0x00);
+      regscript_poke(&rs, 0xFFD3072L, 0x00);
+      regscript_poke(&rs, 0xFFD3048L, 0x68);
+      regscript_modify(&rs, 0xFFD3049L, 0xf0, 0x0);
+      regscript_poke(&rs, 0xFFD304AL, 0xF8);
+      regscript_modify(&rs, 0xFFD304BL, 0xf0, 0x1);
+      regscript_poke(&rs, 0xFFD304EL, 0x68);
+      regscript_modify(&rs, 0xFFD304FL, 0xf0, 0x0);
+      regscript_poke(&rs, 0xFFD3072L, 0);
+      // switch CIA TOD 50/60
+      regscript_modify(&rs, 0xffd3c0el, 0xff, 0x80);
+      regscript_modify(&rs, 0xffd3d0el, 0xff, 0x80);
+    }
+    else {
+      log_info("switching to NTSC mode");
+      regscript_poke(&rs, 0xFFD306fL, 0x87);
+      regscript_poke(&rs, 0xFFD3072L, 0x18);
+      regscript_poke(&rs, 0xFFD3048L, 0x2A);
+      regscript_modify(&rs, 0xFFD3049L, 0xf0, 0x0);
+      regscript_poke(&rs, 0xFFD304AL, 0xB9);
+      regscript_modify(&rs, 0xFFD304BL, 0xf0, 0x1);
+      regscript_poke(&rs, 0xFFD304EL, 0x2A);
+      regscript_modify(&rs, 0xFFD304FL, 0xf0, 0x0);
+      regscript_poke(&rs, 0xFFD3072L, 24);
+      // switch CIA TOD 50/60
+      regscript_modify(&rs, 0xffd3c0el, 0x7f, 0x00);
+      regscript_modify(&rs, 0xffd3d0el, 0x7f, 0x00);
+    }
+    regscript_run(&rs);
+    regscript_free(&rs);
   }
 
   if (ethernet_video) {
@@ -2413,14 +3241,18 @@ int main(int argc, char **argv)
         if (coeffhi < coeff)
           coeffhi = coeff;
         int val = percent * 655;
+        struct regscript rs;
+        regscript_init(&rs);
         while (coeff <= coeffhi) {
-          mega65_poke(0xffd36f4, coeff + 0);
-          mega65_poke(0xffd36f5, val & 0xff);
-          mega65_poke(0xffd36f4, coeff + 1);
-          mega65_poke(0xffd36f5, val >> 8);
+          regscript_poke(&rs, 0xffd36f4, coeff + 0);
+          regscript_poke(&rs, 0xffd36f5, val & 0xff);
+          regscript_poke(&rs, 0xffd36f4, coeff + 1);
+          regscript_poke(&rs, 0xffd36f5, val >> 8);
           fprintf(stderr, "Setting audio coefficient $%02x to %04x\n", coeff, val);
           coeff += 2;
         }
+        regscript_run(&rs);
+        regscript_free(&rs);
       }
       else if ((sscanf(&set_mixer_args[ofs], "%x=%d%n", &coeff, &percent, &n) >= 2)) {
         ofs += n;
@@ -2436,16 +3268,16 @@ int main(int argc, char **argv)
 
   if (show_audio_mixer) {
     monitor_sync();
-    fprintf(stderr, "Reading audio mixer coefficients (takes several seconds).\n");
+    fprintf(stderr, "Reading audio mixer coefficients.\n");
     unsigned char mixer_coefficients[256];
+    struct regscript rs;
+    regscript_init(&rs);
     for (int i = 0; i < 256; i++) {
-      mega65_poke(0xffd36f4, i);
-      //	fprintf(stderr,"poked %d\n",i);
-      mixer_coefficients[i] = mega65_peek(0xffd36f5);
-      //	fprintf(stderr,"peeked\n");
-      fprintf(stderr, ".");
+      regscript_poke(&rs, 0xffd36f4, i);
+      regscript_peek(&rs, 0xffd36f5, &mixer_coefficients[i]);
     }
-    fprintf(stderr, "\n");
+    regscript_run(&rs);
+    regscript_free(&rs);
     for (int i = 0; i < 256; i += 32) {
       switch (i) {
       case 0x00:
@@ -2530,7 +3362,7 @@ int main(int argc, char **argv)
     }
   }
 
-  if (filename || do_go64) {
+  if ((filename || do_go64) && !snaprestore_filename) {
     log_info("detecting C64/C65 mode status");
     detect_mode();
   }
@@ -2946,6 +3778,8 @@ int main(int argc, char **argv)
     log_raiselevel(LOG_NOTE);
 #ifndef WINDOWS
     log_note("entering virtualised F011 wait loop... press 'q' plus <RETURN> to exit");
+    log_note("disks can be swapped with 'mount <drive> <image number or file>', 'eject <drive>' and 'list'");
+    int stdin_open = 1;
 #else
     log_note("entering virtualised F011 wait loop...");
 #endif
@@ -2953,15 +3787,20 @@ int main(int argc, char **argv)
     while (1) {
 #ifndef WINDOWS
       fd_set read_set;
+      FD_ZERO(&read_set);
       FD_SET(fd, &read_set);
-      FD_SET(STDIN_FILENO, &read_set);
-      if (select(fd + 1, &read_set, NULL, NULL, NULL) < 1) {
+      if (stdin_open)
+        FD_SET(STDIN_FILENO, &read_set);
+      // Wake up to write back dirty sectors once the disk goes idle
+      struct timeval idle = { VF011_FLUSH_IDLE_MS / 1000, (VF011_FLUSH_IDLE_MS % 1000) * 1000 };
+      if (select(fd + 1, &read_set, NULL, NULL, vf011_dirty_images() ? &idle : NULL) < 1) {
         log_debug("vF011: select false");
+        vf011_flush_if_idle();
         continue;
       }
       else
         log_debug("vF011: select true");
-      if (FD_ISSET(STDIN_FILENO, &read_set) && fgetc(stdin) == 'q') {
+      if (stdin_open && FD_ISSET(STDIN_FILENO, &read_set) && vf011_stdin_commands(&stdin_open)) {
         log_crit("exit requested, please power cycle your MEGA65");
         break;
       }
@@ -2992,10 +3831,7 @@ int main(int argc, char **argv)
       }
       handle_vf011_requests();
     }
-    if (fd81 != NULL) {
-      log_debug("closing d81 image file");
-      fclose(fd81);
-    }
+    vf011_close_all();
     // disable vF011
     mega65_poke(0xffd3659, 0x00);
     mega65_poke(0xffd368b, 0x07);
@@ -3006,6 +3842,7 @@ int main(int argc, char **argv)
 
 void do_exit(int retval)
 {
+  vf011_close_all();
 #ifndef WINDOWS
   if (thread_count) {
     log_crit("background tasks may be running. CONTROL+C to stop...");
@@ -957,6 +957,71 @@ int push_ram(unsigned long address, unsigned int count, unsigned char *buffer)
   return 0;
 }
 
+int push_ram_pieces(const struct ram_piece *pieces, int count)
+{
+  // Without a receive buffer (or with Xemu) the monitor needs each chunk
+  // to be acknowledged before the next arrives
+  if (no_rxbuff || xemu_flag) {
+    for (int i = 0; i < count; i++)
+      push_ram(pieces[i].address, pieces[i].count, pieces[i].buffer);
+    return 0;
+  }
+
+  int cpu_stopped_state = cpu_stopped;
+  if (!cpu_stopped_state)
+    real_stop_cpu();
+
+  char cmd[64];
+  int outstanding = 0;
+  for (int i = 0; i < count; i++) {
+    unsigned long address = pieces[i].address;
+    for (unsigned int offset = 0; offset < pieces[i].count;) {
+      // Same chunks as push_ram()
+      int b = pieces[i].count - offset;
+      if (b > (0xffff - ((address + offset) & 0xffff)))
+        b = (0xffff - ((address + offset) & 0xffff));
+      if (b > 4096)
+        b = 4096;
+
+      unsigned char *p = &pieces[i].buffer[offset];
+      if (b == 1) {
+        sprintf(cmd, "s%lx %x\r", address + offset, p[0]);
+        slow_write_safe(fd, cmd, strlen(cmd));
+      }
+      else {
+        if (new_monitor)
+          sprintf(cmd, "l%lx %lx\r", address + offset, (address + offset + b) & 0xffff);
+        else
+          sprintf(cmd, "l%lx %lx\r", address + offset - 1, address + offset + b - 1);
+        slow_write_safe(fd, cmd, strlen(cmd));
+        int n = b;
+        while (n > 0) {
+          int w = serialport_write(fd, p, n);
+          if (w > 0) {
+            p += w;
+            n -= w;
+          }
+          else
+            do_usleep(1000);
+        }
+      }
+      // Each chunk ends with a prompt.  Wait for the previous chunk's, so
+      // that this one is already on its way.
+      if (++outstanding > 1) {
+        wait_for_prompt();
+        outstanding--;
+      }
+      offset += b;
+    }
+  }
+  while (outstanding--)
+    wait_for_prompt();
+
+  if (!cpu_stopped_state)
+    start_cpu();
+  return 0;
+}
+
 char parse_byte(const unsigned char *source, unsigned char *target)
 {
   unsigned char val = 0;
@@ -1060,6 +1125,92 @@ int fetch_ram(unsigned long address, unsigned int count, unsigned char *buffer)
   }
 }
 
+/*
+  Like fetch_ram(), but for long transfers that must not be silently wrong:
+  if the monitor stops replying, or a line of the dump can't be parsed, it
+  returns -1 instead of retrying forever (or exiting), so that the caller
+  can retry or give up cleanly.
+
+  If the monitor has an RX buffer, the dump commands for up to
+  FETCH_BURST_COMMANDS pages are sent in one burst, with the CPU stopped so
+  that the monitor keeps up, and the replies are matched up by address.
+*/
+#define FETCH_BURST_COMMANDS 16
+#define FETCH_REPLY_TIMEOUT_MS 2000
+
+int fetch_ram_checked(unsigned long address, unsigned int count, unsigned char *buffer)
+{
+  int cpu_stopped_state = cpu_stopped;
+  if (!no_rxbuff && !cpu_stopped_state)
+    real_stop_cpu();
+
+  int retval = 0;
+  unsigned long addr = address;
+  while (addr < address + count && !retval) {
+    // One M command dumps 256 bytes, and an m command 16
+    char cmds[FETCH_BURST_COMMANDS * 16];
+    int len = 0, lines = 0;
+    unsigned long next = addr;
+    for (int i = 0; i < (no_rxbuff ? 1 : FETCH_BURST_COMMANDS) && next < address + count; i++) {
+      if (address + count - next < 17) {
+        len += snprintf(cmds + len, sizeof(cmds) - len, "m%X\r", (unsigned int)next);
+        next += 0x10;
+        lines += 1;
+      }
+      else {
+        len += snprintf(cmds + len, sizeof(cmds) - len, "M%X\r", (unsigned int)next);
+        next += 0x100;
+        lines += 16;
+      }
+    }
+    slow_write_safe(fd, cmds, len);
+
+    unsigned char read_buff[8192];
+    char line[64];
+    int line_len = 0, got = 0;
+    unsigned long long last_rx = gettime_ms();
+    while (got < lines) {
+      int r = serialport_read(fd, read_buff, sizeof(read_buff));
+      if (r <= 0) {
+        if (gettime_ms() - last_rx > FETCH_REPLY_TIMEOUT_MS) {
+          log_error("fetch_ram_checked: no reply for $%08lx (%d of %d lines)", addr, got, lines);
+          retval = -1;
+          break;
+        }
+        continue;
+      }
+      last_rx = gettime_ms();
+      check_for_vf011_jobs(read_buff, r);
+
+      for (int i = 0; i < r && !retval; i++) {
+        unsigned char c = read_buff[i];
+        if (c != '\r' && c != '\n') {
+          if (line_len < sizeof(line) - 1)
+            line[line_len++] = c;
+          continue;
+        }
+        line[line_len] = 0;
+        unsigned int line_addr;
+        if (line_len >= 42 && line[0] == ':' && sscanf(line, ":%08X:", &line_addr) == 1 && line_addr == addr + got * 16) {
+          for (int j = 0; j < 16 && line_addr + j < address + count; j++)
+            if (parse_byte((unsigned char *)&line[10 + j * 2], &buffer[line_addr + j - address])) {
+              log_error("fetch_ram_checked: error parsing %s", line);
+              retval = -1;
+            }
+          got++;
+        }
+        line_len = 0;
+      }
+    }
+    if (!retval)
+      addr = next;
+  }
+
+  if (!no_rxbuff && !cpu_stopped_state)
+    start_cpu();
+  return retval;
+}
+
 unsigned char ram_cache[512 * 1024 + 255];
 unsigned char ram_cache_valids[512 * 1024 + 255];
 int ram_cache_initialised = 0;
@@ -1100,6 +1251,294 @@ int fetch_ram_cacheable(unsigned long address, unsigned int count, unsigned char
   return 0;
 }
 
+/*
+  Register scripts.
+
+  Tools that drive hardware registers directly (e.g., the F011 in readdisk)
+  spend nearly all of their time waiting for the serial monitor to answer
+  each poke and peek in turn.  A register script collects the accesses
+  first, and then sends them as bursts of monitor commands, parsing all of
+  the replies to each burst in one go.  Anything that depends on a value
+  read back from the MEGA65 (modify and the waits) ends the current burst.
+*/
+
+// How much we send in one burst, so as not to overrun the monitor RX buffer
+#define REGSCRIPT_BURST_COMMANDS 16
+#define REGSCRIPT_BURST_BYTES 192
+// How long we wait for the replies to a burst before giving up
+#define REGSCRIPT_REPLY_TIMEOUT_MS 2000
+
+struct regscript_burst {
+  char cmds[REGSCRIPT_BURST_BYTES + 32];
+  int len;
+  int commands;
+  int peeks;
+  unsigned int peek_addrs[REGSCRIPT_BURST_COMMANDS];
+  unsigned char *results[REGSCRIPT_BURST_COMMANDS];
+};
+
+void regscript_init(struct regscript *rs)
+{
+  rs->ops = NULL;
+  rs->count = 0;
+  rs->max = 0;
+}
+
+void regscript_reset(struct regscript *rs)
+{
+  rs->count = 0;
+}
+
+void regscript_free(struct regscript *rs)
+{
+  free(rs->ops);
+  regscript_init(rs);
+}
+
+static struct regscript_op *regscript_add(struct regscript *rs, int type, unsigned int addr)
+{
+  if (rs->count == rs->max) {
+    rs->max = rs->max ? rs->max * 2 : 64;
+    rs->ops = realloc(rs->ops, sizeof(struct regscript_op) * rs->max);
+    if (!rs->ops) {
+      perror("realloc() failed");
+      exit(-3);
+    }
+  }
+  struct regscript_op *op = &rs->ops[rs->count++];
+  bzero(op, sizeof(struct regscript_op));
+  op->type = type;
+  op->addr = addr;
+  return op;
+}
+
+void regscript_poke(struct regscript *rs, unsigned int addr, unsigned char value)
+{
+  regscript_add(rs, REGSCRIPT_POKE, addr)->value = value;
+}
+
+void regscript_peek(struct regscript *rs, unsigned int addr, unsigned char *result)
+{
+  regscript_add(rs, REGSCRIPT_PEEK, addr)->result = result;
+}
+
+void regscript_modify(struct regscript *rs, unsigned int addr, unsigned char and_mask, unsigned char or_value)
+{
+  struct regscript_op *op = regscript_add(rs, REGSCRIPT_MODIFY, addr);
+  op->mask = and_mask;
+  op->value = or_value;
+}
+
+void regscript_wait_clear(struct regscript *rs, unsigned int addr, unsigned char mask, unsigned int usec)
+{
+  struct regscript_op *op = regscript_add(rs, REGSCRIPT_WAIT_CLEAR, addr);
+  op->mask = mask;
+  op->usec = usec;
+}
+
+void regscript_wait_set(struct regscript *rs, unsigned int addr, unsigned char mask, unsigned int usec)
+{
+  struct regscript_op *op = regscript_add(rs, REGSCRIPT_WAIT_SET, addr);
+  op->mask = mask;
+  op->usec = usec;
+}
+
+void regscript_delay(struct regscript *rs, unsigned int usec)
+{
+  regscript_add(rs, REGSCRIPT_DELAY, 0)->usec = usec;
+}
+
+/*
+  Send the burst, and then read until we have seen one prompt for every
+  command, and a memory line for every peek.  Memory lines are skipped when
+  looking for prompts, in case they contain a '.'.
+*/
+static int regscript_flush(struct regscript_burst *b)
+{
+  if (!b->commands)
+    return 0;
+
+  char *p = b->cmds;
+  int n = b->len;
+  while (n > 0) {
+    int w = serialport_write(fd, (uint8_t *)p, n);
+    if (w > 0) {
+      p += w;
+      n -= w;
+    }
+    else
+      do_usleep(1000 * SLOW_FACTOR);
+  }
+
+  unsigned char read_buff[8192];
+  char line[64];
+  int line_len = 0, memory_line = 0;
+  int prompts = 0, peeks = 0;
+  unsigned long long last_rx = gettime_ms();
+  while (prompts < b->commands || peeks < b->peeks) {
+    int r = serialport_read(fd, read_buff, sizeof(read_buff) - 1);
+    if (r <= 0) {
+      if (gettime_ms() - last_rx > REGSCRIPT_REPLY_TIMEOUT_MS) {
+        log_error("regscript: no reply from monitor (%d of %d prompts, %d of %d peeks)", prompts, b->commands, peeks,
+            b->peeks);
+        b->len = b->commands = b->peeks = 0;
+        return -1;
+      }
+      continue;
+    }
+    last_rx = gettime_ms();
+    check_for_vf011_jobs(read_buff, r);
+
+    for (int i = 0; i < r; i++) {
+      unsigned char c = read_buff[i];
+      if (c == '\r' || c == '\n') {
+        unsigned int addr;
+        line[line_len] = 0;
+        // :0FFD3082:xxxxxxxx... with the byte we want first
+        if (memory_line && line_len >= 42 && peeks < b->peeks && sscanf(line, ":%08X:", &addr) == 1
+            && addr == b->peek_addrs[peeks]) {
+          if (parse_byte((unsigned char *)&line[10], b->results[peeks]))
+            log_debug("regscript: error parsing %s", line);
+          peeks++;
+        }
+        line_len = 0;
+        memory_line = 0;
+        continue;
+      }
+      if (!line_len && c == ':')
+        memory_line = 1;
+      if (line_len < sizeof(line) - 1)
+        line[line_len++] = c;
+      if (c == '.' && !memory_line)
+        prompts++;
+    }
+  }
+
+  b->len = b->commands = b->peeks = 0;
+  return 0;
+}
+
+static int regscript_queue(struct regscript_burst *b, char *cmd, unsigned int peek_addr, unsigned char *result)
+{
+  int len = strlen(cmd);
+  if (b->commands == REGSCRIPT_BURST_COMMANDS || b->len + len > REGSCRIPT_BURST_BYTES)
+    if (regscript_flush(b))
+      return -1;
+  memcpy(&b->cmds[b->len], cmd, len);
+  b->len += len;
+  if (result) {
+    b->peek_addrs[b->peeks] = peek_addr;
+    b->results[b->peeks++] = result;
+  }
+  b->commands++;
+  return 0;
+}
+
+static int regscript_queue_poke(struct regscript_burst *b, unsigned int addr, unsigned char value)
+{
+  char cmd[32];
+  snprintf(cmd, sizeof(cmd), "s%x %x\r", addr, value);
+  return regscript_queue(b, cmd, 0, NULL);
+}
+
+static int regscript_queue_peek(struct regscript_burst *b, unsigned int addr, unsigned char *result)
+{
+  char cmd[32];
+  snprintf(cmd, sizeof(cmd), "m%X\r", addr);
+  return regscript_queue(b, cmd, addr, result);
+}
+
+// Without an RX buffer the monitor can only take one command at a time
+static int regscript_run_unbuffered(struct regscript *rs)
+{
+  for (int i = 0; i < rs->count; i++) {
+    struct regscript_op *op = &rs->ops[i];
+    switch (op->type) {
+    case REGSCRIPT_POKE:
+      mega65_poke(op->addr, op->value);
+      break;
+    case REGSCRIPT_PEEK:
+      *op->result = mega65_peek(op->addr);
+      break;
+    case REGSCRIPT_MODIFY:
+      mega65_poke(op->addr, (mega65_peek(op->addr) & op->mask) | op->value);
+      break;
+    case REGSCRIPT_WAIT_CLEAR:
+    case REGSCRIPT_WAIT_SET: {
+      unsigned long long timeout = gettime_ms() + op->usec / 1000;
+      unsigned char want = op->type == REGSCRIPT_WAIT_SET ? op->mask : 0;
+      while ((mega65_peek(op->addr) & op->mask) != want) {
+        if (op->usec && gettime_ms() > timeout) {
+          log_error("regscript: timeout waiting on $%07x & $%02x", op->addr, op->mask);
+          return -1;
+        }
+      }
+    } break;
+    case REGSCRIPT_DELAY:
+      do_usleep(op->usec);
+      break;
+    }
+  }
+  return 0;
+}
+
+int regscript_run(struct regscript *rs)
+{
+  if (no_rxbuff)
+    return regscript_run_unbuffered(rs);
+
+  // As for push_ram(), the CPU has to be stopped for the monitor to keep up
+  int cpu_stopped_state = cpu_stopped;
+  if (!cpu_stopped_state)
+    real_stop_cpu();
+
+  struct regscript_burst b;
+  b.len = b.commands = b.peeks = 0;
+  int retval = 0;
+  for (int i = 0; i < rs->count && !retval; i++) {
+    struct regscript_op *op = &rs->ops[i];
+    unsigned char v;
+    switch (op->type) {
+    case REGSCRIPT_POKE:
+      retval = regscript_queue_poke(&b, op->addr, op->value);
+      break;
+    case REGSCRIPT_PEEK:
+      retval = regscript_queue_peek(&b, op->addr, op->result);
+      break;
+    case REGSCRIPT_MODIFY:
+      retval = regscript_queue_peek(&b, op->addr, &v) || regscript_flush(&b)
+            || regscript_queue_poke(&b, op->addr, (v & op->mask) | op->value);
+      break;
+    case REGSCRIPT_WAIT_CLEAR:
+    case REGSCRIPT_WAIT_SET: {
+      unsigned long long timeout = gettime_ms() + op->usec / 1000;
+      unsigned char want = op->type == REGSCRIPT_WAIT_SET ? op->mask : 0;
+      while (1) {
+        if ((retval = regscript_queue_peek(&b, op->addr, &v) || regscript_flush(&b)))
+          break;
+        if ((v & op->mask) == want)
+          break;
+        if (op->usec && gettime_ms() > timeout) {
+          log_error("regscript: timeout waiting on $%07x & $%02x", op->addr, op->mask);
+          retval = -1;
+          break;
+        }
+      }
+    } break;
+    case REGSCRIPT_DELAY:
+      retval = regscript_flush(&b);
+      do_usleep(op->usec);
+      break;
+    }
+  }
+  if (!retval)
+    retval = regscript_flush(&b);
+
+  if (!cpu_stopped_state)
+    start_cpu();
+  return retval ? -1 : 0;
+}
+
 time_t last_settle_msg_time = 0;
 
 int detect_mode(void)
@@ -0,0 +1,395 @@
+/*
+  Convert and query binary signal traces (see include/trace.h).
+
+  Traces can be made from VCD files (e.g., from ghdl-vcd), or written
+  directly by the boundary scan of m65 -J when the output file name ends in
+  .m65t.  Queries only read the blocks that cover the time window asked for.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "trace.h"
+
+double start_ns = 0;
+double end_ns = -1;
+int write_latency = 0;
+
+void usage(void)
+{
+  fprintf(stderr, "MEGA65 binary signal trace tool.\n"
+                  "usage: m65trace [-s start ns] [-e end ns] <command> ...\n"
+                  "  import <vcd file> <trace file>\n"
+                  "  export <trace file> <vcd file|-> [signals...]\n"
+                  "  info <trace file>\n"
+                  "  dump <trace file> <signal>\n"
+                  "  edges <trace file> <signal> [rising|falling|both]\n"
+                  "  i2c <trace file> [sda signal] [scl signal]\n"
+                  "  hyperram [-l write latency in clocks] <trace file> [signal prefix, default hr]\n");
+  exit(-1);
+}
+
+struct trace_reader *open_trace(const char *filename)
+{
+  struct trace_reader *r = trace_open(filename);
+  if (!r) {
+    fprintf(stderr, "ERROR: Could not read trace '%s'\n", filename);
+    exit(-1);
+  }
+  return r;
+}
+
+int open_signal(struct trace_reader *r, struct trace_cursor *c, const char *name, int64_t start)
+{
+  int signal = trace_find_signal(r, name);
+  if (signal < 0) {
+    fprintf(stderr, "ERROR: Signal '%s' is not in the trace\n", name);
+    exit(-1);
+  }
+  trace_cursor_init(c, r, signal, start);
+  return signal;
+}
+
+int64_t window_start(struct trace_reader *r)
+{
+  return start_ns > 0 ? trace_ns_to_ticks(r, start_ns) : r->first_time;
+}
+
+int64_t window_end(struct trace_reader *r)
+{
+  return end_ns >= 0 ? trace_ns_to_ticks(r, end_ns) : INT64_MAX;
+}
+
+// Level of a signal, with unknown values taken as the given default
+int level(struct trace_cursor *c, int unknown_level)
+{
+  if (c->unknown)
+    return unknown_level;
+  return c->value ? 1 : 0;
+}
+
+/*
+  Move all of the cursors that change at the earliest next time to that
+  time.  Returns the time, or -1 if there are no more changes before the
+  end time.
+*/
+int64_t next_changes(struct trace_cursor *cursors, int count, int64_t end)
+{
+  int64_t next = INT64_MAX;
+  for (int i = 0; i < count; i++) {
+    int64_t t = trace_cursor_peek(&cursors[i]);
+    if (t < next)
+      next = t;
+  }
+  if (next == INT64_MAX || next > end)
+    return -1;
+  for (int i = 0; i < count; i++)
+    if (trace_cursor_peek(&cursors[i]) == next)
+      trace_cursor_next(&cursors[i]);
+  return next;
+}
+
+int do_info(const char *filename)
+{
+  struct trace_reader *r = open_trace(filename);
+  printf("Tick length: %llu fs\n", (unsigned long long)r->timescale_fs);
+  printf("Time span:   %.3f ns to %.3f ns\n", trace_ticks_to_ns(r, r->first_time), trace_ticks_to_ns(r, r->last_time));
+  unsigned long long compressed = 0, raw = 0;
+  for (int i = 0; i < r->block_count; i++) {
+    compressed += r->blocks[i].compressed_size;
+    raw += r->blocks[i].size;
+  }
+  printf("Blocks:      %d (%llu bytes, %llu uncompressed)\n", r->block_count, compressed, raw);
+  printf("Signals:     %d\n", r->signal_count);
+  for (int i = 0; i < r->signal_count; i++)
+    printf("  %-40s %d bit%s\n", r->signals[i].name, r->signals[i].width, r->signals[i].width == 1 ? "" : "s");
+  trace_free(r);
+  return 0;
+}
+
+void print_value(struct trace_cursor *c, int width)
+{
+  if (c->unknown)
+    printf("x\n");
+  else if (width == 1)
+    printf("%d\n", (int)c->value);
+  else
+    printf("$%llx\n", (unsigned long long)c->value);
+}
+
+int do_dump(const char *filename, const char *name)
+{
+  struct trace_reader *r = open_trace(filename);
+  struct trace_cursor c;
+  int signal = open_signal(r, &c, name, window_start(r));
+  int width = r->signals[signal].width;
+  int64_t end = window_end(r);
+
+  printf("%14.3f ns  ", trace_ticks_to_ns(r, c.time));
+  print_value(&c, width);
+  while (trace_cursor_peek(&c) <= end && trace_cursor_next(&c)) {
+    printf("%14.3f ns  ", trace_ticks_to_ns(r, c.time));
+    print_value(&c, width);
+  }
+
+  trace_cursor_free(&c);
+  trace_free(r);
+  return 0;
+}
+
+int do_edges(const char *filename, const char *name, const char *which)
+{
+  int want_rising = strcmp(which, "falling");
+  int want_falling = strcmp(which, "rising");
+
+  struct trace_reader *r = open_trace(filename);
+  struct trace_cursor c;
+  open_signal(r, &c, name, window_start(r));
+  int64_t end = window_end(r);
+
+  int last = level(&c, -1);
+  int edges = 0;
+  int64_t first_edge = 0, last_edge = 0;
+  while (trace_cursor_peek(&c) <= end && trace_cursor_next(&c)) {
+    int now = level(&c, -1);
+    if (last == 0 && now == 1 && want_rising)
+      printf("%14.3f ns  rising\n", trace_ticks_to_ns(r, c.time));
+    else if (last == 1 && now == 0 && want_falling)
+      printf("%14.3f ns  falling\n", trace_ticks_to_ns(r, c.time));
+    else {
+      last = now;
+      continue;
+    }
+    if (!edges)
+      first_edge = c.time;
+    last_edge = c.time;
+    edges++;
+    last = now;
+  }
+  printf("%d edges", edges);
+  if (edges > 1)
+    printf(", %.3f ns apart on average", trace_ticks_to_ns(r, last_edge - first_edge) / (edges - 1));
+  printf("\n");
+
+  trace_cursor_free(&c);
+  trace_free(r);
+  return 0;
+}
+
+int do_i2c(const char *filename, const char *sda_name, const char *scl_name)
+{
+  struct trace_reader *r = open_trace(filename);
+  struct trace_cursor c[2];
+  int64_t start = window_start(r);
+  open_signal(r, &c[0], sda_name, start);
+  open_signal(r, &c[1], scl_name, start);
+  int64_t end = window_end(r);
+
+  // The bus is pulled up, so undriven lines are high
+  int sda = level(&c[0], 1), scl = level(&c[1], 1);
+  int in_transfer = 0;
+  int bits = 0, byte = 0, byte_number = 0;
+  int64_t t;
+  while ((t = next_changes(c, 2, end)) >= 0) {
+    int last_sda = sda, last_scl = scl;
+    sda = level(&c[0], 1);
+    scl = level(&c[1], 1);
+    double ns = trace_ticks_to_ns(r, t);
+
+    if (last_scl && scl) {
+      // SDA changing while SCL is high is a start or stop condition
+      if (last_sda && !sda) {
+        printf("%14.3f ns  %s\n", ns, in_transfer ? "RESTART" : "START");
+        in_transfer = 1;
+        bits = 0;
+        byte = 0;
+        byte_number = 0;
+      }
+      else if (!last_sda && sda && in_transfer) {
+        printf("%14.3f ns  STOP\n", ns);
+        in_transfer = 0;
+      }
+    }
+    else if (!last_scl && scl && in_transfer) {
+      // Data is sampled on the rising edge of SCL, with the 9th bit the ACK
+      if (bits < 8) {
+        byte = (byte << 1) | sda;
+        bits++;
+        continue;
+      }
+      if (!byte_number)
+        printf("%14.3f ns  address $%02x %s %s\n", ns, byte >> 1, byte & 1 ? "read" : "write", sda ? "NACK" : "ACK");
+      else
+        printf("%14.3f ns  data $%02x %s\n", ns, byte, sda ? "NACK" : "ACK");
+      byte_number++;
+      bits = 0;
+      byte = 0;
+    }
+  }
+
+  trace_cursor_free(&c[0]);
+  trace_cursor_free(&c[1]);
+  trace_free(r);
+  return 0;
+}
+
+#define HYPERRAM_MAX_SHOWN 64
+
+int do_hyperram(const char *filename, const char *prefix)
+{
+  struct trace_reader *r = open_trace(filename);
+  static const char *suffixes[4] = { "cs0", "clk_p", "rwds", "d" };
+  struct trace_cursor c[4];
+  int64_t start = window_start(r);
+  for (int i = 0; i < 4; i++) {
+    char name[TRACE_MAX_NAME];
+    snprintf(name, sizeof(name), "%s_%s", prefix, suffixes[i]);
+    open_signal(r, &c[i], name, start);
+  }
+  int64_t end = window_end(r);
+
+  int cs = level(&c[0], 1), clk = level(&c[1], 0), rwds = level(&c[2], 0);
+  int in_transfer = 0;
+  int ca_bytes = 0;
+  uint64_t ca = 0;
+  int is_read = 0;
+  int edges = 0;
+  int data_count = 0;
+  char data[HYPERRAM_MAX_SHOWN * 3 + 1];
+  int64_t t;
+
+  while ((t = next_changes(c, 4, end)) >= 0) {
+    int last_cs = cs, last_clk = clk, last_rwds = rwds;
+    cs = level(&c[0], 1);
+    clk = level(&c[1], 0);
+    rwds = level(&c[2], 0);
+    int d = c[3].unknown ? -1 : (int)(c[3].value & 0xff);
+    double ns = trace_ticks_to_ns(r, t);
+
+    if (last_cs && !cs) {
+      in_transfer = 1;
+      ca_bytes = 0;
+      ca = 0;
+      edges = 0;
+      data_count = 0;
+      data[0] = 0;
+      continue;
+    }
+    if (!last_cs && cs && in_transfer) {
+      in_transfer = 0;
+      if (ca_bytes < 6)
+        printf("%14.3f ns  incomplete command (%d bytes)\n", ns, ca_bytes);
+      else if (data_count)
+        printf("                 data:%s%s (%d bytes)\n", data, data_count > HYPERRAM_MAX_SHOWN ? " ..." : "", data_count);
+      continue;
+    }
+    if (!in_transfer)
+      continue;
+
+    // Bytes are transferred on both edges of the clock
+    int clk_edge = clk != last_clk;
+    int rwds_edge = rwds != last_rwds;
+    int byte = -2;
+    if (ca_bytes < 6) {
+      if (!clk_edge)
+        continue;
+      ca = (ca << 8) | (d & 0xff);
+      if (++ca_bytes < 6)
+        continue;
+      // CA[47] = read, CA[46] = register space, CA[45] = linear burst,
+      // CA[44:16] = upper address, CA[2:0] = lower address of 16-bit words
+      is_read = (ca >> 47) & 1;
+      uint32_t address = ((((ca >> 16) & 0x1fffffff) << 3) | (ca & 7)) * 2;
+      printf("%14.3f ns  %s %s $%07x%s\n", ns, is_read ? "read " : "write", (ca >> 46) & 1 ? "register" : "memory",
+          address, (ca >> 45) & 1 ? " linear" : " wrapped");
+      continue;
+    }
+    if (is_read) {
+      // Read data is strobed by the memory on RWDS
+      if (rwds_edge)
+        byte = d;
+    }
+    else if (clk_edge) {
+      // Write data follows the latency, with RWDS high masking the byte
+      if (++edges > write_latency * 2)
+        byte = rwds ? -1 : d;
+    }
+    if (byte == -2)
+      continue;
+    if (data_count < HYPERRAM_MAX_SHOWN) {
+      if (byte < 0)
+        strcat(data, " --");
+      else
+        sprintf(&data[data_count * 3], " %02x", byte);
+    }
+    data_count++;
+  }
+
+  for (int i = 0; i < 4; i++)
+    trace_cursor_free(&c[i]);
+  trace_free(r);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "s:e:l:")) != -1) {
+    switch (opt) {
+    case 's':
+      start_ns = strtod(optarg, NULL);
+      break;
+    case 'e':
+      end_ns = strtod(optarg, NULL);
+      break;
+    case 'l':
+      write_latency = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (argc - optind < 2)
+    usage();
+  const char *command = argv[optind];
+  char **args = &argv[optind + 1];
+  int arg_count = argc - optind - 1;
+
+  if (!strcmp(command, "import") && arg_count == 2) {
+    if (trace_import_vcd(args[0], args[1])) {
+      fprintf(stderr, "ERROR: Could not convert '%s' to '%s'\n", args[0], args[1]);
+      exit(-1);
+    }
+    return 0;
+  }
+  if (!strcmp(command, "export") && arg_count >= 2) {
+    struct trace_reader *r = open_trace(args[0]);
+    FILE *out = strcmp(args[1], "-") ? fopen(args[1], "w") : stdout;
+    if (!out) {
+      fprintf(stderr, "ERROR: Could not write to '%s'\n", args[1]);
+      exit(-1);
+    }
+    int64_t end = window_end(r);
+    int result = trace_export_vcd(r, out, &args[2], arg_count - 2, window_start(r), end == INT64_MAX ? -1 : end);
+    if (out != stdout)
+      fclose(out);
+    trace_free(r);
+    return result ? -1 : 0;
+  }
+  if (!strcmp(command, "info") && arg_count == 1)
+    return do_info(args[0]);
+  if (!strcmp(command, "dump") && arg_count == 2)
+    return do_dump(args[0], args[1]);
+  if (!strcmp(command, "edges") && (arg_count == 2 || arg_count == 3))
+    return do_edges(args[0], args[1], arg_count == 3 ? args[2] : "both");
+  if (!strcmp(command, "i2c") && (arg_count == 1 || arg_count == 3))
+    return do_i2c(args[0], arg_count == 3 ? args[1] : "sda", arg_count == 3 ? args[2] : "scl");
+  if (!strcmp(command, "hyperram") && (arg_count == 1 || arg_count == 2))
+    return do_hyperram(args[0], arg_count == 2 ? args[1] : "hr");
+
+  usage();
+  return -1;
+}
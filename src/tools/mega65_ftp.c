@@ -47,6 +47,7 @@
 #include "diskman.h"
 #include "dirtymock.h"
 #include "logging.h"
+#include "bitstream_io.h"
 
 #define BOOL int
 #define TRUE 1
@@ -119,6 +120,7 @@ char current_dir[1024] = "/";
 #include <termios.h>
 #include <readline/readline.h>
 #include <readline/history.h>
+#include <sys/mman.h>
 #endif
 
 int open_file_system(void);
@@ -180,8 +182,14 @@ unsigned char lfn_checksum(const unsigned char *pFCBName);
 int get_cluster_count(char *filename);
 void wipe_direntries_of_current_file_or_dir(void);
 
+int open_sdcard_device(const char *name);
+unsigned char *sdcard_sector(const unsigned int sector_number);
+
 int direct_sdcard_device = 0;
 FILE *fsdcard = NULL;
+// An image file given with -d is mapped, and its sectors read and written in place
+unsigned char *sdcard_image = NULL;
+long long sdcard_image_size = 0;
 
 // Helper routine for faster sector writing
 extern unsigned int helperroutine_len;
@@ -761,8 +769,7 @@ int DIRTYMOCK(main)(int argc, char **argv)
   errno = 0;
 
   if (direct_sdcard_device) {
-    fsdcard = fopen(device_name, "r+b");
-    if (fsdcard == NULL) {
+    if (open_sdcard_device(device_name)) {
       log_error("could not open device '%s'", device_name);
       exit(-3);
     }
@@ -1332,8 +1339,62 @@ int read_flash(const unsigned int flash_address, unsigned char *buffer)
   return retVal;
 }
 
+#ifndef WINDOWS
+void unmap_sdcard_image(void)
+{
+  if (msync(sdcard_image, sdcard_image_size, MS_SYNC))
+    log_error("could not write back '%s': %s", device_name, strerror(errno));
+  munmap(sdcard_image, sdcard_image_size);
+  sdcard_image = NULL;
+}
+#endif
+
+/*
+  Open the device or image file given with -d.  Image files are mapped, so
+  that preparing a card image offline costs no system call per sector; the
+  changes are written back with one msync() when mega65_ftp exits.  Block
+  devices (and Windows) go through stdio.
+*/
+int open_sdcard_device(const char *name)
+{
+  fsdcard = fopen(name, "r+b");
+  if (!fsdcard)
+    return -1;
+#ifndef WINDOWS
+  struct stat st;
+  if (!fstat(fileno(fsdcard), &st) && S_ISREG(st.st_mode) && st.st_size >= 512) {
+    void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fsdcard), 0);
+    if (p != MAP_FAILED) {
+      sdcard_image = p;
+      sdcard_image_size = st.st_size;
+      atexit(unmap_sdcard_image);
+      log_debug("mapped %lld byte image '%s'", sdcard_image_size, name);
+    }
+  }
+#endif
+  return 0;
+}
+
+// A sector of a mapped image, or NULL if the device is not mapped or the sector is past its end
+unsigned char *sdcard_sector(const unsigned int sector_number)
+{
+  if (!sdcard_image || (sector_number + 1LL) * 512 > sdcard_image_size)
+    return NULL;
+  return sdcard_image + sector_number * 512LL;
+}
+
 int read_sector_from_device(const unsigned int sector_number, unsigned char *buffer)
 {
+  if (sdcard_image) {
+    unsigned char *p = sdcard_sector(sector_number);
+    if (!p) {
+      log_error("sector %u is past the end of the image", sector_number);
+      return -1;
+    }
+    memcpy(buffer, p, 512);
+    return 0;
+  }
+
   fseeko(fsdcard, sector_number * 512LL, SEEK_SET);
   fread(buffer, 512, 1, fsdcard);
 
@@ -1413,6 +1474,16 @@ unsigned char verify[512];
 
 int write_sector_to_device(const unsigned int sector_number, unsigned char *buffer)
 {
+  if (sdcard_image) {
+    unsigned char *p = sdcard_sector(sector_number);
+    if (!p) {
+      log_error("sector %u is past the end of the image", sector_number);
+      return -1;
+    }
+    memcpy(p, buffer, 512);
+    return 0;
+  }
+
   fseeko(fsdcard, sector_number * 512LL, SEEK_SET);
   fwrite(buffer, 512, 1, fsdcard);
 
@@ -3023,8 +3094,6 @@ void write_tcl_script(models_type *mdl)
   fclose(f);
 }
 
-int bit2mcs(int argc, char *argv[]);
-
 BOOL initial_flashing_checks(void)
 {
   // assess if running in xemu. If so, exit
@@ -3060,12 +3129,20 @@ void flash_core_to_slot(char *fname, int slotnum)
   if (!check_model_id_field(fname))
     return;
 
-  // If we got here, all is good, so convert .cor to .mcs via bit2mcs tool
-  char offset[16];
-  sprintf(offset, "%08X", slotnum * mdl->slot_size * BYTES_PER_MB);
-  printf("Creating 'out.mcs' at offset: %s...\n", offset);
-  char *argv[4] = { "progname", fname, "out.mcs", offset };
-  bit2mcs(4, argv);
+  // If we got here, all is good, so write the .cor out as an .mcs for the slot
+  uint32_t offset = slotnum * mdl->slot_size * BYTES_PER_MB;
+  struct bitio_map core;
+  printf("Creating 'out.mcs' at offset: %08X...\n", offset);
+  if (bitio_map_file(fname, &core)) {
+    printf("- Could not read '%s'\n", fname);
+    return;
+  }
+  if (bitio_write_mcs("out.mcs", core.data, core.size, offset)) {
+    printf("- Could not write 'out.mcs'\n");
+    bitio_unmap_file(&core);
+    return;
+  }
+  bitio_unmap_file(&core);
 
   printf("Creating 'write-flash.tcl'...\n");
   // Then trigger the *-write-flash.tcl script to be run via vivado
@@ -3890,18 +3967,25 @@ int upload_single_file(char *name, char *dest_name)
       }
 
       // Write sector
-      unsigned char buffer[512];
-      bzero(buffer, 512);
-      int bytes = fread(buffer, 1, 512, f);
       sector_number = partition_start + first_cluster_sector + (sectors_per_cluster * (file_cluster - first_cluster))
                     + sector_in_cluster;
+      // Read straight into a mapped image, bypassing write_sector()
+      unsigned char *image_sector = direct_sdcard_device ? sdcard_sector(sector_number) : NULL;
+      unsigned char buffer[512];
+      unsigned char *dest = image_sector ? image_sector : buffer;
+      int bytes = fread(dest, 1, 512, f);
+      if (bytes < 512)
+        bzero(dest + bytes, 512 - bytes);
       if (0)
         printf("T+%lld : Read %d bytes from file, writing to sector $%x (%d) for cluster %d\n", gettime_us() - start_usec,
             bytes, sector_number, sector_number, file_cluster);
-      printf("\rUploaded %lld bytes.", (long long)st.st_size - remaining_length);
-      fflush(stdout);
+      // Every 64KB into a mapped image, so that the terminal does not set the pace
+      if (!image_sector || !(((long long)st.st_size - remaining_length) & 0xffff) || remaining_length <= 512) {
+        printf("\rUploaded %lld bytes.", (long long)st.st_size - remaining_length);
+        fflush(stdout);
+      }
 
-      if (write_sector(sector_number, buffer)) {
+      if (!image_sector && write_sector(sector_number, buffer)) {
         printf("ERROR: Failed to write to sector %d\n", sector_number);
         retVal = -1;
         break;
@@ -4742,28 +4826,36 @@ int download_single_file(char *dest_name, char *local_name, int showClusters)
         sector_number = partition_start + first_cluster_sector + (sectors_per_cluster * (file_cluster - first_cluster))
                       + sector_in_cluster;
 
+        // A mapped image is written out from in place
+        const unsigned char *src = direct_sdcard_device ? sdcard_sector(sector_number) : NULL;
+
         // We try to read-ahead a lot of sectors, because files are usually not very fragmented,
         // so the extra read-ahead reduces the rount-trip time for scheduling each successive job
-        if (read_sector(sector_number, download_buffer, CACHE_YES, 128)) {
-          printf("ERROR: Failed to read to sector %d\n", sector_number);
-          retVal = -1;
-          if (f)
-            fclose(f);
-          break;
+        if (!src) {
+          if (read_sector(sector_number, download_buffer, CACHE_YES, 128)) {
+            printf("ERROR: Failed to read to sector %d\n", sector_number);
+            retVal = -1;
+            if (f)
+              fclose(f);
+            break;
+          }
+          src = download_buffer;
         }
 
         if (remaining_bytes >= 512)
-          fwrite(download_buffer, 512, 1, f);
+          fwrite(src, 512, 1, f);
         else
-          fwrite(download_buffer, remaining_bytes, 1, f);
+          fwrite(src, remaining_bytes, 1, f);
       }
 
       if (0)
         printf("T+%lld : Read %d bytes from file, writing to sector $%x (%d) for cluster %d\n", gettime_us() - start_usec,
             (int)de.d_filelen, sector_number, sector_number, file_cluster);
-      if (!showClusters && !quietFlag)
+      // Every 64KB from a mapped image, so that the terminal does not set the pace
+      if (!showClusters && !quietFlag && (!sdcard_image || !(((long long)de.d_filelen - remaining_bytes) & 0xffff))) {
         printf("\rDownloaded %lld bytes.", (long long)de.d_filelen - remaining_bytes);
-      fflush(stdout);
+        fflush(stdout);
+      }
 
       //      printf("T+%lld : after write.\n",gettime_us()-start_usec);
 
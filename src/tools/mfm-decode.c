@@ -1,70 +1,48 @@
+/*
+  Decoder for MEGA65 FDC gap captures.
+
+  Each byte of a capture is the time between two flux transitions, in FDC
+  clock ticks.  The decoding itself is done by flux.c; this shows what was
+  found, along with diagnostics for tuning the FDC.  Several captures can be
+  decoded in parallel.  The per-pulse diagnostics are off by default, as
+  they are most of the work (and output) for a long capture.
+*/
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+
+#include "flux.h"
 
-int show_gaps = 1;
-int show_bits = 1;
-int show_quantised_gaps = 1;
+int show_gaps = 0;
+int show_bits = 0;
+int show_quantised_gaps = 0;
 int show_post_correction = 0;
+int write_raw_gaps = 0;
+int show_precomp = 0;
+int summary_only = 0;
+int use_pll = 0;
+int use_index = 0;
+int same_track = 0;
+int finish_last_field = 0;
 
 // MEGA65 floppies contain a track info block that is always written at DD data rate.
 // When the TIB is read, the FDC switches to the indicated rate and encoding
-float rate = 81 + 1; // DD 720KB
-// float rate=40+1; // HD 1.44MB
-
-int rll_encoding = 0;
-
-float quantise_gap_mfm(float gap)
-{
-  if (gap > 0.7 && gap <= 1.25)
-    gap = 1.0;
-  if (gap > 1.25 && gap <= 1.75)
-    gap = 1.5;
-  if (gap > 1.75 && gap < 2.25)
-    gap = 2.0;
-
-  // Give invalid gaps pseudo sensible values
-  if (gap <= 0.7)
-    gap = 1.0;
-  if (gap >= 2.25)
-    gap = 2.0;
-
-  return gap;
-}
-
-float quantise_gap_rll27(float gap)
-{
-  //  printf("gap=%f\n",gap);
-  //  if (gap <= 2.5)
-  //    gap = 2.0;
-  //  else
-  if (gap < 3.5)
-    gap = 3;
-  else if (gap < 4.5)
-    gap = 4;
-  else if (gap < 5.5)
-    gap = 5;
-  else if (gap < 6.5)
-    gap = 6;
-  else if (gap < 7.5)
-    gap = 7;
-  else
-    gap = 8;
-
-  // RLL2,7 uses convention of counting the gap length, excluding the pulse
-  // which is assumed to take up one pulse
-  gap -= 1;
-
-  return gap;
-}
-
-float quantise_gap(float gap)
-{
-  if (rll_encoding)
-    return quantise_gap_rll27(gap);
-  else
-    return quantise_gap_mfm(gap);
-}
+float default_rate = 81 + 1; // DD 720KB
+// float default_rate=40+1; // HD 1.44MB
+float forced_rate = 0;
+
+struct capture {
+  const char *filename;
+  FILE *out;
+  FILE *raw;
+  struct flux_decoder decoder;
+  struct flux_track track;
+};
 
 int q_gap(float gap)
 {
@@ -74,123 +52,194 @@ int q_gap(float gap)
   return b;
 }
 
-int last_pulse = 0;
-float last_gap = 0;
-int last_bit = 0;
-unsigned char byte = 0;
-int bits = 0;
-int byte_count = 0;
-int bytes_emitted = 0;
-int sync_count = 0;
-int field_ofs = 0;
-unsigned char data_field[1024];
-
-#define MAX_GAPS 65536 * 4
-float corrected_deltas[MAX_GAPS];
-float uncorrected_deltas[MAX_GAPS];
-int cdelta_count = 0;
-int ucdelta_count = 0;
-int start_data = 0;
-
-#define MAX_SIGNALS 64
-#define MAX_SAMPLES 65536 * 4
-float traces[MAX_SIGNALS][MAX_SAMPLES];
-int sample_counts[MAX_SIGNALS] = { 0 };
-float max_time = 0;
-
-// CRC16 algorithm from:
-// https://github.com/psbhlw/floppy-disk-ripper/blob/master/fdrc/mfm.cpp
-// GPL3+, Copyright (C) 2014, psb^hlw, ts-labs.
-// crc16 table
-unsigned short crc_ccitt[256];
-unsigned short crc = 0;
-
-// crc16 init table
-void crc16_init()
+float absf(float f)
 {
-  for (int i = 0; i < 256; i++) {
-    unsigned short w = i << 8;
-    for (int a = 0; a < 8; a++)
-      w = (w << 1) ^ ((w & 0x8000) ? 0x1021 : 0);
-    crc_ccitt[i] = w;
-  }
+  if (f < 0)
+    return -f;
+  return f;
 }
 
-// calc crc16 for 1 byte
-unsigned short crc16(unsigned short crc, unsigned short b)
+/*
+  State for rawgaps.csv, which compares each pulse against the last eight,
+  to see how well they line up with whole numbers of gaps.
+*/
+struct raw_gap_state {
+  float recent[8];
+  int recent_q[8];
+  float esum;
+};
+
+void write_raw_gap(struct capture *c, struct raw_gap_state *r, int n, int current_pulse, int last_pulse, float gap)
 {
-  crc = (crc << 8) ^ crc_ccitt[((crc >> 8) & 0xff) ^ b];
-  return crc;
+  struct flux_decoder *d = &c->decoder;
+  float divisor = d->divisor;
+  float now = current_pulse / divisor;
+
+  // v[k] is the time since pulse k, less the quantised gaps since then
+  float v[8];
+  int q_sum = 0;
+  for (int k = 7; k >= 0; k--) {
+    v[k] = now - r->recent[k] - q_sum;
+    q_sum += r->recent_q[k];
+  }
+
+  // Rule 1: Fall-back is to average the registration against the past five pulses
+  float avg = 0;
+  for (int i = 0; i < 8; i++)
+    avg += v[i];
+  avg /= 8;
+  float e1, e2;
+  e1 = gap - quantise_gap(gap, d->rll_encoding) - 1;
+
+  // Rule 2: If the gap is an integer number of gaps vs any of the past five pulses,
+  // then use the one that had the most hits
+  int best_count = 0;
+  int best_int = 0;
+  int counts[10] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  for (int i = 0; i < 8; i++) {
+    if (absf(v[i]) - ((int)absf(v[i])) < 0.02) {
+      int bin = (int)absf(v[i]);
+      if (bin >= 0 && bin < 10)
+        counts[bin]++;
+    }
+  }
+  for (int i = 3; i <= 8; i++) {
+    if (counts[i] > best_count) {
+      best_count = counts[i];
+      best_int = i;
+    }
+  }
+  if (best_count > 0)
+    avg = best_int;
+
+  e2 = avg - quantise_gap(gap, d->rll_encoding) - 1;
+  if (n >= 186)
+    r->esum += absf(e2 * 100) * absf(e2 * 100);
+
+  fprintf(c->raw,
+      "%-4d,% -9.2f"
+      ",% -5.2f"
+      ",% -5.2f"
+      ",%5d"
+      ",% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f"
+      ",% -7.2f,% -7.2f,% -7.2f"
+      "\n",
+      n, now, (current_pulse - last_pulse) / divisor, avg, current_pulse - last_pulse, v[0], v[1], v[2], v[3], v[4], v[5],
+      v[6], v[7], e1, e2, r->esum);
+  for (int k = 0; k < (8 - 1); k++) {
+    r->recent[k] = r->recent[k + 1];
+    r->recent_q[k] = r->recent_q[k + 1];
+  }
+  r->recent[7] = now;
+  r->recent_q[7] = quantise_gap(gap, d->rll_encoding) + 1;
 }
 
-void describe_data(void)
+/*
+  Report the gap lengths based on the previous two gaps
+  to help tune our write pre-comp logic
+*/
+void show_precomp_report(FILE *out, float divisor, const unsigned char *buffer, size_t count)
 {
-  unsigned short crc_calc;
-  switch (data_field[0]) {
-  case 0x65:
-    if (field_ofs > 6) {
-      // MEGA65 Track Information Block
-      fprintf(stdout, "\nTRACK INFO BLOCK: Track=%d, Divisor=%d (%.2fMHz), Encoding=$%02x\n", data_field[1], data_field[2],
-          40.5 / data_field[2], data_field[3]);
-      if ((data_field[3] & 0x0f) == 0x01) {
-        // RLL
-        rate = data_field[2];
-        rll_encoding = 1;
-      }
-      else {
-        // MFM
-        rate = data_field[2];
-        rll_encoding = 0;
-      }
-      start_data = ucdelta_count;
 
-      unsigned short crc = 0xffff;
-      printf("CRC Calc over:");
-      for (int i = 0; i < 3; i++) {
-        crc = crc16(crc, 0xa1);
-        printf(" $%02x", 0xa1);
-      }
-      for (int i = 0; i < 7; i++) {
-        if (i == 5)
-          crc_calc = crc;
-        crc = crc16(crc, data_field[i]);
-        printf(" $%02x", data_field[i]);
+  // Frequency of a gap following the two previously indicate gap values
+  unsigned int *gap_freqs = calloc(256 * 256 * 256, sizeof(unsigned int));
+  if (!gap_freqs) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+#define GAP_FREQ(a, b, c) gap_freqs[((a) << 16) | ((b) << 8) | (c)]
+
+  unsigned int cs[256];
+  bzero(cs, sizeof(unsigned int) * 256);
+  for (size_t i = 2; i < count; i++) {
+    GAP_FREQ(buffer[i - 2], buffer[i - 1], buffer[i])++;
+    cs[buffer[i]]++;
+  }
+  for (int c = 0; c < 256; c++) {
+    if (cs[c])
+      fprintf(out, "%3d : %d\n", c, cs[c]);
+  }
+
+  // Bucket each byte value as an RLL gap.  The values are shifted right one,
+  // so the rate is halved.
+  float rate = divisor / 2;
+  int q[256];
+  for (int v = 0; v < 256; v++)
+    q[v] = q_gap(quantise_gap(v / rate, 1));
+
+  unsigned int bc[10];
+  bzero(bc, sizeof(bc));
+  for (int a = 0; a < 256; a++)
+    for (int b = 0; b < 256; b++)
+      for (int c = 0; c < 256; c++)
+        bc[q[c]] += GAP_FREQ(a, b, c);
+
+  for (int c = 0; c < 10; c++) {
+    if (bc[c]) {
+      fprintf(out, "%d (%6d) : ", c, bc[c]);
+
+      int tally[10][10];
+
+      for (int c0 = 0; c0 < 256; c0++) {
+        if (q[c0] != c)
+          continue;
+        bzero(tally, sizeof(tally));
+        for (int a = 0; a < 256; a++)
+          for (int b = 0; b < 256; b++)
+            tally[q[a]][q[b]] += GAP_FREQ(a, b, c0);
+
+        fprintf(out, "\n      c0=%d : ", c0);
+        for (int a = 0; a < 10; a++) {
+          for (int b = 0; b < 10; b++) {
+            if (tally[a][b])
+              fprintf(out, " %d@%d,%d", tally[a][b], a, b);
+          }
+        }
       }
-      printf("\n");
-      if (crc)
-        printf("CRC FAIL! Saw $%02x%02x, Calculated $%04x\n", data_field[5], data_field[6], crc_calc);
-      else
-        printf("CRC ok\n");
+
+      fprintf(out, "\n");
     }
-    break;
-  case 0xfe:
-    // Sector header
-    fprintf(stdout, "\nSECTOR HEADER: Track=%d, Side=%d, Sector=%d, Size=%d (%d bytes) ", data_field[1], data_field[2],
-        data_field[3], data_field[4], 128 << (data_field[4]));
+  }
+#undef GAP_FREQ
+  free(gap_freqs);
+}
 
-    unsigned short crc = 0xffff;
+void describe_field(struct flux_decoder *d, struct flux_field *f, void *ctx)
+{
+  FILE *out = ctx;
+  unsigned char *data_field = f->data;
+
+  switch (f->type) {
+  case FLUX_FIELD_TIB:
+    fprintf(out, "\nTRACK INFO BLOCK: Track=%d, Divisor=%d (%.2fMHz), Encoding=$%02x\n", data_field[1], data_field[2],
+        40.5 / data_field[2], data_field[3]);
+    fprintf(out, "CRC Calc over:");
     for (int i = 0; i < 3; i++)
-      crc = crc16(crc, 0xa1);
-    for (int i = 0; i < 7; i++) {
-      if (i == 5)
-        crc_calc = crc;
-      crc = crc16(crc, data_field[i]);
-    }
-    if (crc)
-      printf("CRC FAIL! Saw $%02x%02x, Calculated $%04x\n", data_field[5], data_field[6], crc_calc);
+      fprintf(out, " $%02x", 0xa1);
+    for (int i = 0; i < 7; i++)
+      fprintf(out, " $%02x", data_field[i]);
+    fprintf(out, "\n");
+    if (!f->crc_ok)
+      fprintf(out, "CRC FAIL! Saw $%04x, Calculated $%04x\n", f->crc_saw, f->crc_calc);
+    else
+      fprintf(out, "CRC ok\n");
+    break;
+  case FLUX_FIELD_HEADER:
+    fprintf(out, "\nSECTOR HEADER: Track=%d, Side=%d, Sector=%d, Size=%d (%d bytes) ", data_field[1], data_field[2],
+        data_field[3], data_field[4], 128 << (data_field[4]));
+    if (!f->crc_ok)
+      fprintf(out, "CRC FAIL! Saw $%04x, Calculated $%04x\n", f->crc_saw, f->crc_calc);
     else
-      printf("CRC ok\n");
+      fprintf(out, "CRC ok\n");
     break;
-  case 0xfb:
-    // Sector data
-    crc = 0xffff;
-    printf("\nSECTOR DATA:\n");
+  case FLUX_FIELD_DATA:
+    fprintf(out, "\nSECTOR DATA:\n");
     for (int i = 0; i < 512; i += 16) {
-      printf("  %04x :", i);
+      fprintf(out, "  %04x :", i);
       for (int j = 0; j < 16; j++) {
-        printf(" %02x", data_field[1 + i + j]);
+        fprintf(out, " %02x", data_field[1 + i + j]);
       }
-      printf("    ");
+      fprintf(out, "    ");
       for (int j = 0; j < 16; j++) {
         unsigned char c = data_field[1 + i + j];
         // De-PETSCII the data
@@ -199,768 +248,350 @@ void describe_data(void)
         if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'))
           c ^= 0x20;
         if (c >= ' ' && c < 0x7f)
-          printf("%c", c);
+          fputc(c, out);
         else
-          printf(".");
+          fputc('.', out);
       }
-      printf("\n");
+      fprintf(out, "\n");
     }
-    for (int i = 0; i < 3; i++)
-      crc = crc16(crc, 0xa1);
-    unsigned short crc_calc;
-    for (int i = 0; i < 1 + 512 + 2; i++) {
-      if (i == 1 + 512)
-        crc_calc = crc;
-      crc = crc16(crc, data_field[i]);
-    }
-    if (crc) {
-      unsigned int fdc_crc = (data_field[1 + 512] << 8) + data_field[1 + 513];
-      printf("CRC FAIL!  (included field = $%04x, calculated as $%04x)\n", fdc_crc, crc_calc);
+    if (!f->crc_ok) {
+      fprintf(out, "CRC FAIL!  (included field = $%04x, calculated as $%04x)\n", f->crc_saw, f->crc_calc);
       for (int s = 0; s < 4; s++) {
-        crc = 0xffff;
+        unsigned short crc = 0xffff;
         for (int i = 0; i < s; i++)
           crc = crc16(crc, 0xa1);
         for (int i = 1; i < 1 + 512 + 2; i++) {
-          if (i == 1 + 512)
-            crc_calc = crc;
           crc = crc16(crc, data_field[i]);
-          if (crc == fdc_crc)
-            printf("CRC matched at i=%d, with %d sync marks\n", i, s);
+          if (crc == f->crc_saw)
+            fprintf(out, "CRC matched at i=%d, with %d sync marks\n", i, s);
         }
       }
     }
     else
-      printf("CRC ok\n");
-    // Clear sector between operations
-    bzero(data_field, 512);
+      fprintf(out, "CRC ok\n");
     break;
   default:
-    fprintf(stdout, "WARNING: Unknown data field type $%02x\n", data_field[0]);
+    fprintf(out, "WARNING: Unknown data field type $%02x\n", data_field[0]);
     break;
   }
 }
 
-void emit_bit(int b)
+int decode_capture(struct capture *c)
 {
-  if (show_bits)
-    printf("  bit %d\n", b);
-  last_bit = b;
-  byte = (byte << 1) | b;
-  bits++;
-  if (bits == 8) {
-    if (byte_count < 16)
-      byte_count++;
-    else {
-      printf("\n");
-      byte_count = 0;
-    }
-    if (sync_count == 3) {
-      printf("Data field type $%02x\n", byte);
-      sync_count = 0;
-      field_ofs = 1;
-      data_field[0] = byte;
-    }
-    else {
-      printf(" $%02x", byte);
-      if (field_ofs < 1024)
-        data_field[field_ofs++] = byte;
-      if (data_field[0] == 0x65 && field_ofs == 7)
-        describe_data();
-    }
-    bytes_emitted++;
-    byte = 0;
-    bits = 0;
-  }
-}
+  FILE *out = c->out;
+  size_t count;
+  time_t mtime;
 
-int skip_bits = 0;
-char buffered_bits[16];
-int buffered_bit_count = 0;
+  flux_track_init(&c->track);
 
-void buffer_bit(int bit)
-{
-  if (0)
-    fprintf(stdout, "buffered bits before stuffing next: %d:  %s\n", buffered_bit_count, buffered_bits);
+  const unsigned char *buffer = flux_map_capture(c->filename, &count, &mtime);
+  if (!buffer)
+    return -1;
 
-  buffered_bits[buffered_bit_count] = 0;
-  if (skip_bits) {
-    skip_bits--;
-    return;
-  }
-  if (buffered_bit_count < 16) {
-    buffered_bits[buffered_bit_count++] = bit;
-    buffered_bits[buffered_bit_count] = 0;
+  // A summary can come straight from the index, if the capture hasn't changed
+  if (use_index && summary_only && !same_track && !flux_index_read(c->filename, &c->track, count, mtime)) {
+    flux_unmap_capture(buffer, count);
+    flux_track_report(out, &c->track, c->filename);
+    return 0;
   }
-}
 
-// $4E = ...000100 00001000 0100
-//                6        4    5
+  fprintf(out, "Read %zu bytes\n", count);
+  fprintf(out, "NOTE: Assuming DMA floppy gap capture.\n");
+  fprintf(out, "      %zu samples.\n", count);
 
-// $FE = 1000 1000 1000 0100
-//
-
-// 0001000100001001
-
-//    010  10 0010
-
-void bit_buffer_shuffle(int n)
-{
-  for (int i = 0; i < (buffered_bit_count - n); i++)
-    buffered_bits[i] = buffered_bits[i + n];
-  buffered_bit_count -= n;
-  buffered_bits[buffered_bit_count] = 0;
-}
-
-void rll27_decode_gap(float gap)
-{
-  /*
-    Input    Encoded
-
-    11       1000
-    10       0100
-    000      100100
-    010      000100
-    011      001000
-    0011     00001000
-    0010     00100100
-  */
-
-  for (int i = 0; i < gap; i++)
-    buffer_bit('0');
-  buffer_bit('1');
-
-  buffered_bits[buffered_bit_count] = 0;
-  //  printf("buffered bits: [%s]\n",buffered_bits);
-
-  if (buffered_bit_count >= 8) {
-    if (!strncmp("00001000", buffered_bits, 8)) {
-      emit_bit(0);
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(1);
-      bit_buffer_shuffle(8);
-    }
-    else if (!strncmp("00100100", buffered_bits, 8)) {
-      emit_bit(0);
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(0);
-      bit_buffer_shuffle(8);
-    }
-  }
-  if (buffered_bit_count >= 6) {
-    if (!strncmp("100100", buffered_bits, 6)) {
-      emit_bit(0);
-      emit_bit(0);
-      emit_bit(0);
-      bit_buffer_shuffle(6);
-    }
-    else if (!strncmp("000100", buffered_bits, 6)) {
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(0);
-      bit_buffer_shuffle(6);
-    }
-    else if (!strncmp("001000", buffered_bits, 6)) {
-      emit_bit(0);
-      emit_bit(1);
-      emit_bit(1);
-      bit_buffer_shuffle(6);
-    }
-  }
-  if (buffered_bit_count >= 4) {
-    if (!strncmp("1000", buffered_bits, 4)) {
-      emit_bit(1);
-      emit_bit(1);
-      bit_buffer_shuffle(4);
-    }
-    else if (!strncmp("0100", buffered_bits, 4)) {
-      emit_bit(1);
-      emit_bit(0);
-      bit_buffer_shuffle(4);
-    }
+  // Obtain data rate from filename if present, or else from the gaps themselves
+  float rate = forced_rate;
+  if (!rate && sscanf(c->filename, "rate%f", &rate) != 1) {
+    rate = flux_detect_rate(buffer, count);
+    if (rate)
+      fprintf(out, "Rate = %f (from gap histogram)\n", rate);
+    else
+      rate = default_rate;
   }
-}
-
-float recent_gaps[4];
-float sync_gaps_mfm[4] = { 2.0, 1.5, 2.0, 1.5 };
-float sync_gaps_rll27[2] = { 7.0, 2.0 };
-
-int reset_delta = 0;
-int found_sync3 = 0;
-
-float previous_partial_gap = 0;
-
-float mfm_decode(float gap)
-{
-  float gap_in = gap + previous_partial_gap;
-
-  if (gap_in < 0.7) {
-    previous_partial_gap = gap;
-    printf("Accumulating short gap %.2f\n", gap);
-    return 0;
+  else
+    fprintf(out, "Rate = %f\n", rate);
+
+  struct flux_decoder *d = &c->decoder;
+  flux_decoder_init(d, &c->track, rate);
+  if (use_pll)
+    flux_enable_pll(d);
+  d->log = out;
+  if (!summary_only) {
+    d->log_flags = FLUX_LOG_BYTES | (show_bits ? FLUX_LOG_BITS : 0) | (show_quantised_gaps ? FLUX_LOG_QUANTISED : 0);
+    d->field_callback = describe_field;
+    d->callback_ctx = out;
   }
 
-  if (previous_partial_gap) {
-    printf("Accumulated gap = %.2f + %.2f = %.2f\n", gap, previous_partial_gap, gap_in);
-  }
-  gap = quantise_gap(gap_in);
-  previous_partial_gap = 0;
-
-  if (show_quantised_gaps)
-    printf("%.2f (%.2f)\n", gap, gap_in);
-
-  // Look at recent gaps to see if it is a sync mark
-  for (int i = 0; i < 3; i++)
-    recent_gaps[i] = recent_gaps[i + 1];
-  recent_gaps[3] = gap;
-
-  int i;
-  if (!rll_encoding) {
-    for (i = 0; i < 4; i++)
-      if (recent_gaps[i] != sync_gaps_mfm[i])
-        break;
-  }
-  else {
-    for (i = 2; i < 4; i++)
-      if (recent_gaps[i] != sync_gaps_rll27[i - 2])
-        break;
-  }
-  if (i == 4) {
-    //    if (byte_count)
-    //      printf("\n");
-    if (bytes_emitted) {
-      describe_data();
-      printf("(%d bytes since last sync)\n", bytes_emitted);
-      sync_count = 0;
+  if (write_raw_gaps) {
+    char raw_name[1024];
+    snprintf(raw_name, sizeof(raw_name), "%s.rawgaps.csv", c->filename);
+    c->raw = fopen(raw_name, "w");
+    if (!c->raw) {
+      fprintf(stderr, "ERROR: Could not create '%s'\n", raw_name);
+      flux_unmap_capture(buffer, count);
+      return -1;
     }
-    sync_count++;
-    if (sync_count == 3) {
-      printf("SYNC MARK (3x $A1)\n");
-      found_sync3++;
-    }
-    printf("Sync $A1 x #%d\n", sync_count);
-    bits = 0;
-    byte = 0;
-    byte_count = 0;
-    bytes_emitted = 0;
-    buffered_bits[0] = '1';
-    buffered_bits[1] = 0;
-    buffered_bit_count = 1;
-    reset_delta = 1;
-    if (rll_encoding)
-      skip_bits = 3;
-    return gap;
-  }
-
-  if (rll_encoding) {
-    rll27_decode_gap(gap);
   }
-  else {
-    // MFM
-    if (!last_gap) {
-      if (gap == 1.0) {
-        emit_bit(1);
-        emit_bit(1);
+  struct raw_gap_state raw_state;
+  bzero(&raw_state, sizeof(raw_state));
+
+  int last_pulse = 0;
+  int last_pulse_uncorrected = 9;
+  int pulse_adjust = 0;
+  int early = 0;
+  int late = 0;
+  int n = 0;
+  int current_pulse = 0;
+
+  for (size_t i = 1; i < count; i++) {
+    pulse_adjust = 0;
+    int ticks = buffer[i];
+    float divisor = d->divisor;
+
+    current_pulse += ticks;
+    n++;
+
+    if (show_gaps)
+      fprintf(out, " $%03x(%3d) ", ticks * 3 / 2, ticks * 3 / 2);
+
+    if (c->raw)
+      write_raw_gap(c, &raw_state, n, current_pulse, last_pulse, ticks / divisor);
+
+    if (show_gaps)
+      fprintf(out, "%.2f (%d-%d=%d)\n", ticks / divisor, current_pulse, last_pulse, current_pulse - last_pulse);
+
+    if (d->found_sync3 == 1) {
+      if (!summary_only)
+        fprintf(out, "Harmonising at Sync3 after %d samples\n", n - 1);
+      d->found_sync3++;
+    }
+
+    int quantised = flux_decode_ticks(d, ticks);
+    if (show_quantised_gaps) {
+      float uncorrected_gap = (current_pulse - last_pulse_uncorrected) / divisor;
+      float uc_delta = quantise_gap(uncorrected_gap, d->rll_encoding) - uncorrected_gap + 1;
+      fprintf(out, "     uncorrected gap=%.2f, delta=%.2f\n", uncorrected_gap, uc_delta);
+    }
+    if (d->rll_encoding) {
+      float delta = (ticks / divisor - 1) - quantised / 2.0;
+      if (d->reset_delta) {
+        delta = 0;
+        d->reset_delta = 0;
       }
-      else if (gap == 1.5) {
-        emit_bit(0);
-        emit_bit(1);
+      if (delta > 0 && delta <= 0.5) {
+        // Pulse is a bit late, so adjust last_pulse backwards a bit
+        pulse_adjust = (int)(delta * divisor);
       }
-      else if (gap >= 2.0) {
-        emit_bit(1);
-        emit_bit(0);
-        emit_bit(1);
+      if (delta < 0 && delta >= -0.5) {
+        // Pulse is a bit late, so adjust last_pulse backwards a bit
+        pulse_adjust = (int)(delta * divisor);
       }
-    }
-    else {
-      if (last_bit == 1) {
-        if (gap == 1.0)
-          emit_bit(1);
-        else if (gap == 1.5) {
-          emit_bit(0);
-          emit_bit(0);
-        }
-        else if (gap >= 2.0) {
-          emit_bit(0);
-          emit_bit(1);
-        }
+      if (delta < 0)
+        early++;
+      if (delta > 0)
+        late++;
+      if (late > 5) {
+        if (show_post_correction)
+          fprintf(out, "     LATE\n");
+        late = 0;
+        pulse_adjust--;
       }
-      else {
-        // last bit was a 0
-        if (gap == 1.0)
-          emit_bit(0);
-        else if (gap == 1.5) {
-          emit_bit(1);
-        }
-        else if (gap == 2.0) {
-          emit_bit(0);
-          emit_bit(1);
-        }
+      if (early > 5) {
+        if (show_post_correction)
+          fprintf(out, "     EARLY\n");
+        early = 0;
+        pulse_adjust++;
       }
+
+      if (show_post_correction)
+        fprintf(out, "     post-correction delta=%.2f\n", delta);
     }
+    last_pulse = current_pulse - pulse_adjust;
+    last_pulse_uncorrected = current_pulse;
   }
 
-  last_gap = gap;
-  return gap;
-}
+  // Describe whatever was read after the last sync mark.  The field is cut
+  // short, so it only counts if its CRC happens to be right anyway.
+  if (finish_last_field)
+    flux_decoder_finish(d);
 
-struct precomp_rule {
-  float before, me, after;
-  float shift;
-};
+  if (c->raw)
+    fclose(c->raw);
 
-float absf(float f)
-{
-  if (f < 0)
-    return -f;
-  return f;
-}
+  fprintf(out, "\n");
 
-#define RULE_COUNT 13
-// clang-format off
-struct precomp_rule rules[RULE_COUNT]
-={
-  { 1.0,1.0,1.5,+0.10 }, //
-  { 1.0,1.0,2.0,+0.15 }, //
-
-  { 1.0,1.5,1.0,-0.20 }, //
-  { 1.0,1.5,1.5,-0.15 },
-  { 1.0,1.5,2.0,-0.05 },
-
-  { 1.0,2.0,1.0,-0.25 }, //
-  { 1.0,2.0,1.5,-0.20 }, 
-  
-  { 1.5,1.0,1.0,+0.10 },
-  { 1.5,1.0,2.0,+0.20 }, //
-
-  { 1.5,1.5,1.0,-0.05 }, //
-  { 1.5,2.0,1.0,-0.15 }, //
-  
-  { 2.0,1.0,1.00,+0.15},
-  { 2.0,1.0,1.50,+0.20}  //
-};
-// clang-format on
-
-// Frequency of a gap following the two previously indicate gap values
-unsigned int gap_freqs[256][256][256];
+  if (show_precomp)
+    show_precomp_report(out, d->divisor, buffer, count);
 
-int main(int argc, char **argv)
-{
-  if (argc < 2) {
-    fprintf(stderr, "usage: mfm-decode <MEGA65 FDC read capture ...>\n");
-    exit(-1);
-  }
+  flux_unmap_capture(buffer, count);
 
-  for (int i = 0; i < MAX_SIGNALS; i++) {
-    sample_counts[i] = 0;
+  if (!same_track) {
+    flux_track_vote(&c->track);
+    flux_track_report(out, &c->track, c->filename);
+    if (use_index)
+      flux_index_write(c->filename, &c->track, count, mtime);
   }
+  return 0;
+}
 
-  for (int arg = 1; arg < argc; arg++) {
-    FILE *f = fopen(argv[arg], "r");
-    unsigned char buffer[MAX_SAMPLES];
-    int count = fread(buffer, 1, MAX_SAMPLES, f);
-    printf("Read %d bytes\n", count);
-
-    crc16_init();
-
-    int i;
-
-    fprintf(stderr, "NOTE: Assuming DMA floppy gap capture.\n");
-    fprintf(stderr, "      %d samples.\n", count);
-
-    // Obtain data rate from filename if present
-    sscanf(argv[arg], "rate%f", &rate);
-    fprintf(stderr, "Rate = %f\n", rate);
-
-    last_pulse = 0;
-    found_sync3 = 0;
-
-    float divisor = rate;
-    int pulse_adjust = 0;
-    int last_pulse_uncorrected = 9;
-    int early = 0;
-    int late = 0;
-    int n = 0;
-
-    FILE *raw = fopen("rawgaps.csv", "w");
-    float recent[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    int recent_q[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-    float esum = 0;
-
-    int current_pulse = 0;
-
-    for (i = 1; i < count; i++) {
-      pulse_adjust = 0;
-      float gap = buffer[i];
-
-      current_pulse += buffer[i];
-
-      if (show_gaps)
-        printf(" $%03x(%3d) ", (int)(gap * 3.0 / 2), (int)(gap * 3.0 / 2));
-      gap /= divisor;
-
-      n++;
-
-      float v[8] = { current_pulse / divisor - recent[0] - recent_q[1] - recent_q[2] - recent_q[3] - recent_q[4]
-                         - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[1] - recent_q[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6]
-            - recent_q[7],
-        current_pulse / divisor - recent[2] - recent_q[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
-
-        current_pulse / divisor - recent[3] - recent_q[4] - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[4] - recent_q[5] - recent_q[6] - recent_q[7],
-        current_pulse / divisor - recent[5] - recent_q[6] - recent_q[7], current_pulse / divisor - recent[6] - recent_q[7],
-        current_pulse / divisor - recent[7] };
-
-      // Rule 1: Fall-back is to average the registration against the past five pulses
-      float avg = 0;
-      for (int i = 0; i < 8; i++)
-        avg += v[i];
-      avg /= 8;
-      float e1, e2;
-      e1 = gap - quantise_gap(gap) - 1;
-
-      // Rule 2: If the gap is an integer number of gaps vs any of the past five pulses,
-      // then use the one that had the most hits
-      int best_count = 0;
-      int best_int = 0;
-      int counts[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-      for (int i = 0; i < 8; i++) {
-        if (absf(v[i]) - ((int)absf(v[i])) < 0.02) {
-          int bin = (int)absf(v[i]);
-          if (bin >= 0 && bin < 10)
-            counts[bin]++;
-        }
-      }
-      for (int i = 3; i <= 8; i++) {
-        if (counts[i] > best_count) {
-          best_count = counts[i];
-          best_int = i;
-        }
-      }
-      if (best_count > 0)
-        avg = best_int;
-
-      e2 = avg - quantise_gap(gap) - 1;
-      if (n >= 186)
-        esum += absf(e2 * 100) * absf(e2 * 100);
-
-      fprintf(raw,
-          "%-4d,% -9.2f"
-          ",% -5.2f"
-          ",% -5.2f"
-          ",%5d"
-          ",% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f,% -7.2f"
-          ",% -7.2f,% -7.2f,% -7.2f"
-          "\n",
-          n, current_pulse / divisor, (current_pulse - last_pulse) / divisor, avg, current_pulse - last_pulse, v[0], v[1],
-          v[2], v[3], v[4], v[5], v[6], v[7], e1, e2, esum);
-      for (int r = 0; r < (8 - 1); r++)
-        recent[r] = recent[r + 1];
-      for (int r = 0; r < (8 - 1); r++)
-        recent_q[r] = recent_q[r + 1];
-      recent[7] = current_pulse / divisor;
-      recent_q[7] = quantise_gap(gap) + 1;
-
-      if (show_gaps)
-        printf("%.2f (%d-%d=%d)\n", gap, current_pulse, last_pulse, current_pulse - last_pulse);
-
-      if (found_sync3 == 1) {
-        printf("Harmonising at Sync3 after %d samples\n", sample_counts[arg]);
-        sample_counts[arg] = 0;
-        found_sync3++;
-      }
-
-      // Log the trace
-      if (sample_counts[arg]) {
-        // Calculate cumulative time
-        traces[arg][sample_counts[arg]] = gap + traces[arg][sample_counts[arg] - 1];
-      }
-      else {
-        traces[arg][sample_counts[arg]] = gap;
-      }
-      sample_counts[arg]++;
-      if (traces[arg][sample_counts[arg] - 1] > max_time)
-        max_time = traces[arg][sample_counts[arg] - 1];
-
-      float quantised = mfm_decode(gap);
-      {
-        float uncorrected_gap = current_pulse - last_pulse_uncorrected;
-        uncorrected_gap /= divisor;
-        float uc_delta = quantise_gap(uncorrected_gap) - uncorrected_gap + 1;
-        if (show_quantised_gaps)
-          printf("     uncorrected gap=%.2f, delta=%.2f\n", uncorrected_gap, uc_delta);
-        uncorrected_deltas[ucdelta_count++] = uc_delta;
-      }
-      if (rll_encoding) {
-        float delta = (gap - 1) - quantised;
-        if (reset_delta) {
-          delta = 0;
-          reset_delta = 0;
-        }
-        if (delta > 0 && delta <= 0.5) {
-          // Pulse is a bit late, so adjust last_pulse backwards a bit
-          pulse_adjust = (int)(delta * divisor);
-          //		printf("rewind last_pulse by %d\n",pulse_adjust);
-        }
-        if (delta < 0 && delta >= -0.5) {
-          // Pulse is a bit late, so adjust last_pulse backwards a bit
-          pulse_adjust = (int)(delta * divisor);
-          //		printf("advance last_pulse by %d\n",-pulse_adjust);
-        }
-        if (delta < 0)
-          early++;
-        if (delta > 0)
-          late++;
-        if (late > 5) {
-          if (show_post_correction)
-            printf("     LATE\n");
-          late = 0;
-          pulse_adjust--;
-        }
-        if (early > 5) {
-          if (show_post_correction)
-            printf("     EARLY\n");
-          early = 0;
-          pulse_adjust++;
-        }
-
-        if (show_post_correction)
-          printf("     post-correction delta=%.2f\n", delta);
-        corrected_deltas[ucdelta_count] = delta;
-      }
-      last_pulse = current_pulse - pulse_adjust;
-      last_pulse_uncorrected = current_pulse;
-    }
-
-    fclose(raw);
-
-    printf("\n");
-
-    // Record the gap lengths based on the previous two gaps
-    // to help tune our write pre-comp logic
-    bzero(gap_freqs, sizeof(unsigned int) * 256 * 256 * 256);
-    unsigned int cs[256];
-    bzero(cs, sizeof(unsigned int) * 256);
-    for (i = 2; i < count; i++) {
-      gap_freqs[buffer[i - 2]][buffer[i - 1]][buffer[i]]++;
-      cs[buffer[i]]++;
-    }
-    for (int c = 0; c < 256; c++) {
-      if (cs[c])
-        printf("%3d : %d\n", c, cs[c]);
-    }
+/* ============================================================= */
 
-    unsigned int buckets[10][10][10];
-    bzero(buckets, sizeof(unsigned int) * 10 * 10 * 10);
-    unsigned int bc[10];
-    bzero(bc, sizeof(bc));
-
-    rll_encoding = 1;
-    rate = rate / 2; // because values are shifted right one
-
-    for (int c = 0; c < 256; c++) {
-      //	if (!cs[c]) { skip=1; continue; }
-      for (int a = 0; a < 256; a++) {
-        for (int b = 0; b < 256; b++) {
-          if (gap_freqs[a][b][c]) {
-            //	      printf("%d,%d,%d\n",
-            //		     q_gap(quantise_gap(a/rate)),q_gap(quantise_gap(b/rate)),q_gap(quantise_gap(c/rate)));
-            buckets[q_gap(quantise_gap(a / rate))][q_gap(quantise_gap(b / rate))][q_gap(quantise_gap(c / rate))]
-                += gap_freqs[a][b][c];
-            bc[q_gap(quantise_gap(c / rate))] += gap_freqs[a][b][c];
-          }
-        }
-      }
-      //	printf("\n");
-    }
+struct capture *captures;
+int capture_count = 0;
+int next_capture = 0;
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    // int skip = 0;
-    for (int c = 0; c < 10; c++) {
-      if (bc[c]) {
-        printf("%d (%6d) : ", c, bc[c]);
-
-        int tally[10][10];
-
-        for (int c0 = 0; c0 < 256; c0++) {
-          int cc = q_gap(quantise_gap(c0 / rate));
-          bzero(tally, sizeof(tally));
-          for (int a = 0; a < 256; a++) {
-            for (int b = 0; b < 256; b++) {
-              int aa = q_gap(quantise_gap(a / rate));
-              int bb = q_gap(quantise_gap(b / rate));
-              if (cc == c) {
-                if (gap_freqs[a][b][c0]) {
-                  tally[aa][bb] += gap_freqs[a][b][c0];
-                }
-              }
-            }
-          }
+void *worker(void *arg)
+{
+  while (1) {
+    pthread_mutex_lock(&capture_lock);
+    int i = next_capture++;
+    pthread_mutex_unlock(&capture_lock);
+    if (i >= capture_count)
+      break;
+    decode_capture(&captures[i]);
+  }
+  return NULL;
+}
 
-          if (cc == c) {
-            printf("\n      c0=%d : ", c0);
-            for (int a = 0; a < 10; a++) {
-              for (int b = 0; b < 10; b++) {
-                if (tally[a][b])
-                  printf(" %d@%d,%d", tally[a][b], a, b);
-              }
-            }
-          }
-        }
+void usage(void)
+{
+  fprintf(stderr, "usage: mfm-decode [-j threads] [-R rate] [-gbqcrpsPimf] <MEGA65 FDC read capture ...>\n"
+                  "  -j  number of captures to decode at once (default: number of CPUs)\n"
+                  "  -R  ticks per bit cell (default: from a file name of the form rate<n>...,\n"
+                  "      or else from the gaps)\n"
+                  "  -g  show each gap\n"
+                  "  -b  show each decoded bit\n"
+                  "  -q  show each quantised gap\n"
+                  "  -c  show RLL post-correction\n"
+                  "  -r  write <capture>.rawgaps.csv with the registration of each pulse\n"
+                  "  -p  show gap statistics for tuning write pre-compensation\n"
+                  "  -s  only show the summary of each capture\n"
+                  "  -P  follow the data rate with a PLL, instead of a fixed rate\n"
+                  "  -i  keep a <capture>.idx index, and use it for -s if the capture is unchanged\n"
+                  "  -m  the captures are all of the same track: vote on their sectors together\n"
+                  "  -f  also decode the field that is cut off by the end of each capture\n"
+                  "      (the index of -i only ever describes captures decoded without it)\n");
+  exit(-1);
+}
 
-        printf("\n");
-      }
+int main(int argc, char **argv)
+{
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:R:gbqcrpsPimf")) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 'R':
+      forced_rate = atof(optarg);
+      break;
+    case 'g':
+      show_gaps = 1;
+      break;
+    case 'b':
+      show_bits = 1;
+      break;
+    case 'q':
+      show_quantised_gaps = 1;
+      break;
+    case 'c':
+      show_post_correction = 1;
+      break;
+    case 'r':
+      write_raw_gaps = 1;
+      break;
+    case 'p':
+      show_precomp = 1;
+      break;
+    case 's':
+      summary_only = 1;
+      break;
+    case 'P':
+      use_pll = 1;
+      break;
+    case 'i':
+      use_index = 1;
+      break;
+    case 'm':
+      same_track = 1;
+      break;
+    case 'f':
+      finish_last_field = 1;
+      break;
+    default:
+      usage();
     }
   }
-  return 0;
-
-  FILE *f = fopen("gaps.vcd", "w");
-  if (!f)
-    return -1;
-
-  fprintf(f, "$date\n"
-             "   Mon Feb 17 15:29:53 2020\n"
-             "\n"
-             "$end\n"
-             "$version\n"
-             "   MEGA65 Floppy Decode Trace Tool.\n"
-             "$end\n"
-             "$comment\n"
-             "   No comment.\n"
-             "$end\n"
-             "$timescale 1us $end\n"
-             "$scope module logic $end\n");
-
-  for (int arg = 1; arg < argc + 2; arg++) {
-    if (arg < argc)
-      fprintf(f, "$var wire 1 %c %s $end\n", '@' + arg, argv[arg]);
-    else if (arg == argc)
-      fprintf(f, "$var wire 1 %c model $end\n", '@' + arg);
-    else
-      fprintf(f, "$var wire 1 %c modelerr $end\n", '@' + arg);
+  if (optind >= argc)
+    usage();
+  if (finish_last_field)
+    use_index = 0;
+
+  capture_count = argc - optind;
+  captures = calloc(capture_count, sizeof(struct capture));
+  if (!captures) {
+    perror("calloc() failed");
+    exit(-3);
   }
-
-  fprintf(f, "$upscope $end\n"
-             "$enddefinitions $end\n"
-             "$dumpvars\n");
-  for (int arg = 1; arg < argc + 2; arg++)
-    fprintf(f, "0%c\n", '@' + arg);
-  fprintf(f, "$end\n"
-             "\n");
-
-  printf("Determining average time base for fastest rate...\n");
-  float sum = 0;
-  int count = 0;
-  for (int i = 1; i < sample_counts[1]; i++) {
-    float diff = traces[1][i] - traces[1][i - 1];
-    if (diff >= 0.91 && diff <= 1.09) {
-      sum += diff;
-      count++;
+  if (threads > capture_count)
+    threads = capture_count;
+  if (threads < 1)
+    threads = 1;
+
+  // With more than one capture at a time, each one is decoded into a
+  // temporary file, and then shown in order
+  static char stdout_buffer[1 << 16];
+  setvbuf(stdout, stdout_buffer, _IOFBF, sizeof(stdout_buffer));
+  for (int i = 0; i < capture_count; i++) {
+    captures[i].filename = argv[optind + i];
+    captures[i].out = threads > 1 ? tmpfile() : stdout;
+    if (!captures[i].out) {
+      perror("tmpfile() failed");
+      exit(-3);
     }
   }
-  printf("%d samples for slowest rate.\n", sample_counts[argc - 1]);
-  if (count)
-    printf("Renormalising %d samples : 1.0 step on average = %.2f to 1.0\n", sample_counts[1], sum / count);
-  // Renormalise trace 1 to be exactly 1.0 per MFM bit
-  for (int i = 1; i < sample_counts[1]; i++)
-    traces[1][i] /= sum / count;
-
-  // Generate modeled distorted high-data-rate signal
-  // Rule #1: short then long makes the short late, and the long early (draws them together)
-  // Rule #2: long then short makes the long early and short late (pushes them apart)
-  // Rule #3: Double early and double late make no difference
-  // Rule #4: Presumably early + late = ontime ("The Deutsche Bahn Rule")
-  printf("Surrounding gaps:\n");
-  for (int i = 0; i < sample_counts[argc - 1]; i++) {
-    float gap_before = 1.0;
-    float gap_me = 1.0;
-    float gap_after = 1.0;
-    if (i > 1) {
-      gap_before = traces[argc - 1][i - 1] - traces[argc - 1][i - 2];
-    }
-    if (i) {
-      gap_me = traces[argc - 1][i] - traces[argc - 1][i - 1];
-    }
-    if (i < (sample_counts[argc - 1] - 1)) {
-      gap_after = traces[argc - 1][i + 1] - traces[argc - 1][i];
-    }
-    gap_before = quantise_gap(gap_before);
-    gap_me = quantise_gap(gap_me);
-    gap_after = quantise_gap(gap_after);
 
-    float gap_munged = gap_me;
-
-    for (int j = 0; j < RULE_COUNT; j++) {
-      if (gap_before == rules[j].before && gap_me == rules[j].me && gap_after == rules[j].after)
-        gap_munged += rules[j].shift;
-    }
+  if (threads == 1)
+    worker(NULL);
+  else {
+    pthread_t workers[threads];
+    for (int i = 0; i < threads; i++)
+      if (pthread_create(&workers[i], NULL, worker, NULL)) {
+        perror("pthread_create() failed");
+        exit(-3);
+      }
+    for (int i = 0; i < threads; i++)
+      pthread_join(workers[i], NULL);
 
-    traces[argc][i] = gap_munged;
-    float ref_gap = 1.0;
-    if (i) {
-      ref_gap = traces[1][i] - traces[1][i - 1];
-      //	traces[argc+1][i]=quantise_gap(ref_gap)-gap_munged;
-      traces[argc + 1][i] = ref_gap - gap_munged;
-      traces[argc][i] += traces[argc][i - 1];
+    for (int i = 0; i < capture_count; i++) {
+      char buf[65536];
+      size_t r;
+      rewind(captures[i].out);
+      while ((r = fread(buf, 1, sizeof(buf), captures[i].out)) > 0)
+        fwrite(buf, 1, r, stdout);
+      fclose(captures[i].out);
     }
-    printf("#%-5d : %.2f : %.2f : %.2f : %.2f : M=%.2f vs R=%.2f (%.2f)", i, traces[argc - 1][i], gap_before, gap_me,
-        gap_after, gap_munged, ref_gap, traces[argc - 1][i]);
-    if (absf(traces[argc + 1][i]) >= 0.06)
-      printf("  E=%.2f", traces[argc + 1][i]);
-    printf("\n");
   }
 
-  float time = 0;
-  int ofs[MAX_SIGNALS] = { 0 };
-  int asserted[MAX_SIGNALS] = { 0 };
-  for (int arg = 1; arg < argc + 2; arg++) {
-    for (int i = 0; i < sample_counts[arg]; i++)
-      printf("#%d : %.2f : %.2f\n", arg, traces[arg][i], i ? traces[arg][i] - traces[arg][i - 1] : traces[arg][i]);
+  if (same_track) {
+    // Every capture is another look at the same sectors
+    for (int i = 1; i < capture_count; i++)
+      flux_track_merge(&captures[0].track, &captures[i].track);
+    flux_track_vote(&captures[0].track);
+    flux_track_report(stdout, &captures[0].track, "all captures");
   }
-
-  for (time = 0; time < (max_time + 0.01); time += 0.01) {
-    for (int arg = 1; arg < argc + 2; arg++) {
-      if (ofs[arg] < sample_counts[arg]) {
-        if (asserted[arg]) {
-          fprintf(f, "#%d\n0%c\n", (int)(time * 100), '@' + arg);
-          asserted[arg] = 0;
-          ofs[arg]++;
-        }
-        else if (traces[arg][ofs[arg]] <= time) {
-          fprintf(f, "#%d\n1%c\n", (int)(time * 100), '@' + arg);
-          asserted[arg] = 1;
-        }
-      }
+  else if (capture_count > 1) {
+    // One line per capture, for a quick look at a batch
+    printf("\n%-32s %5s %4s %7s %8s %8s\n", "Capture", "Track", "Side", "Sectors", "Hdr CRC", "Data CRC");
+    for (int i = 0; i < capture_count; i++) {
+      struct flux_track *t = &captures[i].track;
+      printf("%-32s %5d %4d %7d %8d %8d\n", captures[i].filename, t->track, t->side, flux_track_sectors_ok(t),
+          t->header_crc_errors, t->data_crc_errors);
     }
   }
-  fclose(f);
-
-  f = fopen("gaps.csv", "w");
-  if (!f)
-    return -1;
-  for (int i = 0; i < sample_counts[1]; i++) {
-    fprintf(f, "%5d, ", i);
-    for (int arg = 1; arg < argc + 2; arg++) {
-      fprintf(f, "%.2f, ", traces[arg][i] - (i ? traces[arg][i - 1] : 0));
-    }
-    fprintf(f, "\n");
-  }
-  fclose(f);
-
-  f = fopen("deltacompare.csv", "w");
-  float ucsum = 0, csum = 0, ucmax = 0, cmax = 0;
-  for (int i = start_data; i < ucdelta_count; i++) {
-    if (absf(uncorrected_deltas[i]) > ucmax)
-      ucmax = uncorrected_deltas[i];
-    if (absf(corrected_deltas[i]) > cmax)
-      cmax = corrected_deltas[i];
-    ucsum += absf(uncorrected_deltas[i]);
-    csum += absf(corrected_deltas[i]);
-    fprintf(f, "%-4d,% -5.2f,% -5.2f,% -5.2f,% -6.2f,% -5.2f,% -6.2f\n", i, uncorrected_deltas[i], corrected_deltas[i], cmax,
-        ucmax, csum, ucsum);
-  }
-  fclose(f);
 
   return 0;
 }
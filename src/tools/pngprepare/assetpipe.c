@@ -0,0 +1,629 @@
+/*
+ * Batch driver for the asset conversion tools.
+ *
+ * Reads a manifest of tool invocations, and runs the independent ones in
+ * parallel.  Each line of the manifest is:
+ *
+ *   <output file> <tool> [arguments ...]
+ *
+ * e.g.,
+ *
+ *   bin/asciifont.bin   pngprepare charrom assets/ascii00-ff.png bin/asciifont.bin
+ *   tiles.bin           pngtoscreens tiles.bin title.png level1.png level2.png
+ *   sprites.txt         pngtosprite assets/sprites.png 0,0,24,21
+ *
+ * The tools keep their state in globals, so each job runs as its own
+ * process.  Screens that should share a tile set are simply listed in the
+ * same pngtoscreens job, which decodes each image once and de-duplicates
+ * tiles across all of them.  If the output file does not appear among the
+ * arguments, the tool's stdout is written to it instead.
+ *
+ * A job whose arguments (or tool) name the output of another job waits
+ * for that job to finish, and is not run at all if it fails.  Jobs are
+ * otherwise started in manifest order, so a manifest may list a job
+ * before or after the jobs it depends on.  Two jobs may not have the same
+ * output, and circular dependencies are an error.
+ *
+ * Every argument that names an existing file is treated as an input.  A
+ * hash of the command line, the contents of the inputs and of the tool
+ * itself is kept in a cache file, and jobs whose hash has not changed
+ * since the output was last built are skipped.  Files that are only
+ * referenced from inside an input (e.g., the images in an md2h65 page)
+ * are not seen, so list them as extra jobs or use -f after changing them.
+ *
+ * This software may be freely redistributed under the terms
+ * of the X11 license.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define MAX_ARGS 256
+#define MAX_JOBS 4096
+#define MAX_THREADS 64
+// Must be a power of two, and larger than MAX_JOBS
+#define OUTPUT_TABLE_SIZE 8192
+
+#define FNV64_OFFSET 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+struct job {
+  char *output;
+  int argc;
+  char *argv[MAX_ARGS + 1];
+  // Output appears in the arguments, otherwise capture stdout into it
+  int output_in_args;
+
+  // Jobs whose inputs include our output, and the number of jobs whose
+  // outputs are our inputs that have not finished yet
+  int *dependents;
+  int dependent_count;
+  int waiting;
+  // A job we depend on that failed, or -1
+  int failed_input;
+
+  unsigned long long hash;
+  int skipped;
+  int status;
+  double seconds;
+};
+
+struct job jobs[MAX_JOBS];
+int job_count = 0;
+
+// Hashes of the outputs as last built, from the cache file
+struct cache_entry {
+  char *output;
+  unsigned long long hash;
+};
+struct cache_entry *cache = NULL;
+int cache_count = 0;
+char *cache_file = ".assetpipe.cache";
+
+char *tool_dir = NULL;
+int force = 0;
+int verbose = 0;
+
+// Job number + 1 of each output, by hash
+int output_table[OUTPUT_TABLE_SIZE];
+
+// Jobs whose inputs are all built, in the order they became ready
+pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t job_ready = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+int ready[MAX_JOBS];
+int ready_head = 0, ready_tail = 0;
+int jobs_done = 0;
+
+/* ============================================================= */
+
+unsigned long long hash_bytes(unsigned long long h, const unsigned char *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ data[i]) * FNV64_PRIME;
+  return h;
+}
+
+// Returns 0 if path is not a readable regular file
+int hash_file(unsigned long long *h, const char *path)
+{
+  struct stat st;
+  if (stat(path, &st) || !S_ISREG(st.st_mode))
+    return 0;
+  // Close on exec, so that jobs started by other threads don't inherit it
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  unsigned char buffer[65536];
+  ssize_t n;
+  while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+    *h = hash_bytes(*h, buffer, n);
+  close(fd);
+  return 1;
+}
+
+// Jobs run in parallel, so the caller provides the buffer for the path
+char *find_tool(char *tool, char *path, int path_len)
+{
+  if (strchr(tool, '/'))
+    return tool;
+
+  if (tool_dir) {
+    snprintf(path, path_len, "%s/%s", tool_dir, tool);
+    if (!access(path, X_OK))
+      return path;
+  }
+
+  char *search = getenv("PATH");
+  if (!search)
+    return NULL;
+  while (*search) {
+    int len = strcspn(search, ":");
+    snprintf(path, path_len, "%.*s/%s", len, search, tool);
+    if (!access(path, X_OK))
+      return path;
+    search += len;
+    if (*search == ':')
+      search++;
+  }
+  return NULL;
+}
+
+unsigned long long job_hash(struct job *j, char *tool_path)
+{
+  unsigned long long h = FNV64_OFFSET;
+
+  // The command itself
+  h = hash_bytes(h, (unsigned char *)j->output, strlen(j->output) + 1);
+  for (int i = 0; i < j->argc; i++)
+    h = hash_bytes(h, (unsigned char *)j->argv[i], strlen(j->argv[i]) + 1);
+
+  // The tool, so that rebuilding a tool rebuilds its outputs
+  if (tool_path)
+    hash_file(&h, tool_path);
+
+  // And every input
+  for (int i = 1; i < j->argc; i++) {
+    if (!strcmp(j->argv[i], j->output))
+      continue;
+    h = hash_bytes(h, (unsigned char *)&i, sizeof(i));
+    hash_file(&h, j->argv[i]);
+  }
+
+  return h;
+}
+
+/* ============================================================= */
+
+void read_cache(void)
+{
+  FILE *f = fopen(cache_file, "r");
+  if (!f)
+    return;
+
+  char line[8192];
+  while (fgets(line, sizeof(line), f)) {
+    unsigned long long hash;
+    char output[8192];
+    if (sscanf(line, "%llx %[^\n]", &hash, output) != 2)
+      continue;
+    cache = realloc(cache, sizeof(struct cache_entry) * (cache_count + 1));
+    if (!cache) {
+      perror("realloc() failed");
+      exit(-3);
+    }
+    cache[cache_count].output = strdup(output);
+    cache[cache_count].hash = hash;
+    cache_count++;
+  }
+  fclose(f);
+}
+
+int cache_matches(struct job *j)
+{
+  struct stat st;
+  if (stat(j->output, &st))
+    return 0;
+  for (int i = 0; i < cache_count; i++)
+    if (!strcmp(cache[i].output, j->output))
+      return cache[i].hash == j->hash;
+  return 0;
+}
+
+int write_cache(void)
+{
+  char temp_file[8192];
+  snprintf(temp_file, sizeof(temp_file), "%s.tmp", cache_file);
+  FILE *f = fopen(temp_file, "w");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not write cache file '%s'\n", temp_file);
+    return -1;
+  }
+
+  // Keep entries for outputs that are not in this manifest
+  for (int i = 0; i < cache_count; i++) {
+    int found = 0;
+    for (int k = 0; k < job_count && !found; k++)
+      if (!strcmp(jobs[k].output, cache[i].output))
+        found = 1;
+    if (!found)
+      fprintf(f, "%016llx %s\n", cache[i].hash, cache[i].output);
+  }
+  for (int k = 0; k < job_count; k++)
+    if (!jobs[k].status)
+      fprintf(f, "%016llx %s\n", jobs[k].hash, jobs[k].output);
+
+  fclose(f);
+  if (rename(temp_file, cache_file)) {
+    fprintf(stderr, "ERROR: Could not rename '%s' to '%s'\n", temp_file, cache_file);
+    return -1;
+  }
+  return 0;
+}
+
+/* ============================================================= */
+
+int read_manifest(char *filename)
+{
+  FILE *f = strcmp(filename, "-") ? fopen(filename, "r") : stdin;
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not open manifest '%s'\n", filename);
+    return -1;
+  }
+
+  char line[65536];
+  int line_num = 0;
+  while (fgets(line, sizeof(line), f)) {
+    line_num++;
+    char *hash_pos = strchr(line, '#');
+    if (hash_pos)
+      *hash_pos = 0;
+
+    char *words[MAX_ARGS + 2];
+    int word_count = 0;
+    for (char *w = strtok(line, " \t\r\n"); w; w = strtok(NULL, " \t\r\n")) {
+      if (word_count == MAX_ARGS + 1) {
+        fprintf(stderr, "ERROR: %s:%d: Too many arguments (maximum is %d)\n", filename, line_num, MAX_ARGS);
+        return -1;
+      }
+      words[word_count++] = strdup(w);
+    }
+    if (!word_count)
+      continue;
+    if (word_count < 2) {
+      fprintf(stderr, "ERROR: %s:%d: Expected <output> <tool> [arguments ...]\n", filename, line_num);
+      return -1;
+    }
+    if (job_count == MAX_JOBS) {
+      fprintf(stderr, "ERROR: %s:%d: Too many jobs (maximum is %d)\n", filename, line_num, MAX_JOBS);
+      return -1;
+    }
+
+    struct job *j = &jobs[job_count++];
+    bzero(j, sizeof(struct job));
+    j->output = words[0];
+    for (int i = 1; i < word_count; i++) {
+      j->argv[j->argc++] = words[i];
+      if (!strcmp(words[i], j->output))
+        j->output_in_args = 1;
+    }
+    j->argv[j->argc] = NULL;
+  }
+
+  if (f != stdin)
+    fclose(f);
+  return 0;
+}
+
+// Slot of output_table for name, which is either free or holds name
+int output_slot(char *name)
+{
+  unsigned long long h = hash_bytes(FNV64_OFFSET, (unsigned char *)name, strlen(name));
+  int slot = h & (OUTPUT_TABLE_SIZE - 1);
+  while (output_table[slot] && strcmp(jobs[output_table[slot] - 1].output, name))
+    slot = (slot + 1) & (OUTPUT_TABLE_SIZE - 1);
+  return slot;
+}
+
+void add_dependent(struct job *producer, int consumer)
+{
+  // An output may be named more than once in the same job
+  if (producer->dependent_count && producer->dependents[producer->dependent_count - 1] == consumer)
+    return;
+  producer->dependents = realloc(producer->dependents, sizeof(int) * (producer->dependent_count + 1));
+  if (!producer->dependents) {
+    perror("realloc() failed");
+    exit(-3);
+  }
+  producer->dependents[producer->dependent_count++] = consumer;
+  jobs[consumer].waiting++;
+}
+
+int build_dependencies(void)
+{
+  for (int n = 0; n < job_count; n++) {
+    int slot = output_slot(jobs[n].output);
+    if (output_table[slot]) {
+      fprintf(stderr, "ERROR: '%s' is the output of more than one job\n", jobs[n].output);
+      return -1;
+    }
+    output_table[slot] = n + 1;
+    jobs[n].failed_input = -1;
+  }
+
+  for (int n = 0; n < job_count; n++)
+    for (int i = 0; i < jobs[n].argc; i++) {
+      int producer = output_table[output_slot(jobs[n].argv[i])] - 1;
+      if (producer != -1 && producer != n)
+        add_dependent(&jobs[producer], n);
+    }
+
+  // Check that every job can be reached from those without inputs
+  int *waiting = malloc(sizeof(int) * (job_count + 1));
+  int *order = malloc(sizeof(int) * (job_count + 1));
+  if (!waiting || !order) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  int count = 0;
+  for (int n = 0; n < job_count; n++) {
+    waiting[n] = jobs[n].waiting;
+    if (!waiting[n])
+      order[count++] = n;
+  }
+  for (int i = 0; i < count; i++) {
+    struct job *j = &jobs[order[i]];
+    for (int d = 0; d < j->dependent_count; d++)
+      if (!--waiting[j->dependents[d]])
+        order[count++] = j->dependents[d];
+  }
+  if (count < job_count) {
+    fprintf(stderr, "ERROR: Circular dependency between these jobs:\n");
+    for (int n = 0; n < job_count; n++)
+      if (waiting[n])
+        fprintf(stderr, "  %s (%s)\n", jobs[n].output, jobs[n].argv[0]);
+  }
+  free(waiting);
+  free(order);
+  return count < job_count ? -1 : 0;
+}
+
+/* ============================================================= */
+
+void show_log(FILE *log)
+{
+  char buffer[4096];
+  size_t n;
+  rewind(log);
+  while ((n = fread(buffer, 1, sizeof(buffer), log)) > 0)
+    fwrite(buffer, 1, n, stderr);
+}
+
+int run_job(struct job *j)
+{
+  char path[8192];
+  char *tool_path = find_tool(j->argv[0], path, sizeof(path));
+  if (!tool_path) {
+    fprintf(stderr, "ERROR: Could not find tool '%s' for '%s'\n", j->argv[0], j->output);
+    return -1;
+  }
+
+  j->hash = job_hash(j, tool_path);
+  if (!force && cache_matches(j)) {
+    j->skipped = 1;
+    return 0;
+  }
+
+  // Collect the tool's chatter, and only show it if asked or if it fails.
+  // Like every file we open while jobs are running, it is closed on exec,
+  // so that it only ends up in the job it belongs to.
+  char log_name[] = "/tmp/assetpipe.XXXXXX";
+  int log_fd = mkostemp(log_name, O_CLOEXEC);
+  if (log_fd == -1) {
+    perror("mkostemp() failed");
+    return -1;
+  }
+  unlink(log_name);
+  FILE *log = fdopen(log_fd, "w+");
+  if (!log) {
+    perror("fdopen() failed");
+    close(log_fd);
+    return -1;
+  }
+
+  int out_fd = -1;
+  if (!j->output_in_args) {
+    out_fd = open(j->output, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out_fd == -1) {
+      fprintf(stderr, "ERROR: Could not open output file '%s': %s\n", j->output, strerror(errno));
+      fclose(log);
+      return -1;
+    }
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    dup2(out_fd != -1 ? out_fd : fileno(log), STDOUT_FILENO);
+    dup2(fileno(log), STDERR_FILENO);
+    execv(tool_path, j->argv);
+    // Only async-signal-safe calls between fork() and _exit()
+    static const char msg[] = "ERROR: Could not run ";
+    write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    write(STDERR_FILENO, tool_path, strlen(tool_path));
+    write(STDERR_FILENO, "\n", 1);
+    _exit(127);
+  }
+  if (out_fd != -1)
+    close(out_fd);
+  if (pid == -1) {
+    perror("fork() failed");
+    fclose(log);
+    return -1;
+  }
+
+  int status = 0;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    ;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  j->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  int failed = !WIFEXITED(status) || WEXITSTATUS(status);
+  pthread_mutex_lock(&output_lock);
+  if (failed)
+    fprintf(stderr, "FAILED: %s (%s)\n", j->output, j->argv[0]);
+  if (failed || verbose)
+    show_log(log);
+  pthread_mutex_unlock(&output_lock);
+  fclose(log);
+
+  if (failed) {
+    // Don't leave a partial output that looks up to date
+    unlink(j->output);
+    return -1;
+  }
+  return 0;
+}
+
+// Call with job_lock held
+void finish_job(int n)
+{
+  struct job *j = &jobs[n];
+  jobs_done++;
+
+  pthread_mutex_lock(&output_lock);
+  if (j->failed_input != -1)
+    fprintf(stderr, "FAILED: %s (not built, as %s failed)\n", j->output, jobs[j->failed_input].output);
+  else if (j->skipped)
+    printf("[%d/%d] %s is up to date\n", jobs_done, job_count, j->output);
+  else if (!j->status)
+    printf("[%d/%d] %s (%s, %.2fs)\n", jobs_done, job_count, j->output, j->argv[0], j->seconds);
+  fflush(stdout);
+  pthread_mutex_unlock(&output_lock);
+
+  for (int d = 0; d < j->dependent_count; d++) {
+    struct job *dep = &jobs[j->dependents[d]];
+    if (j->status && dep->failed_input == -1) {
+      dep->failed_input = n;
+      dep->status = -1;
+    }
+    if (--dep->waiting)
+      continue;
+    if (dep->failed_input != -1)
+      finish_job(j->dependents[d]);
+    else {
+      ready[ready_tail++] = j->dependents[d];
+      pthread_cond_signal(&job_ready);
+    }
+  }
+
+  if (jobs_done == job_count)
+    pthread_cond_broadcast(&job_ready);
+}
+
+void *worker(void *arg)
+{
+  (void)arg;
+
+  pthread_mutex_lock(&job_lock);
+  while (1) {
+    while (ready_head == ready_tail && jobs_done < job_count)
+      pthread_cond_wait(&job_ready, &job_lock);
+    if (ready_head == ready_tail)
+      break;
+    int n = ready[ready_head++];
+    pthread_mutex_unlock(&job_lock);
+
+    jobs[n].status = run_job(&jobs[n]);
+
+    pthread_mutex_lock(&job_lock);
+    finish_job(n);
+  }
+  pthread_mutex_unlock(&job_lock);
+  return NULL;
+}
+
+/* ============================================================= */
+
+void usage(void)
+{
+  fprintf(stderr, "usage: assetpipe [-j threads] [-t tool directory] [-c cache file] [-f] [-v] <manifest>\n"
+                  "  -j  number of jobs to run at once (default: number of CPUs)\n"
+                  "  -t  look for the tools here before searching PATH (default: directory of assetpipe)\n"
+                  "  -c  file to keep output hashes in (default: .assetpipe.cache)\n"
+                  "  -f  rebuild all outputs, even if they are up to date\n"
+                  "  -v  show the output of each tool\n");
+  exit(-3);
+}
+
+int main(int argc, char **argv)
+{
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:t:c:fv")) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = atoi(optarg);
+      break;
+    case 't':
+      tool_dir = optarg;
+      break;
+    case 'c':
+      cache_file = optarg;
+      break;
+    case 'f':
+      force = 1;
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind != argc - 1)
+    usage();
+
+  if (threads < 1)
+    threads = 1;
+  if (threads > MAX_THREADS)
+    threads = MAX_THREADS;
+
+  // By default, use the tools that were built alongside us
+  if (!tool_dir && strchr(argv[0], '/')) {
+    tool_dir = strdup(argv[0]);
+    *strrchr(tool_dir, '/') = 0;
+  }
+
+  if (read_manifest(argv[optind]))
+    exit(-1);
+  if (build_dependencies())
+    exit(-1);
+  read_cache();
+
+  for (int n = 0; n < job_count; n++)
+    if (!jobs[n].waiting)
+      ready[ready_tail++] = n;
+
+  if (threads > job_count)
+    threads = job_count ? job_count : 1;
+
+  pthread_t workers[MAX_THREADS];
+  for (int i = 0; i < threads; i++)
+    if (pthread_create(&workers[i], NULL, worker, NULL)) {
+      perror("pthread_create() failed");
+      exit(-3);
+    }
+  for (int i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+
+  int failed = 0, skipped = 0;
+  for (int i = 0; i < job_count; i++) {
+    if (jobs[i].status)
+      failed++;
+    if (jobs[i].skipped)
+      skipped++;
+  }
+  printf("%d jobs: %d built, %d up to date, %d failed.\n", job_count, job_count - skipped - failed, skipped, failed);
+
+  if (write_cache())
+    exit(-1);
+
+  return failed ? 1 : 0;
+}
@@ -1,12 +1,43 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <gif_lib.h>
 
+#include "tile_index.h"
+
+// Same limit as md2h65: 128KB of tile RAM
+#define MAX_TILES (128 * 1024 / 64)
+
+struct tile tiles[MAX_TILES];
+int tile_count = 0;
+struct tile_index tileset_index;
+
+int tile_lookup(struct tile *t)
+{
+  unsigned int hash = tile_hash(t);
+  int tile_number = tile_index_find(&tileset_index, tiles, t, hash, 0);
+  if (tile_number != -1)
+    return tile_number;
+
+  if (tile_count >= MAX_TILES) {
+    fprintf(stderr, "ERROR: Used up all %d tiles.\n", MAX_TILES);
+    exit(-3);
+  }
+  tiles[tile_count] = *t;
+  tile_index_add(&tileset_index, tile_count, hash);
+  return tile_count++;
+}
+
 int main(int argc, char **argv)
 {
   int gif_error = 0;
   GifFileType *gif = NULL;
 
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: giftotiles <input.gif> [output tileset]\n");
+    exit(-3);
+  }
+
   gif = DGifOpenFileName(argv[1], &gif_error);
   if (!gif) {
     fprintf(stderr, "Could not read GIF file '%s'\n", argv[1]);
@@ -18,5 +49,59 @@ int main(int argc, char **argv)
     exit(-1);
   }
 
+  tile_index_init(&tileset_index, MAX_TILES);
+
+  // Each frame is drawn over the previous one, and then cut into tiles of
+  // colour indices.
+  unsigned char *canvas = calloc(gif->SWidth, gif->SHeight);
+  if (!canvas) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  memset(canvas, gif->SBackGroundColor, gif->SWidth * gif->SHeight);
+
+  for (int frame = 0; frame < gif->ImageCount; frame++) {
+    SavedImage *image = &gif->SavedImages[frame];
+    GifImageDesc *desc = &image->ImageDesc;
+    for (int y = 0; y < desc->Height; y++)
+      for (int x = 0; x < desc->Width; x++) {
+        int cx = desc->Left + x;
+        int cy = desc->Top + y;
+        if (cx < gif->SWidth && cy < gif->SHeight)
+          canvas[cy * gif->SWidth + cx] = image->RasterBits[y * desc->Width + x];
+      }
+
+    int first_tile = tile_count;
+    for (int y = 0; y < gif->SHeight; y += 8)
+      for (int x = 0; x < gif->SWidth; x += 8) {
+        struct tile t;
+        for (int yy = 0; yy < 8; yy++)
+          for (int xx = 0; xx < 8; xx++) {
+            if ((x + xx) < gif->SWidth && (y + yy) < gif->SHeight)
+              t.bytes[xx][yy] = canvas[(y + yy) * gif->SWidth + x + xx];
+            else
+              // Off edge of image
+              t.bytes[xx][yy] = 0;
+          }
+        tile_lookup(&t);
+      }
+    fprintf(stderr, "Frame %d added %d new tiles (%d total).\n", frame, tile_count - first_tile, tile_count);
+  }
+
+  if (argc == 3) {
+    FILE *f = fopen(argv[2], "wb");
+    if (!f) {
+      fprintf(stderr, "ERROR: Could not open output file '%s'\n", argv[2]);
+      exit(-1);
+    }
+    // Same layout as the tile data in H65 files: 8 rows of 8 pixels
+    for (int i = 0; i < tile_count; i++)
+      for (int y = 0; y < 8; y++)
+        for (int x = 0; x < 8; x++)
+          fputc(tiles[i].bytes[x][y], f);
+    fclose(f);
+    fprintf(stderr, "Wrote %d tiles to '%s'\n", tile_count, argv[2]);
+  }
+
   return 0;
 }
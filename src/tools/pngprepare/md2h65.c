@@ -50,11 +50,16 @@
 #include <string.h>
 #include <strings.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sys/stat.h>
 
 // For images
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "tile_index.h"
+#include "quantise.h"
+
 // For fonts
 #include <math.h>
 #include <ft2build.h>
@@ -63,26 +68,28 @@
 
 extern unsigned char ascii_font[4097];
 
-struct tile_set *ts = NULL;
+// Several pages can be built at once, each in its own thread, so all of the
+// state for building a page is thread-local.
+__thread struct tile_set *ts = NULL;
 
 /* ============================================================= */
 
 /* ============================================================= */
 
-int x, y;
-int screen_x = 0, screen_y = 0;
+__thread int x, y;
+__thread int screen_x = 0, screen_y = 0;
 
-int width, height;
-png_byte color_type;
-png_byte bit_depth;
+__thread int width, height;
+__thread png_byte color_type;
+__thread png_byte bit_depth;
 
-png_structp png_ptr;
-png_infop info_ptr;
-int number_of_passes;
-png_bytep *row_pointers;
-int multiplier;
+__thread png_structp png_ptr;
+__thread png_infop info_ptr;
+__thread int number_of_passes;
+__thread png_bytep *row_pointers;
+__thread int multiplier;
 
-FT_Library library;
+__thread FT_Library library;
 #define FONT_PARAGRAPH 0
 #define FONT_H1 1
 #define FONT_H2 2
@@ -91,13 +98,15 @@ FT_Library library;
 #define FONT_PARAGRAPH_BOLDITALIC 5
 #define FONT_PARAGRAPH_ITALIC 6
 #define MAX_TYPEFACES (FONT_PARAGRAPH_ITALIC + 1)
-FT_Face type_faces[MAX_TYPEFACES];
-int current_font = FONT_PARAGRAPH;
+__thread FT_Face type_faces[MAX_TYPEFACES];
+// Which fonts[] entry each type face was loaded from
+__thread int type_face_fonts[MAX_TYPEFACES];
+__thread int current_font = FONT_PARAGRAPH;
 
-FT_GlyphSlot glyph_slot;
-FT_Error error;
+__thread FT_GlyphSlot glyph_slot;
+__thread FT_Error error;
 
-int n;
+__thread int n;
 
 /* ============================================================= */
 
@@ -113,95 +122,41 @@ void abort_(const char *s, ...)
 
 /* ============================================================= */
 
-struct tile {
-  unsigned char bytes[8][8];
-};
-
-struct rgb {
-  int r;
-  int g;
-  int b;
-};
-
 // We only have 128KB of tile RAM, so we can't have more than 128K different
 // coloured pixels
 #define MAX_COLOURS (128 * 1024)
 
 // If we have >256 colours, though, we do need to reduce the final palette down
 // to 256 colours.
-int second_pass_required = 0;
-int pass_num = 1;
+__thread int second_pass_required = 0;
+__thread int pass_num = 1;
 
 struct tile_set {
   struct tile *tiles;
   int tile_count;
   int max_tiles;
+  struct tile_index index;
 
   // Palette
   struct rgb colours[MAX_COLOURS];
   int colour_counts[MAX_COLOURS];
   int target_colours[MAX_COLOURS];
   int colour_count;
+  struct colour_map colour_index;
+
+  // Reduced palette for the 2nd pass
+  struct rgb palette[256];
 
   struct tile_set *next;
 };
 
-int find_nearest_colour(struct tile_set *ts, int c)
-{
-  int nearest_id = 0;
-  int error = 999999999;
-
-  for (int i = 0; i < ts->colour_count; i++)
-    // Has colour been remapped already, or is it the same colour we are looking to approximate?
-    if ((i != c) && ts->target_colours[i] == i) {
-      int this_error = 0 + abs(ts->colours[i].r - ts->colours[c].r) * abs(ts->colours[i].r - ts->colours[c].r)
-                     + abs(ts->colours[i].g - ts->colours[c].g) * abs(ts->colours[i].g - ts->colours[c].g)
-                     + abs(ts->colours[i].b - ts->colours[c].b) * abs(ts->colours[i].b - ts->colours[c].b);
-      if (this_error < error) {
-        nearest_id = i;
-        error = this_error;
-      }
-    }
-
-  return nearest_id;
-}
-
 void quantise_colours(struct tile_set *ts)
 {
-  // Start with all colours mapped to themselves.
-  for (int i = 0; i < ts->colour_count; i++)
-    ts->target_colours[i] = i;
-
-  int colour_count = ts->colour_count;
-  // Colour $FF = 255 has trouble in FCM chars, so don't use it
-  while (colour_count > 254) {
-    int freq = 999999999;
-    int colour_num = 99999999;
-    // Don't remap the C64 normal 16 colours
-    for (int i = 16; i < ts->colour_count; i++) {
-      // Has colour been remapped already?
-      if (ts->target_colours[i] == i) {
-        // No, so check its frequency to see if it is the next rarest colour
-        if (ts->colour_counts[i] < freq) {
-          freq = ts->colour_counts[i];
-          colour_num = i;
-        }
-      }
-    }
-
-    // Find the nearest colour to this one
-    int nearest_colour = find_nearest_colour(ts, colour_num);
-    ts->target_colours[colour_num] = nearest_colour;
-
-    // Increase the weighting of the colour we have switched to
-    ts->colour_counts[nearest_colour] += ts->colour_counts[colour_num];
-
-    printf("Removing rarely used colour #%d (used %d times): Mapping #%02x%02x%02x -> #%02x%02x%02x\n", colour_num, freq,
-        ts->colours[colour_num].r, ts->colours[colour_num].g, ts->colours[colour_num].b, ts->colours[nearest_colour].r,
-        ts->colours[nearest_colour].g, ts->colours[nearest_colour].b);
-
-    colour_count--;
-  }
+  // Colour $FF = 255 has trouble in FCM chars, so don't use it.
+  // Don't remap the C64 normal 16 colours.
+  int palette_size
+      = quantise_palette(ts->colours, ts->colour_counts, ts->colour_count, 16, ts->palette, 254, ts->target_colours);
+  printf("Quantised %d colours down to a palette of %d.\n", ts->colour_count, palette_size);
 }
 
 void palette_c64_init(struct tile_set *ts)
@@ -225,26 +180,24 @@ void palette_c64_init(struct tile_set *ts)
   ts->colours[14] = (struct rgb) { .r = 0xaa, .g = 0x9d, .b = 0xef };
   ts->colours[15] = (struct rgb) { .r = 0xb8, .g = 0xb8, .b = 0xb8 };
   ts->colour_count = 16;
+  for (int i = 0; i < 16; i++)
+    colour_map_insert(&ts->colour_index, ts->colours[i].r, ts->colours[i].g, ts->colours[i].b, i);
   fprintf(stderr, "Setup C64 palette.\n");
 }
 
 int palette_lookup(struct tile_set *ts, int r, int g, int b)
 {
-  int i;
-
   // Do we know this colour already?
-  for (i = 0; i < ts->colour_count; i++) {
-    if (r == ts->colours[i].r && g == ts->colours[i].g && b == ts->colours[i].b) {
-      // It's a colour we have seen before, so return the index
-      if (pass_num == 1)
-        ts->colour_counts[i]++;
-      if (pass_num == 2) {
-        // Resolve remapped/merged colours
-        while (ts->target_colours[i] != i)
-          i = ts->target_colours[i];
-      }
-      return i;
+  int i = colour_map_lookup(&ts->colour_index, r, g, b);
+  if (i != -1) {
+    // It's a colour we have seen before, so return the index
+    if (pass_num == 1)
+      ts->colour_counts[i]++;
+    if (pass_num == 2) {
+      // Resolve remapped/merged colours
+      i = ts->target_colours[i];
     }
+    return i;
   }
 
   // new colour, check if palette has space
@@ -252,12 +205,17 @@ int palette_lookup(struct tile_set *ts, int r, int g, int b)
     fprintf(stderr, "WARNING: Image has many colours. A second pass will be required.\n");
     second_pass_required = 1;
   }
+  if (ts->colour_count >= MAX_COLOURS) {
+    fprintf(stderr, "ERROR: Too many colours (more than %d).\n", MAX_COLOURS);
+    exit(-3);
+  }
 
   // allocate the new colour
   ts->colours[ts->colour_count].r = r;
   ts->colours[ts->colour_count].g = g;
   ts->colours[ts->colour_count].b = b;
   ts->colour_counts[ts->colour_count] = 1;
+  colour_map_insert(&ts->colour_index, r, g, b, ts->colour_count);
   return ts->colour_count++;
 }
 
@@ -284,9 +242,37 @@ struct tile_set *new_tileset(int max_tiles)
     exit(-3);
   }
   ts->max_tiles = max_tiles;
+  tile_index_init(&ts->index, max_tiles);
+  colour_map_init(&ts->colour_index);
   return ts;
 }
 
+void free_tileset(struct tile_set *ts)
+{
+  tile_index_free(&ts->index);
+  colour_map_free(&ts->colour_index);
+  free(ts->tiles);
+  free(ts);
+}
+
+// The files a page is built from, so that it only needs to be rebuilt when
+// one of them changes.
+#define MAX_DEPENDENCIES 256
+__thread char *dependencies[MAX_DEPENDENCIES];
+__thread int dependency_count = 0;
+
+void add_dependency(char *file)
+{
+  for (int i = 0; i < dependency_count; i++)
+    if (!strcmp(dependencies[i], file))
+      return;
+  if (dependency_count >= MAX_DEPENDENCIES) {
+    fprintf(stderr, "ERROR: Page uses too many files. Increase MAX_DEPENDENCIES?\n");
+    exit(-1);
+  }
+  dependencies[dependency_count++] = strdup(file);
+}
+
 struct screen {
   // Unique identifier
   unsigned char screen_id;
@@ -337,47 +323,13 @@ struct screen *new_screen(int id, struct tile_set *tiles, int width, int height)
 int tile_lookup(struct tile_set *ts, struct tile *t)
 {
   // See if tile matches any that we have already stored.
-  // (Also check if it matches flipped in either or both X,Y
-  // axes.
-  for (int i = 0; i < ts->tile_count; i++) {
-    int matches = 1;
-    // Compare unflipped
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i;
-    // Compare with flipped X
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x4000;
-    // Compare with flipped Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x8000;
-    // Compare with flipped X and Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0xC000;
-  }
+  // The index could also match tiles flipped in either or both X,Y
+  // axes, but the original byte-wise comparison never reported such
+  // matches, so we stick to exact matches to keep the output unchanged.
+  unsigned int hash = tile_hash(t);
+  int tile_number = tile_index_find(&ts->index, ts->tiles, t, hash, 0);
+  if (tile_number != -1)
+    return tile_number;
 
   // The tile is new.
   if (ts->tile_count >= ts->max_tiles) {
@@ -386,9 +338,8 @@ int tile_lookup(struct tile_set *ts, struct tile *t)
   }
 
   // Allocate new tile and return
-  for (int y = 0; y < 8; y++)
-    for (int x = 0; x < 8; x++)
-      ts->tiles[ts->tile_count].bytes[x][y] = t->bytes[x][y];
+  ts->tiles[ts->tile_count] = *t;
+  tile_index_add(&ts->index, ts->tile_count, hash);
   return ts->tile_count++;
 }
 
@@ -540,52 +491,52 @@ void read_png_file(char *file_name)
 // Only 24KB colour RAM and screen RAM available
 #define MAX_COLOURRAM_SIZE (24 * 1024)
 
-int i, x = 0, y = 0;
-int colour = 14; // C64 light blue by default
-unsigned char text_colour = 14;
-unsigned char text_colour_saved = 14;
-unsigned char indent = 0;
-unsigned char attributes = 0;
-unsigned char attributes_saved = 0;
-unsigned char screen_ram[MAX_COLOURRAM_SIZE];
-unsigned char colour_ram[MAX_COLOURRAM_SIZE];
+__thread int i, x = 0, y = 0;
+__thread int colour = 14; // C64 light blue by default
+__thread unsigned char text_colour = 14;
+__thread unsigned char text_colour_saved = 14;
+__thread unsigned char indent = 0;
+__thread unsigned char attributes = 0;
+__thread unsigned char attributes_saved = 0;
+__thread unsigned char screen_ram[MAX_COLOURRAM_SIZE];
+__thread unsigned char colour_ram[MAX_COLOURRAM_SIZE];
 #define MAX_LINE_LENGTH 80
 const int max_lines = (MAX_COLOURRAM_SIZE / (MAX_LINE_LENGTH * 2));
-unsigned int screen_ram_used = 0;
-unsigned int in_paragraph = 0;
-unsigned int queued_word_gap = 0;
+__thread unsigned int screen_ram_used = 0;
+__thread unsigned int in_paragraph = 0;
+__thread unsigned int queued_word_gap = 0;
 
 // Buffer for partially accumulated lines of text
 #define MAX_LINE_HEIGHT 64
 #define MAX_LINE_DEPTH 64
-unsigned char accline_screen_ram[MAX_LINE_HEIGHT+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
-unsigned char accline_colour_ram[MAX_LINE_DEPTH+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
-int accline_len=0;
-int accline_display_len=0;
-int accline_height=1;
-int accline_depth=0;
+__thread unsigned char accline_screen_ram[MAX_LINE_HEIGHT+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
+__thread unsigned char accline_colour_ram[MAX_LINE_DEPTH+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
+__thread int accline_len=0;
+__thread int accline_display_len=0;
+__thread int accline_height=1;
+__thread int accline_depth=0;
 
 // And the same for the current word being rendered
-unsigned char accword_screen_ram[MAX_LINE_HEIGHT+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
-unsigned char accword_colour_ram[MAX_LINE_HEIGHT+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
-int accword_len=0;
-int accword_display_len=0;
-int accword_height=1;
-int accword_depth=0;
+__thread unsigned char accword_screen_ram[MAX_LINE_HEIGHT+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
+__thread unsigned char accword_colour_ram[MAX_LINE_HEIGHT+MAX_LINE_DEPTH][MAX_LINE_LENGTH*2];
+__thread int accword_len=0;
+__thread int accword_display_len=0;
+__thread int accword_height=1;
+__thread int accword_depth=0;
 
 #define MAX_URLS 255
 #define MAX_URL_LEN 255
-char urls[MAX_URLS][MAX_URL_LEN];
-int url_addrs[MAX_URLS];
-int url_count = 0;
-int bounding_box_count = 0;
+__thread char urls[MAX_URLS][MAX_URL_LEN];
+__thread int url_addrs[MAX_URLS];
+__thread int url_count = 0;
+__thread int bounding_box_count = 0;
 struct bounding_box {
   int url_id;
   int x1, x2, y1, y2;
 };
 #define MAX_LINKS 4096
-struct bounding_box url_boxes[MAX_LINKS];
-int link_count = 0;
+__thread struct bounding_box url_boxes[MAX_LINKS];
+__thread int link_count = 0;
 
 void register_box(int url_id, int x1, int y1, int x2, int y2)
 {
@@ -621,9 +572,9 @@ int register_url(char *url)
 }
 
 #define MAX_ATTRIBUTES 16
-char attribute_keys[MAX_ATTRIBUTES][1024];
-char attribute_values[MAX_ATTRIBUTES][1024];
-int attribute_count = 0;
+__thread char attribute_keys[MAX_ATTRIBUTES][1024];
+__thread char attribute_values[MAX_ATTRIBUTES][1024];
+__thread int attribute_count = 0;
 
 void parse_attributes(char *in)
 {
@@ -775,8 +726,8 @@ void next_paragraph_no_gap(void)
 }
 
 // Accumulated word (int type to allow use of unicode points)
-int word[1024];
-int word_len = 0;
+__thread int word[1024];
+__thread int word_len = 0;
 
 struct tile blank_tile = {
   { {0,0,0,0,0,0,0,0},
@@ -792,16 +743,96 @@ struct tile blank_tile = {
 
 #define MAX_BITMAP_SIZE 640
 #define BITMAP_BASELINE (MAX_BITMAP_SIZE/2)
-unsigned char glyph_bitmap[MAX_BITMAP_SIZE][MAX_BITMAP_SIZE];
+__thread unsigned char glyph_bitmap[MAX_BITMAP_SIZE][MAX_BITMAP_SIZE];
+
+// Rendered glyph cards are kept for reuse by all pages, keyed by the font and
+// the run of code points that were rendered into them.
+struct glyph_run {
+  int font;
+  int *code_points;
+  int count;
+  int total_width;
+  int char_columns, char_rows, under_rows;
+  // Cards for each column, from the top row down
+  struct tile *cards;
+  struct glyph_run *next;
+};
+
+#define GLYPH_CACHE_BUCKETS 4096
+struct glyph_run *glyph_cache[GLYPH_CACHE_BUCKETS];
+pthread_mutex_t glyph_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The font files and sizes that have been loaded
+#define MAX_FONTS 256
+struct font {
+  char file[1024];
+  int size;
+};
+struct font fonts[MAX_FONTS];
+int font_count = 0;
+
+int font_lookup(char *file, int size)
+{
+  pthread_mutex_lock(&glyph_cache_lock);
+  int i;
+  for (i = 0; i < font_count; i++)
+    if (fonts[i].size == size && !strcmp(fonts[i].file, file))
+      break;
+  if (i == font_count) {
+    if (font_count >= MAX_FONTS) {
+      fprintf(stderr, "ERROR: Too many different fonts. Increase MAX_FONTS?\n");
+      exit(-1);
+    }
+    snprintf(fonts[i].file, sizeof(fonts[i].file), "%s", file);
+    fonts[i].size = size;
+    font_count++;
+  }
+  pthread_mutex_unlock(&glyph_cache_lock);
+  return i;
+}
+
+unsigned int glyph_run_bucket(int font, int code_point)
+{
+  return ((font * 2654435761U) ^ (code_point * 40503U)) % GLYPH_CACHE_BUCKETS;
+}
 
-int encode_glyph_card(int card_x, int card_y, struct tile_set *ts)
+// Glyphs are added to a run until it is wide enough to fill its cards, or
+// the code points run out.  So a run that is still narrow only matches if it
+// also ends where the code points do.
+struct glyph_run *find_glyph_run(int *code_points, int num)
+{
+  int font = type_face_fonts[current_font];
+  struct glyph_run *r;
+
+  pthread_mutex_lock(&glyph_cache_lock);
+  for (r = glyph_cache[glyph_run_bucket(font, code_points[0])]; r; r = r->next) {
+    if (r->font != font || r->count > num)
+      continue;
+    if (r->total_width <= 11 && r->count != num)
+      continue;
+    if (!memcmp(r->code_points, code_points, sizeof(int) * r->count))
+      break;
+  }
+  pthread_mutex_unlock(&glyph_cache_lock);
+  return r;
+}
+
+struct glyph_run *add_glyph_run(struct glyph_run *run)
+{
+  pthread_mutex_lock(&glyph_cache_lock);
+  unsigned int bucket = glyph_run_bucket(run->font, run->code_points[0]);
+  run->next = glyph_cache[bucket];
+  glyph_cache[bucket] = run;
+  pthread_mutex_unlock(&glyph_cache_lock);
+  return run;
+}
+
+void encode_glyph_card(int card_x, int card_y, struct tile *t)
 {
   int base_x=card_x*16;
   // Y=0 is the card directly above the baseline, Y=-1 is directly below the baseline
   int base_y=BITMAP_BASELINE - (card_y+1)*8;
 
-  struct tile t;
-
   int x,y;
   for(y=0;y<8;y++) {
       for(x=0;x<8;x++)
@@ -816,7 +847,7 @@ int encode_glyph_card(int card_x, int card_y, struct tile_set *ts)
 	  int hi=glyph_bitmap[x_pos+1][y_pos];
 	  low=(low>>4)&0xf;
 	  hi=hi&0xf0;
-	  t.bytes[x][y]=hi+low;
+	  t->bytes[x][y]=hi+low;
         }
   }
 
@@ -824,15 +855,15 @@ int encode_glyph_card(int card_x, int card_y, struct tile_set *ts)
     printf("card (%d,%d) is:\n", card_x, card_y);
     for (y = 0; y < 8; y++) {
       for (x = 0; x < 8; x++) {
-        if ((t.bytes[x][y] & 0xf) == 0)
+        if ((t->bytes[x][y] & 0xf) == 0)
           printf(".");
-        else if ((t.bytes[x][y] & 0xf) < 8)
+        else if ((t->bytes[x][y] & 0xf) < 8)
           printf("+");
         else
           printf("*");
-        if (t.bytes[x][y] < 0x10)
+        if (t->bytes[x][y] < 0x10)
           printf(".");
-        else if ((t.bytes[x][y] & 0xf0) < 128)
+        else if ((t->bytes[x][y] & 0xf0) < 128)
           printf("+");
         else
           printf("*");
@@ -840,13 +871,9 @@ int encode_glyph_card(int card_x, int card_y, struct tile_set *ts)
       printf("\n");
     }
   }
-
-  return tile_lookup(ts, &t)
-       // Adjust tile number in screen data for address of tile in RAM
-       + (0x40000 / 0x40);
 }
 
-int render_codepoints(int *code_points,int num)
+struct glyph_run *render_glyph_run(int *code_points,int num)
 {
   glyph_slot = type_faces[current_font]->glyph;
 
@@ -897,18 +924,50 @@ int render_codepoints(int *code_points,int num)
     }
   }
     
-  int char_rows=0,char_columns=0;
-  int under_rows=0;
+  struct glyph_run *run = calloc(sizeof(struct glyph_run), 1);
+  if (!run) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  run->font = type_face_fonts[current_font];
+  run->count = count;
+  run->total_width = total_width;
 
   // Work out size of char grid required to fit the glyph(s)
-  char_rows=max_height/8;      if (max_height&7) char_rows++;
-  char_columns=total_width/16; if (total_width&15) char_columns++;
-  under_rows=max_under/8;      if (max_under&7) under_rows++;
- 
+  run->char_rows=max_height/8;      if (max_height&7) run->char_rows++;
+  run->char_columns=total_width/16; if (total_width&15) run->char_columns++;
+  run->under_rows=max_under/8;      if (max_under&7) run->under_rows++;
+
+  run->code_points = malloc(sizeof(int) * count);
+  run->cards = malloc(sizeof(struct tile) * (run->char_columns * (run->char_rows + run->under_rows) + 1));
+  if ((!run->code_points) || (!run->cards)) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  memcpy(run->code_points, code_points, sizeof(int) * count);
+
+  int card = 0;
+  for (int x = 0; x < run->char_columns; x++)
+    for (int y = run->char_rows - 1; y >= -run->under_rows; y--)
+      encode_glyph_card(x, y, &run->cards[card++]);
+
   if (1) printf("Character is %dx%d cards above and %dx%d below, max_height=%d, max_under=%d\n",
-		char_columns,char_rows,
-		char_columns,under_rows,
+		run->char_columns,run->char_rows,
+		run->char_columns,run->under_rows,
 		max_height,max_under);
+  return run;
+}
+
+int render_codepoints(int *code_points,int num)
+{
+  struct glyph_run *run = find_glyph_run(code_points, num);
+  if (!run)
+    run = add_glyph_run(render_glyph_run(code_points, num));
+
+  int total_width=run->total_width;
+  int char_rows=run->char_rows,char_columns=run->char_columns;
+  int under_rows=run->under_rows;
+  struct tile *card=run->cards;
   int x,y;
     
   printf("y range = %d..%d, width=%d\n",char_rows-1,-under_rows,total_width);
@@ -956,7 +1015,9 @@ int render_codepoints(int *code_points,int num)
 
     for(y=char_rows-1;y>=-under_rows;y--)
       {
-	int card_number=encode_glyph_card(x,y,ts);
+	int card_number=tile_lookup(ts,card++)
+	  // Adjust tile number in screen data for address of tile in RAM
+	  + (0x40000 / 0x40);
 	printf("  encoding tile (%d,%d) using card $%04x in row store y=%d\n",
 	       x,y,card_number,MAX_LINE_HEIGHT-1-y);   
 	// Write tile details into accline_screen_ram and accline_colour_ram
@@ -971,34 +1032,10 @@ int render_codepoints(int *code_points,int num)
 	}
 	if (this_trim&8) accword_colour_ram[MAX_LINE_HEIGHT-1-y][accword_len*2+0]|=0x04; // Trim 8 more pixels
       }
-      else {
-        // Do not apply underline to other than the base row
-        accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 1] = (text_colour + attributes) & 0x7f;
-      }
-      if (trim_pixels & 8)
-        accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] |= 0x04; // Trim 8 more pixels
-    }
-    for (y = char_rows - 1; y >= -under_rows; y--) {
-      int card_number = encode_glyph_card(glyph_slot, x, y, ts);
-      printf("  encoding tile (%d,%d) using card $%04x\n", x, y, card_number);
-      // Write tile details into accline_screen_ram and accline_colour_ram
-      accword_screen_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] = card_number >> 0;
-      accword_screen_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 1] = (card_number >> 8) + (trim_pixels << 5);
-      accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] = 0x20 + 0x08; // ALPHA + NCM glyph
-      if (!y) {
-        accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 1] = text_colour + attributes;
-      }
-      else {
-        // Do not apply underline to other than the base row
-        accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 1] = (text_colour + attributes) & 0x7f;
-      }
-      if (trim_pixels & 8)
-        accword_colour_ram[MAX_LINE_HEIGHT - 1 - y][accword_len * 2 + 0] |= 0x04; // Trim 8 more pixels
-    }
     accword_len++;
   }
   accword_display_len+=total_width;
-  return count;
+  return run->count;
 }
 
 int emit_rendered_word(void)
@@ -1301,6 +1338,7 @@ void emit_text(char *text)
       i += n;
 
       read_png_file(imgname);
+      add_dependency(imgname);
       struct screen *s = png_to_screen(0, ts);
 
       // Check if the image has a link
@@ -1445,6 +1483,8 @@ int do_pass(char **argv, struct tile_set *ts)
         fprintf(stderr, "ERROR: Could not set pixel size for font: %s\n", line);
         exit(-1);
       }
+      type_face_fonts[font_id] = font_lookup(font_file, font_size);
+      add_dependency(font_file);
       glyph_slot = type_faces[font_id]->glyph;
       printf("INFO: Loaded font: %s as %s, size %d\n",font_id_str,font_file,font_size);
       
@@ -1543,14 +1583,16 @@ int do_pass(char **argv, struct tile_set *ts)
   block_header[7] = 0x00;
   fwrite(block_header, 8, 1, outfile);
   unsigned char paletteblock[256];
+  // The 2nd pass uses the quantised palette
+  struct rgb *palette = (pass_num == 2) ? ts->palette : ts->colours;
   for (i = 0; i < 256; i++)
-    paletteblock[i] = nyblswap(ts->colours[i].r);
+    paletteblock[i] = nyblswap(palette[i].r);
   fwrite(paletteblock, 256, 1, outfile);
   for (i = 0; i < 256; i++)
-    paletteblock[i] = nyblswap(ts->colours[i].g);
+    paletteblock[i] = nyblswap(palette[i].g);
   fwrite(paletteblock, 256, 1, outfile);
   for (i = 0; i < 256; i++)
-    paletteblock[i] = nyblswap(ts->colours[i].b);
+    paletteblock[i] = nyblswap(palette[i].b);
   fwrite(paletteblock, 256, 1, outfile);
 
   // Header for screen RAM
@@ -1705,12 +1747,69 @@ int do_pass(char **argv, struct tile_set *ts)
 
 /* ============================================================= */
 
-int main(int argc, char **argv)
+// Dependencies are kept in <output>.d, in the same format as gcc -MD, so that
+// they can also be included into a Makefile.
+int write_dependencies(char *output)
 {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: md2h65 <input.md> <output.h65>\n");
-    exit(-1);
+  char dep_file[1024];
+  snprintf(dep_file, sizeof(dep_file), "%s.d", output);
+  FILE *f = fopen(dep_file, "w");
+  if (!f) {
+    fprintf(stderr, "ERROR: Could not write dependency file '%s'\n", dep_file);
+    return -1;
   }
+  fprintf(f, "%s:", output);
+  for (int i = 0; i < dependency_count; i++)
+    fprintf(f, " \\\n  %s", dependencies[i]);
+  fprintf(f, "\n");
+  fclose(f);
+  return 0;
+}
+
+int page_up_to_date(char *output)
+{
+  struct stat out_st, st;
+  if (stat(output, &out_st))
+    return 0;
+
+  char dep_file[1024];
+  snprintf(dep_file, sizeof(dep_file), "%s.d", output);
+  FILE *f = fopen(dep_file, "r");
+  if (!f)
+    return 0;
+
+  char word[1024];
+  int up_to_date = 1;
+  // Skip the target
+  if (fscanf(f, "%1023s", word) != 1)
+    up_to_date = 0;
+  while (up_to_date && fscanf(f, "%1023s", word) == 1) {
+    if (!strcmp(word, "\\"))
+      continue;
+    if (stat(word, &st) || st.st_mtime > out_st.st_mtime)
+      up_to_date = 0;
+  }
+  fclose(f);
+  return up_to_date;
+}
+
+struct page {
+  char *input;
+  char *output;
+};
+
+int update_only = 0;
+
+// Pages are built in their own threads, so that they start with fresh
+// thread-local state.
+pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t page_done = PTHREAD_COND_INITIALIZER;
+int pages_running = 0;
+
+void *build_page(void *arg)
+{
+  struct page *p = arg;
+  char *page_argv[3] = { "md2h65", p->input, p->output };
 
   // Default to all fonts using MEGA65 ASCII font
   for (int i = 0; i < MAX_TYPEFACES; i++)
@@ -1725,12 +1824,103 @@ int main(int argc, char **argv)
   ts = new_tileset(128 * 1024 / 64);
   palette_c64_init(ts);
 
-  do_pass(argv, ts);
+  add_dependency(p->input);
+
+  do_pass(page_argv, ts);
   pass_num = 2;
   if (second_pass_required) {
     fprintf(stderr, "Quantising colours for 2nd pass.\n");
     quantise_colours(ts);
     fprintf(stderr, "Running 2nd pass.\n");
-    do_pass(argv, ts);
+    do_pass(page_argv, ts);
+  }
+
+  if (update_only && write_dependencies(p->output))
+    exit(-1);
+
+  // Also releases the type faces
+  FT_Done_FreeType(library);
+  free_tileset(ts);
+  for (int i = 0; i < dependency_count; i++)
+    free(dependencies[i]);
+
+  pthread_mutex_lock(&page_lock);
+  pages_running--;
+  pthread_cond_signal(&page_done);
+  pthread_mutex_unlock(&page_lock);
+  return NULL;
+}
+
+void usage(void)
+{
+  fprintf(stderr, "Usage: md2h65 [-j threads] [-u] <input.md> <output.h65> [<input.md> <output.h65> ...]\n"
+                  "  -j  number of pages to build at once (default: 1)\n"
+                  "  -u  only rebuild pages whose input, fonts or images have changed since they were last built.\n"
+                  "      The files each page was built from are listed in <output.h65>.d\n");
+  exit(-1);
+}
+
+int main(int argc, char **argv)
+{
+  int threads = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "j:u")) != -1) {
+    switch (opt) {
+    case 'j':
+      threads = atoi(optarg);
+      if (threads < 1)
+        threads = 1;
+      break;
+    case 'u':
+      update_only = 1;
+      break;
+    default:
+      usage();
+    }
+  }
+  if ((argc - optind) < 2 || (argc - optind) & 1)
+    usage();
+
+  int page_count = (argc - optind) / 2;
+  struct page *pages = calloc(sizeof(struct page), page_count);
+  if (!pages) {
+    perror("calloc() failed");
+    exit(-3);
   }
+
+  int skipped = 0;
+  for (int i = 0; i < page_count; i++) {
+    pages[i].input = argv[optind + i * 2];
+    pages[i].output = argv[optind + i * 2 + 1];
+
+    if (update_only && page_up_to_date(pages[i].output)) {
+      fprintf(stderr, "'%s' is up to date.\n", pages[i].output);
+      skipped++;
+      continue;
+    }
+
+    pthread_mutex_lock(&page_lock);
+    while (pages_running >= threads)
+      pthread_cond_wait(&page_done, &page_lock);
+    pages_running++;
+    pthread_mutex_unlock(&page_lock);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, build_page, &pages[i])) {
+      perror("pthread_create() failed");
+      exit(-3);
+    }
+    pthread_detach(thread);
+  }
+
+  pthread_mutex_lock(&page_lock);
+  while (pages_running)
+    pthread_cond_wait(&page_done, &page_lock);
+  pthread_mutex_unlock(&page_lock);
+
+  if (page_count > 1)
+    fprintf(stderr, "Built %d pages, %d were up to date.\n", page_count - skipped, skipped);
+
+  return 0;
 }
@@ -19,6 +19,8 @@
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "quantise.h"
+
 /* ============================================================= */
 
 char *vhdl_prefix = "library IEEE;\n"
@@ -167,26 +169,19 @@ void read_png_file(char *file_name)
 
 /* ============================================================= */
 
-struct rgb {
-  int r;
-  int g;
-  int b;
-};
-
 struct rgb palette[2560];
 int palette_first = 16;
 int palette_index = 16; // only use upper half of palette
+struct colour_map palette_map;
 
 int palette_lookup(int r, int g, int b)
 {
-  int i;
-
   // Do we know this colour already?
-  for (i = palette_first; i < palette_index; i++) {
-    if (r == palette[i].r && g == palette[i].g && b == palette[i].b) {
-      return i;
-    }
-  }
+  if (!palette_map.keys)
+    colour_map_init(&palette_map);
+  int i = colour_map_lookup(&palette_map, r, g, b);
+  if (i != -1)
+    return i;
 
   // new colour
   if (palette_index > 255) {
@@ -199,6 +194,7 @@ int palette_lookup(int r, int g, int b)
   palette[palette_index].r = r;
   palette[palette_index].g = g;
   palette[palette_index].b = b;
+  colour_map_insert(&palette_map, r, g, b, palette_index);
   return palette_index++;
 }
 
@@ -242,6 +238,9 @@ void process_file(char *outputfilename)
 
   int this_tile[8][8];
 
+  struct colour_map stripe_map;
+  colour_map_init(&stripe_map);
+
   if (width > 720) {
     fprintf(stderr, "ERROR: Image must not be bigger than 720x480, ideally less than 640x400\n");
     exit(-1);
@@ -253,7 +252,10 @@ void process_file(char *outputfilename)
 
 #define MAX_COLOURS 256
     int colour_count = 0;
-    int colours[MAX_COLOURS];
+    struct rgb colours[MAX_COLOURS];
+    struct nearest_colour_index nearest;
+    nearest.tree = NULL;
+    colour_map_clear(&stripe_map);
 
     int subst = 0;
 
@@ -280,38 +282,22 @@ void process_file(char *outputfilename)
             g = 0;
             b = 0;
           }
-          int best_colour = -1;
-          int best_distance = 0x1000000;
-          int c = r + 256 * g + 65536 * b;
-          for (i = 0; i < colour_count; i++) {
-            if (c == colours[i])
-              break;
-            else {
-              int red_delta = abs(r - (colours[i] & 0xff));
-              int green_delta = abs(b - ((colours[i] >> 8) & 0xff));
-              int blue_delta = abs(b - ((colours[i] >> 16) & 0xff));
-              int this_distance = (red_delta * red_delta) + (green_delta * green_delta) + (blue_delta * blue_delta);
-              if (this_distance < best_distance) {
-                best_colour = i;
-                best_distance = this_distance;
-              }
-            }
+          i = colour_map_lookup(&stripe_map, r, g, b);
+          if (i != -1) {
+            this_tile[yy - y][xx - x] = i;
           }
-          if (i == colour_count) {
-            if (colour_count < MAX_COLOURS) {
-              // Allocate a new colour
-              colours[colour_count++] = c;
-              this_tile[yy - y][xx - x] = c;
-            }
-            else {
-              // Too many colours. Store in closest
-              subst++;
-              this_tile[yy - y][xx - x] = best_colour;
-              //	      printf("[#%06x -> #%06x %d]\n",c,colours[best_colour],best_distance);
-            }
+          else if (colour_count < MAX_COLOURS) {
+            // Allocate a new colour
+            colours[colour_count] = (struct rgb) { .r = r, .g = g, .b = b };
+            colour_map_insert(&stripe_map, r, g, b, colour_count);
+            this_tile[yy - y][xx - x] = colour_count++;
           }
           else {
-            this_tile[yy - y][xx - x] = i;
+            // Too many colours. Store in closest
+            if (!nearest.tree)
+              nearest_colour_init(&nearest, colours, colour_count);
+            subst++;
+            this_tile[yy - y][xx - x] = nearest_colour(&nearest, r, g, b);
           }
         }
       }
@@ -347,6 +333,8 @@ void process_file(char *outputfilename)
       }
     }
     printf("\n%d unique tiles, %d colour substitutions\n", tile_count, subst);
+    if (nearest.tree)
+      nearest_colour_free(&nearest);
 
     // Write out palette
   }
@@ -19,6 +19,8 @@
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "quantise.h"
+
 /* ============================================================= */
 
 char *vhdl_prefix = "library IEEE;\n"
@@ -167,41 +169,77 @@ void read_png_file(char *file_name)
 
 /* ============================================================= */
 
-struct rgb {
-  int r;
-  int g;
-  int b;
-};
-
-struct rgb palette[2560];
+// Palette grows as needed, and is quantised down afterwards if required
+struct rgb *palette = NULL;
+int *palette_counts = NULL;
+int palette_alloc = 0;
 int palette_first = 16;
 int palette_index = 16; // only use upper half of palette
+struct colour_map palette_map;
 
-int palette_lookup(int r, int g, int b)
+void palette_init(void)
 {
-  int i;
+  palette_alloc = 4096;
+  palette = calloc(sizeof(struct rgb), palette_alloc);
+  palette_counts = calloc(sizeof(int), palette_alloc);
+  if ((!palette) || (!palette_counts)) {
+    perror("calloc() failed");
+    exit(-1);
+  }
+  colour_map_init(&palette_map);
+}
 
+int palette_lookup(int r, int g, int b)
+{
   // Do we know this colour already?
-  for (i = palette_first; i < palette_index; i++) {
-    if (r == palette[i].r && g == palette[i].g && b == palette[i].b) {
-      return i;
-    }
+  int i = colour_map_lookup(&palette_map, r, g, b);
+  if (i != -1) {
+    palette_counts[i]++;
+    return i;
   }
 
   // new colour
-  if (palette_index > 255) {
-    fprintf(stderr, "Too many colours in image: Must be < 256, now up to %d\n", palette_index);
+  if (palette_index >= palette_alloc) {
+    palette_alloc *= 2;
+    palette = realloc(palette, sizeof(struct rgb) * palette_alloc);
+    palette_counts = realloc(palette_counts, sizeof(int) * palette_alloc);
+    if ((!palette) || (!palette_counts)) {
+      perror("realloc() failed");
+      exit(-1);
+    }
   }
-  if (palette_index > 2559)
-    exit(-1);
 
   // allocate it
   palette[palette_index].r = r;
   palette[palette_index].g = g;
   palette[palette_index].b = b;
+  palette_counts[palette_index] = 1;
+  colour_map_insert(&palette_map, r, g, b, palette_index);
   return palette_index++;
 }
 
+void read_pixel(int x, int y, int multiplier, int *r, int *g, int *b)
+{
+  png_byte *row = row_pointers[y];
+  png_byte *ptr = &(row[x * multiplier]);
+  if (ptr) {
+    *r = ptr[0];
+    if (multiplier > 1) {
+      *g = ptr[1];
+      *b = ptr[2]; // a=ptr[3];
+    }
+    else {
+      *g = *r;
+      *b = *r;
+    }
+  }
+  else {
+    *r = 0;
+    *g = 0;
+    *b = 0;
+  }
+}
+
 unsigned char nyblswap(unsigned char in)
 {
   return ((in & 0xf) << 4) + ((in & 0xf0) >> 4);
@@ -239,6 +277,8 @@ void process_file(int mode, char *outputfilename)
     printf("mode=0 (logo)\n");
     // Logo mode
 
+    palette_init();
+
     // Pre-load in C64 palette, so that those colours can be re-used if required
 
     palette[0] = (struct rgb) { .r = 0, .g = 0, .b = 0 };
@@ -258,38 +298,52 @@ void process_file(int mode, char *outputfilename)
     palette[14] = (struct rgb) { .r = 0xaa, .g = 0x9d, .b = 0xef };
     palette[15] = (struct rgb) { .r = 0xb8, .g = 0xb8, .b = 0xb8 };
 
-    for (y = 0; y < height; y++) {
-      png_byte *row = row_pointers[y];
+    // Collect the colours used, and how often
+    for (y = 0; y < height; y++)
       for (x = 0; x < width; x++) {
-        png_byte *ptr = &(row[x * multiplier]);
         int r, g, b;
-        if (ptr) {
-          r = ptr[0];
-          if (multiplier > 1) {
-            g = ptr[1];
-            b = ptr[2]; // a=ptr[3];
-          }
-          else {
-            g = r;
-            b = r;
-          }
-        }
-        else {
-          r = 0;
-          g = 0;
-          b = 0;
-        }
+        read_pixel(x, y, multiplier, &r, &g, &b);
+        palette_lookup(r, g, b);
+      }
 
-        int c = palette_lookup(r, g, b);
+    // Reduce to the 240 slots in the upper part of the palette if required
+    int colour_count = palette_index - palette_first;
+    int *targets = calloc(sizeof(int), colour_count + 1);
+    struct rgb quantised[256 - 16];
+    if (!targets) {
+      perror("calloc() failed");
+      exit(-1);
+    }
+    int palette_used = quantise_palette(
+        &palette[palette_first], &palette_counts[palette_first], colour_count, 0, quantised, 256 - palette_first, targets);
+    if (palette_used < colour_count) {
+      fprintf(stderr, "Image has %d colours: Quantised to %d\n", colour_count, palette_used);
+      // The colour map still refers to the original colours, and targets[]
+      // maps them onto the quantised palette.
+      for (int i = 0; i < palette_used; i++)
+        palette[palette_first + i] = quantised[i];
+    }
 
-        if (c > 255)
-          printf("Too many colours at (%d,%d)\n", x, y);
+    /* work out where in logo file it must be written.
+       image is made of 8x8 blocks.  So every 8 pixels across increases address
+       by 64, and every 8 pixels down increases pixel count by (64*8), and every
+       single pixel down increases address by 8.
+    */
+    int logo_size = 0x300 + ((height + 7) >> 3) * 64 * (width / 8) + ((width + 7) >> 3) * 64;
+    unsigned char *logo = calloc(1, logo_size);
+    if (!logo) {
+      perror("calloc() failed");
+      exit(-1);
+    }
+    int logo_len = 0x300; // space for palettes
+
+    for (y = 0; y < height; y++) {
+      for (x = 0; x < width; x++) {
+        int r, g, b;
+        read_pixel(x, y, multiplier, &r, &g, &b);
+
+        int c = palette_first + targets[palette_lookup(r, g, b) - palette_first];
 
-        /* work out where in logo file it must be written.
-           image is made of 8x8 blocks.  So every 8 pixels across increases address
-           by 64, and every 8 pixels down increases pixel count by (64*8), and every
-           single pixel down increases address by 8.
-        */
         int address = 0;
         address += 0x300; // space for palettes
         address += (x & 7) + (y & 7) * 8;
@@ -299,43 +353,36 @@ void process_file(int mode, char *outputfilename)
         //	else
         //	  address+=(y>>3)*64*40;
 
-        fseek(outfile, address, SEEK_SET);
-        int n = fwrite(&c, 1, 1, outfile);
-        if (n != 1) {
-          fprintf(stderr, "Could not write pixel (%d,%d) @ $%x\n", x, y, address);
-          if (outfile != NULL) {
-            fclose(outfile);
-            outfile = NULL;
-          }
-          exit(-1);
-        }
+        logo[address] = c;
+        if (address >= logo_len)
+          logo_len = address + 1;
       }
     }
 
-    fprintf(stderr, "Writing out palette of %d values\n", palette_index - palette_first);
+    fprintf(stderr, "Writing out palette of %d values\n", palette_used);
     for (int i = 0; i < 256; i++) {
-      int address;
-      unsigned char c;
       int v;
 
-      address = i + 0x000;
       v = palette[i].r;
-      c = (v >> 4) | ((v & 0xf) << 4);
-      fseek(outfile, address, SEEK_SET);
-      fwrite(&c, 1, 1, outfile);
+      logo[i + 0x000] = (v >> 4) | ((v & 0xf) << 4);
 
-      address = i + 0x100;
       v = palette[i].g;
-      c = (v >> 4) | ((v & 0xf) << 4);
-      fseek(outfile, address, SEEK_SET);
-      fwrite(&c, 1, 1, outfile);
+      logo[i + 0x100] = (v >> 4) | ((v & 0xf) << 4);
 
-      address = i + 0x200;
       v = palette[i].b;
-      c = (v >> 4) | ((v & 0xf) << 4);
-      fseek(outfile, address, SEEK_SET);
-      fwrite(&c, 1, 1, outfile);
+      logo[i + 0x200] = (v >> 4) | ((v & 0xf) << 4);
+    }
+
+    if (fwrite(logo, logo_len, 1, outfile) != 1) {
+      fprintf(stderr, "Could not write logo file\n");
+      if (outfile != NULL) {
+        fclose(outfile);
+        outfile = NULL;
+      }
+      exit(-1);
     }
+    free(logo);
+    free(targets);
 
     if (outfile != NULL) {
       fclose(outfile);
@@ -19,6 +19,9 @@
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "tile_index.h"
+#include "quantise.h"
+
 /* ============================================================= */
 
 char *vhdl_prefix = "library IEEE;\n"
@@ -101,38 +104,27 @@ void abort_(const char *s, ...)
 
 /* ============================================================= */
 
-struct tile {
-  unsigned char bytes[8][8];
-};
-
-struct rgb {
-  int r;
-  int g;
-  int b;
-};
-
 struct tile_set {
   struct tile *tiles;
   int tile_count;
   int max_tiles;
+  struct tile_index index;
 
   // Palette
   struct rgb colours[256];
   int colour_count;
+  struct colour_map colour_index;
 
   struct tile_set *next;
 };
 
 int palette_lookup(struct tile_set *ts, int r, int g, int b)
 {
-  int i;
-
   // Do we know this colour already?
-  for (i = 0; i < ts->colour_count; i++) {
-    if (r == ts->colours[i].r && g == ts->colours[i].g && b == ts->colours[i].b) {
-      // It's a colour we have seen before, so return the index
-      return i;
-    }
+  int i = colour_map_lookup(&ts->colour_index, r, g, b);
+  if (i != -1) {
+    // It's a colour we have seen before, so return the index
+    return i;
   }
 
   // new colour, check if palette has space
@@ -145,6 +137,7 @@ int palette_lookup(struct tile_set *ts, int r, int g, int b)
   ts->colours[ts->colour_count].r = r;
   ts->colours[ts->colour_count].g = g;
   ts->colours[ts->colour_count].b = b;
+  colour_map_insert(&ts->colour_index, r, g, b, ts->colour_count);
   return ts->colour_count++;
 }
 
@@ -166,6 +159,8 @@ struct tile_set *new_tileset(int max_tiles)
     exit(-3);
   }
   ts->max_tiles = max_tiles;
+  tile_index_init(&ts->index, max_tiles);
+  colour_map_init(&ts->colour_index);
   return ts;
 }
 
@@ -219,47 +214,13 @@ struct screen *new_screen(int id, struct tile_set *tiles, int width, int height)
 int tile_lookup(struct tile_set *ts, struct tile *t)
 {
   // See if tile matches any that we have already stored.
-  // (Also check if it matches flipped in either or both X,Y
-  // axes.
-  for (int i = 0; i < ts->tile_count; i++) {
-    int matches = 1;
-    // Compare unflipped
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i;
-    // Compare with flipped X
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x4000;
-    // Compare with flipped Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0x8000;
-    // Compare with flipped X and Y
-    for (int y = 0; y < 8; y++)
-      for (int x = 0; x < 8; x++)
-        if (ts->tiles[i].bytes[x][y] != t->bytes[7 - x][7 - y]) {
-          matches = 0;
-          break;
-        }
-    if (matches)
-      return i | 0xC000;
-  }
+  // The index could also match tiles flipped in either or both X,Y
+  // axes, but the original byte-wise comparison never reported such
+  // matches, so we stick to exact matches to keep the output unchanged.
+  unsigned int hash = tile_hash(t);
+  int tile_number = tile_index_find(&ts->index, ts->tiles, t, hash, 0);
+  if (tile_number != -1)
+    return tile_number;
 
   // The tile is new.
   if (ts->tile_count >= ts->max_tiles) {
@@ -268,9 +229,8 @@ int tile_lookup(struct tile_set *ts, struct tile *t)
   }
 
   // Allocate new tile and return
-  for (int y = 0; y < 8; y++)
-    for (int x = 0; x < 8; x++)
-      ts->tiles[ts->tile_count].bytes[x][y] = t->bytes[x][y];
+  ts->tiles[ts->tile_count] = *t;
+  tile_index_add(&ts->index, ts->tile_count, hash);
   return ts->tile_count++;
 }
 
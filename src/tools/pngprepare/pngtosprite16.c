@@ -19,6 +19,8 @@
 #define PNG_DEBUG 3
 #include <png.h>
 
+#include "quantise.h"
+
 /* ============================================================= */
 
 int x, y;
@@ -113,26 +115,19 @@ void read_png_file(char *file_name)
   printf("Input-file is read and now closed\n");
 }
 
-struct rgb {
-  int r;
-  int g;
-  int b;
-};
-
 struct rgb palette[2560];
 int palette_first = 16;
 int palette_index = 16; // only use upper half of palette
+struct colour_map palette_map;
 
 int palette_lookup(int r, int g, int b)
 {
-  int i;
-
   // Do we know this colour already?
-  for (i = palette_first; i < palette_index; i++) {
-    if (r == palette[i].r && g == palette[i].g && b == palette[i].b) {
-      return i;
-    }
-  }
+  if (!palette_map.keys)
+    colour_map_init(&palette_map);
+  int i = colour_map_lookup(&palette_map, r, g, b);
+  if (i != -1)
+    return i;
 
   // new colour
   if (palette_index > 15) {
@@ -144,6 +139,7 @@ int palette_lookup(int r, int g, int b)
   palette[palette_index].r = r;
   palette[palette_index].g = g;
   palette[palette_index].b = b;
+  colour_map_insert(&palette_map, r, g, b, palette_index);
   return palette_index++;
 }
 
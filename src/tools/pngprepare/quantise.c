@@ -0,0 +1,331 @@
+/*
+ * Colour lookup and palette quantisation for the PNG conversion tools.
+ *
+ * This software may be freely redistributed under the terms
+ * of the X11 license.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "quantise.h"
+
+struct sort_item {
+  int key;
+  int index;
+};
+
+static int compare_sort_items(const void *a, const void *b)
+{
+  const struct sort_item *x = a, *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->index - y->index;
+}
+
+static int channel(struct rgb *c, int axis)
+{
+  switch (axis) {
+  case 0:
+    return c->r;
+  case 1:
+    return c->g;
+  default:
+    return c->b;
+  }
+}
+
+/* ============================================================= */
+
+// Keys are stored as RGB + 1, so that 0 marks an empty slot
+#define COLOUR_KEY(r, g, b) ((((r) << 16) | ((g) << 8) | (b)) + 1)
+
+static int colour_slot(struct colour_map *cm, unsigned int key)
+{
+  int slot = (key * 2654435761U) & cm->mask;
+  while (cm->keys[slot] && cm->keys[slot] != key)
+    slot = (slot + 1) & cm->mask;
+  return slot;
+}
+
+static void colour_map_alloc(struct colour_map *cm, int size)
+{
+  cm->keys = calloc(sizeof(unsigned int), size);
+  cm->values = calloc(sizeof(int), size);
+  if ((!cm->keys) || (!cm->values)) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  cm->mask = size - 1;
+  cm->count = 0;
+}
+
+void colour_map_init(struct colour_map *cm)
+{
+  colour_map_alloc(cm, 1024);
+}
+
+void colour_map_clear(struct colour_map *cm)
+{
+  bzero(cm->keys, sizeof(unsigned int) * (cm->mask + 1));
+  cm->count = 0;
+}
+
+void colour_map_free(struct colour_map *cm)
+{
+  free(cm->keys);
+  free(cm->values);
+  cm->keys = NULL;
+  cm->values = NULL;
+}
+
+int colour_map_lookup(struct colour_map *cm, int r, int g, int b)
+{
+  int slot = colour_slot(cm, COLOUR_KEY(r, g, b));
+  return cm->keys[slot] ? cm->values[slot] : -1;
+}
+
+void colour_map_insert(struct colour_map *cm, int r, int g, int b, int value)
+{
+  // Keep the table at most half full
+  if ((cm->count + 1) * 2 > cm->mask + 1) {
+    struct colour_map old = *cm;
+    colour_map_alloc(cm, (old.mask + 1) * 2);
+    for (int i = 0; i <= old.mask; i++)
+      if (old.keys[i]) {
+        int slot = colour_slot(cm, old.keys[i]);
+        cm->keys[slot] = old.keys[i];
+        cm->values[slot] = old.values[i];
+        cm->count++;
+      }
+    free(old.keys);
+    free(old.values);
+  }
+
+  unsigned int key = COLOUR_KEY(r, g, b);
+  int slot = colour_slot(cm, key);
+  if (!cm->keys[slot]) {
+    cm->keys[slot] = key;
+    cm->count++;
+  }
+  cm->values[slot] = value;
+}
+
+/* ============================================================= */
+
+// The tree is implicit: the median of each range of tree[] is the node,
+// and the halves either side of it are its children.
+static void build_tree(struct nearest_colour_index *nci, struct sort_item *items, int lo, int hi, int axis)
+{
+  if (hi - lo < 2)
+    return;
+
+  for (int i = lo; i < hi; i++) {
+    items[i].index = nci->tree[i];
+    items[i].key = channel(&nci->palette[nci->tree[i]], axis);
+  }
+  qsort(&items[lo], hi - lo, sizeof(struct sort_item), compare_sort_items);
+  for (int i = lo; i < hi; i++)
+    nci->tree[i] = items[i].index;
+
+  int mid = (lo + hi) / 2;
+  build_tree(nci, items, lo, mid, (axis + 1) % 3);
+  build_tree(nci, items, mid + 1, hi, (axis + 1) % 3);
+}
+
+void nearest_colour_init(struct nearest_colour_index *nci, struct rgb *palette, int count)
+{
+  nci->palette = palette;
+  nci->count = count;
+  nci->tree = malloc(sizeof(int) * (count ? count : 1));
+  struct sort_item *items = malloc(sizeof(struct sort_item) * (count ? count : 1));
+  if ((!nci->tree) || (!items)) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  for (int i = 0; i < count; i++)
+    nci->tree[i] = i;
+  build_tree(nci, items, 0, count, 0);
+  free(items);
+}
+
+void nearest_colour_free(struct nearest_colour_index *nci)
+{
+  free(nci->tree);
+  nci->tree = NULL;
+  nci->count = 0;
+}
+
+static void search_tree(
+    struct nearest_colour_index *nci, struct rgb *c, int lo, int hi, int axis, int *best, int *best_distance)
+{
+  if (lo >= hi)
+    return;
+
+  int mid = (lo + hi) / 2;
+  int i = nci->tree[mid];
+  struct rgb *p = &nci->palette[i];
+  int distance = (p->r - c->r) * (p->r - c->r) + (p->g - c->g) * (p->g - c->g) + (p->b - c->b) * (p->b - c->b);
+  if (distance < *best_distance || (distance == *best_distance && i < *best)) {
+    *best = i;
+    *best_distance = distance;
+  }
+
+  int delta = channel(c, axis) - channel(p, axis);
+  int next_axis = (axis + 1) % 3;
+  if (delta < 0) {
+    search_tree(nci, c, lo, mid, next_axis, best, best_distance);
+    if (delta * delta <= *best_distance)
+      search_tree(nci, c, mid + 1, hi, next_axis, best, best_distance);
+  }
+  else {
+    search_tree(nci, c, mid + 1, hi, next_axis, best, best_distance);
+    if (delta * delta <= *best_distance)
+      search_tree(nci, c, lo, mid, next_axis, best, best_distance);
+  }
+}
+
+int nearest_colour(struct nearest_colour_index *nci, int r, int g, int b)
+{
+  struct rgb c = { .r = r, .g = g, .b = b };
+  int best = -1;
+  int best_distance = 0x7fffffff;
+  search_tree(nci, &c, 0, nci->count, 0, &best, &best_distance);
+  return best;
+}
+
+/* ============================================================= */
+
+struct box {
+  int start;
+  int len;
+  int axis;
+  int range;
+};
+
+static void measure_box(struct rgb *colours, int *order, struct box *b)
+{
+  int min[3] = { 255, 255, 255 }, max[3] = { 0, 0, 0 };
+  for (int i = b->start; i < b->start + b->len; i++)
+    for (int axis = 0; axis < 3; axis++) {
+      int v = channel(&colours[order[i]], axis);
+      if (v < min[axis])
+        min[axis] = v;
+      if (v > max[axis])
+        max[axis] = v;
+    }
+  b->axis = 0;
+  b->range = -1;
+  for (int axis = 0; axis < 3; axis++)
+    if (max[axis] - min[axis] > b->range) {
+      b->axis = axis;
+      b->range = max[axis] - min[axis];
+    }
+}
+
+int quantise_palette(
+    struct rgb *colours, int *counts, int colour_count, int fixed, struct rgb *palette, int max_palette, int *targets)
+{
+  if (colour_count <= max_palette) {
+    for (int i = 0; i < colour_count; i++) {
+      palette[i] = colours[i];
+      targets[i] = i;
+    }
+    return colour_count;
+  }
+
+  for (int i = 0; i < fixed; i++)
+    palette[i] = colours[i];
+
+  int max_boxes = max_palette - fixed;
+  int *order = malloc(sizeof(int) * colour_count);
+  struct sort_item *items = malloc(sizeof(struct sort_item) * colour_count);
+  struct box *boxes = malloc(sizeof(struct box) * (max_boxes > 0 ? max_boxes : 1));
+  if ((!order) || (!items) || (!boxes)) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  for (int i = fixed; i < colour_count; i++)
+    order[i] = i;
+
+  int box_count = 0;
+  if (max_boxes > 0) {
+    boxes[0].start = fixed;
+    boxes[0].len = colour_count - fixed;
+    measure_box(colours, order, &boxes[0]);
+    box_count = 1;
+  }
+
+  while (box_count < max_boxes) {
+    // Split the box with the widest spread of colours
+    int split = -1;
+    for (int i = 0; i < box_count; i++)
+      if (boxes[i].len > 1 && boxes[i].range > 0 && (split == -1 || boxes[i].range > boxes[split].range))
+        split = i;
+    if (split == -1)
+      break;
+    struct box *b = &boxes[split];
+
+    // Sort along the widest axis, and cut at the weighted median
+    long long total = 0;
+    for (int i = b->start; i < b->start + b->len; i++) {
+      struct rgb *c = &colours[order[i]];
+      items[i].index = order[i];
+      items[i].key = (channel(c, b->axis) << 16) | (channel(c, (b->axis + 1) % 3) << 8) | channel(c, (b->axis + 2) % 3);
+      total += counts[order[i]];
+    }
+    qsort(&items[b->start], b->len, sizeof(struct sort_item), compare_sort_items);
+    for (int i = b->start; i < b->start + b->len; i++)
+      order[i] = items[i].index;
+
+    long long sum = 0;
+    int cut = 0;
+    while (cut < b->len - 1) {
+      sum += counts[order[b->start + cut]];
+      cut++;
+      if (sum * 2 >= total)
+        break;
+    }
+
+    boxes[box_count].start = b->start + cut;
+    boxes[box_count].len = b->len - cut;
+    b->len = cut;
+    measure_box(colours, order, b);
+    measure_box(colours, order, &boxes[box_count]);
+    box_count++;
+  }
+
+  // Each box becomes the weighted average of its colours
+  for (int i = 0; i < box_count; i++) {
+    long long total = 0, r = 0, g = 0, b = 0;
+    for (int j = boxes[i].start; j < boxes[i].start + boxes[i].len; j++) {
+      struct rgb *c = &colours[order[j]];
+      // Make sure unused colours still count for something
+      long long weight = counts[order[j]] > 0 ? counts[order[j]] : 1;
+      r += c->r * weight;
+      g += c->g * weight;
+      b += c->b * weight;
+      total += weight;
+    }
+    palette[fixed + i].r = (r + total / 2) / total;
+    palette[fixed + i].g = (g + total / 2) / total;
+    palette[fixed + i].b = (b + total / 2) / total;
+  }
+
+  // Then map every colour to its nearest palette entry, which may be one of
+  // the fixed colours rather than its own box.
+  int palette_size = fixed + box_count;
+  struct nearest_colour_index nci;
+  nearest_colour_init(&nci, palette, palette_size);
+  for (int i = 0; i < colour_count; i++)
+    targets[i] = (i < fixed) ? i : nearest_colour(&nci, colours[i].r, colours[i].g, colours[i].b);
+  nearest_colour_free(&nci);
+
+  free(order);
+  free(items);
+  free(boxes);
+  return palette_size;
+}
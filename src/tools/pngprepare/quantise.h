@@ -0,0 +1,102 @@
+#ifndef QUANTISE_H
+#define QUANTISE_H
+
+/*
+ * Colour handling shared by the PNG conversion tools:
+ *
+ * - a hash map from RGB colour to palette index, so that looking up the
+ *   colour of each pixel doesn't need a scan of the whole palette.
+ * - a k-d tree over a palette for finding the nearest colour.
+ * - median-cut reduction of a list of colours down to a palette size.
+ */
+
+struct rgb {
+  int r;
+  int g;
+  int b;
+};
+
+struct colour_map {
+  unsigned int *keys;
+  int *values;
+  int mask;
+  int count;
+};
+
+/*
+ * colour_map_init(cm)
+ *
+ * allocate an empty map.  The map grows as colours are added.
+ */
+void colour_map_init(struct colour_map *cm);
+
+/*
+ * colour_map_clear(cm)
+ *
+ * forget all colours.
+ */
+void colour_map_clear(struct colour_map *cm);
+
+/*
+ * colour_map_free(cm)
+ *
+ * release the memory used by the map.
+ */
+void colour_map_free(struct colour_map *cm);
+
+/*
+ * colour_map_lookup(cm, r, g, b)
+ *
+ * returns the value stored for the colour, or -1 if it is not known.
+ */
+int colour_map_lookup(struct colour_map *cm, int r, int g, int b);
+
+/*
+ * colour_map_insert(cm, r, g, b, value)
+ *
+ * store the value (>= 0) for a colour, replacing any previous one.
+ */
+void colour_map_insert(struct colour_map *cm, int r, int g, int b, int value);
+
+struct nearest_colour_index {
+  struct rgb *palette;
+  int *tree;
+  int count;
+};
+
+/*
+ * nearest_colour_init(nci, palette, count)
+ *
+ * build a k-d tree over palette[0..count-1].  The palette is referenced,
+ * not copied, so must not change while the index is in use.
+ */
+void nearest_colour_init(struct nearest_colour_index *nci, struct rgb *palette, int count);
+
+/*
+ * nearest_colour_free(nci)
+ *
+ * release the tree.
+ */
+void nearest_colour_free(struct nearest_colour_index *nci);
+
+/*
+ * nearest_colour(nci, r, g, b)
+ *
+ * returns the index of the palette entry with the smallest squared RGB
+ * distance to the colour.  Ties go to the lowest index.
+ */
+int nearest_colour(struct nearest_colour_index *nci, int r, int g, int b);
+
+/*
+ * quantise_palette(colours, counts, colour_count, fixed, palette, max_palette, targets)
+ *
+ * reduce colours[0..colour_count-1], used counts[] times each, to a palette
+ * of at most max_palette entries using median cut.  The first fixed colours
+ * are copied to the palette unchanged.  targets[i] is set to the palette
+ * index to use for colours[i].  Returns the number of palette entries.
+ * The result depends only on the inputs, including their order.
+ */
+int quantise_palette(
+    struct rgb *colours, int *counts, int colour_count, int fixed, struct rgb *palette, int max_palette, int *targets);
+
+#endif // QUANTISE_H
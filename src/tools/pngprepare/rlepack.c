@@ -13,210 +13,323 @@
 
   Dynamic programming is used to select optimal (i.e., shortest) encoding,
   so it will automatically pick which combination of tokens is best.
-*/
 
-#define MAX_RAW_SIZE (128 * 1024)
+  The DP runs backwards from the end of the input, so that cost[i] is the
+  cheapest encoding of raw[i..end].  The lengths of the runs of equal bytes
+  and of repeating byte pairs starting at each offset are carried along as
+  we go, and the best successor for each token type is kept in a sliding
+  window minimum.  This makes each step O(1), and lets the tokens be written
+  out front to back as soon as the DP is done.
+*/
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 
-unsigned char raw[MAX_RAW_SIZE];
+#include "dirtymock.h"
+
+// Longest runs each token type can encode
+#define MAX_LITERAL 127
+#define MAX_RLE 127
+#define MAX_PAIR_RLE 510
+
+// Must be a power of two, and larger than the longest window (MAX_PAIR_RLE/2)
+#define WINDOW_RING 512
+
+#define TOKEN_LITERAL 0
+#define TOKEN_RLE 1
+#define TOKEN_PAIR_RLE 2
+#define TOKEN_TYPES 3
+
+unsigned char *raw = NULL;
 int raw_size;
 
-typedef struct dp_item {
-  unsigned char code_byte;
-  unsigned char code_byte2;
-  unsigned char *raw_region;
-  int cumulative_cost;
-  int parent;
-  int offset;
-} dp_item;
+int *cost = NULL;
+unsigned char *token_type = NULL;
+unsigned short *token_len = NULL;
+
+// Monotonic deque giving the minimum value over a window of offsets that
+// slides towards the start of the input.
+typedef struct window {
+  int pos[WINDOW_RING];
+  int val[WINDOW_RING];
+  int head, tail;
+  int upper;
+} window;
+
+struct token_stats {
+  char *name;
+  int tokens;
+  int raw_bytes;
+  int packed_bytes;
+} stats[TOKEN_TYPES] = { { "literal" }, { "RLE" }, { "pair RLE" } };
+
+void window_reset(window *w)
+{
+  w->head = 0;
+  w->tail = 0;
+  w->upper = -1;
+}
 
-dp_item dp_list[MAX_RAW_SIZE + 1];
+// Add a new (lowest) offset to the window
+void window_push(window *w, int pos, int val)
+{
+  // Drop any candidates that are no better than the new one
+  while (w->tail != w->head && w->val[(w->tail - 1) & (WINDOW_RING - 1)] >= val)
+    w->tail--;
+  w->pos[w->tail & (WINDOW_RING - 1)] = pos;
+  w->val[w->tail & (WINDOW_RING - 1)] = val;
+  w->tail++;
+}
 
-int main(int argc, char **argv)
+// Drop offsets that are beyond the upper end of the window
+void window_expire(window *w, int upper)
 {
-  if (argc != 3) {
-    fprintf(stderr, "usage: packtilesest <input tileset> <output compressed file>\n");
-    exit(-3);
-  }
+  while (w->tail != w->head && w->pos[w->head & (WINDOW_RING - 1)] > upper)
+    w->head++;
+}
 
-  int retVal = 0;
-  do {
+int read_input(char *filename)
+{
+  FILE *f = fopen(filename, "r");
+  if (!f) {
+    fprintf(stderr, "Could not open file '%s'\n", filename);
+    return -1;
+  }
 
-    FILE *f = fopen(argv[1], "r");
-    if (!f) {
-      retVal = -1;
-      fprintf(stderr, "Could not open file '%s'\n", argv[1]);
-      break;
+  int alloc_size = 0;
+  raw_size = 0;
+  while (!feof(f)) {
+    if (raw_size == alloc_size) {
+      alloc_size = alloc_size ? alloc_size * 2 : 65536;
+      raw = realloc(raw, alloc_size);
+      if (!raw) {
+        fprintf(stderr, "ERROR: Could not allocate %d bytes for input\n", alloc_size);
+        fclose(f);
+        return -1;
+      }
     }
-
-    raw_size = fread(raw, 1, MAX_RAW_SIZE, f);
-    if (raw_size < 1) {
-      retVal = -1;
-      fprintf(stderr, "Couldd not read contents of input file.\n");
+    int n = fread(&raw[raw_size], 1, alloc_size - raw_size, f);
+    if (n < 1)
       break;
-    }
-    fclose(f);
-
-    printf("Compressing file of %d bytes.\n", raw_size);
+    raw_size += n;
+  }
+  fclose(f);
 
-    // Initialise DP list as infinite cost
-    for (int i = 0; i <= MAX_RAW_SIZE; i++) {
-      dp_list[i].offset = i;
-      dp_list[i].code_byte = 0x00;            // invalid code byte
-      dp_list[i].cumulative_cost = 999999999; // infinite cost
-      dp_list[i].parent = -1;                 // Links to invalid parent
-    }
+  return 0;
+}
 
-    // To get to the start of the file has no cost
-    dp_list[0].cumulative_cost = 0;
-
-    // Now iterate through the file
-    for (int start = 0; start < raw_size; start++) {
-      int cumulative_cost = dp_list[start].cumulative_cost;
-
-      // Consider cost of encoding with non-RLE
-      for (int end = start + 1; end <= raw_size && (end - start) < 128; end++) {
-        int this_cost = 1 + (end - start);
-        if (this_cost + cumulative_cost < dp_list[end].cumulative_cost) {
-          // This is a superior option to what is currently recorded.
-          dp_list[end].code_byte = 0x00 + (end - start);
-          dp_list[end].cumulative_cost = this_cost + cumulative_cost;
-          dp_list[end].raw_region = &raw[start];
-          dp_list[end].parent = start;
-        }
-      }
+void choose(int i, int this_cost, int type, int len)
+{
+  if (this_cost < cost[i]) {
+    cost[i] = this_cost;
+    token_type[i] = type;
+    token_len[i] = len;
+  }
+}
 
-      // Now try RLE
-      for (int end = start + 1; raw[end - 1] == raw[start] && end <= raw_size && (end - start) < 128; end++) {
-        int this_cost = 1 + 1;
-        if (this_cost + cumulative_cost < dp_list[end].cumulative_cost) {
-          // This is a superior option to what is currently recorded.
-          dp_list[end].code_byte = 0x80 + (end - start);
-          dp_list[end].cumulative_cost = this_cost + cumulative_cost;
-          dp_list[end].raw_region = &raw[start];
-          dp_list[end].parent = start;
-        }
-      }
+int find_optimal_encoding(void)
+{
+  static window literal_window, rle_window, pair_window[2];
+
+  cost = malloc(sizeof(int) * (raw_size + 1));
+  token_type = malloc(raw_size);
+  token_len = malloc(sizeof(unsigned short) * raw_size);
+  if (!cost || !token_type || !token_len) {
+    fprintf(stderr, "ERROR: Could not allocate dynamic programming arrays\n");
+    return -1;
+  }
 
-      // Now try RLE of pairs of bytes
-      for (int end = start + 2;
-           (raw[end - 2] == raw[start]) && (raw[end - 1] == raw[start + 1]) && end <= raw_size && (end - start) < 512;
-           end += 2) {
-        int this_cost = 1 + 1 + 2;
-        if (this_cost + cumulative_cost < dp_list[end].cumulative_cost) {
-          // This is a superior option to what is currently recorded.
-          dp_list[end].code_byte = 0x80;
-          dp_list[end].code_byte2 = (end - start) >> 1;
-          dp_list[end].cumulative_cost = this_cost + cumulative_cost;
-          dp_list[end].raw_region = &raw[start];
-          dp_list[end].parent = start;
-        }
-      }
+  window_reset(&literal_window);
+  window_reset(&rle_window);
+  window_reset(&pair_window[0]);
+  window_reset(&pair_window[1]);
+
+  // Getting from the end of the file to the end of the file has no cost
+  cost[raw_size] = 0;
+
+  // Length of run of equal bytes starting at the next offset
+  int run = 0;
+  // Number of bytes from the next offset that match the byte two on, i.e.,
+  // the length of the repeating pair run from there is pair_match+2
+  int pair_match = 0;
+
+  for (int start = raw_size - 1; start >= 0; start--) {
+    cost[start] = 999999999; // infinite cost
+
+    // Consider cost of encoding with non-RLE
+    window_push(&literal_window, start + 1, start + 1 + cost[start + 1]);
+    int upper = start + MAX_LITERAL;
+    if (upper > raw_size)
+      upper = raw_size;
+    window_expire(&literal_window, upper);
+    int end = literal_window.pos[literal_window.head & (WINDOW_RING - 1)];
+    choose(start, 1 + cost[end] + (end - start), TOKEN_LITERAL, end - start);
+
+    // Now try RLE
+    if (start + 1 < raw_size && raw[start] == raw[start + 1])
+      run = (run < MAX_RLE) ? run + 1 : MAX_RLE;
+    else
+      run = 1;
+    upper = start + run;
+    // A longer window than last time means a new run has started, which
+    // so far contains only the next offset.
+    if (upper > rle_window.upper)
+      window_reset(&rle_window);
+    rle_window.upper = upper;
+    window_push(&rle_window, start + 1, cost[start + 1]);
+    window_expire(&rle_window, upper);
+    end = rle_window.pos[rle_window.head & (WINDOW_RING - 1)];
+    choose(start, 1 + 1 + cost[end], TOKEN_RLE, end - start);
+
+    // Now try RLE of pairs of bytes
+    if (start + 2 < raw_size && raw[start] == raw[start + 2])
+      pair_match = pair_match + 1;
+    else
+      pair_match = 0;
+    if (start + 2 <= raw_size) {
+      window *w = &pair_window[start & 1];
+      int pair_len = pair_match + 2;
+      if (pair_len > raw_size - start)
+        pair_len = raw_size - start;
+      if (pair_len > MAX_PAIR_RLE)
+        pair_len = MAX_PAIR_RLE;
+      upper = start + (pair_len & ~1);
+      if (upper > w->upper)
+        window_reset(w);
+      w->upper = upper;
+      window_push(w, start + 2, cost[start + 2]);
+      window_expire(w, upper);
+      end = w->pos[w->head & (WINDOW_RING - 1)];
+      choose(start, 1 + 1 + 2 + cost[end], TOKEN_PAIR_RLE, end - start);
     }
+  }
 
-    // Report on compressed size
-    printf("Compressed size is %d bytes\n", dp_list[raw_size].cumulative_cost);
-
-    dp_item *queue[MAX_RAW_SIZE + 1];
-    int queue_len = 0;
-    int offset = raw_size;
-    while (offset > 0) {
-      queue[queue_len] = &dp_list[offset];
-      queue_len++;
-      if (dp_list[offset].parent >= offset) {
-        fprintf(stderr, "ERROR: Circular dynamic programming path detected.\n");
-        exit(-3);
-      }
-      offset = dp_list[offset].parent;
-    }
+  return 0;
+}
 
-    printf("File encoded using %d tokens\n", queue_len);
+int write_packed(char *filename)
+{
+  FILE *o = fopen(filename, "w");
+  if (!o) {
+    fprintf(stderr, "ERROR: Could not open output file '%s'\n", filename);
+    return -1;
+  }
 
-    FILE *o = fopen(argv[2], "w");
-    if (!o) {
-      retVal = -1;
-      fprintf(stderr, "ERROR: Could not open output file '%s'\n", argv[2]);
+  int tokens = 0;
+  for (int offset = 0; offset < raw_size; offset += token_len[offset]) {
+    int len = token_len[offset];
+    struct token_stats *s = &stats[token_type[offset]];
+    switch (token_type[offset]) {
+    case TOKEN_LITERAL:
+      fputc(0x00 + len, o);
+      fwrite(&raw[offset], len, 1, o);
+      s->packed_bytes += 1 + len;
+      break;
+    case TOKEN_RLE:
+      fputc(0x80 + len, o);
+      fputc(raw[offset], o);
+      s->packed_bytes += 2;
+      break;
+    case TOKEN_PAIR_RLE:
+      fputc(0x80, o);
+      fputc(len >> 1, o);
+      fputc(raw[offset], o);
+      fputc(raw[offset + 1], o);
+      s->packed_bytes += 4;
       break;
     }
-    // Write out contents of queue in reverse order
-    for (int i = queue_len - 1; i >= 0; i--) {
-      fputc(queue[i]->code_byte, o);
-      if (queue[i]->code_byte == 0x80) {
-        fputc(queue[i]->code_byte2, o);
-        fputc(queue[i]->raw_region[0], o);
-        fputc(queue[i]->raw_region[1], o);
-      }
-      else if (queue[i]->code_byte & 0x80)
-        fputc(*queue[i]->raw_region, o);
-      else
-        fwrite(queue[i]->raw_region, queue[i]->code_byte & 0x7f, 1, o);
-    }
-    // Terminate with $00 char to mark end of packed data
-    fputc(0x00, o);
+    s->tokens++;
+    s->raw_bytes += len;
+    tokens++;
+  }
+  // Terminate with $00 char to mark end of packed data
+  fputc(0x00, o);
+  fclose(o);
+
+  printf("File encoded using %d tokens\n", tokens);
+
+  return 0;
+}
+
+void show_stats(void)
+{
+  printf("Token type  Count  Raw bytes  Packed bytes  Ratio\n");
+  for (int i = 0; i < TOKEN_TYPES; i++) {
+    struct token_stats *s = &stats[i];
+    printf("%-10s %6d %10d %13d", s->name, s->tokens, s->raw_bytes, s->packed_bytes);
+    if (s->raw_bytes)
+      printf("  %5.1f%%\n", 100.0 * s->packed_bytes / s->raw_bytes);
+    else
+      printf("      -\n");
+  }
+  // Include the end of data marker in the total
+  printf("Total %38d  %5.1f%%\n", cost[0] + 1, 100.0 * (cost[0] + 1) / raw_size);
+}
+
+int verify_packed(char *filename)
+{
+  FILE *o = fopen(filename, "r");
+  if (!o) {
+    fprintf(stderr, "ERROR: Could not open output file '%s' for verification\n", filename);
+    return -1;
+  }
+  // Worst case is all literals, plus the end marker
+  int packed_size = raw_size + (raw_size + MAX_LITERAL - 1) / MAX_LITERAL + 1;
+  unsigned char *packed = malloc(packed_size + 4);
+  unsigned char *unpacked = malloc(raw_size + MAX_PAIR_RLE);
+  if (!packed || !unpacked) {
+    fprintf(stderr, "ERROR: Could not allocate verification buffers\n");
     fclose(o);
+    return -1;
+  }
+  int packed_len = fread(packed, 1, packed_size + 1, o);
+  fclose(o);
+  printf("Read %d packed bytes for verification.\n", packed_len);
+  // Make sure a truncated token can't read beyond the end of the buffer
+  bzero(&packed[packed_len], packed_size + 4 - packed_len);
 
-    // Now verify
-    o = fopen(argv[2], "r");
-    if (!o) {
-      retVal = -1;
-      fprintf(stderr, "ERROR: Could not open output file '%s' for verification\n", argv[2]);
-      break;
-    }
-    unsigned char packed[MAX_RAW_SIZE * 2];
-    int packed_len = fread(packed, 1, MAX_RAW_SIZE * 2, o);
-    printf("Read %d packed bytes for verification.\n", packed_len);
-
-    unsigned char unpacked[MAX_RAW_SIZE];
-    int unpacked_len = 0;
-    offset = 0;
-    while (offset <= packed_len && unpacked_len < raw_size) {
-      int count = packed[offset] & 0x7f;
-      if (packed[offset] == 0x80) {
-        count = packed[offset + 1];
-        for (int i = 0; i < count; i++) {
-          unpacked[unpacked_len++] = packed[offset + 2];
-          unpacked[unpacked_len++] = packed[offset + 3];
-        }
-        offset += 4;
-      }
-      else if (packed[offset] & 0x80) {
-        // Decode RLE
-        for (int i = 0; i < count; i++)
-          unpacked[unpacked_len++] = packed[offset + 1];
-        offset += 2;
-      }
-      else {
-        bcopy(&packed[offset + 1], &unpacked[unpacked_len], count);
-        offset += 1 + count;
-        unpacked_len += count;
+  int retVal = 0;
+  int unpacked_len = 0;
+  int offset = 0;
+  while (offset < packed_len && unpacked_len < raw_size) {
+    int count = packed[offset] & 0x7f;
+    if (packed[offset] == 0x80) {
+      count = packed[offset + 1];
+      for (int i = 0; i < count && unpacked_len < raw_size; i++) {
+        unpacked[unpacked_len++] = packed[offset + 2];
+        unpacked[unpacked_len++] = packed[offset + 3];
       }
+      offset += 4;
+    }
+    else if (packed[offset] & 0x80) {
+      // Decode RLE
+      for (int i = 0; i < count && unpacked_len < raw_size; i++)
+        unpacked[unpacked_len++] = packed[offset + 1];
+      offset += 2;
     }
-    // Skip end $00 marker
-    if (!packed[offset])
-      offset++;
+    else {
+      if (unpacked_len + count > raw_size)
+        count = raw_size - unpacked_len;
+      bcopy(&packed[offset + 1], &unpacked[unpacked_len], count);
+      offset += 1 + count;
+      unpacked_len += count;
+    }
+  }
+  // Skip end $00 marker
+  if (offset < packed_len && !packed[offset])
+    offset++;
 
+  do {
     if (unpacked_len != raw_size) {
       fprintf(stderr, "ERROR: Unpacked len = %d during verification. Should have been %d\n", unpacked_len, raw_size);
       retVal = 1;
-      o = fopen("verify.out", "w");
-      if (o) {
-        fwrite(unpacked, unpacked_len, 1, o);
-        fclose(o);
-      }
-
       break;
     }
 
     if (offset != packed_len) {
       fprintf(stderr, "ERROR: Only used %d of %d bytes during unpacking.\n", offset, packed_len);
-      o = fopen("verify.out", "w");
-      if (o) {
-        fwrite(unpacked, unpacked_len, 1, o);
-        fclose(o);
-      }
       retVal = 1;
       break;
     }
@@ -225,16 +338,72 @@ int main(int argc, char **argv)
       if (raw[i] != unpacked[i]) {
         fprintf(stderr, "ERROR: Verification error at offset %d : saw 0x%02x instead of 0x%02x\n", i, unpacked[i], raw[i]);
         retVal = 1;
-
-        o = fopen("verify.out", "w");
-        if (o) {
-          fwrite(unpacked, unpacked_len, 1, o);
-          fclose(o);
-        }
-
         break;
       }
     }
+  } while (0);
+
+  if (retVal) {
+    o = fopen("verify.out", "w");
+    if (o) {
+      fwrite(unpacked, unpacked_len, 1, o);
+      fclose(o);
+    }
+  }
+
+  free(packed);
+  free(unpacked);
+  return retVal;
+}
+
+int DIRTYMOCK(main)(int argc, char **argv)
+{
+  int show_token_stats = 0;
+
+  if (argc > 1 && !strcmp(argv[1], "--stats")) {
+    show_token_stats = 1;
+    argc--;
+    argv++;
+  }
+
+  if (argc != 3) {
+    fprintf(stderr, "usage: packtileset [--stats] <input tileset> <output compressed file>\n");
+    exit(-3);
+  }
+
+  int retVal = 0;
+  do {
+
+    if (read_input(argv[1])) {
+      retVal = -1;
+      break;
+    }
+    if (raw_size < 1) {
+      retVal = -1;
+      fprintf(stderr, "Could not read contents of input file.\n");
+      break;
+    }
+
+    printf("Compressing file of %d bytes.\n", raw_size);
+
+    if (find_optimal_encoding()) {
+      retVal = -1;
+      break;
+    }
+
+    // Report on compressed size
+    printf("Compressed size is %d bytes\n", cost[0]);
+
+    if (write_packed(argv[2])) {
+      retVal = -1;
+      break;
+    }
+
+    if (show_token_stats)
+      show_stats();
+
+    // Now verify
+    retVal = verify_packed(argv[2]);
 
   } while (0);
 
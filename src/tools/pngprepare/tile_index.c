@@ -0,0 +1,119 @@
+/*
+ * Hash index for de-duplicating 8x8 tiles.
+ *
+ * This software may be freely redistributed under the terms
+ * of the X11 license.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tile_index.h"
+
+#define FNV_OFFSET 2166136261U
+#define FNV_PRIME 16777619U
+
+void tile_index_init(struct tile_index *ti, int max_tiles)
+{
+  // Keep the table at most half full
+  int buckets = 1;
+  while (buckets < max_tiles * 2)
+    buckets <<= 1;
+
+  ti->buckets = malloc(sizeof(int) * buckets);
+  ti->next = calloc(sizeof(int), max_tiles);
+  ti->hashes = calloc(sizeof(unsigned int), max_tiles);
+  if ((!ti->buckets) || (!ti->next) || (!ti->hashes)) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  ti->bucket_mask = buckets - 1;
+  ti->max_tiles = max_tiles;
+  tile_index_clear(ti);
+}
+
+void tile_index_clear(struct tile_index *ti)
+{
+  for (int i = 0; i <= ti->bucket_mask; i++)
+    ti->buckets[i] = -1;
+}
+
+void tile_index_free(struct tile_index *ti)
+{
+  free(ti->buckets);
+  free(ti->next);
+  free(ti->hashes);
+  ti->buckets = ti->next = NULL;
+  ti->hashes = NULL;
+}
+
+unsigned int tile_hash(struct tile *t)
+{
+  unsigned int h[4] = { FNV_OFFSET, FNV_OFFSET, FNV_OFFSET, FNV_OFFSET };
+
+  for (int y = 0; y < 8; y++)
+    for (int x = 0; x < 8; x++) {
+      h[0] = (h[0] ^ t->bytes[x][y]) * FNV_PRIME;
+      h[1] = (h[1] ^ t->bytes[7 - x][y]) * FNV_PRIME;
+      h[2] = (h[2] ^ t->bytes[x][7 - y]) * FNV_PRIME;
+      h[3] = (h[3] ^ t->bytes[7 - x][7 - y]) * FNV_PRIME;
+    }
+
+  unsigned int min = h[0];
+  for (int i = 1; i < 4; i++)
+    if (h[i] < min)
+      min = h[i];
+  return min;
+}
+
+static void flip_tile(struct tile *out, struct tile *t, int flip)
+{
+  for (int y = 0; y < 8; y++)
+    for (int x = 0; x < 8; x++)
+      out->bytes[x][y] = t->bytes[(flip & TILE_FLIP_X) ? 7 - x : x][(flip & TILE_FLIP_Y) ? 7 - y : y];
+}
+
+int tile_index_find(struct tile_index *ti, struct tile *tiles, struct tile *t, unsigned int hash, int flips)
+{
+  static const int orientations[4] = { 0, TILE_FLIP_X, TILE_FLIP_Y, TILE_FLIP_X | TILE_FLIP_Y };
+  struct tile flipped[4];
+  int have_flipped[4] = { 1, 0, 0, 0 };
+  int best = -1;
+
+  flipped[0] = *t;
+
+  // Chains are newest first, so keep looking for lower numbered matches.
+  // Tiles are only stored if they don't match an existing one, so in
+  // practice there is never more than one.
+  for (int i = ti->buckets[hash & ti->bucket_mask]; i != -1; i = ti->next[i]) {
+    if (ti->hashes[i] != hash)
+      continue;
+    for (int o = 0; o < 4; o++) {
+      if ((orientations[o] & flips) != orientations[o])
+        continue;
+      if (!have_flipped[o]) {
+        flip_tile(&flipped[o], t, orientations[o]);
+        have_flipped[o] = 1;
+      }
+      if (!memcmp(&tiles[i], &flipped[o], sizeof(struct tile))) {
+        best = i | orientations[o];
+        break;
+      }
+    }
+  }
+
+  return best;
+}
+
+void tile_index_add(struct tile_index *ti, int tile_num, unsigned int hash)
+{
+  if (tile_num >= ti->max_tiles) {
+    fprintf(stderr, "ERROR: Tile index only has room for %d tiles.\n", ti->max_tiles);
+    exit(-3);
+  }
+  ti->hashes[tile_num] = hash;
+  ti->next[tile_num] = ti->buckets[hash & ti->bucket_mask];
+  ti->buckets[hash & ti->bucket_mask] = tile_num;
+}
@@ -0,0 +1,77 @@
+#ifndef TILE_INDEX_H
+#define TILE_INDEX_H
+
+/*
+ * Hash index for de-duplicating 8x8 tiles, shared by md2h65, pngtoscreens
+ * and giftotiles.
+ *
+ * Each tile is hashed in all four orientations, and the smallest of these
+ * hashes is used as the key.  A tile and any flipped copy of it thus end up
+ * in the same bucket, and only tiles in that bucket need to be compared.
+ */
+
+struct tile {
+  unsigned char bytes[8][8];
+};
+
+// Flip bits as used in the screen RAM tile number
+#define TILE_FLIP_X 0x4000
+#define TILE_FLIP_Y 0x8000
+
+struct tile_index {
+  int *buckets;
+  int bucket_mask;
+  // Chain of tiles with the same bucket, and the hash of each tile
+  int *next;
+  unsigned int *hashes;
+  int max_tiles;
+};
+
+/*
+ * tile_index_init(ti, max_tiles)
+ *
+ * allocate an empty index able to hold max_tiles tiles.
+ */
+void tile_index_init(struct tile_index *ti, int max_tiles);
+
+/*
+ * tile_index_clear(ti)
+ *
+ * forget all tiles, e.g., when starting a new pass over the input.
+ */
+void tile_index_clear(struct tile_index *ti);
+
+/*
+ * tile_index_free(ti)
+ *
+ * release the memory used by the index.
+ */
+void tile_index_free(struct tile_index *ti);
+
+/*
+ * tile_hash(t)
+ *
+ * calculate the orientation-independent hash of a tile.
+ */
+unsigned int tile_hash(struct tile *t);
+
+/*
+ * tile_index_find(ti, tiles, t, hash, flips)
+ *
+ * look for a stored tile that matches t, either as-is or flipped in the
+ * directions allowed by flips (TILE_FLIP_X | TILE_FLIP_Y).
+ * Returns the lowest matching tile number, with the flip bits needed to
+ * show it as t, or -1 if there is no match.  Orientations are tried in the
+ * order unflipped, X, Y, XY.
+ */
+int tile_index_find(struct tile_index *ti, struct tile *tiles, struct tile *t, unsigned int hash, int flips);
+
+/*
+ * tile_index_add(ti, tile_num, hash)
+ *
+ * record that tile number tile_num, with hash from tile_hash(), has been
+ * stored in the tile set.
+ */
+void tile_index_add(struct tile_index *ti, int tile_num, unsigned int hash);
+
+#endif // TILE_INDEX_H
@@ -60,6 +60,7 @@ int debug_load_memory = 0;
 extern unsigned char recent_bytes[4];
 
 int full_read = 0;
+int use_track_reader = 0;
 
 int osk_enable = 0;
 
@@ -82,9 +83,10 @@ void get_video_state(void);
 void usage(void)
 {
   fprintf(stderr, "MEGA65 remote disk reading tool.\n");
-  fprintf(stderr, "usage: m65 [-l <serial port>] [-s <230400|2000000|4000000>] [-f] out.d81\n");
+  fprintf(stderr, "usage: m65 [-l <serial port>] [-s <230400|2000000|4000000>] [-f] [-T] out.d81\n");
 
   fprintf(stderr, "  -f - Do full copy (instead of only copying sectors likely to contain data.\n"
+                  "  -T - Image the whole disk to out.d81 using a helper on the MEGA65 that reads whole tracks.\n"
                   "  -l - Name of serial port to use, e.g., /dev/ttyUSB1\n"
                   "  -s - Speed of serial port in bits per second. This must match what your bitstream uses.\n"
                   "       (Typically 2000000 or 4000000).\n"
@@ -1014,24 +1016,27 @@ unsigned char checkUSBPermissions()
 
 unsigned char read_a_sector(unsigned char track_number, unsigned char side, unsigned char sector)
 {
+  static struct regscript rs;
+  unsigned char status = 0;
+
+  regscript_reset(&rs);
+
   // Disable auto-seek, or we can't force seeking to track 0
-  mega65_poke(0xffD3696, 0x00);
+  regscript_poke(&rs, 0xffD3696, 0x00);
 
   // Floppy motor on, and select side
-  mega65_poke(0xffD3080, 0x68);
-  if (side)
-    mega65_poke(0xffD3080, 0x60);
+  regscript_poke(&rs, 0xffD3080, side ? 0x60 : 0x68);
 
   // Map FDC sector buffer, not SD sector buffer
-  mega65_poke(0xffD3689, mega65_peek(0xffD3689) & 0x7f);
+  regscript_modify(&rs, 0xffD3689, 0x7f, 0x00);
 
   // Disable matching on any sector, use real drive
-  mega65_poke(0xffd36A1, 0x01);
+  regscript_poke(&rs, 0xffd36A1, 0x01);
 
-  // Wait until busy flag clears
-  while (mega65_peek(0xffD3082) & 0x80) {
-    continue;
-  }
+  // Wait until busy flag clears.  A seek or a read can take a long time on
+  // a slow drive, and failures are reported in the status register, so
+  // there is no timeout, just as when this was a loop of peeks.
+  regscript_wait_clear(&rs, 0xffD3082, 0x80, REGSCRIPT_WAIT_FOREVER);
 
 #if 0
   // Seek to track 0
@@ -1047,18 +1052,19 @@ unsigned char read_a_sector(unsigned char track_number, unsigned char side, unsi
 #endif
 
   // Now select the side, and try to read the sector
-  mega65_poke(0xffD3084, track_number);
-  mega65_poke(0xffD3085, sector);
-  mega65_poke(0xffD3086, side ? 1 : 0);
+  regscript_poke(&rs, 0xffD3084, track_number);
+  regscript_poke(&rs, 0xffD3085, sector);
+  regscript_poke(&rs, 0xffD3086, side ? 1 : 0);
 
   // Issue read command
-  mega65_poke(0xffD3081, 0x01); // but first reset buffers
-  mega65_poke(0xffD3081, 0x40);
+  regscript_poke(&rs, 0xffD3081, 0x01); // but first reset buffers
+  regscript_poke(&rs, 0xffD3081, 0x40);
 
   // Wait for busy flag to clear
-  while (mega65_peek(0xffD3082) & 0x80) { }
+  regscript_wait_clear(&rs, 0xffD3082, 0x80, REGSCRIPT_WAIT_FOREVER);
+  regscript_peek(&rs, 0xffD3082, &status);
 
-  if (mega65_peek(0xffD3082) & 0x18) {
+  if (regscript_run(&rs) || (status & 0x18)) {
     // Read failed
     log_error("failed to read T:%02x, S:%02x, H:%02x", track_number, sector, side);
     return 1;
@@ -1116,6 +1122,257 @@ void goto_track0(void)
   }
 }
 
+/*
+  Whole disk imaging, using the track reader helper (src/utilities/trackread.c).
+
+  The helper reads whole tracks into RAM by itself, and we fetch each one
+  in a single transfer.  It has two job slots, so that it can read the next
+  track while we are fetching the last one.
+*/
+
+extern unsigned int trackreadroutine_len;
+extern unsigned char trackreadroutine[];
+
+#define TRACK_READER_MAILBOX 0x0340
+#define TRACK_READER_JOB(slot) (TRACK_READER_MAILBOX + 0x10 + (slot)*0x10)
+#define TRACK_READER_STATUS(slot) (TRACK_READER_MAILBOX + 0x30 + (slot)*0x10)
+#define TRACK_READER_BUFFER(slot) (0x40000 + (slot)*0x2000)
+#define TRACK_READER_TIMEOUT 10
+
+#define D81_TRACKS 80
+#define D81_SECTORS 10
+#define D81_SECTOR_SIZE 512
+#define D81_TRACK_SIZE (D81_SECTORS * D81_SECTOR_SIZE)
+// The directory and BAM are on track 40, i.e., the 40th physical track
+#define D81_DIRECTORY_TRACK 39
+
+unsigned char d81_image[D81_TRACKS * 2 * D81_TRACK_SIZE];
+unsigned char sector_status[D81_TRACKS][2][D81_SECTORS];
+
+struct track_job {
+  int track;
+  int side;
+  unsigned char seq;
+};
+
+// Sequence numbers tell the helper that a job slot has a new job.  Zero is
+// never used, as that is what the slots start out with.
+unsigned char next_track_job_seq(void)
+{
+  static unsigned char seq = 0;
+  if (!++seq)
+    seq++;
+  return seq;
+}
+
+int load_track_reader(void)
+{
+  char cmd[1024];
+  unsigned char buffer[0x50];
+
+  monitor_sync();
+  detect_mode();
+  if (!saw_c64_mode) {
+    start_cpu();
+    switch_to_c64mode();
+  }
+
+  fake_stop_cpu();
+
+  // Clear the communications area, so that we don't see a stale ready flag
+  bzero(buffer, sizeof(buffer));
+  push_ram(TRACK_READER_MAILBOX, sizeof(buffer), buffer);
+
+  // Load helper, minus the 2 byte load address header
+  push_ram(0x0801, trackreadroutine_len - 2, &trackreadroutine[2]);
+  log_debug("pushed track reader into memory");
+
+  if (saw_openrom) {
+    stuff_keybuffer("RUN\r");
+  }
+  else {
+    snprintf(cmd, 1024, "g080d\r");
+    slow_write(fd, cmd, strlen(cmd));
+    wait_for_prompt();
+  }
+
+  snprintf(cmd, 1024, "t0\r");
+  slow_write(fd, cmd, strlen(cmd));
+  wait_for_prompt();
+
+  // The helper seeks to track 0 before it says it is ready
+  time_t timeout = time(0) + TRACK_READER_TIMEOUT;
+  while (time(0) < timeout) {
+    fetch_ram(TRACK_READER_MAILBOX, 4, buffer);
+    if (!memcmp(buffer, "TRK1", 4)) {
+      log_note("track reader helper installed");
+      return 0;
+    }
+    usleep(100000);
+  }
+  log_error("track reader helper did not start");
+  return -1;
+}
+
+void submit_track_job(int slot, struct track_job *job)
+{
+  unsigned char request[4];
+
+  request[0] = job->track;
+  request[1] = job->side;
+  request[2] = 1; // first sector
+  request[3] = D81_SECTORS;
+  push_ram(TRACK_READER_JOB(slot) + 1, sizeof(request), request);
+  // The sequence number goes last, as it starts the job
+  mega65_poke(TRACK_READER_JOB(slot), job->seq);
+}
+
+int wait_for_track_job(int slot, struct track_job *job)
+{
+  time_t timeout = time(0) + TRACK_READER_TIMEOUT;
+  while (mega65_peek(TRACK_READER_JOB(slot) + 8) != job->seq) {
+    if (time(0) >= timeout) {
+      log_error("timed out waiting for T:%02x, H:%02x", job->track, job->side);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Tracks that have no blocks allocated in the BAM don't need to be read.
+// If the BAM can't be read, assume all tracks are in use.
+void find_used_tracks(int *used)
+{
+  for (int track = 0; track < D81_TRACKS; track++)
+    used[track] = 1;
+
+  if (full_read)
+    return;
+  // The BAM is in logical sectors 1 and 2, i.e., physical sectors 1 and 2 of side 0
+  if ((sector_status[D81_DIRECTORY_TRACK][0][0] & 0x18) || (sector_status[D81_DIRECTORY_TRACK][0][1] & 0x18)) {
+    log_warn("could not read BAM, reading all tracks");
+    return;
+  }
+
+  unsigned char *bam = &d81_image[D81_DIRECTORY_TRACK * 2 * D81_TRACK_SIZE + 0x100];
+  if (bam[2] != 'D' || bam[0x100 + 2] != 'D') {
+    log_warn("BAM does not look like a 1581 disk, reading all tracks");
+    return;
+  }
+  for (int track = 0; track < D81_TRACKS; track++) {
+    unsigned char *entry = &bam[(track / 40) * 0x100 + 0x10 + (track % 40) * 6];
+    if (entry[0] == 40 && track != D81_DIRECTORY_TRACK)
+      used[track] = 0;
+  }
+}
+
+int image_disk(char *d81file)
+{
+  struct track_job jobs[D81_TRACKS * 2];
+  struct track_job in_flight[2];
+  int job_count = 0, next_job = 0, tracks_read = 0;
+
+  FILE *f = fopen(d81file, "wb");
+  if (!f) {
+    log_crit("could not open '%s' for writing", d81file);
+    return -1;
+  }
+
+  if (load_track_reader()) {
+    fclose(f);
+    return -1;
+  }
+
+  unsigned long long start_ms = gettime_ms();
+
+  // Read the directory track first, so that we know which tracks are in use
+  for (int side = 0; side < 2; side++) {
+    jobs[job_count].track = D81_DIRECTORY_TRACK;
+    jobs[job_count++].side = side;
+  }
+
+  // Keep both job slots busy
+  for (int slot = 0; slot < 2; slot++) {
+    in_flight[slot].seq = 0;
+    if (next_job < job_count) {
+      in_flight[slot] = jobs[next_job++];
+      in_flight[slot].seq = next_track_job_seq();
+      submit_track_job(slot, &in_flight[slot]);
+    }
+  }
+
+  int slot = 0;
+  int bad_sectors = 0;
+  while (in_flight[slot].seq) {
+    struct track_job *job = &in_flight[slot];
+    if (wait_for_track_job(slot, job)) {
+      fclose(f);
+      return -1;
+    }
+
+    // The helper is already reading the track in the other slot while we
+    // fetch this one.
+    unsigned char *track_data = &d81_image[(job->track * 2 + job->side) * D81_TRACK_SIZE];
+    fetch_ram(TRACK_READER_STATUS(slot), D81_SECTORS, sector_status[job->track][job->side]);
+    fetch_ram(TRACK_READER_BUFFER(slot), D81_TRACK_SIZE, track_data);
+    tracks_read++;
+
+    for (int sector = 0; sector < D81_SECTORS; sector++) {
+      unsigned char status = sector_status[job->track][job->side][sector];
+      if (status & 0x18) {
+        log_error("failed to read T:%02x, S:%02x, H:%02x after %d attempts", job->track, sector + 1, job->side, status & 7);
+        bzero(&track_data[sector * D81_SECTOR_SIZE], D81_SECTOR_SIZE);
+        bad_sectors++;
+      }
+      else if ((status & 7) > 1)
+        log_warn("read T:%02x, S:%02x, H:%02x after %d attempts", job->track, sector + 1, job->side, status & 7);
+    }
+    log_note("read T:%02x, H:%02x", job->track, job->side);
+
+    if (job->track == D81_DIRECTORY_TRACK && job->side == 0) {
+      int used[D81_TRACKS];
+      find_used_tracks(used);
+      for (int track = 0; track < D81_TRACKS; track++)
+        for (int side = 0; side < 2; side++)
+          if (used[track] && track != D81_DIRECTORY_TRACK) {
+            jobs[job_count].track = track;
+            jobs[job_count++].side = side;
+          }
+    }
+
+    job->seq = 0;
+    if (next_job < job_count) {
+      *job = jobs[next_job++];
+      job->seq = next_track_job_seq();
+      submit_track_job(slot, job);
+    }
+    else if (!in_flight[slot ^ 1].seq) {
+      // All done, so stop the helper, which will be waiting on the other slot
+      struct track_job stop = { .track = 0xff, .side = 0, .seq = next_track_job_seq() };
+      submit_track_job(slot ^ 1, &stop);
+    }
+    slot ^= 1;
+  }
+
+  unsigned long long elapsed_ms = gettime_ms() - start_ms;
+  log_note("read %d tracks in %llu.%03llus (%.1f KB/s)", tracks_read, elapsed_ms / 1000, elapsed_ms % 1000,
+      elapsed_ms ? tracks_read * D81_TRACK_SIZE / 1.024 / elapsed_ms : 0.0);
+
+  if (fwrite(d81_image, sizeof(d81_image), 1, f) != 1) {
+    log_crit("could not write '%s'", d81file);
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  if (bad_sectors) {
+    log_error("%d sectors could not be read, and have been zero-filled in '%s'", bad_sectors, d81file);
+    return 1;
+  }
+  log_note("wrote '%s'", d81file);
+  return 0;
+}
+
 int main(int argc, char **argv)
 {
   start_time = time(0);
@@ -1128,7 +1385,7 @@ int main(int argc, char **argv)
     usage();
 
   int opt;
-  while ((opt = getopt(argc, argv, "fhl:s:?")) != -1) {
+  while ((opt = getopt(argc, argv, "fhl:s:T?")) != -1) {
     switch (opt) {
     case 'h':
     case '?':
@@ -1136,6 +1393,8 @@ int main(int argc, char **argv)
     case 'f':
       full_read = 1;
       break;
+    case 'T':
+      use_track_reader = 1;
       break;
     case 'l':
       serial_port = strdup(optarg);
@@ -1199,6 +1458,12 @@ int main(int argc, char **argv)
   rxbuff_detect();
   monitor_sync();
 
+  if (use_track_reader) {
+    if (optind != argc - 1)
+      usage();
+    do_exit(image_disk(argv[optind]) ? 1 : 0);
+  }
+
   real_stop_cpu();
 
   // Seek to track 0, then to track 37
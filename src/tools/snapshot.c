@@ -0,0 +1,640 @@
+/*
+  Machine state snapshots for m65.  See include/snapshot.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "m65common.h"
+#include "logging.h"
+#include "snapshot.h"
+
+extern int no_rxbuff;
+extern int cpu_stopped;
+
+// Where the checksum routine and its table go while it runs.  Both areas,
+// and zero page, are put back afterwards.
+#define SNAPSHOT_HELPER_ADDR 0x0C00
+#define SNAPSHOT_TABLE_ADDR 0x5E000
+#define SNAPSHOT_TABLE_SIZE (SNAPSHOT_PAGES * 4)
+
+#define SNAPSHOT_HELPER_TIMEOUT_MS 5000
+
+/*
+  I/O registers that make up the visible state of the machine.  Registers
+  that are acknowledged or cleared by accessing them (e.g., $D019, $D01E,
+  $D01F and the CIA interrupt controls) are left alone.
+*/
+static const struct {
+  uint32_t first, last;
+} snapshot_io_ranges[] = {
+  { 0xFFD3000, 0xFFD3018 }, // sprite positions, screen control, memory pointers
+  { 0xFFD301A, 0xFFD301D }, // interrupt mask, sprite enables and sizes
+  { 0xFFD3020, 0xFFD302E }, // colours
+  { 0xFFD3030, 0xFFD3031 }, // VIC-III ROM banking, FAST, H640, V400
+  { 0xFFD3054, 0xFFD3054 }, // VIC-IV control, VFAST
+  { 0xFFD3058, 0xFFD306F }, // line step, character count, screen, colour and sprite pointers
+  { 0xFFD3C02, 0xFFD3C03 }, // CIA 1 data direction
+  { 0xFFD3D00, 0xFFD3D03 }, // CIA 2 VIC bank and data direction
+};
+
+/*
+  Checksum routine, run on the MEGA65 to find the pages that differ from
+  those on the host.  Zero page holds its parameters: $F0-$F3 the 32-bit
+  address of the first page, $F4-$F7 the 32-bit address of the table,
+  $F8-$F9 the number of pages, and $FE is set to $FF once it has
+  finished.  For each page it stores the sum of the bytes, the 16-bit sum
+  of the running sums and the XOR of the bytes, using $FA-$FD while
+  summing.  It leaves the speed alone, as the host sets 40MHz around it
+  through $D031 and $D054, which unlike a write to $00 can be put back.
+
+        SEI
+        LDA #$00
+        TAB
+        LDZ #$00
+  page: LDA #$00
+        STA $FA
+        STA $FB
+        STA $FC
+        STA $FD
+  byte: LDA [$F0],Z
+        TAX
+        EOR $FD
+        STA $FD
+        TXA
+        CLC
+        ADC $FA
+        STA $FA
+        CLC
+        ADC $FB
+        STA $FB
+        BCC nocarry
+        INC $FC
+nocarry:INZ
+        BNE byte
+        LDA $FA
+        STA [$F4],Z
+        INZ
+        LDA $FB
+        STA [$F4],Z
+        INZ
+        LDA $FC
+        STA [$F4],Z
+        INZ
+        LDA $FD
+        STA [$F4],Z
+        LDZ #$00
+        CLC
+        LDA $F4
+        ADC #$04
+        STA $F4
+        BCC dstok
+        INC $F5
+  dstok:INC $F1
+        BNE srcok
+        INC $F2
+  srcok:LDA $F8
+        BNE countlo
+        DEC $F9
+countlo:DEC $F8
+        LDA $F8
+        ORA $F9
+        BNE page
+        LDA #$FF
+        STA $FE
+  done: BRA done
+*/
+static unsigned char snapshot_helper[104] = { 0x78, 0xa9, 0x00, 0x5b, 0xa3, 0x00, 0xa9, 0x00, 0x85, 0xfa, 0x85, 0xfb,
+  0x85, 0xfc, 0x85, 0xfd, 0xea, 0xb2, 0xf0, 0xaa, 0x45, 0xfd, 0x85, 0xfd, 0x8a, 0x18, 0x65, 0xfa, 0x85, 0xfa, 0x18,
+  0x65, 0xfb, 0x85, 0xfb, 0x90, 0x02, 0xe6, 0xfc, 0x1b, 0xd0, 0xe6, 0xa5, 0xfa, 0xea, 0x92, 0xf4, 0x1b, 0xa5, 0xfb,
+  0xea, 0x92, 0xf4, 0x1b, 0xa5, 0xfc, 0xea, 0x92, 0xf4, 0x1b, 0xa5, 0xfd, 0xea, 0x92, 0xf4, 0xa3, 0x00, 0x18, 0xa5,
+  0xf4, 0x69, 0x04, 0x85, 0xf4, 0x90, 0x02, 0xe6, 0xf5, 0xe6, 0xf1, 0xd0, 0x02, 0xe6, 0xf2, 0xa5, 0xf8, 0xd0, 0x02,
+  0xc6, 0xf9, 0xc6, 0xf8, 0xa5, 0xf8, 0x05, 0xf9, 0xd0, 0xa4, 0xa9, 0xff, 0x85, 0xfe, 0x80, 0xfe };
+
+struct snapshot_file_header {
+  char magic[8];
+  uint32_t mode; // bit 0: C64 mode, bit 1: C65 mode
+  uint32_t io_count;
+  uint16_t pc, sp, maph, mapl;
+  uint8_t a, x, y, z, b, p, reserved[2];
+};
+
+void snapshot_checksum(const unsigned char *page, unsigned char *sum)
+{
+  unsigned int s1 = 0, s2 = 0, x = 0;
+  for (int i = 0; i < 256; i++) {
+    x ^= page[i];
+    s1 = (s1 + page[i]) & 0xff;
+    s2 = (s2 + s1) & 0xffff;
+  }
+  sum[0] = s1;
+  sum[1] = s2 & 0xff;
+  sum[2] = s2 >> 8;
+  sum[3] = x;
+}
+
+// Snapshot data of page n, counting chip RAM pages then colour RAM pages
+static unsigned char *snapshot_page_data(const struct snapshot *snap, int n)
+{
+  if (n < SNAPSHOT_CHIPRAM_SIZE / 256)
+    return &snap->chipram[n * 256];
+  return &snap->colourram[(n - SNAPSHOT_CHIPRAM_SIZE / 256) * 256];
+}
+
+static uint32_t snapshot_page_addr(int n)
+{
+  if (n < SNAPSHOT_CHIPRAM_SIZE / 256)
+    return SNAPSHOT_CHIPRAM_ADDR + n * 256;
+  return SNAPSHOT_COLOURRAM_ADDR + (n - SNAPSHOT_CHIPRAM_SIZE / 256) * 256;
+}
+
+int snapshot_diff(const struct snapshot *snap, const unsigned char *sums, unsigned char *dirty)
+{
+  int count = 0;
+  for (int n = 0; n < SNAPSHOT_PAGES; n++) {
+    unsigned char sum[4];
+    snapshot_checksum(snapshot_page_data(snap, n), sum);
+    dirty[n] = memcmp(sum, &sums[n * 4], 4) != 0;
+    count += dirty[n];
+  }
+  return count;
+}
+
+void snapshot_free(struct snapshot *snap)
+{
+  free(snap->chipram);
+  free(snap->colourram);
+  free(snap->io);
+  memset(snap, 0, sizeof(struct snapshot));
+}
+
+static void snapshot_alloc(struct snapshot *snap, int io_count)
+{
+  snap->chipram = malloc(SNAPSHOT_CHIPRAM_SIZE);
+  snap->colourram = malloc(SNAPSHOT_COLOURRAM_SIZE);
+  snap->io = calloc(io_count, sizeof(struct snapshot_io));
+  if (!snap->chipram || !snap->colourram || !snap->io) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  snap->io_count = io_count;
+}
+
+int snapshot_write(const char *filename, const struct snapshot *snap)
+{
+  struct snapshot_file_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, 8);
+  header.mode = (snap->c64_mode ? 1 : 0) | (snap->c65_mode ? 2 : 0);
+  header.io_count = snap->io_count;
+  header.pc = snap->regs.pc;
+  header.sp = snap->regs.sp;
+  header.maph = snap->regs.maph;
+  header.mapl = snap->regs.mapl;
+  header.a = snap->regs.a;
+  header.x = snap->regs.x;
+  header.y = snap->regs.y;
+  header.z = snap->regs.z;
+  header.b = snap->regs.b;
+  header.p = snap->regs.p;
+
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    log_error("could not create snapshot file '%s': %s", filename, strerror(errno));
+    return -1;
+  }
+  if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(snap->chipram, SNAPSHOT_CHIPRAM_SIZE, 1, f) != 1
+      || fwrite(snap->colourram, SNAPSHOT_COLOURRAM_SIZE, 1, f) != 1
+      || fwrite(snap->io, sizeof(struct snapshot_io), snap->io_count, f) != (size_t)snap->io_count) {
+    log_error("could not write snapshot file '%s': %s", filename, strerror(errno));
+    fclose(f);
+    return -1;
+  }
+  if (fclose(f)) {
+    log_error("could not write snapshot file '%s': %s", filename, strerror(errno));
+    return -1;
+  }
+  return 0;
+}
+
+int snapshot_read(const char *filename, struct snapshot *snap)
+{
+  memset(snap, 0, sizeof(struct snapshot));
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    log_error("could not open snapshot file '%s': %s", filename, strerror(errno));
+    return -1;
+  }
+  struct snapshot_file_header header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || memcmp(header.magic, SNAPSHOT_MAGIC, 8)
+      || header.io_count > 0x10000) {
+    log_error("'%s' is not a snapshot file", filename);
+    fclose(f);
+    return -1;
+  }
+  snapshot_alloc(snap, header.io_count);
+  if (fread(snap->chipram, SNAPSHOT_CHIPRAM_SIZE, 1, f) != 1 || fread(snap->colourram, SNAPSHOT_COLOURRAM_SIZE, 1, f) != 1
+      || fread(snap->io, sizeof(struct snapshot_io), snap->io_count, f) != (size_t)snap->io_count) {
+    log_error("snapshot file '%s' is truncated", filename);
+    fclose(f);
+    snapshot_free(snap);
+    return -1;
+  }
+  fclose(f);
+
+  snap->c64_mode = header.mode & 1;
+  snap->c65_mode = (header.mode >> 1) & 1;
+  snap->regs.pc = header.pc;
+  snap->regs.sp = header.sp;
+  snap->regs.maph = header.maph;
+  snap->regs.mapl = header.mapl;
+  snap->regs.a = header.a;
+  snap->regs.x = header.x;
+  snap->regs.y = header.y;
+  snap->regs.z = header.z;
+  snap->regs.b = header.b;
+  snap->regs.p = header.p;
+  return 0;
+}
+
+/*
+  Read the CPU registers from the monitor's r command, whose output is
+  ",0777PPPP AA XX YY ZZ BB SPSP MAPH MAPL LO IN PP ..."
+*/
+static int snapshot_read_regs(struct snapshot_regs *r)
+{
+  if (!no_rxbuff)
+    monitor_sync();
+  slow_write_safe(fd, "r\r", 2);
+
+  char buff[8192];
+  int len = 0;
+  char *s = NULL;
+  long long start = gettime_ms();
+  while (gettime_ms() - start < 1000 && len < (int)sizeof(buff) - 1) {
+    int b = serialport_read(fd, (unsigned char *)buff + len, sizeof(buff) - 1 - len);
+    if (b <= 0) {
+      do_usleep(1000);
+      continue;
+    }
+    len += b;
+    buff[len] = 0;
+    s = strstr(buff, "\n,");
+    if (s && strchr(s + 2, '\n'))
+      break;
+  }
+  if (!s)
+    return -1;
+
+  unsigned int pc, a, x, y, z, b, sp, maph, mapl, lastop, in, p;
+  if (sscanf(&s[6], "%04X %02X %02X %02X %02X %02X %04X %04X %04X %02X %02X %02X", &pc, &a, &x, &y, &z, &b, &sp, &maph,
+          &mapl, &lastop, &in, &p)
+      != 12)
+    return -1;
+  r->pc = pc;
+  r->a = a;
+  r->x = x;
+  r->y = y;
+  r->z = z;
+  r->b = b;
+  r->sp = sp;
+  r->maph = maph;
+  r->mapl = mapl;
+  r->p = p;
+  return 0;
+}
+
+int snapshot_save(const char *filename)
+{
+  long long start = gettime_ms();
+  if (!saw_c64_mode && !saw_c65_mode)
+    detect_mode();
+
+  struct snapshot snap;
+  memset(&snap, 0, sizeof(snap));
+  int io_count = 0;
+  for (unsigned int i = 0; i < sizeof(snapshot_io_ranges) / sizeof(snapshot_io_ranges[0]); i++)
+    io_count += snapshot_io_ranges[i].last - snapshot_io_ranges[i].first + 1;
+  snapshot_alloc(&snap, io_count);
+  snap.c64_mode = saw_c64_mode;
+  snap.c65_mode = saw_c65_mode;
+
+  int cpu_stopped_state = cpu_stopped;
+  real_stop_cpu();
+  int retval = 0;
+  if (snapshot_read_regs(&snap.regs)) {
+    log_error("could not read the CPU registers");
+    retval = -1;
+  }
+  else if (fetch_ram_checked(SNAPSHOT_CHIPRAM_ADDR, SNAPSHOT_CHIPRAM_SIZE, snap.chipram)
+           || fetch_ram_checked(SNAPSHOT_COLOURRAM_ADDR, SNAPSHOT_COLOURRAM_SIZE, snap.colourram)) {
+    log_error("could not read memory");
+    retval = -1;
+  }
+  else {
+    struct regscript rs;
+    regscript_init(&rs);
+    int n = 0;
+    for (unsigned int i = 0; i < sizeof(snapshot_io_ranges) / sizeof(snapshot_io_ranges[0]); i++)
+      for (uint32_t addr = snapshot_io_ranges[i].first; addr <= snapshot_io_ranges[i].last; addr++) {
+        snap.io[n].addr = addr;
+        regscript_peek(&rs, addr, &snap.io[n].value);
+        n++;
+      }
+    if (regscript_run(&rs)) {
+      log_error("could not read the I/O registers");
+      retval = -1;
+    }
+    regscript_free(&rs);
+  }
+  if (!cpu_stopped_state)
+    start_cpu();
+
+  if (!retval)
+    retval = snapshot_write(filename, &snap);
+  if (!retval)
+    log_note("saved snapshot to '%s' (PC=$%04X) in %lldms", filename, snap.regs.pc, gettime_ms() - start);
+  snapshot_free(&snap);
+  return retval;
+}
+
+/*
+  Switch to 40MHz (FAST and VFAST) while the helper runs, keeping $D031
+  and $D054 so that the speed the program chose can be put back.
+*/
+static int snapshot_speed_up(unsigned char *saved)
+{
+  if (fetch_ram_checked(0xFFD3031, 1, &saved[0]) || fetch_ram_checked(0xFFD3054, 1, &saved[1]))
+    return -1;
+  mega65_poke(0xFFD3031, saved[0] | 0x40);
+  mega65_poke(0xFFD3054, saved[1] | 0x40);
+  return 0;
+}
+
+static void snapshot_speed_restore(const unsigned char *saved)
+{
+  mega65_poke(0xFFD3054, saved[1]);
+  mega65_poke(0xFFD3031, saved[0]);
+}
+
+/*
+  Checksum pages with the helper, which must already be in memory, and
+  leave the CPU stopped again.
+*/
+static int snapshot_run_helper(uint32_t addr, int pages, uint32_t table)
+{
+  unsigned char zp[15] = { addr, addr >> 8, addr >> 16, addr >> 24, table, table >> 8, table >> 16, table >> 24, pages,
+    pages >> 8 };
+  push_ram(0xF0, sizeof(zp), zp);
+
+  char cmd[16];
+  snprintf(cmd, sizeof(cmd), "g%04X\r", SNAPSHOT_HELPER_ADDR);
+  slow_write(fd, cmd, strlen(cmd));
+  monitor_sync();
+  start_cpu();
+
+  long long start = gettime_ms();
+  unsigned char done = 0;
+  while (done != 0xFF) {
+    if (gettime_ms() - start > SNAPSHOT_HELPER_TIMEOUT_MS) {
+      real_stop_cpu();
+      return -1;
+    }
+    if (fetch_ram_checked(0xFE, 1, &done))
+      done = 0;
+  }
+  real_stop_cpu();
+  return 0;
+}
+
+// Whether a CPU address is in one of the 8KB blocks mapped by MAP
+static int snapshot_mapped(const struct snapshot_regs *r, unsigned int addr)
+{
+  int block = (addr >> 13) & 7;
+  if (block < 4)
+    return (r->mapl >> (12 + block)) & 1;
+  return (r->maph >> (8 + block)) & 1;
+}
+
+/*
+  Resume the CPU with the saved registers.  The monitor can only set the
+  PC, so a few bytes of code in the free part of the stack load the rest:
+
+        SEI
+        LDA #port
+        STA $01
+        LDA #mapl_lo
+        LDX #mapl_hi
+        LDY #maph_lo
+        LDZ #maph_hi
+        MAP
+        EOM
+        CLE / SEE
+        LDX #spl
+        TXS
+        LDY #sph
+        TYS
+        LDA #b
+        TAB
+        LDA #p
+        PHA
+        LDA #a
+        LDX #x
+        LDY #y
+        LDZ #z
+        PLP
+        JMP pc
+*/
+static void snapshot_resume(const struct snapshot_regs *r, unsigned char port)
+{
+  unsigned char code[40];
+  unsigned int addr = (r->sp - 64) & 0xffff;
+  char cmd[16];
+
+  if (r->sp < 0x48 || ((r->p & 0x20) && (r->sp & 0xff) < 0x48) || snapshot_mapped(r, addr)
+      || snapshot_mapped(r, addr + sizeof(code) - 1)) {
+    log_warn("no room for restoring the CPU registers below SP=$%04X, only setting PC", r->sp);
+    snprintf(cmd, sizeof(cmd), "g%04X\r", r->pc);
+    slow_write(fd, cmd, strlen(cmd));
+    monitor_sync();
+    start_cpu();
+    return;
+  }
+
+  int n = 0;
+  code[n++] = 0x78;
+  code[n++] = 0xa9;
+  code[n++] = port;
+  code[n++] = 0x85;
+  code[n++] = 0x01;
+  code[n++] = 0xa9;
+  code[n++] = r->mapl;
+  code[n++] = 0xa2;
+  code[n++] = r->mapl >> 8;
+  code[n++] = 0xa0;
+  code[n++] = r->maph;
+  code[n++] = 0xa3;
+  code[n++] = r->maph >> 8;
+  code[n++] = 0x5c;
+  code[n++] = 0xea;
+  code[n++] = (r->p & 0x20) ? 0x03 : 0x02;
+  code[n++] = 0xa2;
+  code[n++] = r->sp;
+  code[n++] = 0x9a;
+  code[n++] = 0xa0;
+  code[n++] = r->sp >> 8;
+  code[n++] = 0x2b;
+  code[n++] = 0xa9;
+  code[n++] = r->b;
+  code[n++] = 0x5b;
+  code[n++] = 0xa9;
+  code[n++] = r->p;
+  code[n++] = 0x48;
+  code[n++] = 0xa9;
+  code[n++] = r->a;
+  code[n++] = 0xa2;
+  code[n++] = r->x;
+  code[n++] = 0xa0;
+  code[n++] = r->y;
+  code[n++] = 0xa3;
+  code[n++] = r->z;
+  code[n++] = 0x28;
+  code[n++] = 0x4c;
+  code[n++] = r->pc;
+  code[n++] = r->pc >> 8;
+
+  push_ram(addr, n, code);
+  snprintf(cmd, sizeof(cmd), "g%04X\r", addr);
+  slow_write(fd, cmd, strlen(cmd));
+  monitor_sync();
+  start_cpu();
+}
+
+int snapshot_restore(const char *filename)
+{
+  struct snapshot snap;
+  if (snapshot_read(filename, &snap))
+    return -1;
+
+  long long start = gettime_ms();
+  real_stop_cpu();
+  push_ram(SNAPSHOT_HELPER_ADDR, sizeof(snapshot_helper), snapshot_helper);
+
+  unsigned char *sums = malloc(SNAPSHOT_TABLE_SIZE);
+  unsigned char *dirty = malloc(SNAPSHOT_PAGES);
+  if (!sums || !dirty) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  // The speed is restored with the other I/O registers below
+  unsigned char speed[2];
+  if (snapshot_speed_up(speed)
+      || snapshot_run_helper(SNAPSHOT_CHIPRAM_ADDR, SNAPSHOT_CHIPRAM_SIZE / 256, SNAPSHOT_TABLE_ADDR)
+      || snapshot_run_helper(SNAPSHOT_COLOURRAM_ADDR, SNAPSHOT_COLOURRAM_SIZE / 256,
+          SNAPSHOT_TABLE_ADDR + SNAPSHOT_CHIPRAM_SIZE / 256 * 4)
+      || fetch_ram_checked(SNAPSHOT_TABLE_ADDR, SNAPSHOT_TABLE_SIZE, sums)) {
+    // Without the checksums, everything has to be sent
+    log_warn("could not checksum memory on the MEGA65, restoring all of it");
+    memset(dirty, 1, SNAPSHOT_PAGES);
+  }
+  else
+    snapshot_diff(&snap, sums, dirty);
+
+  // Zero page, the helper and the table were changed by the restore itself
+  dirty[0] = 1;
+  dirty[SNAPSHOT_HELPER_ADDR / 256] = 1;
+  for (int n = 0; n < (SNAPSHOT_TABLE_SIZE + 255) / 256; n++)
+    dirty[SNAPSHOT_TABLE_ADDR / 256 + n] = 1;
+
+  // Send contiguous dirty pages together, without running from chip RAM
+  // into colour RAM
+  int pages = 0, runs = 0;
+  for (int n = 0; n < SNAPSHOT_PAGES; n++) {
+    if (!dirty[n])
+      continue;
+    int count = 1;
+    while (n + count < SNAPSHOT_PAGES && dirty[n + count] && n + count != SNAPSHOT_CHIPRAM_SIZE / 256)
+      count++;
+    push_ram(snapshot_page_addr(n), count * 256, snapshot_page_data(&snap, n));
+    pages += count;
+    runs++;
+    n += count - 1;
+  }
+
+  struct regscript rs;
+  regscript_init(&rs);
+  for (int i = 0; i < snap.io_count; i++)
+    regscript_poke(&rs, snap.io[i].addr, snap.io[i].value);
+  int retval = regscript_run(&rs);
+  regscript_free(&rs);
+  if (retval)
+    log_error("could not restore the I/O registers");
+
+  snapshot_resume(&snap.regs, snap.chipram[1]);
+  saw_c64_mode = snap.c64_mode;
+  saw_c65_mode = snap.c65_mode;
+  log_note("restored snapshot '%s' (%d of %d pages in %d runs) in %lldms", filename, pages, SNAPSHOT_PAGES, runs,
+      gettime_ms() - start);
+
+  free(sums);
+  free(dirty);
+  snapshot_free(&snap);
+  return retval;
+}
+
+int snapshot_checksum_ranges(int count, const uint32_t *addr, const int *pages, unsigned char *sums)
+{
+  int total = 0;
+  for (int i = 0; i < count; i++)
+    total += pages[i];
+  if (total * 4 > SNAPSHOT_TABLE_SIZE)
+    return -1;
+  if (!total)
+    return 0;
+  // The routine runs as a normal program, with whatever is mapped
+  if (in_hypervisor())
+    return -1;
+
+  int cpu_stopped_state = cpu_stopped;
+  real_stop_cpu();
+
+  // Keep what the routine overwrites
+  struct snapshot_regs regs;
+  unsigned char zp[16], helper_area[sizeof(snapshot_helper)], port;
+  unsigned char *table = malloc(total * 4);
+  if (!table) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  if (snapshot_read_regs(&regs) || fetch_ram_checked(0xF0, sizeof(zp), zp) || fetch_ram_checked(1, 1, &port)
+      || fetch_ram_checked(SNAPSHOT_HELPER_ADDR, sizeof(helper_area), helper_area)
+      || fetch_ram_checked(SNAPSHOT_TABLE_ADDR, total * 4, table)) {
+    free(table);
+    if (!cpu_stopped_state)
+      start_cpu();
+    return -1;
+  }
+
+  push_ram(SNAPSHOT_HELPER_ADDR, sizeof(snapshot_helper), snapshot_helper);
+  unsigned char speed[2];
+  int retval = snapshot_speed_up(speed);
+  if (!retval) {
+    for (int i = 0, n = 0; i < count && !retval; n += pages[i++])
+      if (pages[i])
+        retval = snapshot_run_helper(addr[i], pages[i], SNAPSHOT_TABLE_ADDR + n * 4);
+    if (!retval)
+      retval = fetch_ram_checked(SNAPSHOT_TABLE_ADDR, total * 4, sums);
+    snapshot_speed_restore(speed);
+  }
+
+  push_ram(SNAPSHOT_TABLE_ADDR, total * 4, table);
+  push_ram(SNAPSHOT_HELPER_ADDR, sizeof(helper_area), helper_area);
+  push_ram(0xF0, sizeof(zp), zp);
+  snapshot_resume(&regs, port);
+  if (cpu_stopped_state)
+    real_stop_cpu();
+  free(table);
+  return retval;
+}
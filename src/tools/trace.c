@@ -0,0 +1,982 @@
+/*
+  Compact binary signal traces.  See include/trace.h for the format.
+
+  On disk, all numbers in the header and index are little-endian, and
+  those within blocks are LEB128 style variable length integers.
+
+  Header:
+    "M65TRACE", u32 version, u32 signal count, u64 fs per tick,
+    u64 offset of the last block record, u32 block count, u32 reserved,
+    i64 first time, i64 last time
+  Signals, straight after the header:
+    per signal: u16 name length, name, u16 width
+  Then per block, the block followed by its record:
+    u64 offset of the previous block record (0 for the first block),
+    u64 offset, u32 compressed size, u32 size, i64 start time, i64 end time
+  Block (zlib compressed):
+    u32 column offset and u32 change count for each signal, then the
+    columns: u8 unknown, varint value (state at the start of the block),
+    then for each change: varint (time delta << 1 | unknown), varint value
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <zlib.h>
+#include <sys/stat.h>
+#ifndef WINDOWS
+#include <sys/mman.h>
+#endif
+
+#include "trace.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#define TRACE_HEADER_SIZE 56
+#define TRACE_BLOCK_RECORD_SIZE 40
+
+struct trace_column {
+  unsigned char *data;
+  size_t size, max;
+  int changes;
+  int64_t last_time;
+
+  // Current state, and the state at the start of the block
+  uint64_t value;
+  int unknown;
+  uint64_t start_value;
+  int start_unknown;
+};
+
+static void put_u16(unsigned char *p, uint16_t v)
+{
+  p[0] = v;
+  p[1] = v >> 8;
+}
+
+static void put_u32(unsigned char *p, uint32_t v)
+{
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> (i * 8);
+}
+
+static void put_u64(unsigned char *p, uint64_t v)
+{
+  for (int i = 0; i < 8; i++)
+    p[i] = v >> (i * 8);
+}
+
+static uint16_t get_u16(const unsigned char *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t get_u32(const unsigned char *p)
+{
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static uint64_t get_u64(const unsigned char *p)
+{
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--)
+    v = (v << 8) | p[i];
+  return v;
+}
+
+static void column_put(struct trace_column *c, uint64_t v)
+{
+  if (c->size + 10 > c->max) {
+    c->max = c->max ? c->max * 2 : 256;
+    c->data = realloc(c->data, c->max);
+    if (!c->data) {
+      perror("realloc() failed");
+      exit(-3);
+    }
+  }
+  while (v >= 0x80) {
+    c->data[c->size++] = (v & 0x7f) | 0x80;
+    v >>= 7;
+  }
+  c->data[c->size++] = v;
+}
+
+static int get_varint(const unsigned char *data, size_t size, size_t *pos, uint64_t *v)
+{
+  *v = 0;
+  for (int shift = 0; shift < 64 && *pos < size; shift += 7) {
+    unsigned char b = data[(*pos)++];
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return 0;
+  }
+  return -1;
+}
+
+struct trace_writer *trace_create(const char *filename, uint64_t timescale_fs)
+{
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    return NULL;
+  struct trace_writer *w = calloc(1, sizeof(struct trace_writer));
+  if (!w) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  w->f = f;
+  w->timescale_fs = timescale_fs ? timescale_fs : 1;
+  w->end_offset = TRACE_HEADER_SIZE;
+  return w;
+}
+
+int trace_add_signal(struct trace_writer *w, const char *name, int width)
+{
+  // All of the signals have to be known before the first block
+  if (w->block_count || w->block_changes)
+    return -1;
+  w->signals = realloc(w->signals, sizeof(struct trace_signal) * (w->signal_count + 1));
+  w->columns = realloc(w->columns, sizeof(struct trace_column) * (w->signal_count + 1));
+  if (!w->signals || !w->columns) {
+    perror("realloc() failed");
+    exit(-3);
+  }
+  struct trace_signal *s = &w->signals[w->signal_count];
+  snprintf(s->name, TRACE_MAX_NAME, "%s", name);
+  s->width = width;
+  struct trace_column *c = &w->columns[w->signal_count];
+  bzero(c, sizeof(struct trace_column));
+  c->unknown = 1;
+  c->start_unknown = 1;
+  return w->signal_count++;
+}
+
+void trace_set_time(struct trace_writer *w, int64_t time)
+{
+  if (!w->have_time) {
+    w->have_time = 1;
+    w->time = time;
+    w->block_start = time;
+    w->first_time = time;
+    w->last_time = time;
+    return;
+  }
+  if (time <= w->time)
+    return;
+  // Blocks only end between time steps
+  if (w->block_changes >= TRACE_BLOCK_CHANGES)
+    trace_flush(w);
+  w->time = time;
+  if (!w->block_changes)
+    w->block_start = time;
+}
+
+void trace_change(struct trace_writer *w, int signal, uint64_t value, int unknown)
+{
+  if (signal < 0 || signal >= w->signal_count)
+    return;
+  if (!w->have_time)
+    trace_set_time(w, 0);
+  struct trace_column *c = &w->columns[signal];
+  if (unknown)
+    value = 0;
+  if (c->unknown == unknown && c->value == value)
+    return;
+  if (!c->changes)
+    c->last_time = w->block_start;
+  column_put(c, ((uint64_t)(w->time - c->last_time) << 1) | (unknown ? 1 : 0));
+  column_put(c, value);
+  c->last_time = w->time;
+  c->changes++;
+  c->value = value;
+  c->unknown = unknown;
+  w->block_changes++;
+  w->last_time = w->time;
+}
+
+static int write_header(struct trace_writer *w)
+{
+  unsigned char h[TRACE_HEADER_SIZE];
+  memcpy(h, TRACE_MAGIC, 8);
+  put_u32(&h[8], TRACE_VERSION);
+  put_u32(&h[12], w->signal_count);
+  put_u64(&h[16], w->timescale_fs);
+  put_u64(&h[24], w->last_record);
+  put_u32(&h[32], w->block_count);
+  put_u32(&h[36], 0);
+  put_u64(&h[40], w->first_time);
+  put_u64(&h[48], w->last_time);
+  if (fseeko(w->f, 0, SEEK_SET) || fwrite(h, TRACE_HEADER_SIZE, 1, w->f) != 1)
+    return -1;
+  return fflush(w->f) ? -1 : 0;
+}
+
+/*
+  The signals are written before the first block, after which no more can
+  be added.  Until then, nothing follows them, so they can be rewritten.
+*/
+static int write_signals(struct trace_writer *w)
+{
+  unsigned char b[2];
+  if (fseeko(w->f, TRACE_HEADER_SIZE, SEEK_SET))
+    return -1;
+  w->end_offset = TRACE_HEADER_SIZE;
+  for (int i = 0; i < w->signal_count; i++) {
+    int len = strlen(w->signals[i].name);
+    put_u16(b, len);
+    if (fwrite(b, 2, 1, w->f) != 1 || (len && fwrite(w->signals[i].name, len, 1, w->f) != 1))
+      return -1;
+    put_u16(b, w->signals[i].width);
+    if (fwrite(b, 2, 1, w->f) != 1)
+      return -1;
+    w->end_offset += 4 + len;
+  }
+  return 0;
+}
+
+int trace_flush(struct trace_writer *w)
+{
+  if (!w->block_count && write_signals(w))
+    return -1;
+  if (!w->block_changes) {
+    // Still write the header, so that the file is a valid (empty) trace
+    return w->block_count ? 0 : write_header(w);
+  }
+
+  size_t table = w->signal_count * 8;
+  size_t size = table;
+  for (int i = 0; i < w->signal_count; i++)
+    size += 11 + w->columns[i].size;
+  unsigned char *raw = malloc(size);
+  if (!raw) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+
+  size_t ofs = table;
+  for (int i = 0; i < w->signal_count; i++) {
+    struct trace_column *c = &w->columns[i];
+    put_u32(&raw[i * 8], ofs - table);
+    put_u32(&raw[i * 8 + 4], c->changes);
+    raw[ofs++] = c->start_unknown;
+    uint64_t v = c->start_value;
+    while (v >= 0x80) {
+      raw[ofs++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    raw[ofs++] = v;
+    memcpy(&raw[ofs], c->data, c->size);
+    ofs += c->size;
+  }
+
+  uLongf compressed_size = compressBound(ofs);
+  unsigned char *compressed = malloc(compressed_size);
+  if (!compressed) {
+    perror("malloc() failed");
+    exit(-3);
+  }
+  if (compress2(compressed, &compressed_size, raw, ofs, Z_DEFAULT_COMPRESSION) != Z_OK) {
+    free(raw);
+    free(compressed);
+    return -1;
+  }
+
+  // The block and its record go after everything written so far, and only
+  // once they are both out is the header changed to include them
+  unsigned char record[TRACE_BLOCK_RECORD_SIZE];
+  put_u64(&record[0], w->last_record);
+  put_u64(&record[8], w->end_offset);
+  put_u32(&record[16], compressed_size);
+  put_u32(&record[20], ofs);
+  put_u64(&record[24], w->block_start);
+  put_u64(&record[32], w->time);
+
+  int result = 0;
+  if (fseeko(w->f, w->end_offset, SEEK_SET) || fwrite(compressed, compressed_size, 1, w->f) != 1
+      || fwrite(record, TRACE_BLOCK_RECORD_SIZE, 1, w->f) != 1 || fflush(w->f))
+    result = -1;
+  free(raw);
+  free(compressed);
+  if (result)
+    return result;
+  w->block_count++;
+  w->last_record = w->end_offset + compressed_size;
+  w->end_offset = w->last_record + TRACE_BLOCK_RECORD_SIZE;
+
+  for (int i = 0; i < w->signal_count; i++) {
+    struct trace_column *c = &w->columns[i];
+    c->size = 0;
+    c->changes = 0;
+    c->start_value = c->value;
+    c->start_unknown = c->unknown;
+  }
+  w->block_changes = 0;
+  w->block_start = w->time;
+
+  return write_header(w);
+}
+
+int trace_close(struct trace_writer *w)
+{
+  int result = trace_flush(w);
+  if (fclose(w->f))
+    result = -1;
+  for (int i = 0; i < w->signal_count; i++)
+    free(w->columns[i].data);
+  free(w->columns);
+  free(w->signals);
+  free(w);
+  return result;
+}
+
+static void *map_file(const char *filename, size_t *size)
+{
+  int fd = open(filename, O_RDONLY | O_BINARY);
+  if (fd < 0)
+    return NULL;
+  struct stat st;
+  if (fstat(fd, &st) || !st.st_size) {
+    close(fd);
+    return NULL;
+  }
+  *size = st.st_size;
+#ifndef WINDOWS
+  void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  return p == MAP_FAILED ? NULL : p;
+#else
+  void *p = malloc(st.st_size);
+  if (p && read(fd, p, st.st_size) != st.st_size) {
+    free(p);
+    p = NULL;
+  }
+  close(fd);
+  return p;
+#endif
+}
+
+static void unmap_file(const void *p, size_t size)
+{
+#ifndef WINDOWS
+  munmap((void *)p, size);
+#else
+  free((void *)p);
+#endif
+}
+
+struct trace_reader *trace_open(const char *filename)
+{
+  size_t size;
+  const unsigned char *map = map_file(filename, &size);
+  if (!map)
+    return NULL;
+  if (size < TRACE_HEADER_SIZE || memcmp(map, TRACE_MAGIC, 8) || get_u32(&map[8]) != TRACE_VERSION) {
+    unmap_file(map, size);
+    return NULL;
+  }
+
+  struct trace_reader *r = calloc(1, sizeof(struct trace_reader));
+  if (!r) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  r->map = map;
+  r->size = size;
+  r->signal_count = get_u32(&map[12]);
+  r->timescale_fs = get_u64(&map[16]);
+  uint64_t record = get_u64(&map[24]);
+  r->block_count = get_u32(&map[32]);
+  r->first_time = get_u64(&map[40]);
+  r->last_time = get_u64(&map[48]);
+  r->cached_block = -1;
+
+  r->signals = calloc(r->signal_count + 1, sizeof(struct trace_signal));
+  r->blocks = calloc(r->block_count + 1, sizeof(struct trace_block_info));
+  if (!r->signals || !r->blocks) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  uint64_t ofs = TRACE_HEADER_SIZE;
+  for (int i = 0; i < r->signal_count; i++) {
+    if (ofs + 2 > size)
+      goto bad;
+    int len = get_u16(&map[ofs]);
+    if (ofs + 4 + len > size || len >= TRACE_MAX_NAME)
+      goto bad;
+    memcpy(r->signals[i].name, &map[ofs + 2], len);
+    r->signals[i].width = get_u16(&map[ofs + 2 + len]);
+    ofs += 4 + len;
+  }
+  // Follow the block records back from the last one
+  for (int i = r->block_count - 1; i >= 0; i--) {
+    if (record < ofs || record + TRACE_BLOCK_RECORD_SIZE > size)
+      goto bad;
+    const unsigned char *b = &map[record];
+    r->blocks[i].offset = get_u64(&b[8]);
+    r->blocks[i].compressed_size = get_u32(&b[16]);
+    r->blocks[i].size = get_u32(&b[20]);
+    r->blocks[i].start_time = get_u64(&b[24]);
+    r->blocks[i].end_time = get_u64(&b[32]);
+    if (r->blocks[i].offset < ofs || r->blocks[i].offset + r->blocks[i].compressed_size > record)
+      goto bad;
+    // Each record comes before the block after it, so this can't loop
+    uint64_t previous = get_u64(&b[0]);
+    if (i && previous >= r->blocks[i].offset)
+      goto bad;
+    record = previous;
+  }
+  return r;
+
+bad:
+  trace_free(r);
+  return NULL;
+}
+
+void trace_free(struct trace_reader *r)
+{
+  unmap_file(r->map, r->size);
+  free(r->signals);
+  free(r->blocks);
+  free(r->block_data);
+  free(r);
+}
+
+int trace_find_signal(struct trace_reader *r, const char *name)
+{
+  for (int i = 0; i < r->signal_count; i++)
+    if (!strcmp(r->signals[i].name, name))
+      return i;
+  // Allow the case to differ, e.g., SDA vs sda
+  for (int i = 0; i < r->signal_count; i++)
+    if (!strcasecmp(r->signals[i].name, name))
+      return i;
+  return -1;
+}
+
+double trace_ticks_to_ns(struct trace_reader *r, int64_t ticks)
+{
+  return (double)ticks * r->timescale_fs / TRACE_FS_PER_NS;
+}
+
+int64_t trace_ns_to_ticks(struct trace_reader *r, double ns)
+{
+  return (int64_t)(ns * TRACE_FS_PER_NS / r->timescale_fs);
+}
+
+static unsigned char *load_block(struct trace_reader *r, int block)
+{
+  if (r->cached_block == block)
+    return r->block_data;
+  struct trace_block_info *b = &r->blocks[block];
+  if (b->size > r->block_data_size) {
+    r->block_data = realloc(r->block_data, b->size);
+    if (!r->block_data) {
+      perror("realloc() failed");
+      exit(-3);
+    }
+    r->block_data_size = b->size;
+  }
+  uLongf size = b->size;
+  if (uncompress(r->block_data, &size, &r->map[b->offset], b->compressed_size) != Z_OK || size != b->size) {
+    r->cached_block = -1;
+    return NULL;
+  }
+  r->cached_block = block;
+  return r->block_data;
+}
+
+/*
+  Copy the cursor's signal's column out of a block, and read the state of
+  the signal at the start of the block.
+*/
+static int load_column(struct trace_cursor *c, int block, uint64_t *value, int *unknown)
+{
+  struct trace_reader *r = c->r;
+  unsigned char *data = load_block(r, block);
+  if (!data)
+    return -1;
+  size_t table = r->signal_count * 8;
+  size_t start = table + get_u32(&data[c->signal * 8]);
+  size_t end = (c->signal + 1 < r->signal_count) ? table + get_u32(&data[c->signal * 8 + 8]) : r->blocks[block].size;
+  if (start > end || end > r->blocks[block].size)
+    return -1;
+  if (end - start > c->column_max) {
+    c->column_max = end - start;
+    c->column = realloc(c->column, c->column_max);
+    if (!c->column) {
+      perror("realloc() failed");
+      exit(-3);
+    }
+  }
+  memcpy(c->column, &data[start], end - start);
+  c->column_size = end - start;
+  c->remaining = get_u32(&data[c->signal * 8 + 4]);
+  c->block = block;
+  c->column_time = r->blocks[block].start_time;
+  c->pos = 0;
+  if (!c->column_size)
+    return -1;
+  *unknown = c->column[c->pos++];
+  return get_varint(c->column, c->column_size, &c->pos, value);
+}
+
+
+static void decode_next(struct trace_cursor *c)
+{
+  uint64_t delta, value;
+  int unknown;
+
+  c->have_next = 0;
+  while (!c->remaining) {
+    if (c->block + 1 >= c->r->block_count)
+      return;
+    // The state at the start of the block is the one we already have
+    if (load_column(c, c->block + 1, &value, &unknown))
+      return;
+  }
+  if (get_varint(c->column, c->column_size, &c->pos, &delta) || get_varint(c->column, c->column_size, &c->pos, &value))
+    return;
+  c->remaining--;
+  c->column_time += delta >> 1;
+  c->next_time = c->column_time;
+  c->next_value = value;
+  c->next_unknown = delta & 1;
+  c->have_next = 1;
+}
+
+int trace_cursor_init(struct trace_cursor *c, struct trace_reader *r, int signal, int64_t start_time)
+{
+  bzero(c, sizeof(struct trace_cursor));
+  c->r = r;
+  c->signal = signal;
+  c->time = start_time;
+  c->unknown = 1;
+  if (signal < 0 || signal >= r->signal_count)
+    return -1;
+  if (!r->block_count)
+    return 0;
+
+  // Last block that starts at or before the start time
+  int lo = 0, hi = r->block_count - 1;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (r->blocks[mid].start_time <= start_time)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  if (load_column(c, lo, &c->value, &c->unknown))
+    return -1;
+  decode_next(c);
+  while (c->have_next && c->next_time <= start_time) {
+    c->value = c->next_value;
+    c->unknown = c->next_unknown;
+    decode_next(c);
+  }
+  return 0;
+}
+
+int trace_cursor_next(struct trace_cursor *c)
+{
+  if (!c->have_next)
+    return 0;
+  c->time = c->next_time;
+  c->value = c->next_value;
+  c->unknown = c->next_unknown;
+  decode_next(c);
+  return 1;
+}
+
+int64_t trace_cursor_peek(struct trace_cursor *c)
+{
+  return c->have_next ? c->next_time : INT64_MAX;
+}
+
+void trace_cursor_free(struct trace_cursor *c)
+{
+  free(c->column);
+  c->column = NULL;
+  c->column_max = 0;
+}
+
+/*
+  VCD conversion.  The VCD file is read as whitespace separated tokens,
+  which is all that the format needs.
+*/
+struct vcd_reader {
+  const char *pos, *end;
+
+  // Identifier code -> signal
+  char **codes;
+  int *code_signals;
+  int code_slots, code_count;
+};
+
+static int vcd_token(struct vcd_reader *v, const char **token)
+{
+  while (v->pos < v->end && *v->pos <= ' ')
+    v->pos++;
+  *token = v->pos;
+  while (v->pos < v->end && *v->pos > ' ')
+    v->pos++;
+  return v->pos - *token;
+}
+
+static int token_is(const char *token, int len, const char *word)
+{
+  return len == strlen(word) && !strncmp(token, word, len);
+}
+
+static void vcd_skip_section(struct vcd_reader *v)
+{
+  const char *token;
+  int len;
+  while ((len = vcd_token(v, &token)) != 0)
+    if (token_is(token, len, "$end"))
+      return;
+}
+
+static unsigned int hash_code(const char *code, int len)
+{
+  // FNV-1a
+  unsigned int h = 2166136261U;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)code[i];
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static int vcd_find_code(struct vcd_reader *v, const char *code, int len)
+{
+  if (!v->code_slots)
+    return -1;
+  unsigned int slot = hash_code(code, len) & (v->code_slots - 1);
+  while (v->codes[slot]) {
+    if (!strncmp(v->codes[slot], code, len) && !v->codes[slot][len])
+      return v->code_signals[slot];
+    slot = (slot + 1) & (v->code_slots - 1);
+  }
+  return -1;
+}
+
+static void vcd_add_code(struct vcd_reader *v, const char *code, int len, int signal)
+{
+  if ((v->code_count + 1) * 2 > v->code_slots) {
+    // Grow and rehash
+    int old_slots = v->code_slots;
+    char **old_codes = v->codes;
+    int *old_signals = v->code_signals;
+    v->code_slots = old_slots ? old_slots * 2 : 256;
+    v->codes = calloc(v->code_slots, sizeof(char *));
+    v->code_signals = calloc(v->code_slots, sizeof(int));
+    if (!v->codes || !v->code_signals) {
+      perror("calloc() failed");
+      exit(-3);
+    }
+    for (int i = 0; i < old_slots; i++) {
+      if (!old_codes[i])
+        continue;
+      unsigned int slot = hash_code(old_codes[i], strlen(old_codes[i])) & (v->code_slots - 1);
+      while (v->codes[slot])
+        slot = (slot + 1) & (v->code_slots - 1);
+      v->codes[slot] = old_codes[i];
+      v->code_signals[slot] = old_signals[i];
+    }
+    free(old_codes);
+    free(old_signals);
+  }
+  unsigned int slot = hash_code(code, len) & (v->code_slots - 1);
+  while (v->codes[slot])
+    slot = (slot + 1) & (v->code_slots - 1);
+  v->codes[slot] = strndup(code, len);
+  v->code_signals[slot] = signal;
+  v->code_count++;
+}
+
+static uint64_t parse_timescale(struct vcd_reader *v)
+{
+  // The scale can be in one token or two, e.g., "1fs" or "1 fs"
+  char scale[64];
+  int scale_len = 0;
+  const char *token;
+  int len;
+  while ((len = vcd_token(v, &token)) != 0) {
+    if (token_is(token, len, "$end"))
+      break;
+    if (scale_len + len < sizeof(scale)) {
+      memcpy(&scale[scale_len], token, len);
+      scale_len += len;
+    }
+  }
+  scale[scale_len] = 0;
+
+  char *unit;
+  uint64_t n = strtoull(scale, &unit, 10);
+  if (!n)
+    n = 1;
+  if (!strcmp(unit, "s"))
+    return n * 1000000000000000ULL;
+  if (!strcmp(unit, "ms"))
+    return n * 1000000000000ULL;
+  if (!strcmp(unit, "us"))
+    return n * TRACE_FS_PER_US;
+  if (!strcmp(unit, "ns"))
+    return n * TRACE_FS_PER_NS;
+  if (!strcmp(unit, "ps"))
+    return n * 1000ULL;
+  return n;
+}
+
+static void parse_var(struct vcd_reader *v, struct trace_writer *w)
+{
+  // $var <type> <width> <code> <reference> [range] $end
+  const char *fields[4];
+  int lens[4];
+  int n = 0;
+  const char *token;
+  int len;
+  while ((len = vcd_token(v, &token)) != 0) {
+    if (token_is(token, len, "$end"))
+      break;
+    if (n < 4) {
+      fields[n] = token;
+      lens[n++] = len;
+    }
+  }
+  if (n < 4)
+    return;
+  // Several names for the same signal only need to be kept once
+  if (vcd_find_code(v, fields[2], lens[2]) >= 0)
+    return;
+
+  // Drop any bit range from the name
+  int name_len = lens[3];
+  for (int i = 0; i < lens[3]; i++)
+    if (fields[3][i] == '[') {
+      name_len = i;
+      break;
+    }
+  char name[TRACE_MAX_NAME];
+  snprintf(name, sizeof(name), "%.*s", name_len, fields[3]);
+
+  int signal = trace_add_signal(w, name, atoi(fields[1]));
+  if (signal >= 0)
+    vcd_add_code(v, fields[2], lens[2], signal);
+}
+
+int trace_import_vcd(const char *vcd_file, const char *trace_file)
+{
+  size_t size;
+  const char *vcd = map_file(vcd_file, &size);
+  if (!vcd)
+    return -1;
+  struct trace_writer *w = trace_create(trace_file, 1);
+  if (!w) {
+    unmap_file(vcd, size);
+    return -1;
+  }
+
+  struct vcd_reader v;
+  bzero(&v, sizeof(v));
+  v.pos = vcd;
+  v.end = vcd + size;
+
+  const char *token;
+  int len;
+
+  // Header
+  while ((len = vcd_token(&v, &token)) != 0) {
+    if (token_is(token, len, "$enddefinitions")) {
+      vcd_skip_section(&v);
+      break;
+    }
+    else if (token_is(token, len, "$var"))
+      parse_var(&v, w);
+    else if (token_is(token, len, "$timescale"))
+      w->timescale_fs = parse_timescale(&v);
+    else if (token[0] == '$')
+      vcd_skip_section(&v);
+  }
+
+  // Value changes
+  while ((len = vcd_token(&v, &token)) != 0) {
+    uint64_t value = 0;
+    int unknown = 0;
+    switch (token[0]) {
+    case '#':
+      trace_set_time(w, strtoll(token + 1, NULL, 10));
+      break;
+    case 'b':
+    case 'B':
+      for (int i = 1; i < len; i++) {
+        value <<= 1;
+        switch (token[i]) {
+        case '1':
+        case 'h':
+        case 'H':
+          value |= 1;
+          break;
+        case '0':
+        case 'l':
+        case 'L':
+          break;
+        default:
+          unknown = 1;
+        }
+      }
+      len = vcd_token(&v, &token);
+      trace_change(w, vcd_find_code(&v, token, len), value, unknown);
+      break;
+    case 'r':
+    case 'R':
+      // Real values are kept as integers
+      value = (int64_t)strtod(token + 1, NULL);
+      len = vcd_token(&v, &token);
+      trace_change(w, vcd_find_code(&v, token, len), value, 0);
+      break;
+    case '0':
+    case '1':
+      trace_change(w, vcd_find_code(&v, token + 1, len - 1), token[0] == '1', 0);
+      break;
+    case 'x':
+    case 'X':
+    case 'z':
+    case 'Z':
+      trace_change(w, vcd_find_code(&v, token + 1, len - 1), 0, 1);
+      break;
+    case '$':
+      if (token_is(token, len, "$comment"))
+        vcd_skip_section(&v);
+      // $dumpvars etc. just bracket value changes
+      break;
+    }
+  }
+
+  for (int i = 0; i < v.code_slots; i++)
+    free(v.codes[i]);
+  free(v.codes);
+  free(v.code_signals);
+  unmap_file(vcd, size);
+  return trace_close(w);
+}
+
+static void vcd_code(int n, char *code)
+{
+  int i = 0;
+  do {
+    code[i++] = 33 + n % 94;
+    n /= 94;
+  } while (n);
+  code[i] = 0;
+}
+
+static void vcd_value(FILE *out, struct trace_cursor *c, int width, const char *code)
+{
+  if (width == 1) {
+    fprintf(out, "%c%s\n", c->unknown ? 'x' : (c->value ? '1' : '0'), code);
+    return;
+  }
+  if (c->unknown) {
+    fprintf(out, "bx %s\n", code);
+    return;
+  }
+  char bits[65];
+  int n = 0;
+  for (int i = 63; i >= 0; i--)
+    if (n || (c->value >> i) & 1 || !i)
+      bits[n++] = '0' + ((c->value >> i) & 1);
+  bits[n] = 0;
+  fprintf(out, "b%s %s\n", bits, code);
+}
+
+int trace_export_vcd(struct trace_reader *r, FILE *out, char **names, int name_count, int64_t start_time, int64_t end_time)
+{
+  int count = name_count ? name_count : r->signal_count;
+  struct trace_cursor *cursors = calloc(count, sizeof(struct trace_cursor));
+  char(*codes)[8] = calloc(count, 8);
+  if (!cursors || !codes) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  for (int i = 0; i < count; i++) {
+    int signal = name_count ? trace_find_signal(r, names[i]) : i;
+    if (signal < 0) {
+      fprintf(stderr, "ERROR: Signal '%s' is not in the trace\n", names[i]);
+      for (int j = 0; j < i; j++)
+        trace_cursor_free(&cursors[j]);
+      free(cursors);
+      free(codes);
+      return -1;
+    }
+    trace_cursor_init(&cursors[i], r, signal, start_time);
+    vcd_code(i, codes[i]);
+  }
+
+  // VCD only allows scales of 1, 10 or 100 units
+  static const struct {
+    const char *unit;
+    uint64_t fs;
+  } units[] = { { "s", 1000000000000000ULL }, { "ms", 1000000000000ULL }, { "us", TRACE_FS_PER_US },
+    { "ns", TRACE_FS_PER_NS }, { "ps", 1000 }, { "fs", 1 } };
+  char scale[64];
+  snprintf(scale, sizeof(scale), "%llu fs", (unsigned long long)r->timescale_fs);
+  for (int i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+    uint64_t n = r->timescale_fs / units[i].fs;
+    if (!(r->timescale_fs % units[i].fs) && (n == 1 || n == 10 || n == 100)) {
+      snprintf(scale, sizeof(scale), "%d %s", (int)n, units[i].unit);
+      break;
+    }
+  }
+
+  fprintf(out,
+      "$version\n"
+      "   MEGA65 m65trace.\n"
+      "$end\n"
+      "$timescale %s $end\n"
+      "$scope module logic $end\n",
+      scale);
+  for (int i = 0; i < count; i++) {
+    struct trace_signal *s = &r->signals[cursors[i].signal];
+    fprintf(out, "$var wire %d %s %s $end\n", s->width, codes[i], s->name);
+  }
+  fprintf(out, "$upscope $end\n"
+               "$enddefinitions $end\n"
+               "#%lld\n"
+               "$dumpvars\n",
+      (long long)start_time);
+  for (int i = 0; i < count; i++)
+    vcd_value(out, &cursors[i], r->signals[cursors[i].signal].width, codes[i]);
+  fprintf(out, "$end\n");
+
+  while (1) {
+    int64_t next = INT64_MAX;
+    for (int i = 0; i < count; i++) {
+      int64_t t = trace_cursor_peek(&cursors[i]);
+      if (t < next)
+        next = t;
+    }
+    if (next == INT64_MAX || (end_time >= 0 && next > end_time))
+      break;
+    fprintf(out, "#%lld\n", (long long)next);
+    for (int i = 0; i < count; i++)
+      if (trace_cursor_peek(&cursors[i]) == next) {
+        trace_cursor_next(&cursors[i]);
+        vcd_value(out, &cursors[i], r->signals[cursors[i].signal].width, codes[i]);
+      }
+  }
+
+  for (int i = 0; i < count; i++)
+    trace_cursor_free(&cursors[i]);
+  free(cursors);
+  free(codes);
+  return ferror(out) ? -1 : 0;
+}
@@ -4,6 +4,11 @@
 #include <unistd.h>
 #include <string.h>
 #include <strings.h>
+#include <math.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #define PNG_DEBUG 3
 #include <png.h>
@@ -11,26 +16,51 @@
 #include <cairo.h>
 #include <cairo-pdf.h>
 
+#include "dirtymock.h"
+
+// Columns of the signal that is rendered
 int *values;
 double *times;
 int val_count=0;
-int val_allocated=0;
 
 int ts_mult=0;
 char ts_units[1024];
-int next_is_ts=0;
 float ts_div=1.0;
 
-#define MAX_SIGS 16
+// Only value changes inside this window (in ns) are kept
+double window_start=0;
+double window_end=-1;
+// Time of the last timestamp read, i.e., where the last value stops
+double trace_end=0;
+// Keep at most one value change per this many ns of each signal
+double decimate=0;
+
+struct signal {
+  const char *name;
+  char *code;
+  int width;
+  int found;
+
+  // Columnar storage of the value changes, grown as needed
+  int *values;
+  double *times;
+  int count;
+  int allocated;
+
+  // Value in effect when the window starts
+  int pending;
+  int has_pending;
+
+  // Another selected signal with the same identifier code
+  struct signal *next_alias;
+};
+
 int sig_count=0;
-char sig_names[MAX_SIGS][1024];
-char sig_desigs[MAX_SIGS][1024];
-int sig_widths[MAX_SIGS];
-int sig_firstbits[MAX_SIGS];
+struct signal *sigs=NULL;
 
-char sig_name[1024];
-char sig_designator[1024];
-int sig_firstbit,sig_lastbit,sig_width;
+// Identifier code -> signal, for the selected signals only
+int code_hash_size=0;
+struct signal **code_hash=NULL;
 
 void abort_(const char * s, ...)
 {
@@ -54,6 +84,244 @@ void parse_ts(void)
   fprintf(stderr,"INFO: Timestep divisor is %f\n",ts_div);
 }
 
+unsigned int hash_code(const char *code,int len)
+{
+  // FNV-1a
+  unsigned int h=2166136261U;
+  for(int i=0;i<len;i++) {
+    h^=(unsigned char)code[i];
+    h*=16777619U;
+  }
+  return h;
+}
+
+struct signal *find_code(const char *code,int len)
+{
+  unsigned int slot=hash_code(code,len)&(code_hash_size-1);
+  while(code_hash[slot]) {
+    struct signal *s=code_hash[slot];
+    if (!strncmp(s->code,code,len)&&!s->code[len]) return s;
+    slot=(slot+1)&(code_hash_size-1);
+  }
+  return NULL;
+}
+
+void add_code(struct signal *sig)
+{
+  int len=strlen(sig->code);
+  struct signal *s=find_code(sig->code,len);
+  if (s) {
+    // Two of the selected names refer to the same signal
+    while(s->next_alias) s=s->next_alias;
+    s->next_alias=sig;
+    return;
+  }
+  unsigned int slot=hash_code(sig->code,len)&(code_hash_size-1);
+  while(code_hash[slot]) slot=(slot+1)&(code_hash_size-1);
+  code_hash[slot]=sig;
+}
+
+void append_value(struct signal *sig,double t,int v)
+{
+  if (sig->count==sig->allocated) {
+    sig->allocated=sig->allocated?sig->allocated*2:65536;
+    sig->values=realloc(sig->values,sizeof(int)*sig->allocated);
+    sig->times=realloc(sig->times,sizeof(double)*sig->allocated);
+    if ((!sig->values)||(!sig->times)) {
+      fprintf(stderr,"ERROR: Failed to allocate arrays for measurements.\n");
+      exit(-1);
+    }
+  }
+  sig->values[sig->count]=v;
+  sig->times[sig->count++]=t;
+}
+
+void store_value(struct signal *sig,double t,int v)
+{
+  if (t<window_start) {
+    sig->pending=v;
+    sig->has_pending=1;
+    return;
+  }
+  if (!sig->count&&sig->has_pending&&t>window_start)
+    append_value(sig,window_start,sig->pending);
+  if (decimate>0&&sig->count) {
+    // Replace the last value if it is in the same interval
+    double last=sig->times[sig->count-1];
+    if (floor((t-window_start)/decimate)==floor((last-window_start)/decimate)) {
+      sig->values[sig->count-1]=v;
+      return;
+    }
+  }
+  append_value(sig,t,v);
+}
+
+/*
+  The VCD file is mapped into memory and read as whitespace separated
+  tokens, which is all that the format needs.
+*/
+const char *vcd_pos;
+const char *vcd_end;
+
+int next_token(const char **token)
+{
+  while(vcd_pos<vcd_end&&*vcd_pos<=' ') vcd_pos++;
+  *token=vcd_pos;
+  while(vcd_pos<vcd_end&&*vcd_pos>' ') vcd_pos++;
+  return vcd_pos-*token;
+}
+
+int token_is(const char *token,int len,const char *word)
+{
+  return len==strlen(word)&&!strncmp(token,word,len);
+}
+
+// Skip to the $end of a header section
+void skip_section(void)
+{
+  const char *token;
+  int len;
+  while((len=next_token(&token))!=0)
+    if (token_is(token,len,"$end")) return;
+}
+
+void parse_var(void)
+{
+  // $var <type> <width> <code> <reference> [range] $end
+  const char *fields[4];
+  int lens[4];
+  int n=0;
+  const char *token;
+  int len;
+  while((len=next_token(&token))!=0) {
+    if (token_is(token,len,"$end")) break;
+    if (n<4) {
+      fields[n]=token;
+      lens[n++]=len;
+    }
+  }
+  if (n<4) return;
+
+  // The name is matched without any bit range
+  int name_len=lens[3];
+  for(int i=0;i<lens[3];i++)
+    if (fields[3][i]=='[') {
+      name_len=i;
+      break;
+    }
+
+  for(int i=0;i<sig_count;i++) {
+    if (strlen(sigs[i].name)!=name_len||strncmp(sigs[i].name,fields[3],name_len)) continue;
+    if (sigs[i].found) {
+      fprintf(stderr,"WARNING: Signal '%s' appears more than once. Using the first one.\n",sigs[i].name);
+      continue;
+    }
+    sigs[i].found=1;
+    sigs[i].width=atoi(fields[1]);
+    sigs[i].code=strndup(fields[2],lens[2]);
+    fprintf(stderr,"INFO: Signal '%s' is designated by '%s'\n",sigs[i].name,sigs[i].code);
+    add_code(&sigs[i]);
+  }
+}
+
+void parse_timescale(void)
+{
+  // The scale can be in one token or two, e.g., "1fs" or "1 fs"
+  char scale[1024];
+  int scale_len=0;
+  const char *token;
+  int len;
+  while((len=next_token(&token))!=0) {
+    if (token_is(token,len,"$end")) break;
+    if (scale_len+len+1<sizeof(scale)) {
+      memcpy(&scale[scale_len],token,len);
+      scale_len+=len;
+      scale[scale_len++]=' ';
+    }
+  }
+  scale[scale_len]=0;
+  if (sscanf(scale,"%d %s",&ts_mult,ts_units)==2||sscanf(scale,"%d%s",&ts_mult,ts_units)==2) {
+    fprintf(stderr,"INFO: Set time scale to x %d %s\n",ts_mult,ts_units);
+    parse_ts();
+  }
+}
+
+int parse_value(const char *v,int len)
+{
+  int value=0;
+  for(int i=0;i<len;i++) {
+    value=value*2;
+    switch(v[i]) {
+    case '1': case 'H': case 'h': value+=1; break;
+    }
+  }
+  return value;
+}
+
+long long parse_vcd(void)
+{
+  const char *token;
+  int len;
+  long long changes=0;
+
+  // Header
+  while((len=next_token(&token))!=0) {
+    if (token_is(token,len,"$enddefinitions")) {
+      skip_section();
+      break;
+    }
+    else if (token_is(token,len,"$var")) parse_var();
+    else if (token_is(token,len,"$timescale")) parse_timescale();
+    else if (token[0]=='$') skip_section();
+  }
+
+  // Value changes
+  double ts=0;
+  while((len=next_token(&token))!=0) {
+    struct signal *sig;
+    switch(token[0]) {
+    case '#':
+      ts=strtoll(token+1,NULL,10)/ts_div;
+      // Nothing after the window can matter
+      if (window_end>=0&&ts>window_end) {
+	trace_end=window_end;
+	return changes;
+      }
+      trace_end=ts;
+      break;
+    case 'b': case 'B': case 'r': case 'R': {
+      // Vector or real value, followed by the identifier code
+      int real=(token[0]=='r'||token[0]=='R');
+      const char *v=token+1;
+      int v_len=len-1;
+      len=next_token(&token);
+      if (!len) return changes;
+      changes++;
+      for(sig=find_code(token,len);sig;sig=sig->next_alias) {
+	if (real) store_value(sig,ts,(int)strtod(v,NULL));
+	else store_value(sig,ts,parse_value(v,v_len));
+      }
+      break;
+    }
+    case '0': case '1': case 'x': case 'X': case 'z': case 'Z':
+      // Scalar value, with the identifier code straight after it
+      changes++;
+      for(sig=find_code(token+1,len-1);sig;sig=sig->next_alias)
+	store_value(sig,ts,token[0]=='1');
+      break;
+    case '$':
+      if (token_is(token,len,"$comment")) skip_section();
+      // $dumpvars etc. just bracket value changes
+      break;
+    default:
+      fprintf(stderr,"ERROR: Unknown data format '%.*s'\n",len,token);
+      break;
+    }
+  }
+  return changes;
+}
+
+
 void draw_line(cairo_t *cr, float x1, float y1, float x2, float y2)
 {
   cairo_set_line_width(cr, 0.5);
@@ -84,124 +352,83 @@ int set_pixel(png_bytep *png_rows, int x, int y, int r, int g, int b)
   return 0;
 }
 
-int main(int argc,char **argv) 
+void usage(void)
+{
+  fprintf(stderr,"usage: vcdgraph [-s start ns] [-e end ns] [-d decimation ns] <vcd input file> <pdf output file> <signal names...>\n");
+  fprintf(stderr,"  The first signal is the one that is rendered.\n");
+  exit(-1);
+}
+
+int DIRTYMOCK(main)(int argc,char **argv) 
 {
-  if (argc<3) {
-    fprintf(stderr,"usage: vcdgraph <vcd input file> <pdf output file> [signal names...]\n");
+  int opt;
+  while((opt=getopt(argc,argv,"s:e:d:"))!=-1) {
+    switch(opt) {
+    case 's': window_start=strtod(optarg,NULL); break;
+    case 'e': window_end=strtod(optarg,NULL); break;
+    case 'd': decimate=strtod(optarg,NULL); break;
+    default: usage();
+    }
+  }
+  if (argc-optind<3) usage();
+  const char *vcd_file=argv[optind];
+  const char *pdf_file=argv[optind+1];
+
+  sig_count=argc-optind-2;
+  sigs=calloc(sizeof(struct signal),sig_count);
+  for(code_hash_size=16;code_hash_size<sig_count*2;code_hash_size*=2)
+    continue;
+  code_hash=calloc(sizeof(struct signal *),code_hash_size);
+  if ((!sigs)||(!code_hash)) {
+    fprintf(stderr,"ERROR: Failed to allocate signal table.\n");
     exit(-1);
   }
+  for(int i=0;i<sig_count;i++) sigs[i].name=argv[optind+2+i];
 
-  val_allocated=100000000;
-  values = calloc(sizeof(int),val_allocated);
-  times = calloc(sizeof(double),val_allocated);
-  if ((!values)||(!times)) {
-    fprintf(stderr,"ERROR: Failed to allocate arrays for measurements.\n");
+  int fd=open(vcd_file,O_RDONLY);
+  struct stat st;
+  if (fd<0||fstat(fd,&st)||!st.st_size) {
+    fprintf(stderr,"ERROR: Could not read from '%s'\n",vcd_file);
     exit(-1);
   }
-  
-  
-  FILE *f=fopen(argv[1],"r");
-  if (!f) {
-    fprintf(stderr,"ERROR: Could not read from '%s'\n",argv[1]);
+  const char *vcd=mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+  if (vcd==MAP_FAILED) {
+    fprintf(stderr,"ERROR: Could not read from '%s'\n",vcd_file);
     exit(-1);
   }
+  madvise((void *)vcd,st.st_size,MADV_SEQUENTIAL);
+  vcd_pos=vcd;
+  vcd_end=vcd+st.st_size;
 
-  char line[1024];
+  long long changes=parse_vcd();
 
-  int in_setup=1;
+  munmap((void *)vcd,st.st_size);
+  close(fd);
 
-  double ts=0;
-  
-  int lines=0;
-  line[0]=0; fgets(line,1024,f);
-  while(line[0]) {
-
-    if (in_setup) {
-
-      if (next_is_ts) {
-	next_is_ts=0;
-	if (sscanf(line,"%d %s",&ts_mult,ts_units)==2) {
-	  fprintf(stderr,"INFO: Set time scale to x %d %s\n",ts_mult,ts_units);
-	  parse_ts();
-	}
-      }
-      else if (sscanf(line,"$timescale %d %s $end",&ts_mult,ts_units)==2) {
-	fprintf(stderr,"INFO: Set time scale to x %d %s\n",ts_mult,ts_units);
-	parse_ts();
-      }
-      else if (!strncmp("$timescale",line,strlen("$timescale"))) next_is_ts=1;
-      else if (sscanf(line,"$var reg %d %s %[^[][%d:%d] $end",
-		      &sig_width,sig_designator,sig_name,&sig_firstbit,&sig_lastbit)==5) {
-	for(int i=3;i<argc;i++) {
-	  if (!strcmp(sig_name,argv[i])) {
-	    fprintf(stderr,"INFO: Signal '%s' is designated by '%s'\n",sig_name,sig_designator);
-	    if (sig_count<MAX_SIGS) {
-	      strcpy(sig_names[sig_count],sig_name);
-	      strcpy(sig_desigs[sig_count],sig_designator);
-	      sig_widths[sig_count]=sig_width;
-	      sig_firstbits[sig_count]=sig_firstbit;
-	      sig_count++;
-	    } else {
-	      fprintf(stderr,"ERROR: Too many signals. Increase MAX_SIGS or select fewer signals.\n");
-	      exit(-1);
-	    }
-	  }
-	}
-      }
-      if (!strncmp("$enddefinitions",line,strlen("$enddefinitions"))) {
-	in_setup=0;
-	fprintf(stderr,"INFO: Found %d signals.\n",sig_count);
-	if (sig_count!=(argc-3)) {
-	  fprintf(stderr,"ERROR: Expected to see %d signals.  Are some of the names incorrect?\n",argc-2);
-	  exit(-1);
-	}
-      }
-    } else {
-      long long ts_raw;
-      if (sscanf(line,"#%lld",&ts_raw)==1) {
-	ts=ts_raw/ts_div;
-	//	fprintf(stderr,"DEBUG: ts=%g\n",ts);
-      }
-      // Remove CRLF
-      while(line[0]&&line[strlen(line)-1]<' ') line[strlen(line)-1]=0;
-      for(int sig=0;sig<sig_count;sig++) {
-	if (!strcmp(&line[strlen(line)-strlen(sig_desigs[sig])],sig_desigs[sig])) {
-	  if (line[0]=='b') {
-	    // Binary string
-	    int v=0;
-	    for(int i=1;i<strlen(line);i++) {
-	      if (line[i]==' ') break;
-	      v=v*2;
-	      switch(line[i]) {
-	      case 'U': case 'X': case '0': v+=0; break;
-	      case '1': case 'H': v+=1; break;
-	      }
-	    }
-	    //	    fprintf(stderr,"DEBUG: Value for %s at ts %g : v=%d\n",sig_names[sig],ts,v);
-	    if (val_count<val_allocated) {
-	      values[val_count]=v;
-	      times[val_count++]=ts;
-	    } else {
-	      fprintf(stderr,"WARNING: Too many measurements. Stopping at ts = %g ns\n",ts);
-	      break;
-	    }
-	  } else {
-	    fprintf(stderr,"ERROR: Unknown data format '%s'\n",line);
-	  }
-	}
-      }
+  int found=0;
+  for(int i=0;i<sig_count;i++) {
+    if (!sigs[i].found) {
+      fprintf(stderr,"ERROR: Signal '%s' not found.  Is the name correct?\n",sigs[i].name);
+      continue;
     }
-      
-    
-    lines++;
-    
-    line[0]=0; fgets(line,1024,f);
+    found++;
+    // A signal that did not change in the window still has a value
+    if (!sigs[i].count&&sigs[i].has_pending) append_value(&sigs[i],window_start,sigs[i].pending);
+    fprintf(stderr,"INFO: Read %d values for '%s'\n",sigs[i].count,sigs[i].name);
+  }
+  fprintf(stderr,"INFO: Found %d signals.\n",found);
+  if (found!=sig_count) exit(-1);
+  fprintf(stderr,"INFO: Processed %lld value changes\n",changes);
+
+  values=sigs[0].values;
+  times=sigs[0].times;
+  val_count=sigs[0].count;
+  if (!val_count) {
+    fprintf(stderr,"ERROR: No values for '%s' in the time window.\n",sigs[0].name);
+    exit(-1);
   }
 
-  fprintf(stderr,"INFO: Read %d values\n",val_count);
-  
-  fclose(f);
-  fprintf(stderr,"INFO: Processed %d lines\n",lines);
+  double ts;
   
   cairo_surface_t *surface;
   cairo_t *cr;
@@ -209,7 +436,7 @@ int main(int argc,char **argv)
   int page_height=842;
   int page_width=595;
   
-  surface = cairo_pdf_surface_create("pdffile.pdf", page_width, page_height);
+  surface = cairo_pdf_surface_create(pdf_file, page_width, page_height);
   cr = cairo_create(surface);
 
   cairo_set_source_rgb(cr, 0, 0, 0);
@@ -239,7 +466,7 @@ int main(int argc,char **argv)
   int val=0;
 
   // Now used to track time point during rendering
-  ts=0.0;
+  ts=window_start;
 
   while(raster_num < 312.5*2 ) {
     fprintf(stderr,"INFO: Page starting on raster %d\n",raster_num);
@@ -281,7 +508,7 @@ int main(int argc,char **argv)
 	ts+=ts_step;
 	
 	// Advance to the next measurement, if required
-	while((val_num<val_count)&&times[val_num+1]<ts) val_num++;
+	while(val_num+1<val_count&&times[val_num+1]<ts) val_num++;
 	val=values[val_num];
 	
 	draw_line(cr,page_x_margin+72/2+(x-1),page_y+ROW_HEIGHT-ROW_GAP-prev_val/256.0*(ROW_HEIGHT - ROW_GAP),
@@ -299,7 +526,7 @@ int main(int argc,char **argv)
   cairo_destroy(cr);
 
   fprintf(stderr,"Writing raw sample file to samples.raw\n");
-  ts=0.0;
+  ts=window_start;
   // 27MHz apparent sample rate
   double ts_step = 1000.0/27;  
   val_num=0;
@@ -307,12 +534,12 @@ int main(int argc,char **argv)
 #define MAX_SAMPLES 8000000
   unsigned char samples[MAX_SAMPLES];
   
-  while((val_num<val_count)&&sample_num<MAX_SAMPLES)
+  while(ts<trace_end&&sample_num<MAX_SAMPLES)
     {
       ts+=ts_step;
       
       // Advance to the next measurement, if required
-      while((val_num<val_count)&&times[val_num+1]<ts) val_num++;
+      while(val_num+1<val_count&&times[val_num+1]<ts) val_num++;
       val=values[val_num];
       
       samples[sample_num++]=val;
@@ -320,7 +547,7 @@ int main(int argc,char **argv)
     }
   
   
-  f=fopen("samples.raw","wb");
+  FILE *f=fopen("samples.raw","wb");
   fwrite(samples,1,sample_num,f);
   fclose(f);
 
@@ -356,6 +583,10 @@ int main(int argc,char **argv)
   printf("Raster length is probably %d samples.\n",best_hyst);
   printf("Sync length is probably %d samples.\n",best_len_hyst);
   raster_len=best_hyst;
+  if (!raster_len) {
+    fprintf(stderr,"ERROR: Could not find any sync pulses.\n");
+    exit(-1);
+  }
   rasters = sample_num/raster_len + 1;
   
   png_structp png_ptr;
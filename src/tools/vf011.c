@@ -0,0 +1,289 @@
+/*
+  Disk images for the virtual F011 service of m65.  See include/vf011.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#ifdef WINDOWS
+#include <io.h>
+#endif
+
+#include "m65common.h"
+#include "logging.h"
+#include "vf011.h"
+
+static struct vf011_image images[VF011_MAX_IMAGES];
+static int image_count = 0;
+static int drive_image[VF011_DRIVES] = { -1, -1 };
+
+int vf011_add_image(const char *filename)
+{
+  // Loading the same file twice would give two caches of it
+  for (int i = 0; i < image_count; i++)
+    if (!strcmp(images[i].filename, filename))
+      return i;
+  if (image_count == VF011_MAX_IMAGES) {
+    log_error("too many disk images (max %d)", VF011_MAX_IMAGES);
+    return -1;
+  }
+  memset(&images[image_count], 0, sizeof(struct vf011_image));
+  images[image_count].filename = strdup(filename);
+  return image_count++;
+}
+
+int vf011_image_count(void)
+{
+  return image_count;
+}
+
+struct vf011_image *vf011_get_image(int n)
+{
+  if (n < 0 || n >= image_count)
+    return NULL;
+  return &images[n];
+}
+
+/*
+  Read an image into memory.  It is opened for update, and only created if
+  it does not exist (as opposed to truncating it, should a write come first).
+*/
+static int vf011_open(struct vf011_image *img)
+{
+  if (img->f)
+    return 0;
+
+  img->f = fopen(img->filename, "rb+");
+  if (!img->f && errno == ENOENT)
+    img->f = fopen(img->filename, "wb+");
+  if (!img->f) {
+    log_error("could not open D81 file: '%s'", img->filename);
+    return -1;
+  }
+
+  fseek(img->f, 0, SEEK_END);
+  long file_size = ftell(img->f);
+  img->size = file_size > VF011_D81_SIZE ? file_size : VF011_D81_SIZE;
+  img->data = calloc(img->size, 1);
+  img->dirty = calloc(img->size / 512 + 1, 1);
+  if (!img->data || !img->dirty) {
+    perror("calloc() failed");
+    exit(-3);
+  }
+  rewind(img->f);
+  if (fread(img->data, 1, file_size, img->f) != (size_t)file_size) {
+    log_error("could not read D81 file: '%s'", img->filename);
+    fclose(img->f);
+    img->f = NULL;
+    free(img->data);
+    free(img->dirty);
+    img->data = img->dirty = NULL;
+    return -1;
+  }
+  log_debug("cached %ld bytes of D81 image '%s'", file_size, img->filename);
+  return 0;
+}
+
+int vf011_mount(int drive, int n)
+{
+  if (drive < 0 || drive >= VF011_DRIVES) {
+    log_error("no drive %d", drive);
+    return -1;
+  }
+  if (n < -1 || n >= image_count) {
+    log_error("no disk image %d", n);
+    return -1;
+  }
+  if (n >= 0 && vf011_open(&images[n]))
+    return -1;
+  drive_image[drive] = n;
+  if (n >= 0)
+    log_note("drive %d: '%s'", drive, images[n].filename);
+  else
+    log_note("drive %d: empty", drive);
+  return 0;
+}
+
+struct vf011_image *vf011_drive_image(int drive)
+{
+  if (drive < 0 || drive >= VF011_DRIVES || drive_image[drive] < 0)
+    return NULL;
+  return &images[drive_image[drive]];
+}
+
+unsigned char *vf011_sector(struct vf011_image *img, int track, int sector, int side, int writep)
+{
+  int physical_sector = (side == 0 ? sector - 1 : sector + 9);
+  long offset = (track * 20L + physical_sector) * 512;
+  if (!img->data || offset < 0)
+    return NULL;
+  if (offset + 512 > img->size) {
+    if (!writep)
+      return NULL;
+    // Writing past the end of the file used to extend it, so keep doing so
+    long new_size = offset + 512;
+    img->data = realloc(img->data, new_size);
+    img->dirty = realloc(img->dirty, new_size / 512 + 1);
+    if (!img->data || !img->dirty) {
+      perror("realloc() failed");
+      exit(-3);
+    }
+    memset(&img->data[img->size], 0, new_size - img->size);
+    memset(&img->dirty[img->size / 512], 0, new_size / 512 + 1 - img->size / 512);
+    img->size = new_size;
+  }
+  return &img->data[offset];
+}
+
+void vf011_sector_written(struct vf011_image *img, unsigned char *sector)
+{
+  long n = (sector - img->data) / 512;
+  if (!img->dirty[n]) {
+    img->dirty[n] = 1;
+    img->dirty_count++;
+  }
+  img->last_write_time = gettime_ms();
+}
+
+int vf011_flush(struct vf011_image *img)
+{
+  if (!img->f || !img->dirty_count)
+    return 0;
+
+  long long start = gettime_ms();
+  int runs = 0, written = 0;
+  int sectors = img->size / 512;
+  for (int i = 0; i < sectors; i++) {
+    if (!img->dirty[i])
+      continue;
+    // Write contiguous dirty sectors together
+    int n = 1;
+    while (i + n < sectors && img->dirty[i + n])
+      n++;
+    if (fseek(img->f, i * 512L, SEEK_SET) || fwrite(&img->data[i * 512], 512, n, img->f) != (size_t)n) {
+      log_error("failed to write back sectors %d-%d of '%s': %s", i, i + n - 1, img->filename, strerror(errno));
+      return -1;
+    }
+    // Keep dirty_count in step, as a later write error leaves the rest dirty
+    memset(&img->dirty[i], 0, n);
+    img->dirty_count -= n;
+    written += n;
+    runs++;
+    i += n - 1;
+  }
+  fflush(img->f);
+#ifdef WINDOWS
+  _commit(_fileno(img->f));
+#else
+  fsync(fileno(img->f));
+#endif
+  log_info("wrote back %d dirty sectors of '%s' in %d runs in %lldms", written, img->filename, runs,
+      gettime_ms() - start);
+  return 0;
+}
+
+int vf011_dirty_images(void)
+{
+  int count = 0;
+  for (int i = 0; i < image_count; i++)
+    if (images[i].dirty_count)
+      count++;
+  return count;
+}
+
+void vf011_flush_if_idle(void)
+{
+  long long now = gettime_ms();
+  for (int i = 0; i < image_count; i++)
+    if (images[i].dirty_count && now - images[i].last_write_time >= VF011_FLUSH_IDLE_MS)
+      vf011_flush(&images[i]);
+}
+
+void vf011_close_all(void)
+{
+  for (int i = 0; i < image_count; i++) {
+    struct vf011_image *img = &images[i];
+    if (!img->f)
+      continue;
+    vf011_flush(img);
+    log_debug("closing d81 image file '%s'", img->filename);
+    fclose(img->f);
+    img->f = NULL;
+    free(img->data);
+    free(img->dirty);
+    img->data = img->dirty = NULL;
+  }
+}
+
+static int vf011_parse_drive(const char *arg)
+{
+  char *end;
+  long drive = strtol(arg, &end, 10);
+  if (!*arg || *end || drive < 0 || drive >= VF011_DRIVES) {
+    log_error("no drive '%s'", arg);
+    return -1;
+  }
+  return drive;
+}
+
+/*
+  Image to mount, given as its number in the list (-1 for none), or as a
+  file name, which is added to the list if it is not already there.
+  Returns -2 if there is no such image.
+*/
+static int vf011_parse_image(const char *arg)
+{
+  char *end;
+  long n = strtol(arg, &end, 10);
+  if (*arg && !*end) {
+    if (n < -1 || n >= image_count) {
+      log_error("no disk image %s", arg);
+      return -2;
+    }
+    return n;
+  }
+  n = vf011_add_image(arg);
+  return n < 0 ? -2 : n;
+}
+
+int vf011_command(const char *line)
+{
+  char cmd[16], arg1[1024], arg2[1024];
+  int args = sscanf(line, "%15s %1023s %1023[^\r\n]", cmd, arg1, arg2);
+  if (args < 1)
+    return 0;
+
+  if (!strcmp(cmd, "q") || !strcmp(cmd, "quit"))
+    return 1;
+  if (!strcmp(cmd, "list")) {
+    for (int i = 0; i < image_count; i++) {
+      char drives[32] = "";
+      for (int d = 0; d < VF011_DRIVES; d++)
+        if (drive_image[d] == i)
+          sprintf(drives + strlen(drives), " [drive %d]", d);
+      printf("%2d: %s%s%s\n", i, images[i].filename, images[i].dirty_count ? " (dirty)" : "", drives);
+    }
+    fflush(stdout);
+  }
+  else if (!strcmp(cmd, "mount") && args == 3) {
+    int drive = vf011_parse_drive(arg1);
+    int n = drive < 0 ? -2 : vf011_parse_image(arg2);
+    if (n >= -1)
+      vf011_mount(drive, n);
+  }
+  else if (!strcmp(cmd, "eject") && args >= 2) {
+    int drive = vf011_parse_drive(arg1);
+    if (drive >= 0)
+      vf011_mount(drive, -1);
+  }
+  else if (!strcmp(cmd, "flush")) {
+    for (int i = 0; i < image_count; i++)
+      vf011_flush(&images[i]);
+  }
+  else
+    log_warn("unknown command '%s' (use list, mount <drive> <image>, eject <drive>, flush or quit)", cmd);
+  return 0;
+}
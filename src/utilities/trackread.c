@@ -0,0 +1,247 @@
+/*
+  Track reader helper for readdisk.
+
+  Reads whole tracks from the internal floppy drive into RAM by itself,
+  so that the host only has to fetch the finished tracks in bulk, rather
+  than driving the F011 one register at a time over the serial monitor.
+  There are two job slots, so that the host can fetch one track while
+  the next one is being read.
+
+  Communication is through memory that the host reads and writes with the
+  serial monitor while this runs:
+
+  $0340 - "TRK1" once the helper is running.
+  $0350 + slot * $10 - job for slot 0 or 1:
+     +0 sequence number, written last by the host to start the job
+     +1 track, +2 side, +3 first sector, +4 number of sectors (max 16)
+     +8 sequence number of the last job completed in this slot
+  $0370 + slot * $10 - status of each sector of the job: the low 3 bits are
+     the number of attempts, and $18 the RNF/CRC bits of $D082 if the sector
+     could not be read.
+  $40000 + slot * $2000 - the sector data.
+
+  Slots are used alternately, starting with slot 0.  A track number of $FF
+  stops the helper.
+*/
+
+#include <stdio.h>
+#define POKE(X, Y) (*(unsigned char *)(X)) = Y
+#define PEEK(X) (*(unsigned char *)(X))
+
+// In the cassette buffer, which is free in C64 mode
+#define MAILBOX 0x0340U
+#define JOB(slot) (MAILBOX + 0x10 + (slot)*0x10)
+#define STATUS(slot) (MAILBOX + 0x30 + (slot)*0x10)
+#define TRACK_BUFFER(slot) (0x40000L + (slot)*0x2000L)
+
+#define FDC_SECTOR_BUFFER 0xFFD6C00L
+
+#define MAX_ATTEMPTS 4
+
+struct dmagic_dmalist {
+  // Enhanced DMA options
+  unsigned char option_0b;
+  unsigned char option_80;
+  unsigned char source_mb;
+  unsigned char option_81;
+  unsigned char dest_mb;
+  unsigned char end_of_options;
+
+  // F018B format DMA request
+  unsigned char command;
+  unsigned int count;
+  unsigned int source_addr;
+  unsigned char source_bank;
+  unsigned int dest_addr;
+  unsigned char dest_bank;
+  unsigned char sub_cmd; // F018B subcmd
+  unsigned int modulo;
+};
+
+struct dmagic_dmalist dmalist;
+
+void m65_io_enable(void)
+{
+  // Gate C65 IO enable
+  POKE(0xd02fU, 0x47);
+  POKE(0xd02fU, 0x53);
+  // Force to full speed
+  POKE(0, 65);
+}
+
+void do_dma(void)
+{
+  m65_io_enable();
+
+  // Now run DMA job (to and from anywhere, and list is in low 1MB)
+  POKE(0xd702U, 0);
+  POKE(0xd704U, 0x00); // List is in $00xxxxx
+  POKE(0xd701U, ((unsigned int)&dmalist) >> 8);
+  POKE(0xd705U, ((unsigned int)&dmalist) & 0xff); // triggers enhanced DMA
+}
+
+void lcopy(long source_address, long destination_address, unsigned int count)
+{
+  if (!count)
+    return;
+  dmalist.option_0b = 0x0b;
+  dmalist.option_80 = 0x80;
+  dmalist.source_mb = source_address >> 20;
+  dmalist.option_81 = 0x81;
+  dmalist.dest_mb = (destination_address >> 20);
+  dmalist.end_of_options = 0x00;
+
+  dmalist.command = 0x00; // copy
+  dmalist.count = count;
+  dmalist.sub_cmd = 0;
+  dmalist.source_addr = source_address & 0xffff;
+  dmalist.source_bank = (source_address >> 16) & 0x0f;
+  if (source_address >= 0xd000 && source_address < 0xe000)
+    dmalist.source_bank |= 0x80;
+  dmalist.dest_addr = destination_address & 0xffff;
+  dmalist.dest_bank = (destination_address >> 16) & 0x0f;
+  if (destination_address >= 0xd000 && destination_address < 0xe000)
+    dmalist.dest_bank |= 0x80;
+
+  do_dma();
+}
+
+void wait_10ms(void)
+{
+  // 16 x ~64usec raster lines = ~1ms
+  int c = 160;
+  unsigned char b;
+  while (c--) {
+    b = PEEK(0xD012U);
+    while (b == PEEK(0xD012U))
+      continue;
+  }
+}
+
+void wait_while_busy(void)
+{
+  while (PEEK(0xD082U) & 0x80)
+    continue;
+}
+
+unsigned char current_track;
+unsigned char slot = 0;
+unsigned char track, side, first_sector, sector_count, sector, attempts, status;
+unsigned int job;
+
+void step(unsigned char command)
+{
+  wait_while_busy();
+  POKE(0xD081U, command);
+  wait_while_busy();
+}
+
+void goto_track0(void)
+{
+  // Step out until the drive reports that the head is over track 0
+  while (!(PEEK(0xD082U) & 0x01))
+    step(0x10);
+  current_track = 0;
+}
+
+void seek(unsigned char track)
+{
+  if (track == current_track)
+    return;
+  while (current_track < track) {
+    step(0x18);
+    current_track++;
+  }
+  while (current_track > track) {
+    step(0x10);
+    current_track--;
+  }
+  // Let the head settle
+  wait_10ms();
+  wait_10ms();
+}
+
+void main(void)
+{
+  asm("sei");
+
+  m65_io_enable();
+
+  // Disable auto-seek, as we do our own seeking
+  POKE(0xD696U, 0x00);
+
+  // Map FDC sector buffer, not SD sector buffer
+  POKE(0xD689U, PEEK(0xD689U) & 0x7f);
+
+  // Disable matching on any sector, use real drive
+  POKE(0xD6A1U, 0x01);
+
+  // Floppy motor on
+  POKE(0xD080U, 0x68);
+
+  printf("%cMEGA65 track reader helper.\n", 0x93);
+
+  goto_track0();
+
+  POKE(JOB(0) + 8, PEEK(JOB(0)));
+  POKE(JOB(1) + 8, PEEK(JOB(1)));
+  POKE(MAILBOX + 0, 'T');
+  POKE(MAILBOX + 1, 'R');
+  POKE(MAILBOX + 2, 'K');
+  POKE(MAILBOX + 3, '1');
+
+  while (1) {
+    job = JOB(slot);
+    if (PEEK(job) == PEEK(job + 8))
+      continue;
+
+    track = PEEK(job + 1);
+    side = PEEK(job + 2);
+    first_sector = PEEK(job + 3);
+    sector_count = PEEK(job + 4);
+    if (sector_count > 16)
+      sector_count = 16;
+
+    if (track == 0xff)
+      break;
+
+    seek(track);
+
+    // Select side
+    POKE(0xD080U, side ? 0x60 : 0x68);
+
+    for (sector = 0; sector < sector_count; sector++) {
+      for (attempts = 1; attempts <= MAX_ATTEMPTS; attempts++) {
+        wait_while_busy();
+        POKE(0xD084U, track);
+        POKE(0xD085U, first_sector + sector);
+        POKE(0xD086U, side ? 1 : 0);
+
+        // Reset buffers, then read
+        POKE(0xD081U, 0x01);
+        POKE(0xD081U, 0x40);
+        wait_while_busy();
+
+        status = PEEK(0xD082U) & 0x18;
+        if (!status)
+          break;
+      }
+      if (attempts > MAX_ATTEMPTS)
+        attempts = MAX_ATTEMPTS;
+      POKE(STATUS(slot) + sector, status | attempts);
+      lcopy(FDC_SECTOR_BUFFER, TRACK_BUFFER(slot) + sector * 0x200L, 0x200);
+
+      // Show we are alive
+      POKE(0xD020U, PEEK(0xD020U) + 1);
+    }
+
+    // Mark the job as done
+    POKE(job + 8, PEEK(job));
+    slot ^= 1;
+  }
+
+  // Floppy motor off
+  POKE(0xD080U, 0x00);
+  POKE(MAILBOX + 0, 0);
+  __asm__("jmp 58552");
+}